@@ -0,0 +1,270 @@
+// Copyright 2018 Schibsted
+
+#include "controller-route.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sbp/logging.h"
+#include "sbp/memalloc_functions.h"
+
+enum route_param_type {
+	RPT_STRING,
+	RPT_INT,
+};
+
+struct route_node;
+
+struct route_param {
+	const char *key;
+	size_t key_len;
+	enum route_param_type type;
+	struct route_node *child;
+};
+
+struct route_node {
+	/* Literal edge leading to this node, points into an url. */
+	const char *label;
+	size_t label_len;
+	int index;
+
+	/* Literal children all start with different characters. */
+	int nchildren;
+	struct route_node **children;
+
+	int nparams;
+	struct route_param *params;
+};
+
+struct ctrl_route {
+	struct route_node root;
+};
+
+struct route_state {
+	const char *end;
+	struct ctrl_route_param stack[CTRL_ROUTE_MAX_PARAMS];
+	int nstack;
+
+	int best;
+	struct ctrl_route_param *params;
+	int nparams;
+};
+
+static struct route_node *
+route_node_new(const char *label, size_t label_len) {
+	struct route_node *node = xcalloc(1, sizeof(*node));
+	node->label = label;
+	node->label_len = label_len;
+	node->index = -1;
+	return node;
+}
+
+static void
+route_node_free(struct route_node *node) {
+	for (int i = 0 ; i < node->nchildren ; i++) {
+		route_node_free(node->children[i]);
+		free(node->children[i]);
+	}
+	free(node->children);
+	for (int i = 0 ; i < node->nparams ; i++) {
+		route_node_free(node->params[i].child);
+		free(node->params[i].child);
+	}
+	free(node->params);
+}
+
+struct ctrl_route *
+ctrl_route_new(void) {
+	struct ctrl_route *route = xcalloc(1, sizeof(*route));
+	route->root.index = -1;
+	return route;
+}
+
+void
+ctrl_route_free(struct ctrl_route *route) {
+	if (!route)
+		return;
+	route_node_free(&route->root);
+	free(route);
+}
+
+static struct route_node *
+route_add_literal(struct route_node *node, const char *s, size_t len) {
+	while (len > 0) {
+		struct route_node *child = NULL;
+		int i;
+
+		for (i = 0 ; i < node->nchildren ; i++) {
+			if (node->children[i]->label[0] == *s) {
+				child = node->children[i];
+				break;
+			}
+		}
+		if (!child) {
+			child = route_node_new(s, len);
+			node->children = xrealloc(node->children, (node->nchildren + 1) * sizeof(*node->children));
+			node->children[node->nchildren++] = child;
+			return child;
+		}
+
+		size_t common = 1;
+		while (common < len && common < child->label_len && s[common] == child->label[common])
+			common++;
+
+		if (common < child->label_len) {
+			/* Split the edge, a new node takes the shared prefix. */
+			struct route_node *split = route_node_new(child->label, common);
+			child->label += common;
+			child->label_len -= common;
+			split->children = xmalloc(sizeof(*split->children));
+			split->children[0] = child;
+			split->nchildren = 1;
+			node->children[i] = split;
+			child = split;
+		}
+		node = child;
+		s += common;
+		len -= common;
+	}
+	return node;
+}
+
+static struct route_node *
+route_add_param(struct route_node *node, const char *key, size_t key_len, enum route_param_type type) {
+	for (int i = 0 ; i < node->nparams ; i++) {
+		struct route_param *rp = &node->params[i];
+		if (rp->type == type && rp->key_len == key_len && memcmp(rp->key, key, key_len) == 0)
+			return rp->child;
+	}
+
+	node->params = xrealloc(node->params, (node->nparams + 1) * sizeof(*node->params));
+	struct route_param *rp = &node->params[node->nparams++];
+	rp->key = key;
+	rp->key_len = key_len;
+	rp->type = type;
+	rp->child = route_node_new(NULL, 0);
+	return rp->child;
+}
+
+/*
+ * Parses a <key> or <key:type> placeholder starting at lt.
+ * Returns a pointer to the closing '>', or NULL if malformed.
+ */
+static const char *
+route_parse_param(const char *lt, size_t *key_len, enum route_param_type *type) {
+	const char *p = lt + 1;
+	const char *colon = NULL;
+
+	for (; *p != '>' ; p++) {
+		if (*p == '\0' || *p == '<')
+			return NULL;
+		if (*p == ':' && !colon)
+			colon = p;
+	}
+
+	*type = RPT_STRING;
+	*key_len = (colon ?: p) - (lt + 1);
+	if (colon) {
+		if (p - colon - 1 == 3 && strncmp(colon + 1, "int", 3) == 0)
+			*type = RPT_INT;
+		else if (p - colon - 1 != 6 || strncmp(colon + 1, "string", 6) != 0)
+			return NULL;
+	}
+	return p;
+}
+
+int
+ctrl_route_add(struct ctrl_route *route, const char *url, int index) {
+	struct route_node *node = &route->root;
+	const char *p;
+	size_t key_len;
+	enum route_param_type type;
+	int nparams = 0;
+
+	/* Validate first, so that nothing is added for malformed urls. */
+	for (p = url ; *p ; p++) {
+		if (*p == '>')
+			goto malformed;
+		if (*p == '<') {
+			if (!(p = route_parse_param(p, &key_len, &type)) || ++nparams > CTRL_ROUTE_MAX_PARAMS)
+				goto malformed;
+		}
+	}
+
+	p = url;
+	while (*p) {
+		const char *lt = strchr(p, '<');
+		node = route_add_literal(node, p, lt ? (size_t)(lt - p) : strlen(p));
+		if (!lt)
+			break;
+		p = route_parse_param(lt, &key_len, &type);
+		node = route_add_param(node, lt + 1, key_len, type);
+		p++;
+	}
+
+	/* For duplicates the first one wins. */
+	if (node->index < 0 || index < node->index)
+		node->index = index;
+	return 0;
+
+malformed:
+	log_printf(LOG_CRIT, "Malformed handler url found: %s", url);
+	return -1;
+}
+
+static void
+route_match_node(const struct route_node *node, const char *p, struct route_state *st) {
+	if (p == st->end) {
+		if (node->index >= 0 && (st->best < 0 || node->index < st->best)) {
+			st->best = node->index;
+			memcpy(st->params, st->stack, st->nstack * sizeof(*st->stack));
+			st->nparams = st->nstack;
+		}
+		return;
+	}
+
+	for (int i = 0 ; i < node->nchildren ; i++) {
+		const struct route_node *child = node->children[i];
+		if (child->label[0] != *p)
+			continue;
+		if ((size_t)(st->end - p) >= child->label_len && memcmp(p, child->label, child->label_len) == 0)
+			route_match_node(child, p + child->label_len, st);
+		break;
+	}
+
+	for (int i = 0 ; i < node->nparams ; i++) {
+		const struct route_param *rp = &node->params[i];
+		const char *q = p;
+
+		while (q < st->end && *q != '/') {
+			if (rp->type == RPT_INT && (*q < '0' || *q > '9'))
+				break;
+			q++;
+		}
+		/* Placeholders never match an empty segment. */
+		if (q == p || (rp->type == RPT_INT && q < st->end && *q != '/'))
+			continue;
+
+		st->stack[st->nstack++] = (struct ctrl_route_param){ rp->key, rp->key_len, p, q - p };
+		route_match_node(rp->child, q, st);
+		st->nstack--;
+	}
+}
+
+int
+ctrl_route_match(const struct ctrl_route *route, const char *path, size_t len,
+		struct ctrl_route_param *params, int *nparams) {
+	struct route_state st;
+
+	/* Not using an initializer, no need to clear the stack. */
+	st.end = path + len;
+	st.nstack = 0;
+	st.best = -1;
+	st.params = params;
+	st.nparams = 0;
+
+	route_match_node(&route->root, path, &st);
+	*nparams = st.nparams;
+	return st.best;
+}
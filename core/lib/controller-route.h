@@ -0,0 +1,39 @@
+// Copyright 2018 Schibsted
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Radix trie of controller handler urls, compiled once at setup.
+ *
+ * Urls are literal strings with optional <name> placeholders, matching
+ * anything up to the next '/', or <name:int> matching only digits. Either
+ * needs at least one character, an empty segment doesn't match.
+ * When several urls match, the one added with the lowest index wins, the
+ * same as checking them one by one in order.
+ */
+
+#define CTRL_ROUTE_MAX_PARAMS 16
+
+struct ctrl_route;
+
+struct ctrl_route_param {
+	const char *key;
+	size_t key_len;
+	const char *value;
+	size_t value_len;
+};
+
+struct ctrl_route *ctrl_route_new(void);
+void ctrl_route_free(struct ctrl_route *route);
+
+/* The url is referenced, not copied. Returns -1 if the url is malformed. */
+int ctrl_route_add(struct ctrl_route *route, const char *url, int index);
+
+/*
+ * Returns the index of the matching url, or -1. Parameter values point into path.
+ * params must have room for CTRL_ROUTE_MAX_PARAMS entries. Doesn't allocate.
+ */
+int ctrl_route_match(const struct ctrl_route *route, const char *path, size_t len,
+		struct ctrl_route_param *params, int *nparams);
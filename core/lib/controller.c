@@ -1,6 +1,8 @@
 // Copyright 2018 Schibsted
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <pthread.h>
@@ -13,9 +15,15 @@
 #include <errno.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "sbp/logging.h"
 #include "sbp/http.h"
+#include "sbp/sock_util.h"
 #if __has_include("sbp/http_parser.h")
 #include "sbp/http_parser.h"
 #else
@@ -33,8 +41,10 @@
 #include "sbp/tls.h"
 
 #define MIN_NTHREADS 5
+#define WORKER_DRAIN_TIMEOUT_S 5
 
 #include "controller-events.h"
+#include "controller-route.h"
 
 struct job {
 	bool initial;
@@ -54,9 +64,12 @@ struct ctrl {
 	struct ctrl_handler_int *handlers;
 	struct bconf_node *ctrl_conf;
 	int nhandlers;
+	struct ctrl_route *route;
 	int listen_socket;
 	bool acl_disabled;
 	bool quit;
+	bool thread_per_core;
+	bool drain_listen;	/* Per core workers serve the shared listen backlog when quitting, it's about to be closed. */
 	pthread_mutex_t quit_mutex;
 
 	struct {
@@ -88,10 +101,21 @@ struct ctrl {
 	uint64_t *num_accept;
 };
 
+struct ctrl_conn;
+
 struct worker {
+	/* Must be first, worker_accept_event casts back from it. */
+	struct event_handler listen_event;
 	struct ctrl *ctrl;
 	pthread_t worker_thread;
 
+	/* Only used in thread per core mode, where each worker has its own event loop. */
+	union ctrl_event_e event_e;
+	struct event_handler quit_event;
+	int listen_socket;
+	bool owns_listen;
+	TAILQ_HEAD(, ctrl_conn) conns;
+
 	struct stat_message *thr_state;
 	struct stat_message *handler_name;
 	uint64_t *handler_data_total;
@@ -132,6 +156,23 @@ struct ctrl_req {
 	const char *response_content_type;
 	void *raw_response_data;
 	size_t raw_response_data_sz;
+	const struct iovec *response_iov;
+	int response_iovcnt;
+	int response_fd;
+	off_t response_fd_off;
+	size_t response_fd_len;
+};
+
+/*
+ * Connection owned by a worker in thread per core mode. The request state is
+ * kept between reads so that requests can be parsed as data arrives.
+ */
+struct ctrl_conn {
+	/* Must be first, conn_read_event casts back from it. */
+	struct event_handler ev;
+	struct ctrl_req cr;
+	bool initial;
+	TAILQ_ENTRY(ctrl_conn) conn_list;
 };
 
 #define WORKER_STATE(worker, ...) do { if (worker->thr_state) { stat_message_printf(worker->thr_state, __VA_ARGS__); } } while (0)
@@ -222,7 +263,16 @@ ctrl_error(struct ctrl_req *cr, int error, const char *fmt, ...) {
 
 	cr->handler = &error_handler;
 	cr->status = error;
-	ctrl_close(cr);		/* We don't know if it's a fatal protocol error or just some misunderstanding, always close. */
+	/* We don't know if it's a fatal protocol error or just some misunderstanding, always close. */
+	ctrl_close(cr);
+
+	/* These would override the error output. */
+	cr->response_iov = NULL;
+	cr->response_iovcnt = 0;
+	if (cr->response_fd >= 0) {
+		close(cr->response_fd);
+		cr->response_fd = -1;
+	}
 
 	if (cr->in_handler == 1) {
 		cr->in_handler = 2;
@@ -235,6 +285,7 @@ ctrl_error(struct ctrl_req *cr, int error, const char *fmt, ...) {
 
 static void
 quit_listen_thread_and_broadcast(struct ctrl *ctrl, bool close_listen) {
+	ctrl->drain_listen = close_listen;
 	ctrl->quit = true;
 
 	/* Wake up event listener */
@@ -243,6 +294,12 @@ quit_listen_thread_and_broadcast(struct ctrl *ctrl, bool close_listen) {
 		ctrl->closefd[1] = -1;
 	}
 
+	/* Per core workers wake up on closefd and stop listening when exiting,
+	 * the listen socket is closed once they're joined.
+	 */
+	if (ctrl->thread_per_core)
+		return;
+
 	if (close_listen) {
 		close(ctrl->listen_socket);
 		ctrl->listen_socket = -1;
@@ -298,14 +355,20 @@ ctrl_quit_stage_one(struct ctrl *ctrl, bool close_listen) {
 		TAILQ_INSERT_TAIL(&ctrl->worker_threads, executing_worker, worker_list);
 	}
 
+	/* A worker calling quit from a handler still drains the shared socket,
+	 * stage two closes it after joining that worker.
+	 */
+	if (ctrl->thread_per_core && close_listen && !executing_worker) {
+		close(ctrl->listen_socket);
+		ctrl->listen_socket = -1;
+	}
+
 	return 0;
 }
 
 void
 ctrl_quit_stage_two(struct ctrl *ctrl) {
 	log_printf(LOG_DEBUG, "ctrl_quit stage two");
-	if (ctrl->listen_socket != -1)
-		close(ctrl->listen_socket);
 
 	/* There can be at most one, otherwise something went horribly wrong */
 	if (!TAILQ_EMPTY(&ctrl->worker_threads)) {
@@ -327,6 +390,9 @@ ctrl_quit_stage_two(struct ctrl *ctrl) {
 
 		free(worker);
 	}
+	if (ctrl->listen_socket != -1)
+		close(ctrl->listen_socket);
+
 	pthread_mutex_destroy(&ctrl->queue_lock);
 	pthread_mutex_destroy(&ctrl->job_lock);
 	pthread_cond_destroy(&ctrl->job_cond);
@@ -336,6 +402,7 @@ ctrl_quit_stage_two(struct ctrl *ctrl) {
 			stat_counter_dynamic_free(ctrl->handlers[i].cnt);
 	}
 	free(ctrl->handlers);
+	ctrl_route_free(ctrl->route);
 
 	/* We are the only ones hadling here, no need to lock */
 	while (!TAILQ_EMPTY(&ctrl->event_list)) {
@@ -396,6 +463,31 @@ ctrl_set_raw_response_data(struct ctrl_req *cr, void *d, size_t sz) {
 	cr->raw_response_data_sz = sz;
 }
 
+void
+ctrl_set_response_iov(struct ctrl_req *cr, const struct iovec *iov, int iovcnt) {
+	cr->response_iov = iov;
+	cr->response_iovcnt = iovcnt;
+}
+
+int
+ctrl_set_response_fd(struct ctrl_req *cr, int fd, off_t offset, size_t len) {
+	if (len == 0) {
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			log_printf(LOG_CRIT, "controller: fstat response fd: %m");
+			close(fd);
+			return -1;
+		}
+		len = st.st_size > offset ? st.st_size - offset : 0;
+	}
+	if (cr->response_fd >= 0)
+		close(cr->response_fd);
+	cr->response_fd = fd;
+	cr->response_fd_off = offset;
+	cr->response_fd_len = len;
+	return 0;
+}
+
 size_t
 ctrl_get_content_length(struct ctrl_req *cr) {
 	return cr->content_length;
@@ -477,17 +569,95 @@ on_message_begin(struct http_parser *hp) {
 	return 0;
 }
 
+/*
+ * Write all of iov, which is modified on partial writes.
+ */
+static int
+write_iov_all(struct ctrl_req *cr, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t r;
+
+		if (cr->tls)
+			r = tls_write_vecs(cr->tls, iov, iovcnt);
+		else
+			r = writev(cr->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (r < 0 && errno == EINTR && !cr->tls)
+			continue;
+		if (r < 1)
+			return -1;
+
+		while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send the response fd, with sendfile if the kernel can do it for us.
+ * TLS and other platforms read it in chunks.
+ */
+static int
+write_fd_all(struct ctrl_req *cr) {
+	off_t off = cr->response_fd_off;
+	size_t left = cr->response_fd_len;
+
+#ifdef __linux__
+	if (!cr->tls) {
+		while (left > 0) {
+			ssize_t r = sendfile(cr->fd, cr->response_fd, &off, left);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0 && (errno == EINVAL || errno == ENOSYS) && off == cr->response_fd_off)
+				break;	/* Not supported for this fd, fall back to reading. */
+			if (r < 1)
+				return -1;
+			left -= r;
+		}
+		if (left == 0)
+			return 0;
+	}
+#endif
+
+	size_t bufsz = left < 65536 ? left : 65536;
+	char *buf = xmalloc(bufsz);
+	int res = 0;
+	while (left > 0) {
+		ssize_t r = pread(cr->response_fd, buf, left < bufsz ? left : bufsz, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1) {
+			res = -1;
+			break;
+		}
+		struct iovec iov = { .iov_base = buf, .iov_len = r };
+		if (write_iov_all(cr, &iov, 1)) {
+			res = -1;
+			break;
+		}
+		off += r;
+		left -= r;
+	}
+	free(buf);
+	return res;
+}
+
 static int
 on_message_complete(struct http_parser *hp) {
 	struct ctrl_req *cr = hp->data;
 
 	if (cr->handler) {
 		struct buf_string hdrs = { 0 };
-		char *data;
-		size_t data_sz;
-		ssize_t r;
-		char *hdr_data;
-		size_t hdr_sz;
+		struct iovec iovbuf[8];
+		struct iovec *iov = iovbuf;
+		int iovcnt = 1;
+		size_t data_sz = 0;
 		char buf[128];
 
 		WORKER_STATE(cr->worker, "handler_finish");
@@ -495,13 +665,27 @@ on_message_complete(struct http_parser *hp) {
 		cr->in_handler = 1;		/* For error bailouts. */
 		(*cr->handler->hand.finish)(cr, cr->qs, cr->handler_data ?: cr->handler->hand.cb_data);
 
-		if (cr->raw_response_data != NULL) {
-			data = cr->raw_response_data;
+		/* Headers go in iov[0], filled in below once the length is known. */
+		if (cr->response_fd >= 0) {
+			data_sz = cr->response_fd_len;
+			if (cr->text.pos != 0 || cr->raw_response_data || cr->response_iov)
+				log_printf(LOG_CRIT, "controller: [%s]: fd response with other output, using fd", cr->handler->hand.url);
+		} else if (cr->response_iov) {
+			if (cr->response_iovcnt + 1 > (int)(sizeof(iovbuf) / sizeof(iovbuf[0])))
+				iov = xmalloc((cr->response_iovcnt + 1) * sizeof(*iov));
+			for (int i = 0; i < cr->response_iovcnt; i++) {
+				iov[iovcnt++] = cr->response_iov[i];
+				data_sz += cr->response_iov[i].iov_len;
+			}
+			if (cr->text.pos != 0 || cr->raw_response_data)
+				log_printf(LOG_CRIT, "controller: [%s]: iov response with other output, using iov", cr->handler->hand.url);
+		} else if (cr->raw_response_data != NULL) {
+			iov[iovcnt++] = (struct iovec){ .iov_base = cr->raw_response_data, .iov_len = cr->raw_response_data_sz };
 			data_sz = cr->raw_response_data_sz;
 			if (cr->text.pos != 0)
 				log_printf(LOG_CRIT, "controller: [%s]: raw data with buf output, using raw data", cr->handler->hand.url);
-		} else {
-			data = cr->text.buf;
+		} else if (cr->text.pos) {
+			iov[iovcnt++] = (struct iovec){ .iov_base = cr->text.buf, .iov_len = cr->text.pos };
 			data_sz = cr->text.pos;
 		}
 
@@ -528,38 +712,29 @@ on_message_complete(struct http_parser *hp) {
 
 		WORKER_STATE(cr->worker, "sending_result (%llu + %zd bytes)", (unsigned long long)hdrs.pos, data_sz);
 
-		hdr_data = hdrs.buf;
-		hdr_sz = hdrs.pos;
-		do {
-			if (cr->tls)
-				r = tls_write(cr->tls, hdr_data, hdr_sz);
-			else
-				r = write(cr->fd, hdr_data, hdr_sz);
-			if (r < 1) {
-				log_printf(LOG_CRIT, "controller: Failed to write response header: %m");
-			} else {
-				hdr_data += r;
-				hdr_sz -= r;
-			}
-		} while (r > 0 && hdr_sz > 0);
-		free(hdrs.buf);
-		if (data_sz && hdr_sz == 0) {
-			do {
-				if (cr->tls)
-					r = tls_write(cr->tls, data, data_sz);
-				else
-					r = write(cr->fd, data, data_sz);
-				if (r < 1) {
-					log_printf(LOG_CRIT, "controller: Failed to write response data: %m");
-				} else {
-					data += r;
-					data_sz -= r;
-				}
-			} while (r > 0 && data_sz > 0);
+		/* Headers and body in a single writev, or headers followed by the fd. */
+		iov[0] = (struct iovec){ .iov_base = hdrs.buf, .iov_len = hdrs.pos };
+		if (write_iov_all(cr, iov, iovcnt)) {
+			log_printf(LOG_CRIT, "controller: Failed to write response: %m");
+			ctrl_close(cr);
+		} else if (cr->response_fd >= 0 && write_fd_all(cr)) {
+			log_printf(LOG_CRIT, "controller: Failed to write response data: %m");
+			ctrl_close(cr);
 		}
+		free(hdrs.buf);
+		if (iov != iovbuf)
+			free(iov);
 		free(cr->text.buf);
 		cr->text.buf = NULL;
 		cr->text.pos = 0;
+		if (cr->response_fd >= 0) {
+			close(cr->response_fd);
+			cr->response_fd = -1;
+		}
+		cr->response_iov = NULL;
+		cr->response_iovcnt = 0;
+		cr->raw_response_data = NULL;
+		cr->raw_response_data_sz = 0;
 
 		if (cr->handler->hand.cleanup)
 			(*cr->handler->hand.cleanup)(cr, cr->handler_data ?: cr->handler->hand.cb_data);
@@ -584,80 +759,6 @@ parse_qs_cb(struct parse_cb_data *d, char *key, int klen, char *val, int vlen) {
 	sm_insert(qs, key, klen, val, vlen);
 }
 
-struct path_param {
-	const char *key;
-	size_t key_len;
-	const char *value;
-	size_t value_len;
-};
-
-static bool
-match_handler(const char *handler_url, size_t handler_url_len, const char *request_url, size_t request_url_len, struct path_param **p, int *num_params) {
-	bool match = false;
-	const char *hup = handler_url;
-	const char *hend = handler_url + handler_url_len;
-	const char *rup = request_url;
-	const char *rend = request_url + request_url_len;
-	int paramidx = 0;
-	int num_vars = 0, num_var_ends = 0;
-	struct path_param *params = NULL;
-
-	for (const char *hp = hup; hp < hend; hp++) {
-		int diff;
-		if (*hp == '<')
-			num_vars++;
-		if (*hp == '>')
-			num_var_ends++;
-
-		diff = num_vars - num_var_ends;
-		if (diff != 0 && diff != 1) {
-			log_printf(LOG_CRIT, "Malformed handler url found: %.*s", (int)handler_url_len, handler_url);
-			goto out;
-		}
-	}
-
-	params = xcalloc(num_vars, sizeof(*params));
-	for (; hup != hend && rup != rend; hup++, rup++) {
-		if (*hup == *rup) {
-			continue;
-		} else if (*hup == '<') {
-			params[paramidx].key = ++hup;
-			while (*hup++ != '>') {
-				params[paramidx].key_len++;
-			}
-
-			params[paramidx].value = rup;
-			while (*rup != '/' && rup != rend) {
-				rup++;
-				params[paramidx].value_len++;
-			}
-			paramidx++;
-
-			if (rup == rend || hup == hend)
-				break;
-		} else if (*hup != *rup) {
-			break;
-		}
-	}
-
-	if (hup != hend || rup != rend) {
-		goto out;
-	}
-
-	log_printf(LOG_DEBUG, "Found matching handler for with url: %.*s", (int)handler_url_len, handler_url);
-	match = true;
-
-out:
-	if (!match) {
-		free(params);
-		params = NULL;
-		num_vars = 0;
-	}
-	*p = params;
-	*num_params = num_vars;
-	return match;
-}
-
 static struct bconf_node *
 get_default_acl(void) {
 	static struct bconf_node *default_acl;
@@ -764,7 +865,7 @@ static int
 on_url(struct http_parser *hp, const char *at, size_t length) {
 	struct ctrl_req *cr = hp->data;
 	struct http_parser_url hpu;
-	struct path_param *params = NULL;
+	struct ctrl_route_param params[CTRL_ROUTE_MAX_PARAMS];
 	int num_path_params = 0;
 	int res;
 
@@ -780,15 +881,14 @@ on_url(struct http_parser *hp, const char *at, size_t length) {
 		ctrl_error(cr, 400, "on_url: no path");
 		return 0;
 	}
-	for (int i = 0; i < cr->worker->ctrl->nhandlers; i++) {
-		const struct ctrl_handler_int *hi = &cr->worker->ctrl->handlers[i];
-
-		if (match_handler(hi->hand.url, strlen(hi->hand.url), at + hpu.field_data[UF_PATH].off, hpu.field_data[UF_PATH].len, &params, &num_path_params)) {
-			cr->handler = hi;
-			if (hi->cnt)
-				STATCNT_INC(hi->cnt);
-			break;
-		}
+	int hidx = ctrl_route_match(cr->worker->ctrl->route, at + hpu.field_data[UF_PATH].off, hpu.field_data[UF_PATH].len, params, &num_path_params);
+	if (hidx >= 0) {
+		const struct ctrl_handler_int *hi = &cr->worker->ctrl->handlers[hidx];
+
+		log_printf(LOG_DEBUG, "Found matching handler for with url: %s", hi->hand.url);
+		cr->handler = hi;
+		if (hi->cnt)
+			STATCNT_INC(hi->cnt);
 	}
 
 	if (!check_acl(cr, at + hpu.field_data[UF_PATH].off, hpu.field_data[UF_PATH].len,
@@ -797,14 +897,12 @@ on_url(struct http_parser *hp, const char *at, size_t length) {
 			log_printf(LOG_WARNING, "controller: ACL check failed, but ACL disabled");
 		} else {
 			ctrl_error(cr, 403, "Forbidden (%.*s)", hpu.field_data[UF_PATH].len, at + hpu.field_data[UF_PATH].off);
-			free(params);
 			return 0;
 		}
 	}
 
 	if (cr->handler == NULL) {
 		ctrl_error(cr, 404, "unknown url (%.*s)", hpu.field_data[UF_PATH].len, at + hpu.field_data[UF_PATH].off);
-		free(params);
 		return 0;
 	}
 
@@ -834,7 +932,6 @@ on_url(struct http_parser *hp, const char *at, size_t length) {
 		free(qs);
 	}
 
-	free(params);
 	return 0;
 }
 
@@ -969,24 +1066,76 @@ static struct http_parser_settings hp_settings = {
 
 };
 
+static void
+request_begin(struct ctrl_req *cr) {
+	http_parser_init(&cr->hp, HTTP_REQUEST);
+	cr->hp.data = cr;
+	cr->response_fd = -1;
+	cr->header_state = HS_NONE;
+	cr->upgrade[0] = '\0';
+	cr->message_completed = false;
+	cr->keepalive = false;
+}
+
+static int
+request_parse(struct ctrl_req *cr, const char *buf, size_t len) {
+	size_t nparsed = http_parser_execute(&cr->hp, &hp_settings, buf, len);
+	if (nparsed != len) {
+		log_printf(LOG_CRIT, "handle_command: request parse error: %s (%s)",
+				http_errno_description(HTTP_PARSER_ERRNO(&cr->hp)),
+				http_errno_name(HTTP_PARSER_ERRNO(&cr->hp)));
+		return -1;
+	}
+	return 0;
+}
+
+static bool
+request_upgrading(struct ctrl_req *cr) {
+	return cr->hp.upgrade && cr->handler->hand.upgrade && cr->status == 101;
+}
+
+/*
+ * Called once the message is completed, hands the fd over on upgrade
+ * and decides on keepalive. Resets the request for the next one.
+ */
+static void
+request_done(struct ctrl_req *cr) {
+	if (request_upgrading(cr)) {
+		WORKER_STATE(cr->worker, "upgraded");
+		cr->keepalive = false;
+		(*cr->handler->hand.upgrade)(cr, cr->fd, cr->tls, cr->handler_data ?: cr->handler->hand.cb_data);
+		cr->fd = -1;
+		cr->tls = NULL;
+	} else if (cr->close_conn || !http_should_keep_alive(&cr->hp)) {
+		/* Always close if asked to */
+		WORKER_STATE(cr->worker, "closed");
+	} else {
+		WORKER_STATE(cr->worker, "keepalive");
+		cr->keepalive = true;
+	}
+	sm_free(cr->qs);
+	cr->qs = NULL;
+	bconf_free(&cr->custom_headers);
+	bconf_free(&cr->cr_bconf);
+	cr->handler = NULL;
+	cr->handler_data = NULL;
+	cr->content_length = 0;
+	cr->status = 0;
+	cr->in_handler = 0;
+	cr->response_content_type = NULL;
+}
+
 static void
 handle_request(struct ctrl_req *cr, int initbyte) {
 	char buf[65536];
-	size_t nparsed;
 	ssize_t len;
 
-	http_parser_init(&cr->hp, HTTP_REQUEST);
-	cr->hp.data = cr;
+	request_begin(cr);
 
 	if (initbyte >= 0) {
 		char ch = initbyte;
-		nparsed = http_parser_execute(&cr->hp, &hp_settings, &ch, 1);
-		if (nparsed != 1) {
-			log_printf(LOG_CRIT, "handle_command: request parse error: %s (%s)",
-					http_errno_description(HTTP_PARSER_ERRNO(&cr->hp)),
-					http_errno_name(HTTP_PARSER_ERRNO(&cr->hp)));
+		if (request_parse(cr, &ch, 1))
 			return;
-		}
 	}
 
 	do {
@@ -1005,37 +1154,11 @@ handle_request(struct ctrl_req *cr, int initbyte) {
 			return;
 		}
 
-		nparsed = http_parser_execute(&cr->hp, &hp_settings, buf, len);
-		if (nparsed != (size_t)len) {
-			log_printf(LOG_CRIT, "handle_command: request parse error: %s (%s)",
-					http_errno_description(HTTP_PARSER_ERRNO(&cr->hp)),
-					http_errno_name(HTTP_PARSER_ERRNO(&cr->hp)));
+		if (request_parse(cr, buf, len))
 			return;
-		}
 	} while (!cr->message_completed);
 
-	if (cr->hp.upgrade && cr->handler->hand.upgrade && cr->status == 101) {
-		WORKER_STATE(cr->worker, "upgraded");
-		cr->keepalive = false;
-		(*cr->handler->hand.upgrade)(cr, cr->fd, cr->tls, cr->handler_data ?: cr->handler->hand.cb_data);
-		cr->fd = -1;
-		cr->tls = NULL;
-	} else if (cr->close_conn || !http_should_keep_alive(&cr->hp)) {
-		/* Always close if asked to */
-		WORKER_STATE(cr->worker, "closed");
-	} else {
-		WORKER_STATE(cr->worker, "keepalive");
-		cr->keepalive = true;
-	}
-	sm_free(cr->qs);
-	bconf_free(&cr->custom_headers);
-	bconf_free(&cr->cr_bconf);
-	cr->handler = NULL;
-	cr->handler_data = NULL;
-	cr->content_length = 0;
-	cr->status = 0;
-	cr->in_handler = 0;
-	cr->response_content_type = NULL;
+	request_done(cr);
 }
 
 static int
@@ -1271,6 +1394,262 @@ worker_thread(void *v) {
 	pthread_exit(NULL);
 }
 
+static void
+conn_close(struct ctrl_conn *conn) {
+	struct ctrl_req *cr = &conn->cr;
+
+	TAILQ_REMOVE(&cr->worker->conns, conn, conn_list);
+	if (cr->tls) {
+		tls_stop(cr->tls);
+		tls_free(cr->tls);
+	}
+	/* Closing also removes it from the event set. */
+	if (cr->fd != -1)
+		close(cr->fd);
+	free(conn);
+}
+
+/*
+ * Thread per core read handler. Plain HTTP requests are parsed as data
+ * arrives, without blocking the thread waiting for the rest of a request.
+ * TLS connections are read blocking until the request is complete, since
+ * decrypted data might be buffered where the event loop can't see it.
+ */
+static void
+conn_read_event(struct event_handler *event_handler, struct ctrl *ctrl) {
+	struct ctrl_conn *conn = (struct ctrl_conn *)event_handler;
+	struct ctrl_req *cr = &conn->cr;
+	struct worker *worker = cr->worker;
+	char buf[65536];
+	ssize_t len;
+
+	WORKER_STATE(worker, "handling");
+
+	if (conn->initial) {
+		conn->initial = false;
+		int r = check_for_tls(ctrl, cr);
+		if (r == -2) {
+			conn_close(conn);
+			goto out;
+		}
+		request_begin(cr);
+		if (r >= 0) {
+			char ch = r;
+			if (request_parse(cr, &ch, 1)) {
+				conn_close(conn);
+				goto out;
+			}
+		}
+	}
+
+	do {
+		if (cr->tls)
+			len = tls_read(cr->tls, buf, sizeof(buf));
+		else
+			len = recv(cr->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+		if (len < 0 && !cr->tls && (errno == EAGAIN || errno == EWOULDBLOCK))
+			goto out;
+
+		if (len < 0) {
+			log_printf(LOG_CRIT, "handle_request: read %m");
+			conn_close(conn);
+			goto out;
+		}
+
+		if (len == 0) {
+			WORKER_STATE(worker, "closed, empty read");
+			conn_close(conn);
+			goto out;
+		}
+
+		if (request_parse(cr, buf, len)) {
+			conn_close(conn);
+			goto out;
+		}
+	} while (!cr->message_completed);
+
+	/* The upgrade handler owns the fd, make sure we don't see any more events for it. */
+	if (request_upgrading(cr))
+		event_e_remove(&worker->event_e, cr->fd);
+
+	request_done(cr);
+
+	if (cr->keepalive && !ctrl->quit)
+		request_begin(cr);
+	else
+		conn_close(conn);
+
+out:
+	WORKER_STATE(worker, "idle");
+}
+
+static void
+worker_accept(struct worker *worker, struct ctrl *ctrl) {
+	/* The listen socket is non-blocking, accept until the backlog is empty. */
+	while (true) {
+		int fd = accept(worker->listen_socket, NULL, NULL);
+		if (fd < 0) {
+			/* Other workers might have taken it if the listen socket is shared. */
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+				log_printf(LOG_CRIT, "Error accepting in listen socket: %m");
+			return;
+		}
+		STATCNT_INC(ctrl->num_accept);
+
+#ifndef __linux__
+		/* Accepted sockets inherit O_NONBLOCK here, responses are written blocking. */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+#endif
+
+		struct ctrl_conn *conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			log_printf(LOG_CRIT, "failed to calloc ctrl_conn: %m");
+			close(fd);
+			continue;
+		}
+		conn->ev.cb = conn_read_event;
+		conn->ev.fd = fd;
+		conn->cr.worker = worker;
+		conn->cr.fd = fd;
+		conn->cr.response_fd = -1;
+		conn->initial = true;
+
+		if (event_e_add(&worker->event_e, &conn->ev, fd, false) < 0) {
+			log_printf(LOG_CRIT, "Error adding socket to event set: %m");
+			close(fd);
+			free(conn);
+			continue;
+		}
+		TAILQ_INSERT_TAIL(&worker->conns, conn, conn_list);
+	}
+}
+
+static void
+worker_accept_event(struct event_handler *event_handler, struct ctrl *ctrl) {
+	struct worker *worker = (struct worker *)event_handler;
+
+	if (ctrl->quit)
+		return;
+
+	worker_accept(worker, ctrl);
+}
+
+/*
+ * Closing a listen socket resets the connections still in its backlog, and
+ * for SO_REUSEPORT they aren't moved to the other sockets bound to the port.
+ * Accept them before the socket is closed and serve them, giving up after
+ * WORKER_DRAIN_TIMEOUT_S.
+ */
+static void
+worker_drain_listen(struct worker *worker, struct ctrl *ctrl) {
+	if (ctrl->closefd[0] >= 0)
+		event_e_remove(&worker->event_e, ctrl->closefd[0]);
+
+	worker_accept(worker, ctrl);
+	if (worker->owns_listen) {
+		close(worker->listen_socket);
+		worker->owns_listen = false;
+	} else {
+		/* Shared, closed by ctrl_quit once all workers are joined. */
+		event_e_remove(&worker->event_e, worker->listen_socket);
+	}
+	worker->listen_socket = -1;
+
+	time_t deadline = time(NULL) + WORKER_DRAIN_TIMEOUT_S;
+	while (!TAILQ_EMPTY(&worker->conns) && time(NULL) < deadline) {
+		if (event_e_handle(&worker->event_e, ctrl) < 0 && errno != EINTR) {
+			log_printf(LOG_CRIT, "Error handling events: %m");
+			break;
+		}
+	}
+}
+
+static void
+worker_quit_event(struct event_handler *event_handler, struct ctrl *ctrl) {
+	/* closefd was closed, ctrl->quit is already set and the loop will exit. */
+}
+
+/*
+ * Thread per core worker. Owns its listen socket, event set and all
+ * connections accepted on it, nothing is passed between threads.
+ */
+static void *
+worker_event_thread(void *v) {
+	struct worker *worker = (struct worker *)v;
+	struct ctrl *ctrl = worker->ctrl;
+
+	WORKER_STATE(worker, "idle");
+	while (!ctrl->quit) {
+		if (event_e_handle(&worker->event_e, ctrl) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf(LOG_CRIT, "Error handling events: %m");
+			break;
+		}
+	}
+
+	while (!TAILQ_EMPTY(&worker->conns))
+		conn_close(TAILQ_FIRST(&worker->conns));
+	if (worker->owns_listen || ctrl->drain_listen)
+		worker_drain_listen(worker, ctrl);
+	while (!TAILQ_EMPTY(&worker->conns))
+		conn_close(TAILQ_FIRST(&worker->conns));
+	event_e_close(&worker->event_e);
+
+	pthread_exit(NULL);
+}
+
+/*
+ * Set up the event set and listen socket of a per core worker. With reuseport
+ * every worker gets its own socket bound to the same port, otherwise they all
+ * wait on the shared one.
+ */
+static int
+worker_event_setup(struct worker *worker, const char *host, bool reuseport) {
+	struct ctrl *ctrl = worker->ctrl;
+
+	TAILQ_INIT(&worker->conns);
+	worker->listen_socket = ctrl->listen_socket;
+	if (reuseport && !TAILQ_EMPTY(&ctrl->worker_threads)) {
+		char pbuf[NI_MAXSERV];
+		int r = get_local_port(ctrl->listen_socket, pbuf, sizeof(pbuf), NI_NUMERICSERV);
+		if (r) {
+			log_printf(LOG_CRIT, "controller: failed to get listen port: %s", gai_strerror(r));
+			return -1;
+		}
+		if ((worker->listen_socket = create_socket_reuseport(host, pbuf)) == -1)
+			return -1;
+		worker->owns_listen = true;
+	}
+
+	if (fcntl(worker->listen_socket, F_SETFL, fcntl(worker->listen_socket, F_GETFL) | O_NONBLOCK) == -1) {
+		log_printf(LOG_CRIT, "controller: failed to set listen socket non-blocking: %m");
+		goto fail;
+	}
+
+	event_e_init(&worker->event_e);
+	worker->listen_event.cb = worker_accept_event;
+	worker->listen_event.fd = worker->listen_socket;
+	if (event_e_add(&worker->event_e, &worker->listen_event, worker->listen_socket, false) < 0) {
+		log_printf(LOG_CRIT, "Error adding socket to event set: %m");
+		event_e_close(&worker->event_e);
+		goto fail;
+	}
+	if (ctrl->closefd[0] >= 0) {
+		worker->quit_event.cb = worker_quit_event;
+		worker->quit_event.fd = ctrl->closefd[0];
+		event_e_add(&worker->event_e, &worker->quit_event, ctrl->closefd[0], false);
+	}
+	return 0;
+
+fail:
+	if (worker->owns_listen)
+		close(worker->listen_socket);
+	worker->owns_listen = false;
+	return -1;
+}
+
 static int
 ctrl_setup_https_server(struct ctrl *ctrl, struct bconf_node *ctrl_conf, const char *cert_host,
 		struct https_state *https) {
@@ -1367,6 +1746,7 @@ ctrl_setup(struct bconf_node *ctrl_conf, const struct ctrl_handler *handlers, in
 	int r;
 	int i;
 	const char *cert_host = host;
+	bool reuseport = false;
 
 	/* XXX: sysloghook necessity */
 	log_printf(LOG_INFO, "controller: setting up controller");
@@ -1374,8 +1754,17 @@ ctrl_setup(struct bconf_node *ctrl_conf, const struct ctrl_handler *handlers, in
 	if (!bconf_get_int(ctrl_conf, "bind_host"))
 		host = NULL;
 
+	ctrl->thread_per_core = bconf_get_int(ctrl_conf, "thread_per_core");
+
 	if (listen_socket == -1) {
-		if ((ctrl->listen_socket = create_socket(host, port)) == -1) {
+		if (ctrl->thread_per_core) {
+			ctrl->listen_socket = create_socket_reuseport(host, port);
+			if (ctrl->listen_socket == -1)
+				log_printf(LOG_WARNING, "controller: sharing the listen socket between threads");
+			else
+				reuseport = true;
+		}
+		if (!reuseport && (ctrl->listen_socket = create_socket(host, port)) == -1) {
 			free(ctrl);
 			return NULL;
 		}
@@ -1427,22 +1816,26 @@ ctrl_setup(struct bconf_node *ctrl_conf, const struct ctrl_handler *handlers, in
 	ctrl->stat_counters_prefix = bconf_get_string(ctrl->ctrl_conf, "stat_counters_prefix");
 	ctrl->nhandlers = nhandlers;
 	ctrl->handlers = calloc(nhandlers, sizeof(*ctrl->handlers));
+	ctrl->route = ctrl_route_new();
 	for (i = 0; i < nhandlers; i++) {
 		ctrl->handlers[i].hand = handlers[i];
+		/* Malformed urls are logged and never match. */
+		ctrl_route_add(ctrl->route, handlers[i].url, i);
 		if (ctrl->stat_counters_prefix) {
 			/* We skip the first character of the url because it's always a '/'. */
 			ctrl->handlers[i].cnt = stat_counter_dynamic_alloc(3, ctrl->stat_counters_prefix, &handlers[i].url[1], "calls");
 		}
 	}
 
-	/* Non fatal */
+	/* Non fatal, except for per core workers which only wake up on it to quit. */
 	if (pipe(ctrl->closefd) < 0) {
-		log_printf(LOG_WARNING, "Failed to create closefd %m");
+		log_printf(ctrl->thread_per_core ? LOG_CRIT : LOG_WARNING, "Failed to create closefd %m");
 		ctrl->closefd[0] = ctrl->closefd[1] = -1;
 	}
 
 	ctrl->num_accept = stat_counter_dynamic_alloc(2, "controller", "accept");
-	if ((r = pthread_create(&ctrl->listen_thread, NULL, listen_thread, ctrl)) != 0) {
+	if (ctrl->thread_per_core ? ctrl->closefd[0] < 0
+			: (r = pthread_create(&ctrl->listen_thread, NULL, listen_thread, ctrl)) != 0) {
 		if (listen_socket == -1)
 			close(ctrl->listen_socket);
 
@@ -1465,13 +1858,20 @@ ctrl_setup(struct bconf_node *ctrl_conf, const struct ctrl_handler *handlers, in
 		pthread_cond_destroy(&ctrl->job_cond);
 
 		free(ctrl->handlers);
+		ctrl_route_free(ctrl->route);
 		free(ctrl);
 		return NULL;
 	}
 
 	nthr = bconf_get_int(ctrl_conf, "nthreads");
-	if (nthr < MIN_NTHREADS)
+	if (ctrl->thread_per_core) {
+		if (nthr <= 0)
+			nthr = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthr <= 0)
+			nthr = 1;
+	} else if (nthr < MIN_NTHREADS) {
 		nthr = MIN_NTHREADS;
+	}
 
 	for (i = 0; i < nthr; i++) {
 		struct worker *worker = calloc(1, sizeof(*worker));
@@ -1492,8 +1892,18 @@ ctrl_setup(struct bconf_node *ctrl_conf, const struct ctrl_handler *handlers, in
 			worker->handler_data_current = stat_counter_dynamic_alloc(5, ctrl->stat_counters_prefix, "thread", buf, "post_data", "current");
 		}
 
-		if ((r = pthread_create(&worker->worker_thread, NULL, worker_thread, worker)) != 0) {
+		if (ctrl->thread_per_core && worker_event_setup(worker, host, reuseport)) {
+			log_printf(LOG_CRIT, "failed to set up event loop for worker #%d", i);
+			r = -1;
+		} else if ((r = pthread_create(&worker->worker_thread, NULL, ctrl->thread_per_core ? worker_event_thread : worker_thread, worker)) != 0) {
 			log_printf(LOG_CRIT, "failed to create worker_thread #%d, %d, %s", i, r, strerror(r));
+			if (ctrl->thread_per_core) {
+				event_e_close(&worker->event_e);
+				if (worker->owns_listen)
+					close(worker->listen_socket);
+			}
+		}
+		if (r != 0) {
 			if (ctrl->stat_counters_prefix) {
 				stat_message_dynamic_free(worker->thr_state);
 				stat_message_dynamic_free(worker->handler_name);
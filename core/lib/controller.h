@@ -12,6 +12,7 @@ struct vtree_chain;
 struct ctrl_req;
 struct stringmap;
 struct tls;
+struct iovec;
 struct ctrl_handler {
 	const char *url;
 	/*
@@ -29,6 +30,14 @@ struct ctrl_handler {
 struct ctrl;
 struct https_state;
 
+/*
+ * With thread_per_core=1 in the config, each of the nthreads workers (default
+ * one per CPU) runs its own event loop, accepting on its own SO_REUSEPORT
+ * socket bound to the same port and handling those connections itself.
+ * If a listen socket is passed in, or reuseport isn't supported, the workers
+ * share that socket instead. Handlers block the other connections on the same
+ * thread while running, so they should be quick in this mode.
+ */
 struct ctrl *ctrl_setup(struct bconf_node *, const struct ctrl_handler *, int nhandlers, int, struct https_state*);
 /*
  * Shutdown controller threads and clean up.
@@ -74,6 +83,22 @@ void ctrl_set_content_type(struct ctrl_req *cr, const char *ct);
  */
 void ctrl_set_raw_response_data(struct ctrl_req *, void *, size_t);
 
+/*
+ * Makes this request respond with the concatenation of the iovecs, written
+ * with scatter-gather IO without copying. Neither the array nor the data is
+ * copied, keep them valid until the cleanup callback. Overrides raw data
+ * and buf output.
+ */
+void ctrl_set_response_iov(struct ctrl_req *, const struct iovec *iov, int iovcnt);
+
+/*
+ * Makes this request respond with len bytes from fd starting at offset,
+ * using sendfile where possible. A len of 0 means until the end of the file.
+ * The controller takes over the fd and closes it when done.
+ * Overrides all the other response data. Returns -1 if fstat fails.
+ */
+int ctrl_set_response_fd(struct ctrl_req *, int fd, off_t offset, size_t len);
+
 /*
  * Returns the Content-Length set by the request or 0 if none has been received.
  */
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <netdb.h>
+#include <stdbool.h>
 
 #include "create_socket.h"
 #include "sbp/logging.h"
@@ -16,7 +17,7 @@
 #include "sbp/sock_util.h"
 
 static int 
-create_socket_single_af(const char *host, const char *port, int af, int level) {
+create_socket_single_af(const char *host, const char *port, int af, int level, bool reuseport) {
 	int the_socket;
 	int opt;
 	const struct addrinfo hints = { .ai_family = af, .ai_flags = AI_PASSIVE | AI_ADDRCONFIG, .ai_socktype = SOCK_STREAM };
@@ -40,6 +41,14 @@ create_socket_single_af(const char *host, const char *port, int af, int level) {
 		freeaddrinfo(res);
 		return -1;
 	}
+#ifdef SO_REUSEPORT
+	opt = 1;
+	if (reuseport && setsockopt(the_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		log_printf(level, "Failed to set reuseport (%m).");
+		freeaddrinfo(res);
+		return -1;
+	}
+#endif
 	opt = 0;
 	if (res->ai_family == AF_INET6 && setsockopt(the_socket, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) < 0) {
 		log_printf(level, "Failed to unset v6only (%m).");
@@ -69,16 +78,32 @@ create_socket_single_af(const char *host, const char *port, int af, int level) {
  * any IP-address on the specified port.
  */
 
-int
-create_socket(const char *host, const char *port) {
+static int
+create_socket_opt(const char *host, const char *port, bool reuseport) {
 	int s;
-	if ((s = create_socket_single_af(host, port, AF_INET6, LOG_INFO)) == -1) {
+	if ((s = create_socket_single_af(host, port, AF_INET6, LOG_INFO, reuseport)) == -1) {
 		log_printf(LOG_INFO, "Retrying with IPv4 only socket.");
-		s = create_socket_single_af(host, port, AF_INET, LOG_CRIT);
+		s = create_socket_single_af(host, port, AF_INET, LOG_CRIT, reuseport);
 	}
 	return s;
 }
 
+int
+create_socket(const char *host, const char *port) {
+	return create_socket_opt(host, port, false);
+}
+
+int
+create_socket_reuseport(const char *host, const char *port) {
+#ifdef SO_REUSEPORT
+	return create_socket_opt(host, port, true);
+#else
+	log_printf(LOG_INFO, "SO_REUSEPORT not supported on this platform.");
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
 int
 create_socket_any_port(const char *host, char **port) {
 	int s = create_socket(host, "0");
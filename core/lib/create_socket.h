@@ -15,6 +15,12 @@ extern "C" {
 int create_socket(const char *host, const char *port);
 int create_socket_unix(const char *);
 
+/* Same as create_socket but sets SO_REUSEPORT, allowing several sockets to be
+ * bound to the same address and port, with the kernel spreading connections
+ * between them. Returns -1 with errno ENOPROTOOPT if not supported.
+ */
+int create_socket_reuseport(const char *host, const char *port);
+
 /* Return malloced string with port number in *port */
 int create_socket_any_port(const char *host, char **port) NONNULL(2);
 
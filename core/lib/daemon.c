@@ -15,6 +15,7 @@
 #endif
 #include <sys/resource.h>
 #include <sys/poll.h>
+#include <pthread.h>
 
 #include "daemon.h"
 #include "sbp/http.h"
@@ -36,6 +37,10 @@ int healthcheck_unavail_ms;
 int healthcheck_unavail_limit;
 float respawn_delay_backoff_rate = 1.0f;
 
+static void (*reload_cb)(void *cbarg);
+static void *reload_cbarg;
+static bool reload_deferred;
+
 bool startup_wait = false;
 static int startup_wait_timeout_ms = 5000;
 static int pfd[2];
@@ -89,6 +94,48 @@ cleanup(void) {
 	free(switchuid);
 }
 
+void
+set_reload_cb(void (*cb)(void *cbarg), void *cbarg) {
+	reload_cb = cb;
+	reload_cbarg = cbarg;
+}
+
+void
+set_reload_deferred(bool flag) {
+	reload_deferred = flag;
+}
+
+static void *
+reload_thread(void *v) {
+	sigset_t *set = v;
+	int sig;
+
+	while (sigwait(set, &sig) == 0) {
+		log_printf(LOG_INFO, "SIGHUP received, reloading");
+		reload_cb(reload_cbarg);
+	}
+	return NULL;
+}
+
+void
+reload_here(void) {
+	static sigset_t set;
+	static bool started;
+	pthread_t thread;
+
+	if (!reload_cb || started)
+		return;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL)))
+		xerr(1, "pthread_sigmask");
+	if ((errno = pthread_create(&thread, NULL, reload_thread, &set)))
+		xerr(1, "pthread_create");
+	pthread_detach(thread);
+	started = true;
+}
+
 void
 set_startup_wait(void) {
 	startup_wait = true;
@@ -269,6 +316,8 @@ bos_here_until(int *out_rc) {
 			signal(SIGINT, SIG_DFL);
 			signal(SIGTERM, SIG_DFL);
 			signal(SIGPIPE, SIG_IGN);
+			if (!reload_deferred)
+				reload_here();
 			if (respawn) {
 				/* In child it's ok to use plog. */
 				plog_string_printf(logging_plog_ctx(), PLOG_CRIT, "BOS restarting main in %d seconds. Attempt #%d", (int)respawn_delay, respawn);
@@ -608,6 +657,8 @@ daemonify_here_until(bool nobos, int *out_rc) {
 
 	if (!nobos)
 		return bos_here_until(out_rc);
+	if (!reload_deferred)
+		reload_here();
 	return false;
 }
 
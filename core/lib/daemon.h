@@ -27,6 +27,18 @@ void set_quick_start(int flag);
 void set_respawn_backoff_attrs(int min_s, int max_s, float rate);
 void set_healthcheck_url(int interval_s, int unavail_interval_ms, int unavail_limit, const char *fmt, ...) FORMAT_PRINTF(4, 5);
 void set_bos_cb(void (*)(enum bos_event ev, int arg, void *cbarg), void *cbarg);
+/*
+ * Call cb on SIGHUP instead of letting it kill the process, which bos then
+ * restarts. cb runs in its own thread in the process running the app, so
+ * it can take its time to e.g. load a new config into a bconf_handle while
+ * other threads keep using the old one. See reload_here.
+ */
+void set_reload_cb(void (*cb)(void *cbarg), void *cbarg);
+/*
+ * Keep bos and daemonify from calling reload_here. Set it if the process
+ * forks again before starting up, and call reload_here in the new child.
+ */
+void set_reload_deferred(bool flag);
 void set_startup_wait_timeout_ms(int);
 void set_startup_wait(void);
 void startup_ready(const char *daemon_id);
@@ -42,7 +54,19 @@ int bos(int (*)(void)) NORETURN;
 
 void do_switchuid(void);
 
-/* Returns value from bos_here_until, or false if nobos is set. */
+/*
+ * Starts the SIGHUP thread if set_reload_cb has been called. Done by bos in
+ * the child and by daemonify when nobos is set, unless set_reload_deferred
+ * is on. Otherwise call it before creating any threads, since SIGHUP is
+ * blocked in the threads created after it.
+ */
+void reload_here(void);
+
+/* Returns value from bos_here_until, or false if nobos is set.
+ * Calls reload_here in the process that returns false, unless
+ * set_reload_deferred is on. The thread does not survive a fork, so set
+ * that if you fork again and call reload_here in that child instead.
+ */
 bool daemonify_here_until(bool nobos, int *out_rc);
 
 void daemonify_here(bool nobos);
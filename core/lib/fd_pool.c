@@ -1,5 +1,6 @@
 // Copyright 2018 Schibsted
 
+#include "sbp/atomic.h"
 #include "sbp/avl.h"
 #include "sbp/buf_string.h"
 #include "fd_pool.h"
@@ -27,12 +28,17 @@
 #include <fcntl.h>
 #include <sys/poll.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/un.h>
@@ -43,31 +49,65 @@
 #define POLLRDHUP 0
 #endif
 
+/*
+ * Entry states, used when the reaper is running. The state is kept in the
+ * low bits of entry->state, the rest is a generation bumped on each put,
+ * making stale reaper events fail their compare and swap.
+ */
+enum fd_pool_entry_state {
+	FDPE_BUSY,	/* Checked out, or not yet pooled. */
+	FDPE_IDLE,	/* In the port stack and alive. */
+	FDPE_DEAD,	/* In the port stack, but the peer closed. */
+	FDPE_HUP,	/* Checked out, and the peer closed. Not pooled on put. */
+};
+#define FDPE_STATE_MASK 3
+#define FDPE_GEN_INC 4
+
 struct fd_pool_entry {
-	SLIST_ENTRY(fd_pool_entry) link;
+	struct fd_pool_entry *next;
+	struct fd_pool_port *port;
+	uint64_t state;
+	uint64_t expires; /* Monotonic ms, 0 if no idle_timeout. */
 	int fd;
+	bool watched; /* fd is in the reaper epoll set. */
+};
+
+/*
+ * Lock-free LIFO of entries (a Treiber stack). The tag in top is bumped on
+ * each swap, so a top that was popped and pushed back in between is detected.
+ * Entries are never freed while the pool is alive, they're recycled through
+ * pool->free_entries, thus it's safe to read next from an entry someone else
+ * just popped, the swap will fail on the tag.
+ *
+ * Unlinking entries below the top, such as the oldest one for cycle_last,
+ * is done with FD_POOL_STACK_LOCKED set in the top pointer. Pops wait for
+ * it to be cleared while pushes go on, they never touch the entries already
+ * in the stack. That way the stack is never seen as empty when it isn't.
+ */
+#define FD_POOL_STACK_LOCKED ((uintptr_t)1)
+
+struct fd_pool_stack {
+	struct atomic_tagptr top;
 };
 
 struct fd_pool_port {
-	SLIST_ENTRY(fd_pool_entry) link;
+	struct fd_pool_stack entries;
 	char port_key[32];
 	struct sockaddr_storage sockaddr;
 	socklen_t addrlen;
 	char peer[256];
 	struct plog_ctx *count_ctx;
-	SLIST_HEAD(, fd_pool_entry) entries;
-	struct fd_pool_entry *last_ptr;
+	int nentries;
 };
 
 struct fd_pool_node {
 	TAILQ_ENTRY(fd_pool_node) link;
 	struct fd_pool *pool;
 	int socktype;
-	int nports;
-	struct fd_pool_port *ports;
-	pthread_mutex_t lock;
 	int cost;
 	int refs;
+	int nports;
+	struct fd_pool_port ports[];
 };
 
 struct fd_pool_service_node {
@@ -87,10 +127,19 @@ struct fd_pool_service {
 	int timeoutms;
 	struct sdr_conn *sdconn;
 	struct plog_ctx *count_ctx;
+
+	/* Idle fd limits, per port. 0 means no limit. */
+	int max_idle;
+	int idle_timeout_ms;
+	int min_idle;
+	char min_idle_port_key[32];
+
+	/* Start another connect in parallel if one takes longer than this. 0 means off. */
+	int connect_stagger_ms;
 };
 
 struct fd_pool {
-	SLIST_HEAD(, fd_pool_entry) free_entries;
+	struct fd_pool_stack free_entries;
 	pthread_mutex_t lock;
 	struct plog_ctx *ports_ctx;
 	struct plog_ctx *services_ctx;
@@ -99,6 +148,15 @@ struct fd_pool {
 	struct sd_registry *sdr;
 
 	struct vtree_chain *upmap;
+
+	struct {
+		pthread_t thread;
+		pthread_mutex_t lock;
+		int epollfd;
+		int wakefd;
+		bool quit;
+		int sweep_ms; /* Atomic, see fd_pool_reaper_sweep_every. */
+	} reaper;
 };
 
 struct fd_pool_conn {
@@ -118,12 +176,488 @@ struct fd_pool_conn {
 	bool silent;
 	bool active_fd;
 	bool nonblock;
+	int flflags;
+	int pending_fd;
+	bool report_latency;
+	uint64_t got_us;
 	void *aux;
 };
 
 #define LOCK(x) pthread_mutex_lock((x))
 #define UNLOCK(x) pthread_mutex_unlock((x))
 
+static struct fd_pool_entry *
+fd_pool_stack_top(struct atomic_tagptr top) {
+	return (struct fd_pool_entry *)((uintptr_t)top.ptr & ~FD_POOL_STACK_LOCKED);
+}
+
+static void
+fd_pool_stack_push(struct fd_pool_stack *stack, struct fd_pool_entry *first, struct fd_pool_entry *last) {
+	struct atomic_tagptr top;
+
+	do {
+		top = atomic_read_tagptr(&stack->top);
+		last->next = fd_pool_stack_top(top);
+	} while (!atomic_cas_tagptr(&stack->top, top, (void *)((uintptr_t)first | ((uintptr_t)top.ptr & FD_POOL_STACK_LOCKED))));
+}
+
+static struct fd_pool_entry *
+fd_pool_stack_pop(struct fd_pool_stack *stack) {
+	struct atomic_tagptr top;
+	struct fd_pool_entry *entry;
+
+	while (1) {
+		top = atomic_read_tagptr(&stack->top);
+		if (!(entry = fd_pool_stack_top(top)))
+			return NULL;
+		if ((uintptr_t)top.ptr & FD_POOL_STACK_LOCKED) {
+			sched_yield();
+			continue;
+		}
+		if (atomic_cas_tagptr(&stack->top, top, entry->next))
+			return entry;
+	}
+}
+
+/* Detach all entries from the stack. The caller owns the returned list. */
+static struct fd_pool_entry *
+fd_pool_stack_take(struct fd_pool_stack *stack) {
+	struct atomic_tagptr top;
+
+	while (1) {
+		top = atomic_read_tagptr(&stack->top);
+		if (!top.ptr)
+			return NULL;
+		if ((uintptr_t)top.ptr & FD_POOL_STACK_LOCKED) {
+			sched_yield();
+			continue;
+		}
+		if (atomic_cas_tagptr(&stack->top, top, NULL))
+			return top.ptr;
+	}
+}
+
+/* Keep pops out while unlinking entries. Returns the top entry. */
+static struct fd_pool_entry *
+fd_pool_stack_lock(struct fd_pool_stack *stack) {
+	struct atomic_tagptr top;
+
+	while (1) {
+		top = atomic_read_tagptr(&stack->top);
+		if ((uintptr_t)top.ptr & FD_POOL_STACK_LOCKED) {
+			sched_yield();
+			continue;
+		}
+		if (atomic_cas_tagptr(&stack->top, top, (void *)((uintptr_t)top.ptr | FD_POOL_STACK_LOCKED)))
+			return top.ptr;
+	}
+}
+
+static void
+fd_pool_stack_unlock(struct fd_pool_stack *stack) {
+	struct atomic_tagptr top;
+
+	do {
+		top = atomic_read_tagptr(&stack->top);
+	} while (!atomic_cas_tagptr(&stack->top, top, fd_pool_stack_top(top)));
+}
+
+/*
+ * Unlink entry from a locked stack. prev is the entry above it, or NULL
+ * if entry was the top, in which case others might have been pushed above
+ * it since.
+ */
+static void
+fd_pool_stack_unlink(struct fd_pool_stack *stack, struct fd_pool_entry *prev, struct fd_pool_entry *entry) {
+	struct atomic_tagptr top;
+
+	while (!prev) {
+		top = atomic_read_tagptr(&stack->top);
+		prev = fd_pool_stack_top(top);
+		if (prev == entry) {
+			if (atomic_cas_tagptr(&stack->top, top, (void *)((uintptr_t)entry->next | FD_POOL_STACK_LOCKED)))
+				return;
+			prev = NULL;
+			continue;
+		}
+		while (prev->next != entry)
+			prev = prev->next;
+	}
+	prev->next = entry->next;
+}
+
+/*
+ * Pop the oldest entry instead of the newest, used for cycle_last.
+ * The idle lists are expected to be short so the walk is cheap.
+ */
+static struct fd_pool_entry *
+fd_pool_stack_pop_last(struct fd_pool_stack *stack) {
+	struct fd_pool_entry *prev = NULL, *entry = fd_pool_stack_lock(stack);
+
+	if (entry) {
+		while (entry->next) {
+			prev = entry;
+			entry = entry->next;
+		}
+		fd_pool_stack_unlink(stack, prev, entry);
+	}
+	fd_pool_stack_unlock(stack);
+	return entry;
+}
+
+static void
+fd_pool_recycle_entry(struct fd_pool *pool, struct fd_pool_entry *entry) {
+	fd_pool_stack_push(&pool->free_entries, entry, entry);
+}
+
+static struct fd_pool_entry *
+fd_pool_alloc_entry(struct fd_pool *pool) {
+	return fd_pool_stack_pop(&pool->free_entries) ?: zmalloc(sizeof(struct fd_pool_entry));
+}
+
+static bool
+fd_pool_entry_set_state(struct fd_pool_entry *entry, uint64_t state, enum fd_pool_entry_state from, enum fd_pool_entry_state to) {
+	if ((state & FDPE_STATE_MASK) != from)
+		return false;
+	return __sync_bool_compare_and_swap(&entry->state, state, (state & ~(uint64_t)FDPE_STATE_MASK) + FDPE_GEN_INC + to);
+}
+
+static uint64_t
+fd_pool_now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+fd_pool_now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Close an fd that's been idle too long. */
+static void
+fd_pool_expire_entry(struct fd_pool *pool, struct fd_pool_entry *entry) {
+	plog_int(entry->port->count_ctx, "connections", -1);
+	plog_int(entry->port->count_ctx, "expired", 1);
+	close(entry->fd);
+	fd_pool_recycle_entry(pool, entry);
+}
+
+/* Close an fd the peer closed, counting it as reaped. */
+static void
+fd_pool_reap_entry(struct fd_pool *pool, struct fd_pool_entry *entry) {
+	plog_int(entry->port->count_ctx, "connections", -1);
+	plog_int(entry->port->count_ctx, "reaped", 1);
+	close(entry->fd);
+	fd_pool_recycle_entry(pool, entry);
+}
+
+/*
+ * The reaper keeps all pooled fds in an edge triggered epoll set and
+ * evicts the ones where the peer closed the connection, so that
+ * fd_pool_get doesn't have to poll each fd before using it.
+ * Events are double checked with poll, they might be stale if the entry
+ * has been reused for another fd.
+ */
+#ifdef __linux__
+static bool
+fd_pool_peer_closed(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLHUP | POLLRDHUP };
+
+	return poll(&pfd, 1, 0) != 0;
+}
+
+static bool
+fd_pool_reaper_watch(struct fd_pool *pool, struct fd_pool_entry *entry) {
+	if (pool->reaper.epollfd == -1)
+		return false;
+
+	struct epoll_event ev = { .events = EPOLLRDHUP | EPOLLET, .data.ptr = entry };
+	return epoll_ctl(pool->reaper.epollfd, EPOLL_CTL_ADD, entry->fd, &ev) == 0;
+}
+
+/*
+ * Unlink the entries drop returns true for from the port stack and return
+ * them. It's done in place, getters don't find the port empty meanwhile.
+ */
+static struct fd_pool_entry *
+fd_pool_port_unlink(struct fd_pool_port *port, bool (*drop)(struct fd_pool_entry *, uint64_t), uint64_t now) {
+	struct fd_pool_entry *entry, *next, *prev = NULL, *dropped = NULL;
+
+	for (entry = fd_pool_stack_lock(&port->entries) ; entry ; entry = next) {
+		next = entry->next;
+		if (!drop(entry, now)) {
+			prev = entry;
+			continue;
+		}
+		fd_pool_stack_unlink(&port->entries, prev, entry);
+		__sync_fetch_and_sub(&port->nentries, 1);
+		entry->next = dropped;
+		dropped = entry;
+	}
+	fd_pool_stack_unlock(&port->entries);
+	return dropped;
+}
+
+static bool
+fd_pool_entry_dead(struct fd_pool_entry *entry, uint64_t now) {
+	return (entry->state & FDPE_STATE_MASK) == FDPE_DEAD;
+}
+
+static bool
+fd_pool_entry_expired(struct fd_pool_entry *entry, uint64_t now) {
+	return entry->expires && entry->expires <= now;
+}
+
+/* Remove dead entries from the port stack. */
+static void
+fd_pool_reaper_evict(struct fd_pool *pool, struct fd_pool_port *port) {
+	struct fd_pool_entry *entry, *next;
+
+	for (entry = fd_pool_port_unlink(port, fd_pool_entry_dead, 0) ; entry ; entry = next) {
+		next = entry->next;
+		fd_pool_reap_entry(pool, entry);
+	}
+}
+
+/*
+ * Close all entries past their idle_timeout. Since we hold the reaper lock
+ * no events are processed for them meanwhile.
+ */
+static void
+fd_pool_reaper_sweep(struct fd_pool *pool) {
+	uint64_t now = fd_pool_now_ms();
+	struct fd_pool_node *node;
+
+	LOCK(&pool->lock);
+	TAILQ_FOREACH(node, &pool->all_nodes, link) {
+		for (int i = 0 ; i < node->nports ; i++) {
+			struct fd_pool_port *port = &node->ports[i];
+			struct fd_pool_entry *entry, *next;
+
+			if (!port->nentries)
+				continue;
+
+			for (entry = fd_pool_port_unlink(port, fd_pool_entry_expired, now) ; entry ; entry = next) {
+				next = entry->next;
+				entry->state = (entry->state & ~(uint64_t)FDPE_STATE_MASK) + FDPE_GEN_INC + FDPE_BUSY;
+				fd_pool_expire_entry(pool, entry);
+			}
+		}
+	}
+	UNLOCK(&pool->lock);
+}
+
+static void
+fd_pool_reaper_event(struct fd_pool *pool, struct fd_pool_entry *entry) {
+	uint64_t state = entry->state;
+	__asm volatile("" ::: "memory");
+	int fd = entry->fd;
+
+	switch (state & FDPE_STATE_MASK) {
+	case FDPE_IDLE:
+		if (fd_pool_peer_closed(fd) && fd_pool_entry_set_state(entry, state, FDPE_IDLE, FDPE_DEAD))
+			fd_pool_reaper_evict(pool, entry->port);
+		break;
+	case FDPE_BUSY:
+		if (fd_pool_peer_closed(fd))
+			fd_pool_entry_set_state(entry, state, FDPE_BUSY, FDPE_HUP);
+		break;
+	}
+}
+
+static void *
+fd_pool_reaper_thread(void *v) {
+	struct fd_pool *pool = v;
+	struct epoll_event events[64];
+	uint64_t next_sweep = 0;
+
+	while (1) {
+		int sweep_ms = __atomic_load_n(&pool->reaper.sweep_ms, __ATOMIC_ACQUIRE);
+		int timeout = -1;
+
+		if (sweep_ms >= 0) {
+			uint64_t now = fd_pool_now_ms();
+			/* The interval might have been shortened while we slept. */
+			if (next_sweep > now + sweep_ms)
+				next_sweep = now + sweep_ms;
+			timeout = next_sweep > now ? next_sweep - now : 0;
+		}
+
+		int n = epoll_wait(pool->reaper.epollfd, events, sizeof(events) / sizeof(events[0]), timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf(LOG_CRIT, "fd_pool: reaper epoll_wait: %m");
+			return NULL;
+		}
+
+		LOCK(&pool->reaper.lock);
+		if (sweep_ms >= 0) {
+			uint64_t now = fd_pool_now_ms();
+			if (now >= next_sweep) {
+				fd_pool_reaper_sweep(pool);
+				next_sweep = now + sweep_ms;
+			}
+		}
+		for (int i = 0 ; i < n ; i++) {
+			/* NULL is the wake fd. */
+			if (!events[i].data.ptr) {
+				uint64_t cnt;
+				UNUSED_RESULT(read(pool->reaper.wakefd, &cnt, sizeof(cnt)));
+				if (__atomic_load_n(&pool->reaper.quit, __ATOMIC_ACQUIRE)) {
+					UNLOCK(&pool->reaper.lock);
+					return NULL;
+				}
+				continue;
+			}
+			fd_pool_reaper_event(pool, events[i].data.ptr);
+		}
+		UNLOCK(&pool->reaper.lock);
+	}
+}
+
+int
+fd_pool_start_reaper(struct fd_pool *pool) {
+	if (pool->reaper.epollfd != -1)
+		return 0;
+
+	int epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1)
+		return -1;
+
+	int wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if (wakefd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev) == -1) {
+		int e = errno;
+		if (wakefd != -1)
+			close(wakefd);
+		close(epollfd);
+		errno = e;
+		return -1;
+	}
+
+	pool->reaper.wakefd = wakefd;
+	pool->reaper.quit = false;
+	pool->reaper.epollfd = epollfd;
+	int err = pthread_create(&pool->reaper.thread, NULL, fd_pool_reaper_thread, pool);
+	if (err) {
+		close(wakefd);
+		close(epollfd);
+		pool->reaper.epollfd = -1;
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+fd_pool_reaper_wake(struct fd_pool *pool) {
+	uint64_t one = 1;
+
+	if (pool->reaper.epollfd != -1)
+		UNUSED_RESULT(write(pool->reaper.wakefd, &one, sizeof(one)));
+}
+
+static void
+fd_pool_stop_reaper(struct fd_pool *pool) {
+	if (pool->reaper.epollfd == -1)
+		return;
+
+	__atomic_store_n(&pool->reaper.quit, true, __ATOMIC_RELEASE);
+	fd_pool_reaper_wake(pool);
+	pthread_join(pool->reaper.thread, NULL);
+	close(pool->reaper.wakefd);
+	close(pool->reaper.epollfd);
+	pool->reaper.epollfd = -1;
+}
+#else
+static bool
+fd_pool_reaper_watch(struct fd_pool *pool, struct fd_pool_entry *entry) {
+	return false;
+}
+
+int
+fd_pool_start_reaper(struct fd_pool *pool) {
+	errno = ENOSYS;
+	return -1;
+}
+
+static void
+fd_pool_reaper_wake(struct fd_pool *pool) {
+}
+
+static void
+fd_pool_stop_reaper(struct fd_pool *pool) {
+}
+#endif
+
+/* Let the reaper sweep for expired fds at least every ms, waking it up to pick up a shorter interval. */
+static void
+fd_pool_reaper_sweep_every(struct fd_pool *pool, int ms) {
+	int cur = __atomic_load_n(&pool->reaper.sweep_ms, __ATOMIC_RELAXED);
+
+	do {
+		if (cur >= 0 && cur <= ms)
+			return;
+	} while (!__atomic_compare_exchange_n(&pool->reaper.sweep_ms, &cur, ms, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	fd_pool_reaper_wake(pool);
+}
+
+/*
+ * Store fd as idle in port, reusing entry if it's for the same fd.
+ * The fd is closed instead if max_idle is reached or the reaper saw the peer
+ * close it while it was checked out.
+ */
+static void
+fd_pool_port_put(struct fd_pool *pool, struct fd_pool_service *srv, struct fd_pool_port *port,
+		struct fd_pool_entry *entry, int fd, bool silent) {
+	if (entry && entry->fd != fd) {
+		/* Not the fd we handed out, treat it as a new one. */
+		fd_pool_recycle_entry(pool, entry);
+		entry = NULL;
+	}
+
+	if (srv->max_idle > 0 && port->nentries >= srv->max_idle) {
+		if (!silent)
+			log_printf(LOG_DEBUG, "fd_pool: Not keeping fd %d to %s: max_idle reached", fd, port->peer);
+		plog_int(port->count_ctx, "connections", -1);
+		close(fd);
+		if (entry)
+			fd_pool_recycle_entry(pool, entry);
+		return;
+	}
+
+	if (entry) {
+		entry->port = port;
+	} else {
+		entry = fd_pool_alloc_entry(pool);
+		entry->fd = fd;
+		entry->port = port;
+		entry->state = (entry->state & ~(uint64_t)FDPE_STATE_MASK) + FDPE_GEN_INC + FDPE_BUSY;
+		entry->watched = fd_pool_reaper_watch(pool, entry);
+	}
+	entry->expires = srv->idle_timeout_ms > 0 ? fd_pool_now_ms() + srv->idle_timeout_ms : 0;
+
+	uint64_t state;
+	do {
+		state = entry->state;
+		if ((state & FDPE_STATE_MASK) == FDPE_HUP) {
+			if (!silent)
+				log_printf(LOG_DEBUG, "fd_pool: Not keeping fd %d to %s: reaped", fd, port->peer);
+			fd_pool_reap_entry(pool, entry);
+			return;
+		}
+	} while (!fd_pool_entry_set_state(entry, state, FDPE_BUSY, FDPE_IDLE));
+
+	__sync_fetch_and_add(&port->nentries, 1);
+	fd_pool_stack_push(&port->entries, entry, entry);
+}
+
 static const struct addrinfo default_hints = {
 	.ai_flags = AI_ADDRCONFIG,
 	.ai_socktype = SOCK_STREAM
@@ -217,15 +751,14 @@ fd_pool_node_new(struct fd_pool *pool, int socktype, int cost, int nports, struc
 	node->socktype = socktype;
 	node->cost = cost;
 	node->nports = nports;
-	node->ports = (struct fd_pool_port*)(node + 1);
 	memcpy(node->ports, ports, sizeof(struct fd_pool_port[nports]));
 
 	for (int i = 0 ; i < nports ; i++) {
-		SLIST_INIT(&node->ports[i].entries);
+		node->ports[i].entries = (struct fd_pool_stack){ { NULL, 0 } };
+		node->ports[i].nentries = 0;
 		node->ports[i].count_ctx = fd_pool_open_count_ctx(pool, node->ports[i].peer, cost, node->ports[i].port_key);
 	}
 
-	pthread_mutex_init(&node->lock, NULL);
 	node->refs = 1;
 
 	TAILQ_INSERT_TAIL(&pool->all_nodes, node, link);
@@ -263,7 +796,8 @@ fd_pool_add_node(struct fd_pool *pool, struct fd_pool_service *srv, struct sbala
 	}
 	sn->node = node;
 
-	sbalance_add_serv(sb, node->cost, sn);
+	/* Identify the node by address on the hash ring, so it keeps its place when others change. */
+	sbalance_add_serv_key(sb, node->cost, sn, node->ports[0].peer);
 }
 
 static int
@@ -367,18 +901,23 @@ fd_pool_free_node(void *v) {
 	TAILQ_REMOVE(&node->pool->all_nodes, node, link);
 	UNLOCK(&node->pool->lock);
 
+	/*
+	 * Entries are recycled rather than freed, the reaper might have pending
+	 * events for them. Bumping the generation makes those events no-ops.
+	 */
+	LOCK(&node->pool->reaper.lock);
 	for (int i = 0 ; i < node->nports ; i++) {
 		struct fd_pool_port *p = &node->ports[i];
-		while (!SLIST_EMPTY(&p->entries)) {
-			struct fd_pool_entry *entry = SLIST_FIRST(&p->entries);
-
-			SLIST_REMOVE_HEAD(&p->entries, link);
+		struct fd_pool_entry *entry, *next;
+		for (entry = fd_pool_stack_take(&p->entries) ; entry ; entry = next) {
+			next = entry->next;
 			close(entry->fd);
-			free(entry);
+			entry->state = (entry->state & ~(uint64_t)FDPE_STATE_MASK) + FDPE_GEN_INC + FDPE_BUSY;
+			fd_pool_recycle_entry(node->pool, entry);
 		}
 		plog_close(p->count_ctx);
 	}
-	pthread_mutex_destroy(&node->lock);
+	UNLOCK(&node->pool->reaper.lock);
 	free(node);
 }
 
@@ -461,10 +1000,13 @@ struct fd_pool *
 fd_pool_new(struct sd_registry *sdr) {
 	struct fd_pool *pool = zmalloc(sizeof (*pool));
 
-	SLIST_INIT(&pool->free_entries);
 	pthread_mutex_init(&pool->lock, NULL);
 	TAILQ_INIT(&pool->all_nodes);
 
+	pthread_mutex_init(&pool->reaper.lock, NULL);
+	pool->reaper.epollfd = -1;
+	pool->reaper.sweep_ms = -1;
+
 	pool->upmap = &default_upmap;
 
 	pool->sdr = sdr;
@@ -486,6 +1028,10 @@ fd_pool_get_strat(struct vtree_chain *vtree) {
 			return ST_HASH;
 		else if (strcmp(strat, "random") == 0)
 			return ST_RANDOM;
+		else if (strcmp(strat, "ewma") == 0)
+			return ST_EWMA;
+		else if (strcmp(strat, "ring") == 0)
+			return ST_RING;
 	} else if (vtree_getint(vtree, "client_hash", NULL)) {
 		return ST_HASH;
 	} else if (vtree_getint(vtree, "random_pick", NULL)) {
@@ -494,6 +1040,22 @@ fd_pool_get_strat(struct vtree_chain *vtree) {
 	return ST_SEQ;
 }
 
+static void
+fd_pool_set_service_config(struct fd_pool *pool, struct fd_pool_service *srv, struct vtree_chain *vtree) {
+	srv->connect_stagger_ms = vtree_getint(vtree, "connect_stagger", NULL);
+	sbalance_set_load_bound(srv->sb, vtree_getint(vtree, "load_bound", NULL) / 100.0);
+	srv->max_idle = vtree_getint(vtree, "max_idle", NULL);
+	srv->idle_timeout_ms = vtree_getint(vtree, "idle_timeout", NULL);
+	srv->min_idle = vtree_getint(vtree, "min_idle", NULL);
+	strlcpy(srv->min_idle_port_key, vtree_get(vtree, "min_idle_port_key", NULL) ?: "port", sizeof(srv->min_idle_port_key));
+
+	if (srv->max_idle > 0 && srv->min_idle > srv->max_idle)
+		srv->min_idle = srv->max_idle;
+
+	if (srv->idle_timeout_ms > 0)
+		fd_pool_reaper_sweep_every(pool, srv->idle_timeout_ms);
+}
+
 static int
 services_compare(const struct avl_node *an, const struct avl_node *bn) {
 	struct fd_pool_service *a = avl_data(an, struct fd_pool_service, tree);
@@ -578,6 +1140,7 @@ fd_pool_create(const char *service, struct vtree_chain *vtree, const struct addr
 			vtree_getint(vtree, "connect_timeout", NULL) ?: vtree_getint(vtree, "timeout", NULL),
 			hints);
 
+	fd_pool_set_service_config(pool, srv, vtree);
 	fd_pool_populate_from_vtree(pool, srv, srv->sb, vtree);
 
 	if (!srv->sb->sb_nserv && !vtree_haskey(vtree, "sd", NULL)) {
@@ -638,6 +1201,8 @@ fd_pool_add_config(struct fd_pool *pool, struct vtree_chain *vtree, const struct
 		return 0; /* Presumed already identically configured. */
 	}
 
+	fd_pool_set_service_config(pool, srv, vtree);
+
 	int err = fd_pool_populate_from_vtree(pool, srv, srv->sb, vtree);
 
 	if (!srv->sdconn)
@@ -806,6 +1371,106 @@ fd_pool_add_unix(struct fd_pool *pool, const char *service, const char *path, in
 	return 0;
 }
 
+/*
+ * Open connections to each min_idle_port_key port in sb until it has
+ * min_idle idle fds. All connects are done in parallel, waiting at most
+ * the service connect timeout.
+ */
+static void
+fd_pool_prewarm(struct fd_pool *pool, struct fd_pool_service *srv, struct sbalance *sb) {
+	if (srv->min_idle <= 0)
+		return;
+
+	int npending = 0, apending = 0;
+	struct pollfd *pfds = NULL;
+	struct fd_pool_port **pports = NULL;
+
+	for (unsigned int i = 0 ; i < sb->sb_nserv ; i++) {
+		struct fd_pool_service_node *sn = sb->sb_service[i].data;
+		struct fd_pool_node *node = sn->node;
+
+		for (int j = 0 ; j < node->nports ; j++) {
+			struct fd_pool_port *port = &node->ports[j];
+
+			if (strcmp(port->port_key, srv->min_idle_port_key) != 0)
+				continue;
+
+			for (int n = port->nentries ; n < srv->min_idle ; n++) {
+				int fd = socket(port->sockaddr.ss_family, node->socktype, 0);
+				if (fd == -1)
+					break;
+				int flflags = fcntl(fd, F_GETFL, 0);
+				fcntl(fd, F_SETFL, flflags | O_NONBLOCK);
+				fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+
+				if (connect(fd, (struct sockaddr*)&port->sockaddr, port->addrlen) < 0 && errno != EINPROGRESS) {
+					log_printf(LOG_INFO, "fd_pool: prewarm connect(%s): %m", port->peer);
+					close(fd);
+					break;
+				}
+				if (npending == apending) {
+					apending = apending ? apending * 2 : 16;
+					pfds = xrealloc(pfds, apending * sizeof(*pfds));
+					pports = xrealloc(pports, apending * sizeof(*pports));
+				}
+				pfds[npending] = (struct pollfd){ .fd = fd, .events = POLLOUT };
+				pports[npending] = port;
+				npending++;
+			}
+		}
+	}
+
+	uint64_t deadline = fd_pool_now_ms() + srv->timeoutms;
+	int left = npending;
+	while (left > 0) {
+		uint64_t now = fd_pool_now_ms();
+		if (now >= deadline)
+			break;
+		int n = poll(pfds, npending, deadline - now);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		for (int i = 0 ; i < npending ; i++) {
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+
+			int fd = pfds[i].fd;
+			int error = 0;
+			socklen_t sl = sizeof(error);
+			pfds[i].fd = -1;
+			left--;
+
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &sl) == 0 && error == 0 && (pfds[i].revents & POLLOUT)) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+				plog_int(pports[i]->count_ctx, "connections", 1);
+				plog_int(pports[i]->count_ctx, "prewarmed", 1);
+				fd_pool_port_put(pool, srv, pports[i], NULL, fd, true);
+			} else {
+				if (error)
+					errno = error;
+				log_printf(LOG_INFO, "fd_pool: prewarm connect(%s): %m", pports[i]->peer);
+				close(fd);
+			}
+		}
+	}
+
+	for (int i = 0 ; i < npending ; i++) {
+		if (pfds[i].fd >= 0)
+			close(pfds[i].fd);
+	}
+	free(pfds);
+	free(pports);
+}
+
+static bool
+fd_pool_same_node(const void *a, const void *b) {
+	const struct fd_pool_service_node *sna = a, *snb = b;
+
+	return sna->node == snb->node;
+}
+
 int
 fd_pool_update_hosts(struct fd_pool *pool, const char *service, struct vtree_chain *vtree) {
 	/* It's assumed that this function is the only one updating pool->sb,
@@ -824,9 +1489,16 @@ fd_pool_update_hosts(struct fd_pool *pool, const char *service, struct vtree_cha
 
 	struct sbalance *src_sb = srv->sb;
 	struct sbalance *sb = sbalance_create(src_sb->sb_retries, src_sb->sb_failcost, src_sb->sb_softfailcost, sbalance_strat(src_sb));
+	sbalance_set_load_bound(sb, src_sb->sb_loadbound);
 
 	int n = fd_pool_populate_from_vtree(pool, srv, sb, vtree);
 
+	/* Keep what's been learned about the nodes still present. */
+	sbalance_copy_stats(sb, src_sb, fd_pool_same_node);
+
+	/* Connect before publishing, so the first requests on the new hosts can reuse fds. */
+	fd_pool_prewarm(pool, srv, sb);
+
 	if (sb->sb_nserv) {
 		pthread_rwlock_wrlock(&srv->sblock);
 		if (srv->sb == src_sb) {
@@ -848,6 +1520,8 @@ fd_pool_free(struct fd_pool *pool) {
 	if (!pool)
 		return;
 
+	fd_pool_stop_reaper(pool);
+
 	/* Standard avl tree disposal strategy, convert to linked list. */
 	struct avl_it it;
 	struct avl_node *n;
@@ -871,12 +1545,12 @@ fd_pool_free(struct fd_pool *pool) {
 	/* Nodes should've been freed now. */
 	assert(TAILQ_EMPTY(&pool->all_nodes));
 
-	while (!SLIST_EMPTY(&pool->free_entries)) {
-		struct fd_pool_entry *entry = SLIST_FIRST(&pool->free_entries);
-
-		SLIST_REMOVE_HEAD(&pool->free_entries, link);
+	struct fd_pool_entry *entry, *next;
+	for (entry = fd_pool_stack_take(&pool->free_entries) ; entry ; entry = next) {
+		next = entry->next;
 		free(entry);
 	}
+	pthread_mutex_destroy(&pool->reaper.lock);
 	plog_close(pool->ports_ctx);
 	plog_close(pool->services_ctx);
 	free(pool);
@@ -910,6 +1584,13 @@ fd_pool_set_cycle_last(struct fd_pool *pool, const char *service, bool cl) {
 		srv->cycle_last = cl;
 }
 
+void
+fd_pool_set_connect_stagger(struct fd_pool *pool, const char *service, int ms) {
+	struct fd_pool_service *srv = fd_pool_find_service(pool, service);
+	if (srv)
+		srv->connect_stagger_ms = ms;
+}
+
 void
 fd_pool_set_nonblock(struct fd_pool_conn *conn, bool nb) {
 	conn->nonblock = nb;
@@ -942,6 +1623,7 @@ fd_pool_new_conn(struct fd_pool *pool, const char *service, const char *port_key
 	conn->sc_hash = remote_addr ? sbalance_hash_string(remote_addr) : 0;
 	port_key = fd_pool_upmap_lookup(conn->pool->upmap, port_key);
 	conn->port_key = xstrdup(port_key);
+	conn->pending_fd = -1;
 
 	return conn;
 }
@@ -953,16 +1635,15 @@ fd_pool_free_conn(struct fd_pool_conn *conn) {
 
 	if (conn->active_fd)
 		plog_int(conn->port->count_ctx, "connections", -1);
+	if (conn->pending_fd != -1)
+		close(conn->pending_fd);
 
 	sbalance_conn_done(&conn->sc);
 	if (conn->sc.sc_sb)
 		sbalance_release(conn->sc.sc_sb, fd_pool_free_node);
 
-	if (conn->entry) {
-		LOCK(&conn->pool->lock);
-		SLIST_INSERT_HEAD(&conn->pool->free_entries, conn->entry, link);
-		UNLOCK(&conn->pool->lock);
-	}
+	if (conn->entry)
+		fd_pool_recycle_entry(conn->pool, conn->entry);
 	free(conn->node_filter);
 	free(conn->port_key);
 	free(conn);
@@ -1004,21 +1685,9 @@ fd_pool_move_node(struct fd_pool_conn *conn, enum sbalance_conn_status status) {
 	} while (!fd_pool_move_port(conn));
 }
 
-int
-fd_pool_get(struct fd_pool_conn *conn, enum sbalance_conn_status status, const char **peer, const char **port_key) {
-	int fd = -1;
-	int flflags = 0;
-	socklen_t sl;
-	int error;
-
-	conn->active_fd = false;
-
-	if (!conn->srv) {
-		errno = ENOENT;
-		return -1;
-	}
-
-	/* Restart if we're not on latest gen, to avoid bad node ptrs. */
+/* Restart if we're not on latest gen, to avoid bad node ptrs. */
+static void
+fd_pool_conn_restart(struct fd_pool_conn *conn, enum sbalance_conn_status status) {
 	if (status == SBCS_START || conn->sb_gen < conn->srv->sb_gen) {
 		pthread_rwlock_rdlock(&conn->srv->sblock);
 		struct sbalance *sb = conn->srv->sb;
@@ -1029,172 +1698,487 @@ fd_pool_get(struct fd_pool_conn *conn, enum sbalance_conn_status status, const c
 		}
 		conn->sb_gen = conn->srv->sb_gen;
 		conn->sn = NULL;
+		conn->report_latency = sbalance_strat(sb) == ST_EWMA || sbalance_strat(sb) == ST_RING;
 		sbalance_conn_new(&conn->sc, sb, conn->sc_hash);
 		pthread_rwlock_unlock(&conn->srv->sblock);
 	}
+}
 
-	/* Initialize errno in case we return -1 directly. */
-	errno = EAGAIN;
+/*
+ * Pop a usable idle fd from the current port, closing dead and expired ones.
+ * Returns -1 and sets conn->entry to NULL if there are none.
+ */
+static int
+fd_pool_reuse_fd(struct fd_pool_conn *conn) {
+	uint64_t now = 0;
 
-	while (fd == -1) {
-		if (conn->ti)
-			timer_handover(conn->ti, "connect");
+	while ((conn->entry = conn->srv->cycle_last ? fd_pool_stack_pop_last(&conn->port->entries)
+			: fd_pool_stack_pop(&conn->port->entries))) {
+		struct pollfd pfd;
+		int n;
 
-		if (!conn->sn) {
-			fd_pool_move_node(conn, status);
-		} else if (!conn->entry) {
-			/*
-			 * conn->entry will be NULL only if the last try was a new connection made to the port.
-			 * Thus we retry the same node and port until a new connection fails.
-			 */
-			if (!fd_pool_move_port(conn))
-				fd_pool_move_node(conn, status);
+		__sync_fetch_and_sub(&conn->port->nentries, 1);
+
+		uint64_t state = conn->entry->state;
+		if (!fd_pool_entry_set_state(conn->entry, state, FDPE_IDLE, FDPE_BUSY)) {
+			/* Found dead by the reaper but not yet evicted. */
+			if (!conn->silent)
+				log_printf(LOG_DEBUG, "fd_pool: NOT using existing fd to %s: reaped", conn->port->peer);
+			fd_pool_reap_entry(conn->pool, conn->entry);
+			continue;
 		}
-		if (!conn->port) {
-			return -1;
+
+		if (conn->entry->expires) {
+			if (!now)
+				now = fd_pool_now_ms();
+			if (conn->entry->expires <= now) {
+				if (!conn->silent)
+					log_printf(LOG_DEBUG, "fd_pool: NOT using existing fd to %s: idle_timeout", conn->port->peer);
+				fd_pool_expire_entry(conn->pool, conn->entry);
+				continue;
+			}
 		}
 
-		if (conn->ti)
-			timer_add_attribute(conn->ti, conn->port->peer);
+		if (conn->entry->watched) {
+			if (!conn->silent)
+				log_printf(LOG_DEBUG, "fd_pool: using existing fd to %s", conn->port->peer);
+			conn->active_fd = true;
+			return conn->entry->fd;
+		}
 
-		if (peer)
-			*peer = conn->port->peer;
-		if (port_key)
-			*port_key = conn->port->port_key;
+		memset(&pfd, 0, sizeof(pfd));
+
+		pfd.fd = conn->entry->fd;
+		pfd.events = POLLHUP | POLLRDHUP;
 
-		if (conn->entry) {
-			LOCK(&conn->pool->lock);
-			SLIST_INSERT_HEAD(&conn->pool->free_entries, conn->entry, link);
-			UNLOCK(&conn->pool->lock);
+		n = poll(&pfd, 1, 0);
+
+		if (n == 0) {
+			if (!conn->silent)
+				log_printf(LOG_DEBUG, "fd_pool: using existing fd to %s", conn->port->peer);
+			conn->active_fd = true;
+			return conn->entry->fd;
 		}
 
-		if (!SLIST_EMPTY(&conn->port->entries)) {
-			LOCK(&conn->sn->node->lock);
-			while ((conn->entry = SLIST_FIRST(&conn->port->entries))) {
-				struct pollfd pfd;
-				int n;
+		if (!conn->silent) {
+			if (n > 0)
+				log_printf(LOG_DEBUG, "fd_pool: NOT using existing fd to %s: EOF", conn->port->peer);
+			else
+				log_printf(LOG_DEBUG, "fd_pool: NOT using existing fd to %s: %m", conn->port->peer);
+		}
+		plog_int(conn->port->count_ctx, "connections", -1);
+		close(conn->entry->fd);
 
-				SLIST_REMOVE_HEAD(&conn->port->entries, link);
-				UNLOCK(&conn->sn->node->lock);
+		fd_pool_recycle_entry(conn->pool, conn->entry);
+	}
 
-				memset(&pfd, 0, sizeof(pfd));
+	return -1;
+}
 
-				pfd.fd = conn->entry->fd;
-				pfd.events = POLLHUP | POLLRDHUP;
+enum fd_pool_step {
+	FDPS_EXHAUSTED,
+	FDPS_REUSED,
+	FDPS_CONNECTED,
+	FDPS_IN_PROGRESS,
+	FDPS_FAILED,
+};
 
-				n = poll(&pfd, 1, 0);
+/*
+ * Move to the next port if needed, then either reuse an idle fd or
+ * start a new non-blocking connect. Never blocks.
+ */
+static enum fd_pool_step
+fd_pool_get_step(struct fd_pool_conn *conn, enum sbalance_conn_status *status, const char **peer, const char **port_key, int *fdp) {
+	int fd;
 
-				if (n == 0) {
-					if (!conn->silent)
-						log_printf(LOG_DEBUG, "fd_pool: using existing fd to %s", conn->port->peer);
-					conn->active_fd = true;
-					return conn->entry->fd;
-				}
+	*fdp = -1;
 
-				if (!conn->silent) {
-					if (n > 0)
-						log_printf(LOG_DEBUG, "fd_pool: NOT using existing fd to %s: EOF", conn->port->peer);
-					else
-						log_printf(LOG_DEBUG, "fd_pool: NOT using existing fd to %s: %m", conn->port->peer);
-				}
-				plog_int(conn->port->count_ctx, "connections", -1);
-				close(conn->entry->fd);
+	if (conn->ti)
+		timer_handover(conn->ti, "connect");
 
-				LOCK(&conn->pool->lock);
-				SLIST_INSERT_HEAD(&conn->pool->free_entries, conn->entry, link);
-				UNLOCK(&conn->pool->lock);
+	if (!conn->sn) {
+		fd_pool_move_node(conn, *status);
+	} else if (!conn->entry) {
+		/*
+		 * conn->entry will be NULL only if the last try was a new connection made to the port.
+		 * Thus we retry the same node and port until a new connection fails.
+		 */
+		if (!fd_pool_move_port(conn))
+			fd_pool_move_node(conn, *status);
+	}
+	if (!conn->port)
+		return FDPS_EXHAUSTED;
 
-				LOCK(&conn->sn->node->lock);
-			}
-			UNLOCK(&conn->sn->node->lock);
+	if (conn->ti)
+		timer_add_attribute(conn->ti, conn->port->peer);
+
+	if (peer)
+		*peer = conn->port->peer;
+	if (port_key)
+		*port_key = conn->port->port_key;
+
+	if (conn->entry)
+		fd_pool_recycle_entry(conn->pool, conn->entry);
+
+	if ((fd = fd_pool_reuse_fd(conn)) != -1) {
+		conn->active_fd = true;
+		if (conn->report_latency)
+			conn->got_us = fd_pool_now_us();
+		*fdp = fd;
+		return FDPS_REUSED;
+	}
+
+	*status = SBCS_FAIL;
+
+	if ((fd = socket(conn->port->sockaddr.ss_family, conn->sn->node->socktype, 0)) == -1) {
+		if (!conn->silent)
+			log_printf(LOG_INFO, "fd_pool: socket(%s): %m", conn->port->peer);
+		return FDPS_FAILED;
+	}
+
+	/*
+	 * Set the socket to be non-blocking so that we can time out in the connect step.
+	 */
+	conn->flflags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, conn->flflags | O_NONBLOCK);
+	int flags = fcntl(fd, F_GETFD, 0);
+	fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+
+	*fdp = fd;
+	if (connect(fd, (struct sockaddr*)&conn->port->sockaddr, conn->port->addrlen) == 0)
+		return FDPS_CONNECTED;
+	if (errno == EINPROGRESS)
+		return FDPS_IN_PROGRESS;
+
+	if (!conn->silent)
+		log_printf(LOG_INFO, "fd_pool: connect(%s): %m", conn->port->peer);
+	close(fd);
+	*fdp = -1;
+	if (conn->ti)
+		timer_add_attribute(conn->ti, "conn_fail");
+	return FDPS_FAILED;
+}
+
+/*
+ * Check an in progress connect given the poll revents for it, 0 meaning it timed out.
+ * Closes the fd on failure.
+ */
+static bool
+fd_pool_connect_result(struct fd_pool_conn *conn, int fd, int revents) {
+	if (revents) {
+		/* SO_ERROR has the result, also when only POLLERR or POLLHUP is set. */
+		int error = 0;
+		socklen_t sl = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &sl) == 0) {
+			if (error == 0 && (revents & (POLLIN|POLLOUT)) != 0)
+				return true;
+			errno = error ?: ECONNREFUSED;
 		}
+		if (!conn->silent)
+			log_printf(LOG_INFO, "fd_pool: connect(%s): %m", conn->port->peer);
+	} else {
+		errno = ETIMEDOUT;
+		if (!conn->silent)
+			log_printf(LOG_INFO, "fd_pool: poll(%s): %m", conn->port->peer);
+	}
+	close(fd);
+	if (conn->ti)
+		timer_add_attribute(conn->ti, "conn_fail");
+	return false;
+}
 
-		conn->entry = NULL;
-		status = SBCS_FAIL;
+static int
+fd_pool_connected(struct fd_pool_conn *conn, int fd, bool restore_flags) {
+	if (!conn->silent)
+		log_printf(LOG_DEBUG, "fd_pool: Connected to %s", conn->port->peer);
 
-		if ((fd = socket(conn->port->sockaddr.ss_family, conn->sn->node->socktype, 0)) == -1) {
-			if (!conn->silent)
-				log_printf(LOG_INFO, "fd_pool: socket(%s): %m", conn->port->peer);
+	if (restore_flags) {
+		/*
+		 * Restore old flags, the socket shouldn't be non-blocking anymore.
+		 */
+		fcntl(fd, F_SETFL, conn->flflags);
+	}
+
+	plog_int(conn->port->count_ctx, "connections", 1);
+	conn->active_fd = true;
+	if (conn->report_latency)
+		conn->got_us = fd_pool_now_us();
+	return fd;
+}
+
+#define FD_POOL_MAX_RACE 8
+
+struct fd_pool_attempt {
+	int fd;
+	uint64_t deadline;
+	struct fd_pool_service_node *sn;
+	unsigned int serv; /* sbalance index of sn. */
+	struct fd_pool_port *port;
+	char *pk_ptr;
+};
+
+static void
+fd_pool_race_close(struct fd_pool_attempt *att, int natt) {
+	for (int i = 0 ; i < natt ; i++)
+		close(att[i].fd);
+}
+
+/*
+ * Happy eyeballs style connect, used when connect_stagger is set.
+ * Called with a connect in progress in *fdp. Instead of waiting the full
+ * timeout for it, the next port or node is tried every stagger ms, or as soon
+ * as an attempt fails, and the first one to connect wins. Losers that also
+ * managed to connect are pooled, the rest are closed.
+ * Returns FDPS_CONNECTED or FDPS_REUSED with conn pointing at the winning port,
+ * or FDPS_EXHAUSTED.
+ */
+static enum fd_pool_step
+fd_pool_race(struct fd_pool_conn *conn, const char **peer, const char **port_key, int *fdp) {
+	struct fd_pool_attempt att[FD_POOL_MAX_RACE];
+	struct pollfd pfds[FD_POOL_MAX_RACE];
+	int stagger = conn->srv->connect_stagger_ms;
+	int timeoutms = conn->srv->timeoutms;
+	uint64_t now = fd_pool_now_ms();
+	uint64_t next_start = now + stagger;
+	bool exhausted = false;
+	int natt = 0;
+
+	att[natt++] = (struct fd_pool_attempt){ *fdp, now + timeoutms, conn->sn, conn->sc.sc_last, conn->port, conn->pk_ptr };
+
+	while (natt > 0) {
+		int timeout = -1;
+		bool start = false;
+		int winner = -1;
+
+		if (!exhausted && natt < FD_POOL_MAX_RACE)
+			timeout = next_start > now ? next_start - now : 0;
+		for (int i = 0 ; i < natt ; i++) {
+			int t = att[i].deadline > now ? att[i].deadline - now : 0;
+			if (timeout == -1 || t < timeout)
+				timeout = t;
+			pfds[i] = (struct pollfd){ .fd = att[i].fd, .events = POLLIN | POLLOUT | POLLHUP | POLLRDHUP };
+		}
+
+		int n = poll(pfds, natt, timeout);
+		if (n == -1 && errno == EINTR)
 			continue;
+		now = fd_pool_now_ms();
+
+		/* Keep the position for the next attempt, connect_result logs using conn->port. */
+		struct fd_pool_port *cur_port = conn->port;
+		for (int i = natt - 1 ; i >= 0 ; i--) {
+			int revents = n > 0 ? pfds[i].revents : 0;
+			if (!revents && att[i].deadline > now)
+				continue;
+			conn->port = att[i].port;
+			if (fd_pool_connect_result(conn, att[i].fd, revents)) {
+				winner = i;
+				break;
+			}
+			/* Not necessarily the node we're on now. */
+			sbalance_serv_status(conn->sc.sc_sb, att[i].serv, SBCS_FAIL);
+			att[i] = att[--natt];
+			start = true;
 		}
+		conn->port = cur_port;
+
+		if (winner >= 0) {
+			struct fd_pool_attempt w = att[winner];
+			att[winner] = att[--natt];
+
+			for (int i = 0 ; i < natt ; i++) {
+				struct pollfd lp = { .fd = att[i].fd, .events = POLLOUT };
+				int error = 0;
+				socklen_t sl = sizeof(error);
+
+				if (poll(&lp, 1, 0) == 1 && (lp.revents & POLLOUT)
+						&& getsockopt(att[i].fd, SOL_SOCKET, SO_ERROR, &error, &sl) == 0 && error == 0) {
+					if (!conn->nonblock)
+						fcntl(att[i].fd, F_SETFL, conn->flflags);
+					plog_int(att[i].port->count_ctx, "connections", 1);
+					fd_pool_port_put(conn->pool, conn->srv, att[i].port, NULL, att[i].fd, conn->silent);
+				} else {
+					close(att[i].fd);
+				}
+			}
+
+			sbalance_serv_status(conn->sc.sc_sb, w.serv, SBCS_START);
+			conn->sn = w.sn;
+			conn->port = w.port;
+			conn->pk_ptr = w.pk_ptr;
+			if (peer)
+				*peer = conn->port->peer;
+			if (port_key)
+				*port_key = conn->port->port_key;
+			*fdp = w.fd;
+			return FDPS_CONNECTED;
+		}
+
+		if (now >= next_start)
+			start = true;
+		if (!start || exhausted || natt >= FD_POOL_MAX_RACE)
+			continue;
 
 		/*
-		 * Set the socket to be non-blocking so that we can time out in the connect step.
+		 * Failures are already accounted for above. The nodes still
+		 * connecting are slow, soft fail them, they might still win.
 		 */
-		flflags = fcntl(fd, F_GETFL, 0);
-		fcntl(fd, F_SETFL, flflags | O_NONBLOCK);
-		int flags = fcntl(fd, F_GETFD, 0);
-		fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+		for (int i = 0 ; i < natt ; i++)
+			sbalance_serv_status(conn->sc.sc_sb, att[i].serv, SBCS_TEMPFAIL);
+		enum sbalance_conn_status st = SBCS_START;
+		int fd;
+		enum fd_pool_step step;
+		while ((step = fd_pool_get_step(conn, &st, peer, port_key, &fd)) == FDPS_FAILED)
+			;
+		switch (step) {
+		case FDPS_EXHAUSTED:
+			exhausted = true;
+			break;
+		case FDPS_REUSED:
+		case FDPS_CONNECTED:
+			fd_pool_race_close(att, natt);
+			*fdp = fd;
+			return step;
+		case FDPS_IN_PROGRESS:
+			att[natt++] = (struct fd_pool_attempt){ fd, now + timeoutms, conn->sn, conn->sc.sc_last, conn->port, conn->pk_ptr };
+			next_start = now + stagger;
+			break;
+		case FDPS_FAILED:
+			break;
+		}
+	}
+
+	return FDPS_EXHAUSTED;
+}
+
+int
+fd_pool_get(struct fd_pool_conn *conn, enum sbalance_conn_status status, const char **peer, const char **port_key) {
+	int fd;
+
+	conn->active_fd = false;
 
-		if (connect(fd, (struct sockaddr*)&conn->port->sockaddr, conn->port->addrlen) < 0) {
+	if (!conn->srv) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	fd_pool_conn_restart(conn, status);
+
+	/* Initialize errno in case we return -1 directly. */
+	errno = EAGAIN;
+
+	while (1) {
+		switch (fd_pool_get_step(conn, &status, peer, port_key, &fd)) {
+		case FDPS_EXHAUSTED:
+			return -1;
+		case FDPS_REUSED:
+			return fd;
+		case FDPS_FAILED:
+			continue;
+		case FDPS_CONNECTED:
+			break;
+		case FDPS_IN_PROGRESS:
 			/*
 			 * Connection in progress. poll on it so that we
 			 * can time out (except if async).
 			 */
-			if (errno == EINPROGRESS) {
-				struct pollfd pfd;
+			if (!conn->async && conn->srv->connect_stagger_ms > 0) {
+				enum fd_pool_step res = fd_pool_race(conn, peer, port_key, &fd);
+				if (res == FDPS_EXHAUSTED)
+					return -1;
+				if (res == FDPS_REUSED)
+					return fd;
+			} else if (!conn->async) {
+				struct pollfd pfd = { .fd = fd, .events = POLLIN | POLLOUT | POLLHUP | POLLRDHUP };
 				int n;
 
-				if (conn->async)
-					break;
-
-				memset(&pfd, 0, sizeof(pfd));
-
-				pfd.fd = fd;
-				pfd.events = POLLIN | POLLOUT | POLLHUP | POLLRDHUP;
-
 				do {
 					n = poll(&pfd, 1, conn->srv->timeoutms);
 					/* XXX we restart the timeout on EINTR. */
 				} while (n == -1 && errno == EINTR);
 
-				if (n == 1 && (pfd.revents & (POLLIN|POLLOUT)) != 0) {
-					/* Almost ok, just check SO_ERROR as well. */
-					error = 0;
-					sl = sizeof(error);
-					if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &sl) == 0 && error == 0)
-						break;
-
-					if (error != 0)
-						errno = error;
-					if (!conn->silent)
-						log_printf(LOG_INFO, "fd_pool: getsockopt(%s): %m", conn->port->peer);
-				} else if (!conn->silent) {
-					switch (n) {
-					case 1:
-						errno = ECONNREFUSED; /* XXX Not sure this is true. */
-						break;
-					case 0:
-						errno = ETIMEDOUT;
-						break;
-					}
-					log_printf(LOG_INFO, "fd_pool: poll(%s): %m", conn->port->peer);
-				}
-			} else if (!conn->silent) {
-				log_printf(LOG_INFO, "fd_pool: connect(%s): %m", conn->port->peer);
+				if (!fd_pool_connect_result(conn, fd, n == 1 ? pfd.revents : 0))
+					continue;
 			}
-			close(fd);
-			fd = -1;
-			if (conn->ti)
-				timer_add_attribute(conn->ti, "conn_fail");
+			break;
 		}
+		return fd_pool_connected(conn, fd, !conn->async && !conn->nonblock);
+	}
+}
+
+static void
+fd_pool_set_fd_nonblock(int fd) {
+	int fl = fcntl(fd, F_GETFL, 0);
+
+	if (fl != -1 && !(fl & O_NONBLOCK))
+		fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
 
+static enum fd_pool_async_status
+fd_pool_get_async(struct fd_pool_conn *conn, enum sbalance_conn_status status, int *fd, const char **peer, const char **port_key) {
+	while (1) {
+		switch (fd_pool_get_step(conn, &status, peer, port_key, fd)) {
+		case FDPS_EXHAUSTED:
+			return FDPA_FAIL;
+		case FDPS_REUSED:
+			/* Might have been put back blocking. */
+			fd_pool_set_fd_nonblock(*fd);
+			return FDPA_DONE;
+		case FDPS_FAILED:
+			continue;
+		case FDPS_CONNECTED:
+			fd_pool_connected(conn, *fd, false);
+			return FDPA_DONE;
+		case FDPS_IN_PROGRESS:
+			conn->pending_fd = *fd;
+			return FDPA_WAIT;
+		}
 	}
-	if (fd != -1 && !conn->silent)
-		log_printf(LOG_DEBUG, "fd_pool: Connected to %s", conn->port->peer);
+}
 
-	if (!conn->async && !conn->nonblock) {
-		/*
-		 * Restore old flags, the socket shouldn't be non-blocking anymore.
-		 */
-		fcntl(fd, F_SETFL, flflags);
+enum fd_pool_async_status
+fd_pool_get_start(struct fd_pool_conn *conn, enum sbalance_conn_status status, int *fd, const char **peer, const char **port_key) {
+	*fd = -1;
+	conn->active_fd = false;
+
+	if (!conn->srv) {
+		errno = ENOENT;
+		return FDPA_FAIL;
 	}
 
-	if (fd != -1) {
-		plog_int(conn->port->count_ctx, "connections", 1);
-		conn->active_fd = true;
+	if (conn->pending_fd != -1) {
+		close(conn->pending_fd);
+		conn->pending_fd = -1;
 	}
-	return fd;
+
+	fd_pool_conn_restart(conn, status);
+
+	errno = EAGAIN;
+	return fd_pool_get_async(conn, status, fd, peer, port_key);
+}
+
+enum fd_pool_async_status
+fd_pool_get_continue(struct fd_pool_conn *conn, int revents, int *fd, const char **peer, const char **port_key) {
+	int pfd = conn->pending_fd;
+
+	*fd = -1;
+	if (pfd == -1) {
+		errno = EINVAL;
+		return FDPA_FAIL;
+	}
+	conn->pending_fd = -1;
+
+	if (fd_pool_connect_result(conn, pfd, revents)) {
+		if (peer)
+			*peer = conn->port->peer;
+		if (port_key)
+			*port_key = conn->port->port_key;
+		*fd = fd_pool_connected(conn, pfd, false);
+		return FDPA_DONE;
+	}
+
+	fd_pool_conn_restart(conn, SBCS_FAIL);
+	return fd_pool_get_async(conn, SBCS_FAIL, fd, peer, port_key);
 }
 
 void
@@ -1204,6 +2188,9 @@ fd_pool_put(struct fd_pool_conn *conn, int fd) {
 
 	conn->active_fd = false;
 
+	if (conn->report_latency)
+		sbalance_conn_report(&conn->sc, fd_pool_now_us() - conn->got_us);
+
 	/* Assume it doesn't change after first time we're called. */
 	if (!fdlimit.rlim_cur)
 		getrlimit(RLIMIT_NOFILE, &fdlimit);
@@ -1217,32 +2204,12 @@ fd_pool_put(struct fd_pool_conn *conn, int fd) {
 		return;
 	}
 
-	pthread_rwlock_rdlock(&conn->srv->sblock);
-
-	if (entry) {
-		conn->entry = NULL;
-	} else {
-		if (!SLIST_EMPTY(&conn->pool->free_entries)) {
-			LOCK(&conn->pool->lock);
-			entry = SLIST_FIRST(&conn->pool->free_entries);
-			if (entry)
-				SLIST_REMOVE_HEAD(&conn->pool->free_entries, link);
-			UNLOCK(&conn->pool->lock);
-		}
-		if (!entry)
-			entry = xmalloc(sizeof (*entry));
-	}
-	entry->fd = fd;
-	LOCK(&conn->sn->node->lock);
-
-	if (conn->srv->cycle_last && !SLIST_EMPTY(&conn->port->entries)) {
-		SLIST_INSERT_AFTER(conn->port->last_ptr, entry, link);
-	} else {
-		SLIST_INSERT_HEAD(&conn->port->entries, entry, link);
-	}
-	conn->port->last_ptr = entry; /* Only used if cycle_last so this is ok. */
-	UNLOCK(&conn->sn->node->lock);
-	pthread_rwlock_unlock(&conn->srv->sblock);
+	/*
+	 * No need for the sblock here, conn keeps a reference to the sbalance
+	 * and thereby the node, even if it's no longer the latest generation.
+	 */
+	conn->entry = NULL;
+	fd_pool_port_put(conn->pool, conn->srv, conn->port, entry, fd, conn->silent);
 }
 
 struct fd_pool *
@@ -1361,13 +2328,7 @@ fd_pool_iter_ports(struct fd_pool *pool, const char *service, int *state, struct
 	iter->socktype = node->socktype;
 	iter->sockaddr = (struct sockaddr*)&port->sockaddr;
 	iter->addrlen = port->addrlen;
-	pthread_mutex_lock(&node->lock);
-	iter->num_stored_fds = 0;
-	struct fd_pool_entry *entry;
-	SLIST_FOREACH(entry, &port->entries, link) {
-		iter->num_stored_fds++;
-	}
-	pthread_mutex_unlock(&node->lock);
+	iter->num_stored_fds = port->nentries;
 	(*state)++;
 	return true;
 }
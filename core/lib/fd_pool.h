@@ -49,6 +49,20 @@ void fd_pool_free(struct fd_pool *pool);
  * For add_config, service name is extracted from vtree, and only configures if not already present.
  * The found name is put in the out parameter if not NULL.
  * The others take service as input and add nodes even if config is already there.
+ *
+ * Idle fds can be limited per port with these optional keys in the vtree:
+ * max_idle - Maximum number of idle fds kept, extra ones are closed on put.
+ * idle_timeout - Close idle fds unused for this many ms.
+ * min_idle - Open connections when hosts are updated until each port has this many idle fds.
+ * min_idle_port_key - Port key used by min_idle, defaults to "port".
+ *
+ * connect_stagger - If a connect takes longer than this many ms, start connecting to the
+ * next port or node in parallel and use whichever finishes first. Off by default.
+ *
+ * strat=ring picks the first node from a consistent hash ring using the remote_addr given to
+ * fd_pool_new_conn, so that only hashes on changed nodes move when hosts are updated.
+ * load_bound - With strat=ring, skip nodes having more than this percentage of the
+ * average number of connections in use, e.g. 125. Off by default.
  */
 int fd_pool_add_config(struct fd_pool *pool, struct vtree_chain *vtree, const struct addrinfo *hints, const char **out_service) NONNULL(1);
 
@@ -93,6 +107,19 @@ int fd_pool_update_hosts(struct fd_pool *pool, const char *service, struct vtree
 
 void fd_pool_set_cycle_last(struct fd_pool *pool, const char *service, bool cl) NONNULL(1);
 
+/* Same as the connect_stagger config key, for services not added from a vtree. 0 disables. */
+void fd_pool_set_connect_stagger(struct fd_pool *pool, const char *service, int ms) NONNULL(1);
+
+/* Start a background thread watching all pooled fds with epoll, evicting the ones
+ * where the peer closed the connection. This makes fd_pool_get skip the poll
+ * otherwise done on each reused fd.
+ * Evicted fds are counted as "reaped" in the port count contexts.
+ * Only fds pooled after this call are watched, so call it before using the pool.
+ * The thread is stopped by fd_pool_free. Returns -1 and sets errno on failure,
+ * ENOSYS if not supported on this platform.
+ */
+int fd_pool_start_reaper(struct fd_pool *pool) NONNULL(1);
+
 /* Set a custom urlport map, overriding the default. The pointer given is kept as a reference and
  * must be valid as long as the pool is.
  * The main purpose of portmaps is to map port numbers given in e.g. URLs to port keys, but
@@ -111,6 +138,24 @@ void fd_pool_free_conn(struct fd_pool_conn *conn);
 int fd_pool_get(struct fd_pool_conn *conn, enum sbalance_conn_status status, const char **peer, const char **port_key) NONNULL(1);
 void fd_pool_put(struct fd_pool_conn *conn, int fd) NONNULL(1);
 
+/* Non-blocking variant of fd_pool_get, for use with an event loop.
+ * fd_pool_get_start returns FDPA_DONE with a usable fd in *fd, FDPA_FAIL when out
+ * of places to connect, or FDPA_WAIT with a connecting fd in *fd. In the last
+ * case, wait for POLLOUT on it and call fd_pool_get_continue with the returned
+ * events, or with 0 if fd_pool_timeout() ms passed first. fd_pool_get_continue
+ * closes the fd if the connect failed and moves on to the next node or port,
+ * so it can return FDPA_WAIT again with a different fd.
+ * Fds returned from these are non-blocking, also pooled ones that were put
+ * back blocking. On FDPA_FAIL errno is from the last failed connect.
+ */
+enum fd_pool_async_status {
+	FDPA_FAIL = -1,
+	FDPA_DONE = 0,
+	FDPA_WAIT = 1,
+};
+enum fd_pool_async_status fd_pool_get_start(struct fd_pool_conn *conn, enum sbalance_conn_status status, int *fd, const char **peer, const char **port_key) NONNULL(1, 3);
+enum fd_pool_async_status fd_pool_get_continue(struct fd_pool_conn *conn, int revents, int *fd, const char **peer, const char **port_key) NONNULL(1, 3);
+
 struct fd_pool *fd_pool_conn_pool(struct fd_pool_conn *conn) NONNULL(1);
 
 int fd_pool_timeout(struct fd_pool_conn *conn) NONNULL(1);
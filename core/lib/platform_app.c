@@ -328,6 +328,9 @@ papp_start(struct papp *app, struct bconf_node *conf, bool will_fork) {
 	if (!(app->flags & PAPP_NOBOS) && !(app->flags & PAPP_NO_SD_SETUP))
 		sd_registry_setup_bos_client(conf, &app->https);
 
+	/* The reload thread would be lost in papp_fork, start it in the child. */
+	set_reload_deferred(will_fork);
+
 	bool exiting = false;
 	int rc;
 	if (foreground) {
@@ -338,6 +341,8 @@ papp_start(struct papp *app, struct bconf_node *conf, bool will_fork) {
 		if (!nobos) {
 			curl_global_cleanup();
 			exiting = bos_here_until(&rc);
+		} else if (!will_fork) {
+			reload_here();
 		}
 	} else {
 		if ((app->flags & PAPP_SMART_START) && !bconf_get_int(conf, "no-smart-start"))
@@ -372,6 +377,7 @@ papp_fork(struct papp *app, struct bconf_node *conf) {
 	curl_global_init(CURL_GLOBAL_DEFAULT);
 
 	if (p == 0) {
+		reload_here();
 		init_go_runtime(app->orig_argc, app->orig_argv);
 		papp_init_sdr(app, conf);
 		http_clear_https_unlink(&app->https);
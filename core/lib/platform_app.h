@@ -121,6 +121,7 @@ void papp_usage(struct papp *app, bool verbose);
  * Starts BOS (if neither PAPP_NOBOS nor nobos option set).
  * Configures SD if appropriate (sd.service option set).
  * Starts Go runtime in child if present and will_fork is false.
+ * The same goes for the reload thread, see set_reload_cb.
  * Set will_fork to true if you plan to call papp_fork before starting
  * up the application, otherwise false.
  */
@@ -128,6 +129,7 @@ void papp_start(struct papp *app, struct bconf_node *conf, bool will_fork);
 
 /*
  * Forks and starts go runtime in child if present.
+ * Also starts the reload thread in the child if set_reload_cb was called.
  * Also initializes the sdr and fd_pool, which are skipped by start if
  * will_fork is true, due to that it might create threads.
  * It's only valid to call this after papp_start with will_fork true,
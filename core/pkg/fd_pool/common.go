@@ -45,9 +45,13 @@
 //
 // strat=seq
 //
+// strat=ewma
+//
 // Changes the order of the connection attempts from sequential to either
 // random or deterministically random based on a value given by the API user
 // (typically the client ip). By default a random strat is used.
+// The ewma strat picks the least loaded of two random hosts, based on
+// latency and outstanding requests, with random fallback.
 //
 // Old keys for these are .random_pick=1 resp. .client_hash=1
 //
@@ -138,6 +138,8 @@ func BconfConfig(conf bconf.Bconf) *ServiceConfig {
 		srv.Strat = sbalance.StratRandom
 	case "seq":
 		srv.Strat = sbalance.StratSeq
+	case "ewma":
+		srv.Strat = sbalance.StratEWMA
 	}
 	srv.FailCost = conf.Get("failcost").Int(DefaultFailCost)
 	srv.SoftFailCost = conf.Get("tempfailcost").Int(DefaultSoftFailCost)
@@ -166,6 +166,8 @@ func (p *CPool) AddConfig(ctx context.Context, config *ServiceConfig) (string, e
 		values = append(values, "hash")
 	case sbalance.StratRandom:
 		values = append(values, "random")
+	case sbalance.StratEWMA:
+		values = append(values, "ewma")
 	default: // StratSeq
 		values = append(values, "seq")
 	}
@@ -126,6 +126,20 @@ type fdServiceNode struct {
 	refs    int32
 }
 
+// Nodes are the same if they're for the same key and share connection sets.
+func sameServiceNode(a, b interface{}) bool {
+	fa, fb := a.(*fdServiceNode), b.(*fdServiceNode)
+	if fa.key != fb.key || len(fa.connSet) != len(fb.connSet) {
+		return false
+	}
+	for pk, cs := range fa.connSet {
+		if fb.connSet[pk] != cs {
+			return false
+		}
+	}
+	return true
+}
+
 func (fds *fdServiceNode) Retain() *fdServiceNode {
 	if fds == nil {
 		return nil
@@ -465,6 +479,8 @@ func (pool *GoPool) UpdateHostsConfig(ctx context.Context, service string, hosts
 	l := sb.Len()
 	if l > 0 {
 		srv.sblock.Lock()
+		// Keep what's been learned about the nodes still present.
+		sb.CopyStats(srv.Service, sameServiceNode)
 		sb, srv.Service = srv.Service, sb
 		srv.sblock.Unlock()
 		for _, node := range sb.Nodes() {
@@ -487,6 +503,7 @@ type conn struct {
 	srvnode    *fdServiceNode
 	connset    *fdConnSet
 	newConnect bool
+	gotAt      time.Time
 
 	closed uint32
 
@@ -593,6 +610,7 @@ func (c *conn) get(ctx context.Context, status sbalance.ConnStatus) (NetConn, er
 			c.SetDeadline(time.Time{})
 			c.connset.Unlock()
 			c.newConnect = false
+			c.gotAt = time.Now()
 			slog.CtxDebug(ctx, "Reusing connection", "peer", c.connset.port.Addr)
 			return c, nil
 		}
@@ -601,6 +619,7 @@ func (c *conn) get(ctx context.Context, status sbalance.ConnStatus) (NetConn, er
 
 		c.Conn, err = c.srv.DialContext(ctx, c.connset.port.Netw, c.connset.port.Addr)
 		if c.Conn != nil {
+			c.gotAt = time.Now()
 			return c, nil
 		}
 		// We ran into a hard failure.
@@ -633,6 +652,9 @@ func (c *conn) Put() {
 	if !atomic.CompareAndSwapUint32(&c.closed, 0, 1) {
 		return
 	}
+	if r, ok := c.sbconn.(sbalance.Reporter); ok {
+		r.Report(time.Since(c.gotAt))
+	}
 	c.connset.Lock()
 	c.connset.conns = append(c.connset.conns, c.Conn)
 	c.connset.Unlock()
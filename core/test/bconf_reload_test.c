@@ -0,0 +1,117 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Reloads a config file into a bconf_handle on SIGHUP, through the
+ * set_reload_cb thread, while reader threads keep looking up keys.
+ */
+
+#include "sbp/bconf.h"
+#include "sbp/bconf_handle.h"
+#include "sbp/bconfig.h"
+#include "sbp/daemon.h"
+#include "sbp/error_functions.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NKEYS 1000
+#define NREADERS 4
+
+static char conf_path[] = "/tmp/bconf_reload_test.XXXXXX";
+static struct bconf_handle *handle;
+static bool done;
+
+static void
+write_conf(int generation) {
+	char tmp[sizeof(conf_path) + 4];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", conf_path);
+	if (!(f = fopen(tmp, "w")))
+		xerr(1, "fopen");
+	fprintf(f, "generation=%d\n", generation);
+	for (int i = 0; i < NKEYS; i++)
+		fprintf(f, "keys.%d.value=%d\n", i, generation);
+	fclose(f);
+	if (rename(tmp, conf_path))
+		xerr(1, "rename");
+}
+
+static void
+reload(void *cbarg) {
+	struct bconf_node *root = config_init(conf_path);
+
+	assert(root);
+	bconf_handle_publish(handle, root);
+}
+
+static void *
+reader(void *v) {
+	unsigned int seed = (unsigned int)(uintptr_t)&seed;
+	int last = 0;
+	char key[32];
+
+	while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+		struct bconf_node *root = bconf_handle_pin(handle);
+		int generation = bconf_get_int(root, "generation");
+
+		assert(generation >= last);
+		for (int i = 0; i < 10; i++) {
+			snprintf(key, sizeof(key), "keys.%d.value", rand_r(&seed) % NKEYS);
+			assert(bconf_get_int(root, key) == generation);
+		}
+		bconf_handle_unpin(handle);
+		last = generation;
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+	int reloads = argc > 1 ? atoi(argv[1]) : 100;
+	pthread_t threads[NREADERS];
+
+	int fd = mkstemp(conf_path);
+	if (fd < 0)
+		xerr(1, "mkstemp");
+	close(fd);
+	write_conf(0);
+	handle = bconf_handle_new(config_init(conf_path));
+
+	set_reload_cb(reload, NULL);
+	reload_here();
+
+	for (int i = 0; i < NREADERS; i++)
+		pthread_create(&threads[i], NULL, reader, NULL);
+
+	for (int gen = 1; gen <= reloads; gen++) {
+		unsigned long version = bconf_handle_version(handle);
+
+		write_conf(gen);
+		kill(getpid(), SIGHUP);
+		for (int ms = 0; bconf_handle_version(handle) == version; ms++) {
+			if (ms == 5000)
+				xerrx(1, "No reload after SIGHUP");
+			nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+		}
+	}
+
+	__atomic_store_n(&done, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < NREADERS; i++)
+		pthread_join(threads[i], NULL);
+
+	struct bconf_node *root = bconf_handle_pin(handle);
+	assert(bconf_get_int(root, "generation") == reloads);
+	bconf_handle_unpin(handle);
+	assert(bconf_handle_reclaim() == 0);
+
+	bconf_handle_free(handle);
+	unlink(conf_path);
+	return 0;
+}
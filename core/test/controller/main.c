@@ -11,6 +11,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
 
 #include "sbp/bconf.h"
 #include "sbp/bconfig.h"
@@ -162,6 +163,52 @@ keepalive_finish(struct ctrl_req *cr, struct stringmap *qs, void *v) {
 	ctrl_output_text(cr, "keepalive-calls: %" PRIu64 "\n", k);
 }
 
+/* 5 MB of numbered lines, served both from a file and as an iovec chain. */
+#define LARGE_LINES 500000
+#define LARGE_LINE_LEN 10
+#define LARGE_NIOV 5
+
+static char *large_data;
+static struct iovec large_iov[LARGE_NIOV];
+static int large_fd = -1;
+
+static void
+large_setup(void) {
+	size_t sz = LARGE_LINES * LARGE_LINE_LEN;
+	large_data = malloc(sz + 1);
+	for (int i = 0; i < LARGE_LINES; i++)
+		snprintf(large_data + i * LARGE_LINE_LEN, LARGE_LINE_LEN + 1, "%09d\n", i);
+
+	for (int i = 0; i < LARGE_NIOV; i++) {
+		large_iov[i].iov_base = large_data + i * (sz / LARGE_NIOV);
+		large_iov[i].iov_len = sz / LARGE_NIOV;
+	}
+
+	char path[] = "/tmp/regress-controller-XXXXXX";
+	if ((large_fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	unlink(path);
+	if (write(large_fd, large_data, sz) != (ssize_t)sz)
+		err(1, "write");
+}
+
+static void
+large_file_cb(struct ctrl_req *cr, struct stringmap *qs, void *v) {
+	int fd = dup(large_fd);
+	if (fd == -1) {
+		ctrl_error(cr, 500, "dup: %m");
+		return;
+	}
+	ctrl_set_content_type(cr, "text/plain");
+	ctrl_set_response_fd(cr, fd, 0, 0);
+}
+
+static void
+large_iov_cb(struct ctrl_req *cr, struct stringmap *qs, void *v) {
+	ctrl_set_content_type(cr, "text/plain");
+	ctrl_set_response_iov(cr, large_iov, LARGE_NIOV);
+}
+
 static struct bconf_node *root;
 
 static void *
@@ -231,6 +278,11 @@ run(void) {
 			.finish = dump_qs_cb,
 			.cb_data = NULL,
 		},
+		{
+			.url = "/typed/<param:int>",
+			.finish = dump_qs_cb,
+			.cb_data = NULL,
+		},
 		{
 			.url = "/foo/<first>/<second>",
 			.finish = dump_qs_cb,
@@ -280,6 +332,14 @@ run(void) {
 			.url = "/keepalive",
 			.finish = keepalive_finish,
 		},
+		{
+			.url = "/large_file",
+			.finish = large_file_cb,
+		},
+		{
+			.url = "/large_iov",
+			.finish = large_iov_cb,
+		},
 		{
 			.url = "/no_substring_match",
 			.finish = acl_finish,
@@ -293,6 +353,8 @@ run(void) {
 	if (semaphore_init(&state.stop_sem, false, 0) == -1)
 		err(1, "semaphore_init");
 
+	large_setup();
+
 
 	state.stop = false;
 	state.started = false;
@@ -341,6 +403,8 @@ run(void) {
 	pthread_join(kthread, NULL);
 
 	semaphore_destroy(&state.stop_sem);
+	close(large_fd);
+	free(large_data);
 	bconf_free(&root);
 	log_shutdown();
 
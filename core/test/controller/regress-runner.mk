@@ -23,7 +23,11 @@ REGRESS_TARGETS+=ctrl-hej-tjo-param
 REGRESS_TARGETS+=ctrl-partial-param
 REGRESS_TARGETS+=ctrl-two-params
 REGRESS_TARGETS+=ctrl-middle-param
+REGRESS_TARGETS+=ctrl-typed-int
+REGRESS_TARGETS+=ctrl-typed-notint
 REGRESS_TARGETS+=ctrl-keepalive-calls
+REGRESS_TARGETS+=sha-ctrl-large_file
+REGRESS_TARGETS+=sha-ctrl-large_iov
 REGRESS_TARGETS+=enforce-min-nthreads
 REGRESS_TARGETS+=platform-regress-controller-stop
 
@@ -42,6 +46,14 @@ REGRESS_TARGETS+=ctrl-any_method
 REGRESS_TARGETS+=post-ctrl-any_method
 REGRESS_TARGETS+=ctrl-only_get
 REGRESS_TARGETS+=post-ctrl-only_get
+REGRESS_TARGETS+=platform-regress-controller-stop
+
+REGRESS_TARGETS+=platform-regress-controller-start-percore.conf
+REGRESS_TARGETS+=ctrl-hej
+REGRESS_TARGETS+=ctrl-hej-tjo-param
+REGRESS_TARGETS+=pctrl-sha256
+REGRESS_TARGETS+=sha-ctrl-large_file
+REGRESS_TARGETS+=ctrl-keepalive-calls
 
 
 TESTOUT=${TESTDIR}/test.out
@@ -70,6 +82,10 @@ hctrl-%:
 	curl -s -D ${TESTOUT} http://127.0.0.1:$$(cat .testport)/`cat $@.in`
 	match --force-new ${TESTOUT} $@.out
 
+sha-ctrl-%:
+	curl -s http://127.0.0.1:$$(cat .testport)/`cat $@.in` | ${PYTHON} -c 'import hashlib, sys; print(hashlib.sha256(getattr(sys.stdin, "buffer", sys.stdin).read()).hexdigest())' > ${TESTOUT}
+	match ${TESTOUT} $@.out
+
 pctrl-%:
 	curl -s --data-binary @$@.post http://127.0.0.1:$$(cat .testport)/`cat $@.in` > ${TESTOUT}
 	match ${TESTOUT} $@.out
@@ -0,0 +1,208 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Handler matching benchmark, comparing the compiled route trie with
+ * checking every handler url in order, which is what on_url used to do.
+ * Both are run on the same requests and must pick the same handler.
+ *
+ * Usage: regress_ctrl_route_bench [handlers] [iterations]
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../lib/controller-route.c"
+
+struct path_param {
+	const char *key;
+	size_t key_len;
+	const char *value;
+	size_t value_len;
+};
+
+/* The previous matcher, kept as a baseline. */
+static bool
+match_handler(const char *handler_url, size_t handler_url_len, const char *request_url, size_t request_url_len, struct path_param **p, int *num_params) {
+	bool match = false;
+	const char *hup = handler_url;
+	const char *hend = handler_url + handler_url_len;
+	const char *rup = request_url;
+	const char *rend = request_url + request_url_len;
+	int paramidx = 0;
+	int num_vars = 0, num_var_ends = 0;
+	struct path_param *params = NULL;
+
+	for (const char *hp = hup; hp < hend; hp++) {
+		int diff;
+		if (*hp == '<')
+			num_vars++;
+		if (*hp == '>')
+			num_var_ends++;
+
+		diff = num_vars - num_var_ends;
+		if (diff != 0 && diff != 1)
+			goto out;
+	}
+
+	params = xcalloc(num_vars, sizeof(*params));
+	for (; hup != hend && rup != rend; hup++, rup++) {
+		if (*hup == *rup) {
+			continue;
+		} else if (*hup == '<') {
+			params[paramidx].key = ++hup;
+			while (*hup++ != '>') {
+				params[paramidx].key_len++;
+			}
+
+			params[paramidx].value = rup;
+			while (*rup != '/' && rup != rend) {
+				rup++;
+				params[paramidx].value_len++;
+			}
+			paramidx++;
+
+			if (rup == rend || hup == hend)
+				break;
+		} else if (*hup != *rup) {
+			break;
+		}
+	}
+
+	if (hup != hend || rup != rend)
+		goto out;
+
+	match = true;
+
+out:
+	if (!match) {
+		free(params);
+		params = NULL;
+		num_vars = 0;
+	}
+	*p = params;
+	*num_params = num_vars;
+	return match;
+}
+
+static int
+linear_match(char **urls, int nurls, const char *path, size_t len, int *nparams) {
+	for (int i = 0 ; i < nurls ; i++) {
+		struct path_param *params;
+		if (match_handler(urls[i], strlen(urls[i]), path, len, &params, nparams)) {
+			free(params);
+			return i;
+		}
+	}
+	*nparams = 0;
+	return -1;
+}
+
+static double
+elapsed(const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[]) {
+	int nhandlers = 300;
+	int iterations = 20000;
+
+	if (argc > 1)
+		nhandlers = atoi(argv[1]);
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+
+	/* Similar to what a service with many handlers registers. */
+	static const char *const templates[] = {
+		"/svc%d/status",
+		"/svc%d/items/<id>",
+		"/svc%d/items/<id>/detail",
+		"/svc%d/users/<user>/items/<id>",
+	};
+	const int ntemplates = sizeof(templates) / sizeof(templates[0]);
+	char **urls = xcalloc(nhandlers, sizeof(*urls));
+	struct ctrl_route *route = ctrl_route_new();
+
+	for (int i = 0 ; i < nhandlers ; i++) {
+		xasprintf(&urls[i], templates[i % ntemplates], i / ntemplates);
+		ctrl_route_add(route, urls[i], i);
+	}
+
+	/* Half hits spread over all handlers, half misses. */
+	enum { NREQ = 64 };
+	char *reqs[NREQ];
+	for (int i = 0 ; i < NREQ ; i++) {
+		int svc = (i * 7919) % (nhandlers / ntemplates + 1);
+		switch (i % 8) {
+		case 0: xasprintf(&reqs[i], "/svc%d/status", svc); break;
+		case 1: xasprintf(&reqs[i], "/svc%d/items/%d", svc, i); break;
+		case 2: xasprintf(&reqs[i], "/svc%d/items/%d/detail", svc, i); break;
+		case 3: xasprintf(&reqs[i], "/svc%d/users/u%d/items/%d", svc, i, i); break;
+		case 4: xasprintf(&reqs[i], "/svc%d/missing", svc); break;
+		case 5: xasprintf(&reqs[i], "/nosuch/%d", i); break;
+		case 6: xasprintf(&reqs[i], "/svc%d/items/%d/other", svc, i); break;
+		case 7: xasprintf(&reqs[i], "/svc%d", svc); break;
+		}
+	}
+
+	struct ctrl_route_param params[CTRL_ROUTE_MAX_PARAMS];
+	int hits = 0;
+	for (int i = 0 ; i < NREQ ; i++) {
+		int ln, tn;
+		int l = linear_match(urls, nhandlers, reqs[i], strlen(reqs[i]), &ln);
+		int t = ctrl_route_match(route, reqs[i], strlen(reqs[i]), params, &tn);
+		if (l != t || ln != tn) {
+			fprintf(stderr, "Mismatch for %s: linear %d (%d params), trie %d (%d params)\n", reqs[i], l, ln, t, tn);
+			return 1;
+		}
+		hits += t >= 0;
+	}
+
+	/* Unlike the previous matcher, placeholders don't match empty segments anywhere. */
+	static const char *const empty[] = { "/svc0/items/", "/svc0/items//detail", "/svc0/users//items/1" };
+	for (size_t i = 0 ; i < sizeof(empty) / sizeof(empty[0]) ; i++) {
+		int tn;
+		if (ctrl_route_match(route, empty[i], strlen(empty[i]), params, &tn) != -1) {
+			fprintf(stderr, "Empty segment matched for %s\n", empty[i]);
+			return 1;
+		}
+	}
+
+	struct timespec start;
+	volatile int sink = 0;
+	int n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int it = 0 ; it < iterations ; it++) {
+		for (int i = 0 ; i < NREQ ; i++)
+			sink += linear_match(urls, nhandlers, reqs[i], strlen(reqs[i]), &n);
+	}
+	double tl = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int it = 0 ; it < iterations ; it++) {
+		for (int i = 0 ; i < NREQ ; i++)
+			sink += ctrl_route_match(route, reqs[i], strlen(reqs[i]), params, &n);
+	}
+	double tt = elapsed(&start);
+
+	double ops = (double)iterations * NREQ;
+	printf("%d handlers, %d of %d requests matching\n", nhandlers, hits, NREQ);
+	printf("%8s %14s %14s\n", "", "ops/s", "ns/op");
+	printf("%8s %14.0f %14.1f\n", "linear", ops / tl, tl * 1e9 / ops);
+	printf("%8s %14.0f %14.1f\n", "trie", ops / tt, tt * 1e9 / ops);
+
+	for (int i = 0 ; i < NREQ ; i++)
+		free(reqs[i]);
+	for (int i = 0 ; i < nhandlers ; i++)
+		free(urls[i]);
+	free(urls);
+	ctrl_route_free(route);
+	return 0;
+}
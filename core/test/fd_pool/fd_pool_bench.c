@@ -0,0 +1,194 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Multi-threaded checkout/checkin benchmark for fd_pool.
+ * Each thread repeatedly gets a pooled fd and puts it back, all against
+ * the same service and port, which is the worst case for contention.
+ *
+ * Runs once with the default poll check on reused fds and once with the reaper.
+ * For comparison the idle list is also run on its own, both as the mutex
+ * protected list fd_pool used before and as the lock-free stack it uses now.
+ *
+ * Usage: regress_fd_pool_bench [iterations per thread] [max threads]
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sbp/atomic.h"
+#include "sbp/create_socket.h"
+#include "sbp/error_functions.h"
+#include "sbp/fd_pool.h"
+#include "sbp/logging.h"
+#include "sbp/memalloc_functions.h"
+
+static struct fd_pool *pool;
+static int iterations = 100000;
+
+static void *
+acceptor(void *v) {
+	int s = *(int*)v;
+	/* Keep accepted fds open so that the pooled connections stay alive. */
+	while (accept(s, NULL, NULL) >= 0)
+		;
+	return NULL;
+}
+
+static void *
+worker(void *v) {
+	struct fd_pool_conn *conn = fd_pool_new_conn(pool, "bench", NULL, NULL);
+	fd_pool_set_silent(conn);
+
+	for (int i = 0 ; i < iterations ; i++) {
+		int fd = fd_pool_get(conn, SBCS_START, NULL, NULL);
+		assert(fd >= 0);
+		fd_pool_put(conn, fd);
+	}
+
+	fd_pool_free_conn(conn);
+	return NULL;
+}
+
+struct list_entry {
+	struct list_entry *next;
+	int fd;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct list_entry *head;
+	struct atomic_tagptr top;
+} list = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void *
+mutex_worker(void *v) {
+	for (int i = 0 ; i < iterations ; i++) {
+		pthread_mutex_lock(&list.lock);
+		struct list_entry *e = list.head;
+		list.head = e->next;
+		pthread_mutex_unlock(&list.lock);
+
+		assert(e->fd >= 0);
+
+		pthread_mutex_lock(&list.lock);
+		e->next = list.head;
+		list.head = e;
+		pthread_mutex_unlock(&list.lock);
+	}
+	return NULL;
+}
+
+static void *
+lockfree_worker(void *v) {
+	for (int i = 0 ; i < iterations ; i++) {
+		struct atomic_tagptr top;
+		struct list_entry *e;
+
+		do {
+			top = atomic_read_tagptr(&list.top);
+			e = top.ptr;
+		} while (!atomic_cas_tagptr(&list.top, top, e->next));
+
+		assert(e->fd >= 0);
+
+		do {
+			top = atomic_read_tagptr(&list.top);
+			e->next = top.ptr;
+		} while (!atomic_cas_tagptr(&list.top, top, e));
+	}
+	return NULL;
+}
+
+static double
+run(void *(*fn)(void *), int nthreads) {
+	pthread_t threads[nthreads];
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0 ; i < nthreads ; i++)
+		pthread_create(&threads[i], NULL, fn, NULL);
+	for (int i = 0 ; i < nthreads ; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void
+report(const char *name, void *(*fn)(void *), int maxthreads) {
+	/* Warm up, for fd_pool creating the connections needed by the largest run. */
+	run(fn, maxthreads);
+
+	printf("%s\n%8s %14s %14s\n", name, "threads", "ops/s", "ns/op/thread");
+	for (int n = 1 ; n <= maxthreads ; n *= 2) {
+		double t = run(fn, n);
+		double ops = (double)n * iterations;
+		printf("%8d %14.0f %14.1f\n", n, ops / t, t * 1e9 / iterations);
+		if (n < maxthreads && n * 2 > maxthreads)
+			n = maxthreads / 2;
+	}
+}
+
+static void
+bench(const char *port, int maxthreads, bool reaper) {
+	pool = fd_pool_create_single("bench", "127.0.0.1", port, 1, 1000, NULL);
+	assert(pool);
+	if (reaper && fd_pool_start_reaper(pool) == -1)
+		xerr(1, "fd_pool_start_reaper");
+
+	report(reaper ? "reaper" : "poll", worker, maxthreads);
+
+	fd_pool_free(pool);
+}
+
+static void
+bench_list(int maxthreads) {
+	struct list_entry *entries = xcalloc(maxthreads, sizeof(*entries));
+
+	/* One entry per thread, a pop never finds the list empty. */
+	for (int i = 0 ; i < maxthreads ; i++) {
+		entries[i].fd = i;
+		entries[i].next = i + 1 < maxthreads ? &entries[i + 1] : NULL;
+	}
+
+	list.head = entries;
+	report("mutex list", mutex_worker, maxthreads);
+
+	list.top.ptr = entries;
+	report("lock-free list", lockfree_worker, maxthreads);
+
+	free(entries);
+}
+
+int
+main(int argc, char *argv[]) {
+	int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (argc > 2)
+		maxthreads = atoi(argv[2]);
+
+	log_setup_perror("fd_pool_bench", "info");
+
+	char *port;
+	int s = create_socket_any_port("127.0.0.1", &port);
+	assert(s >= 0);
+
+	pthread_t acc;
+	pthread_create(&acc, NULL, acceptor, &s);
+
+	bench(port, maxthreads, false);
+	bench(port, maxthreads, true);
+	bench_list(maxthreads);
+
+	close(s);
+	free(port);
+	return 0;
+}
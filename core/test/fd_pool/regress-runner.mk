@@ -5,10 +5,14 @@ FLAVOR?=dev
 
 print-tests:
 	@echo TEST: test_1
+	@echo TEST: bench_1
 	@echo CLEANUP: cleanup
 
 test_1:
 	regress_fd_pool_test ../../../${BUILDPATH}/${FLAVOR}/regress/common/fd_pool/test.conf
 
+bench_1:
+	regress_fd_pool_bench 10000 4
+
 cleanup:
 	rm -f .test.out
@@ -98,14 +98,21 @@ test_fd_pool_update_hosts(void) {
 	assert(sb2->sb_refs == 3);
 	assert(expect_close == -1);
 
+	/* Stats of nodes still present survive the update. */
+	sbalance_serv_status(sb2, 0, SBCS_FAIL);
+	sb2->sb_service[0].ewma_us = 1234;
+
 	fd_pool_update_hosts(pool, "test", bconf_vtree(&node, root));
 	assert(srv->sb_gen == 3);
 	assert(sb2->sb_refs == 2);
+	assert(srv->sb->sb_service[0].tempfailcost == sb2->sb_failcost);
+	assert(srv->sb->sb_service[0].ewma_us == 1234);
+	sbalance_serv_status(srv->sb, 0, SBCS_START);
 
 	/* Test last generation put works. */
 	struct fd_pool_port *cp = conn->port;
 	fd_pool_put(conn, cfd);
-	assert(!SLIST_EMPTY(&cp->entries));
+	assert(cp->nentries > 0);
 	cfd = fd_pool_get(conn, SBCS_START, NULL, NULL);
 	assert(sb2->sb_refs == 1);
 
@@ -118,7 +125,7 @@ test_fd_pool_update_hosts(void) {
 	 */
 	struct fd_pool_port *cp2 = conn2->port;
 	fd_pool_put(conn2, cfd2);
-	assert(!SLIST_EMPTY(&cp2->entries));
+	assert(cp2->nentries > 0);
 	assert(cp2 == cp);
 
 	fd_pool_free_conn(conn);
@@ -160,6 +167,481 @@ test_new_conn_new_service(void) {
 	fd_pool_free(pool);
 }
 
+#define STACK_THREADS 4
+#define STACK_ENTRIES 8
+
+static struct fd_pool_stack test_stack;
+
+/* Half of the threads pop the top, half the oldest. There are always more entries than threads. */
+static void *
+stack_worker(void *v) {
+	bool last = (intptr_t)v & 1;
+
+	for (int i = 0 ; i < 100000 ; i++) {
+		struct fd_pool_entry *e = last ? fd_pool_stack_pop_last(&test_stack) : fd_pool_stack_pop(&test_stack);
+		assert(e != NULL);
+		fd_pool_stack_push(&test_stack, e, e);
+	}
+	return NULL;
+}
+
+static void
+test_stack_pop_last(void) {
+	struct fd_pool_entry entries[STACK_ENTRIES] = {{0}};
+	pthread_t threads[STACK_THREADS];
+
+	/* The oldest entry is popped, also when entries are pushed above it while locked. */
+	fd_pool_stack_push(&test_stack, &entries[0], &entries[0]);
+	assert(fd_pool_stack_pop_last(&test_stack) == &entries[0]);
+	assert(test_stack.top.ptr == NULL);
+	fd_pool_stack_push(&test_stack, &entries[0], &entries[0]);
+	fd_pool_stack_push(&test_stack, &entries[1], &entries[1]);
+	assert(fd_pool_stack_lock(&test_stack) == &entries[1]);
+	fd_pool_stack_push(&test_stack, &entries[2], &entries[2]);
+	fd_pool_stack_unlink(&test_stack, NULL, &entries[1]);
+	fd_pool_stack_unlock(&test_stack);
+	assert(fd_pool_stack_pop_last(&test_stack) == &entries[0]);
+	assert(fd_pool_stack_pop(&test_stack) == &entries[2]);
+	assert(fd_pool_stack_pop(&test_stack) == NULL);
+
+	for (int i = 0 ; i < STACK_ENTRIES ; i++)
+		fd_pool_stack_push(&test_stack, &entries[i], &entries[i]);
+	for (intptr_t i = 0 ; i < STACK_THREADS ; i++)
+		pthread_create(&threads[i], NULL, stack_worker, (void*)i);
+	for (int i = 0 ; i < STACK_THREADS ; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Nothing lost or duplicated. */
+	int n = 0;
+	for (struct fd_pool_entry *e = fd_pool_stack_take(&test_stack) ; e ; e = e->next) {
+		assert(e >= entries && e < entries + STACK_ENTRIES && !e->fd);
+		e->fd = 1;
+		n++;
+	}
+	assert(n == STACK_ENTRIES);
+}
+
+static void
+test_reaper(void) {
+	char *port;
+	int s = create_socket_any_port("127.0.0.1", &port);
+	assert(s >= 0);
+
+	struct fd_pool *pool = fd_pool_create_single("test", "127.0.0.1", port, 1, 1000, NULL);
+	assert(fd_pool_start_reaper(pool) == 0);
+
+	struct fd_pool_conn *conn = fd_pool_new_conn(pool, "test", NULL, NULL);
+
+	/* Peer closes while the fd is idle, the reaper should evict it. */
+	int cfd = fd_pool_get(conn, SBCS_START, NULL, NULL);
+	assert(cfd >= 0);
+	int sfd = accept(s, NULL, NULL);
+	assert(sfd >= 0);
+	struct fd_pool_port *cp = conn->port;
+	fd_pool_put(conn, cfd);
+	assert(cp->nentries == 1);
+	assert(cp->entries.top.ptr != NULL);
+	assert(((struct fd_pool_entry*)cp->entries.top.ptr)->watched);
+
+	expect_close = cfd;
+	close(sfd);
+	for (int i = 0 ; i < 100 && cp->nentries > 0 ; i++)
+		usleep(10000);
+	assert(cp->nentries == 0);
+	assert(cp->entries.top.ptr == NULL);
+	assert(expect_close == -1);
+
+	/* Peer closes while checked out, the fd should not be pooled on put. */
+	cfd = fd_pool_get(conn, SBCS_START, NULL, NULL);
+	assert(cfd >= 0);
+	sfd = accept(s, NULL, NULL);
+	assert(sfd >= 0);
+	fd_pool_put(conn, cfd);
+	cfd = fd_pool_get(conn, SBCS_START, NULL, NULL);
+	assert(conn->entry != NULL);
+	close(sfd);
+	for (int i = 0 ; i < 100 && (conn->entry->state & FDPE_STATE_MASK) != FDPE_HUP ; i++)
+		usleep(10000);
+	assert((conn->entry->state & FDPE_STATE_MASK) == FDPE_HUP);
+	expect_close = cfd;
+	fd_pool_put(conn, cfd);
+	assert(expect_close == -1);
+	assert(cp->nentries == 0);
+
+	fd_pool_free_conn(conn);
+	fd_pool_free(pool);
+	close(s);
+	free(port);
+}
+
+/* A service with idle_timeout added after the reaper started still gets swept. */
+static void
+test_reaper_sweep(void) {
+	char *port;
+	int s = create_socket_any_port("127.0.0.1", &port);
+	assert(s >= 0);
+
+	struct fd_pool *pool = fd_pool_new(NULL);
+	assert(fd_pool_start_reaper(pool) == 0);
+	usleep(10000);
+
+	struct bconf_node *root = NULL;
+	bconf_add_data(&root, "service", "test");
+	bconf_add_data(&root, "host.1.name", "127.0.0.1");
+	bconf_add_data(&root, "host.1.port", port);
+	bconf_add_data(&root, "idle_timeout", "50");
+	struct vtree_chain node = {0};
+	assert(fd_pool_add_config(pool, bconf_vtree(&node, root), NULL, NULL) == 0);
+
+	struct fd_pool_conn *conn = fd_pool_new_conn(pool, "test", NULL, NULL);
+	int cfd = fd_pool_get(conn, SBCS_START, NULL, NULL);
+	assert(cfd >= 0);
+	struct fd_pool_port *cp = conn->port;
+	expect_close = cfd;
+	fd_pool_put(conn, cfd);
+	assert(cp->nentries == 1);
+	for (int i = 0 ; i < 100 && cp->nentries > 0 ; i++)
+		usleep(10000);
+	assert(cp->nentries == 0);
+	assert(expect_close == -1);
+
+	fd_pool_free_conn(conn);
+	vtree_free(&node);
+	bconf_free(&root);
+	fd_pool_free(pool);
+	close(s);
+	free(port);
+}
+
+static void
+test_idle_limits(void) {
+	char *port;
+	int s = create_socket_any_port("127.0.0.1", &port);
+	assert(s >= 0);
+
+	struct bconf_node *root = NULL;
+	bconf_add_data(&root, "service", "test");
+	bconf_add_data(&root, "host.1.name", "127.0.0.1");
+	bconf_add_data(&root, "host.1.port", port);
+	bconf_add_data(&root, "max_idle", "2");
+	bconf_add_data(&root, "idle_timeout", "60000");
+	bconf_add_data(&root, "min_idle", "2");
+	struct vtree_chain node = {0};
+
+	struct fd_pool *pool = fd_pool_new(NULL);
+	assert(fd_pool_add_config(pool, bconf_vtree(&node, root), NULL, NULL) == 0);
+
+	struct fd_pool_service *srv = fd_pool_find_service(pool, "test");
+	assert(srv->max_idle == 2);
+	assert(srv->idle_timeout_ms == 60000);
+	assert(srv->min_idle == 2);
+	assert(strcmp(srv->min_idle_port_key, "port") == 0);
+
+	struct fd_pool_conn *conns[3];
+	int fds[3];
+	for (int i = 0 ; i < 3 ; i++) {
+		conns[i] = fd_pool_new_conn(pool, "test", NULL, NULL);
+		fds[i] = fd_pool_get(conns[i], SBCS_START, NULL, NULL);
+		assert(fds[i] >= 0);
+	}
+	struct fd_pool_port *cp = conns[0]->port;
+
+	/* Only max_idle fds are kept. */
+	fd_pool_put(conns[0], fds[0]);
+	fd_pool_put(conns[1], fds[1]);
+	expect_close = fds[2];
+	fd_pool_put(conns[2], fds[2]);
+	assert(expect_close == -1);
+	assert(cp->nentries == 2);
+
+	/* Expired fds are closed instead of reused. */
+	struct fd_pool_entry *top = cp->entries.top.ptr;
+	top->expires = 1;
+	expect_close = top->fd;
+	int fd = fd_pool_get(conns[0], SBCS_START, NULL, NULL);
+	assert(expect_close == -1);
+	assert(fd == fds[0]);
+	assert(cp->nentries == 0);
+	fd_pool_put(conns[0], fd);
+	assert(cp->nentries == 1);
+
+	/* Update hosts tops up to min_idle. */
+	assert(fd_pool_update_hosts(pool, "test", bconf_vtree(&node, root)) == 1);
+	assert(cp->nentries == 2);
+
+	for (int i = 0 ; i < 3 ; i++)
+		fd_pool_free_conn(conns[i]);
+	vtree_free(&node);
+	bconf_free(&root);
+	fd_pool_free(pool);
+	close(s);
+	free(port);
+}
+
+/*
+ * Returns a listening socket that doesn't complete any more connects, by
+ * filling up its accept queue. Linux drops SYNs when that happens.
+ */
+static int
+blackhole_socket(char **port, int *fillfds, int nfill) {
+	int s = create_socket_any_port("127.0.0.1", port);
+	assert(s >= 0);
+	assert(listen(s, 0) == 0);
+
+	struct sockaddr_storage ss;
+	socklen_t sl = sizeof(ss);
+	assert(getsockname(s, (struct sockaddr*)&ss, &sl) == 0);
+
+	for (int i = 0 ; i < nfill ; i++) {
+		fillfds[i] = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		assert(fillfds[i] >= 0);
+		connect(fillfds[i], (struct sockaddr*)&ss, sl);
+		struct pollfd pfd = { .fd = fillfds[i], .events = POLLOUT };
+		if (poll(&pfd, 1, 100) == 0) {
+			close(fillfds[i]);
+			fillfds[i] = -1;
+			return s;
+		}
+	}
+	assert(!"accept queue never filled up");
+}
+
+/* Drive fd_pool_get_start/continue like an event loop would. */
+static enum fd_pool_async_status
+async_get(struct fd_pool_conn *conn, int *fd, const char **peer) {
+	const char *p;
+	enum fd_pool_async_status res = fd_pool_get_start(conn, SBCS_START, fd, &p, NULL);
+
+	while (res == FDPA_WAIT) {
+		assert(*fd >= 0);
+		struct pollfd pfd = { .fd = *fd, .events = POLLOUT };
+		int n = poll(&pfd, 1, fd_pool_timeout(conn));
+		assert(n >= 0);
+		if (n == 0)
+			expect_close = *fd;
+		res = fd_pool_get_continue(conn, n ? pfd.revents : 0, fd, &p, NULL);
+		assert(expect_close == -1);
+	}
+	if (peer)
+		*peer = p;
+	return res;
+}
+
+static void
+test_async(void) {
+	/* Grab a port nobody listens on. */
+	char *refused;
+	int r = create_socket_any_port("127.0.0.1", &refused);
+	assert(r >= 0);
+	close(r);
+
+	char *port2, *port3;
+	int fillfds[16];
+	memset(fillfds, -1, sizeof(fillfds));
+	int s2 = blackhole_socket(&port2, fillfds, 16);
+	int s3 = create_socket_any_port("127.0.0.1", &port3);
+	assert(s3 >= 0);
+
+	struct bconf_node *root = NULL;
+	bconf_add_data(&root, "service", "test");
+	bconf_add_data(&root, "strat", "seq");
+	bconf_add_data(&root, "retries", "1");
+	bconf_add_data(&root, "timeout", "1000");
+	bconf_add_data(&root, "host.1.name", "127.0.0.1");
+	bconf_add_data(&root, "host.1.port", refused);
+	bconf_add_data(&root, "host.2.name", "127.0.0.1");
+	bconf_add_data(&root, "host.2.port", port2);
+	bconf_add_data(&root, "host.3.name", "127.0.0.1");
+	bconf_add_data(&root, "host.3.port", port3);
+	struct vtree_chain node = {0};
+
+	struct fd_pool *pool = fd_pool_new(NULL);
+	assert(fd_pool_add_config(pool, bconf_vtree(&node, root), NULL, NULL) == 0);
+
+	struct fd_pool_conn *conn = fd_pool_new_conn(pool, "test", NULL, NULL);
+	fd_pool_set_silent(conn);
+
+	char peer3[256];
+	snprintf(peer3, sizeof(peer3), "127.0.0.1 %s", port3);
+
+	/* Host 1 is refused and host 2 times out, so host 3 is used. */
+	const char *peer = NULL;
+	int fd;
+	assert(async_get(conn, &fd, &peer) == FDPA_DONE);
+	assert(fd >= 0);
+	assert(strcmp(peer, peer3) == 0);
+	assert(fcntl(fd, F_GETFL) & O_NONBLOCK);
+
+	/* The pooled fd is used the next time around, non-blocking even if it was put back blocking. */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	fd_pool_put(conn, fd);
+	int pfd;
+	assert(async_get(conn, &pfd, &peer) == FDPA_DONE);
+	assert(pfd == fd);
+	assert(fcntl(pfd, F_GETFL) & O_NONBLOCK);
+	fd_pool_put(conn, pfd);
+	fd_pool_free_conn(conn);
+
+	/* Running out of nodes fails, with the error from the last connect. */
+	close(s3);
+	bconf_add_data(&root, "host.2.port", refused);
+	bconf_add_data(&root, "host.3.port", refused);
+	assert(fd_pool_update_hosts(pool, "test", bconf_vtree(&node, root)) == 3);
+
+	conn = fd_pool_new_conn(pool, "test", NULL, NULL);
+	fd_pool_set_silent(conn);
+	assert(async_get(conn, &fd, NULL) == FDPA_FAIL);
+	assert(fd == -1);
+	assert(errno == ECONNREFUSED);
+	fd_pool_free_conn(conn);
+
+	vtree_free(&node);
+	bconf_free(&root);
+	fd_pool_free(pool);
+	for (int i = 0 ; i < 16 ; i++) {
+		if (fillfds[i] >= 0)
+			close(fillfds[i]);
+	}
+	close(s2);
+	free(refused);
+	free(port2);
+	free(port3);
+}
+
+static void
+test_connect_stagger(void) {
+	char *slow_port, *port;
+	int fillfds[16];
+	memset(fillfds, -1, sizeof(fillfds));
+	int slow = blackhole_socket(&slow_port, fillfds, 16);
+	int s = create_socket_any_port("127.0.0.1", &port);
+	assert(s >= 0);
+
+	struct bconf_node *root = NULL;
+	bconf_add_data(&root, "service", "test");
+	bconf_add_data(&root, "strat", "seq");
+	bconf_add_data(&root, "timeout", "5000");
+	bconf_add_data(&root, "connect_stagger", "20");
+	bconf_add_data(&root, "host.1.name", "127.0.0.1");
+	bconf_add_data(&root, "host.1.port", slow_port);
+	bconf_add_data(&root, "host.2.name", "127.0.0.1");
+	bconf_add_data(&root, "host.2.port", port);
+	struct vtree_chain node = {0};
+
+	struct fd_pool *pool = fd_pool_new(NULL);
+	assert(fd_pool_add_config(pool, bconf_vtree(&node, root), NULL, NULL) == 0);
+	assert(fd_pool_find_service(pool, "test")->connect_stagger_ms == 20);
+
+	struct fd_pool_conn *conn = fd_pool_new_conn(pool, "test", NULL, NULL);
+	fd_pool_set_silent(conn);
+
+	/* Host 2 wins long before host 1 would time out. */
+	const char *peer;
+	uint64_t start = fd_pool_now_ms();
+	int fd = fd_pool_get(conn, SBCS_START, &peer, NULL);
+	assert(fd >= 0);
+	assert(fd_pool_now_ms() - start < 1000);
+	assert(strcmp(strchr(peer, ' ') + 1, port) == 0);
+	assert(!(fcntl(fd, F_GETFL) & O_NONBLOCK));
+	fd_pool_put(conn, fd);
+	assert(conn->port->nentries == 1);
+
+	/* Without stagger, the slow host is waited for. */
+	fd_pool_set_connect_stagger(pool, "test", 0);
+	fd_pool_set_async(conn, 1);
+	fd = fd_pool_get(conn, SBCS_START, &peer, NULL);
+	assert(fd >= 0);
+	assert(strcmp(strchr(peer, ' ') + 1, slow_port) == 0);
+	close(fd);
+
+	fd_pool_free_conn(conn);
+	vtree_free(&node);
+	bconf_free(&root);
+	fd_pool_free(pool);
+	for (int i = 0 ; i < 16 ; i++) {
+		if (fillfds[i] >= 0)
+			close(fillfds[i]);
+	}
+	close(slow);
+	close(s);
+	free(slow_port);
+	free(port);
+}
+
+static void *
+stagger_get(void *v) {
+	struct fd_pool_conn *conn = v;
+
+	return (void*)(intptr_t)fd_pool_get(conn, SBCS_START, NULL, NULL);
+}
+
+static unsigned int
+stagger_tempfailcost(struct fd_pool_service *srv, const char *port) {
+	for (unsigned int i = 0 ; i < srv->sb->sb_nserv ; i++) {
+		struct fd_pool_service_node *sn = srv->sb->sb_service[i].data;
+		if (strcmp(strchr(sn->node->ports[0].peer, ' ') + 1, port) == 0)
+			return srv->sb->sb_service[i].tempfailcost;
+	}
+	assert(!"no such port");
+}
+
+/* A racing connect that fails is accounted to its own node, not the one tried last. */
+static void
+test_connect_stagger_fail(void) {
+	char *port1, *port2;
+	int fill1[16], fill2[16];
+	memset(fill1, -1, sizeof(fill1));
+	memset(fill2, -1, sizeof(fill2));
+	int s1 = blackhole_socket(&port1, fill1, 16);
+	int s2 = blackhole_socket(&port2, fill2, 16);
+
+	struct bconf_node *root = NULL;
+	bconf_add_data(&root, "service", "test");
+	bconf_add_data(&root, "strat", "seq");
+	bconf_add_data(&root, "retries", "0");
+	bconf_add_data(&root, "timeout", "1000");
+	bconf_add_data(&root, "connect_stagger", "500");
+	bconf_add_data(&root, "host.1.name", "127.0.0.1");
+	bconf_add_data(&root, "host.1.port", port1);
+	bconf_add_data(&root, "host.2.name", "127.0.0.1");
+	bconf_add_data(&root, "host.2.port", port2);
+	struct vtree_chain node = {0};
+
+	struct fd_pool *pool = fd_pool_new(NULL);
+	assert(fd_pool_add_config(pool, bconf_vtree(&node, root), NULL, NULL) == 0);
+	struct fd_pool_service *srv = fd_pool_find_service(pool, "test");
+
+	struct fd_pool_conn *conn = fd_pool_new_conn(pool, "test", NULL, NULL);
+	fd_pool_set_silent(conn);
+
+	/* Host 1 times out at 1000 ms while host 2, started at 500 ms, is still connecting. */
+	pthread_t thr;
+	pthread_create(&thr, NULL, stagger_get, conn);
+	usleep(1250000);
+	assert(stagger_tempfailcost(srv, port1) == FD_POOL_DEFAULT_FAIL);
+	assert(stagger_tempfailcost(srv, port2) != FD_POOL_DEFAULT_FAIL);
+
+	void *res;
+	pthread_join(thr, &res);
+	assert((intptr_t)res == -1);
+	assert(stagger_tempfailcost(srv, port2) == FD_POOL_DEFAULT_FAIL);
+
+	fd_pool_free_conn(conn);
+	vtree_free(&node);
+	bconf_free(&root);
+	fd_pool_free(pool);
+	for (int i = 0 ; i < 16 ; i++) {
+		if (fill1[i] >= 0)
+			close(fill1[i]);
+		if (fill2[i] >= 0)
+			close(fill2[i]);
+	}
+	close(s1);
+	close(s2);
+	free(port1);
+	free(port2);
+}
+
 static void
 test_host_to_service(void) {
 	const char *domain = "example.com";
@@ -188,7 +670,16 @@ test_host_to_service(void) {
 
 int
 main(int argc, char *argv[]) {
+	test_stack_pop_last();
 	test_fd_pool_update_hosts();
 	test_new_conn_new_service();
+	test_idle_limits();
+	test_async();
+#ifdef __linux__
+	test_reaper();
+	test_reaper_sweep();
+	test_connect_stagger();
+	test_connect_stagger_fail();
+#endif
 	test_host_to_service();
 }
@@ -55,15 +55,19 @@ type jsonIoWriter struct {
 }
 
 func (wr jsonIoWriter) WriteMessage(ctx context.Context, msg plogd.LogMessage) {
-	body, err := msg.MarshalJSON()
+	buf := plogd.GetBuffer()
+	defer buf.Free()
+	var err error
+	buf.B, err = msg.AppendJSON(buf.B)
 	if err != nil {
 		slog.CtxError(ctx, "Failed to marshal message", "error", err, "msg", fmt.Sprint(msg))
 		return
 	}
-	body = append(body, '\n')
-	_, err = wr.w.Write(body)
+	buf.B = append(buf.B, '\n')
+	_, err = wr.w.Write(buf.B)
 	if err != nil {
-		slog.CtxError(ctx, "Failed to write message", "error", err, "body", body)
+		// The buffer is reused, copy it.
+		slog.CtxError(ctx, "Failed to write message", "error", err, "body", string(buf.B))
 	}
 }
 
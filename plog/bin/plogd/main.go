@@ -172,8 +172,8 @@ var work sync.WaitGroup
 var sigCh = make(chan os.Signal)
 var quitDoneCh = make(chan struct{})
 
-func listen(ctx context.Context, sessionStore *SessionStorage, dataStore *DataStorage, l net.Listener, seqpacket bool) {
-	pl := plogproto.Listener{l, seqpacket}
+func listen(ctx context.Context, sessionStore *SessionStorage, dataStore *DataStorage, l net.Listener, seqpacket bool, shmSize int) {
+	pl := plogproto.Listener{Listener: l, Seqpacket: seqpacket, ShmSize: shmSize}
 	for {
 		conn, err := pl.Accept()
 		if err != nil {
@@ -238,6 +238,19 @@ func main() {
 	httpAddr := flag.String("httpd", os.Getenv("PLOG_HTTPD_ADDR"), "Run HTTP server on this address")
 	pidfile := flag.String("pidfile", "", "Write PID to this file. Truncated early but the pid is written once the service is ready to accept answers")
 	subprog := flag.String("subprog", "", "If set, split the prog field on + and add the second value to the output with this key.")
+	storage := flag.String("storage", "channels", "Storage engine for open contexts. \"channels\" uses a goroutine and channel per open dict or list, "+
+		"\"sharded\" keeps them in mutex protected shards, which is lighter with many concurrent contexts.")
+	jsonMemLimit := flag.Int("json-mem-limit", 64<<20, "Max bytes to buffer in memory while the -json address is slow or unavailable. 0 for no limit.")
+	jsonSpillDir := flag.String("json-spill-dir", "", "Spill messages to segment files in this directory when -json-mem-limit is reached, "+
+		"and send them once reconnected. If not set, messages are dropped.")
+	jsonSpillLimit := flag.Int64("json-spill-limit", 0, "Max bytes to spill to disk. 0 for no limit.")
+	jsonSpillSegment := flag.Int64("json-spill-segment", 16<<20, "Size of the spill segment files.")
+	jsonSpillSync := flag.String("json-spill-fsync", "segment", "When to fsync spilled data. \"never\", \"segment\" when a segment file is complete, or \"always\".")
+	jsonCompress := flag.String("json-compress", "none", "Compress the stream to the -json address. \"none\" or \"gzip\", which is flushed after each batch.")
+	jsonBatchDelay := flag.Duration("json-batch-delay", 0, "Wait this long for -json-batch-size bytes of messages before sending them to the -json address. "+
+		"Gives better compression with -json-compress.")
+	jsonBatchSize := flag.Int("json-batch-size", defaultBatchSize, "Max bytes to compress per batch, and the size to wait for with -json-batch-delay.")
+	shmSize := flag.Int("shm-size", plogproto.DefaultShmSize, "Size of the shared memory rings handed out to clients asking for them on the unix stream socket. 0 to only use the socket.")
 
 	flag.Parse()
 
@@ -252,6 +265,13 @@ func main() {
 
 	sessionStore := SessionStorage{}
 	dataStore := DataStorage{}
+	switch *storage {
+	case "channels":
+	case "sharded":
+		dataStore.Sharded = true
+	default:
+		log.Fatalf("Unknown storage engine %q", *storage)
+	}
 
 	if *httpAddr == "" {
 		*httpAddr = ":8180"
@@ -259,13 +279,28 @@ func main() {
 	s := &server{dataStore: &dataStore}
 
 	var err error
+	var netWriter *NetWriter
 	switch {
 	case *logstashAddr != "":
 		if *outPlugin != "" || *jsonFile != "" {
 			err = fmt.Errorf("only one of -json, -file and -output-plugin can be used")
 			break
 		}
-		dataStore.Output, err = NewNetWriter("tcp", *logstashAddr)
+		conf := NetWriterConfig{
+			MemLimit:         *jsonMemLimit,
+			SpillDir:         *jsonSpillDir,
+			SpillLimit:       *jsonSpillLimit,
+			SpillSegmentSize: *jsonSpillSegment,
+			Compress:         *jsonCompress,
+			BatchDelay:       *jsonBatchDelay,
+			BatchSize:        *jsonBatchSize,
+		}
+		conf.SpillSync, err = parseSpillSync(*jsonSpillSync)
+		if err != nil {
+			break
+		}
+		netWriter, err = NewNetWriter("tcp", *logstashAddr, conf)
+		dataStore.Output = netWriter
 	case *jsonFile != "":
 		if *outPlugin != "" {
 			err = fmt.Errorf("only one of -json, -file and -output-plugin can be used")
@@ -324,7 +359,7 @@ func main() {
 			log.Fatal(err)
 		}
 		defer l.Close()
-		go listen(ctx, &sessionStore, &dataStore, l, a[0] == "unixpacket")
+		go listen(ctx, &sessionStore, &dataStore, l, a[0] == "unixpacket", *shmSize)
 	}
 
 	self, err := newSelfSession(&dataStore, &sessionStore)
@@ -334,6 +369,14 @@ func main() {
 	log.SetOutput(self)
 	self.InjectSlog()
 
+	var state *selfState
+	if netWriter != nil {
+		state, err = newSelfState(&dataStore, "net_writer", netWriter.Stats)
+		if err != nil {
+			log.Fatal(err)
+		}
+	}
+
 	if pidF != nil {
 		fmt.Fprintf(pidF, "%d\n", os.Getpid())
 		pidF.Close()
@@ -350,6 +393,9 @@ func main() {
 	self.ResetSlog()
 	log.SetOutput(os.Stderr)
 	self.Close(true)
+	if state != nil {
+		state.Close()
+	}
 	cancel()
 
 	graceful := make(chan struct{})
@@ -4,7 +4,10 @@ package main
 
 import (
 	"bytes"
+	"compress/gzip"
 	"context"
+	"fmt"
+	"io"
 	"log"
 	"net"
 	"os"
@@ -23,6 +26,37 @@ const (
 	shutdown          = iota
 )
 
+const (
+	// Max bytes read back from the spill queue at a time.
+	spillReadChunk = 1 << 20
+	// How long to try sending the buffer at shutdown before spilling it.
+	shutdownWriteTimeout = 5 * time.Second
+	// Default max size of compressed batches.
+	defaultBatchSize = 64 << 10
+)
+
+// NetWriterConfig contains the buffering options for a NetWriter.
+type NetWriterConfig struct {
+	// Bytes to buffer in memory while the upstream is slow or
+	// disconnected. 0 means no limit.
+	MemLimit int
+	// Directory to spill messages to once MemLimit is reached. If empty
+	// the messages are dropped instead.
+	SpillDir         string
+	SpillSegmentSize int64
+	// Max bytes to spill, 0 means no limit.
+	SpillLimit int64
+	SpillSync  spillSync
+
+	// Compression of the stream, "gzip" or "none". Each batch is flushed
+	// so it can be decompressed as soon as it's received.
+	Compress string
+	// Wait up to BatchDelay for BatchSize bytes of messages before
+	// sending. 0 sends whatever is buffered as soon as possible.
+	BatchDelay time.Duration
+	BatchSize  int
+}
+
 // NetWriter is used to send logs over the network.
 type NetWriter struct {
 	network, address string
@@ -30,8 +64,31 @@ type NetWriter struct {
 	LocalIP          string
 	bytes.Buffer
 	signal chan netmsg
-	data   chan []byte
+	data   chan *plogd.Buffer
 	sync.Mutex
+
+	memLimit int
+	spill    *spillQueue
+	spillErr bool
+	done     chan struct{}
+
+	batchDelay time.Duration
+	batchSize  int
+	batchStart time.Time
+	// Set if compressing, writing to zbuf. A new stream is started for
+	// each connection.
+	gz   *gzip.Writer
+	zbuf bytes.Buffer
+	// Batch taken from the buffer, kept until it's sent.
+	batch []byte
+
+	// Metrics, protected by the mutex.
+	spilledTotal int64
+	droppedTotal int
+	droppedBytes int64
+	sentBytes    int64
+	wireBytes    int64
+	batches      int
 }
 
 func (wr *NetWriter) eofReader() {
@@ -73,53 +130,205 @@ func (wr *NetWriter) Connect() error {
 	return nil
 }
 
+// queue adds a message to the memory buffer. If the buffer is full, or
+// there are already spilled messages, it's spilled to keep the order.
+// Must hold the mutex.
+func (wr *NetWriter) queue(d *plogd.Buffer) {
+	defer d.Free()
+	spilled := wr.spill != nil && wr.spill.Len() > 0
+	if !spilled && (wr.memLimit <= 0 || wr.Buffer.Len()+len(d.B) <= wr.memLimit) {
+		if wr.Buffer.Len() == 0 {
+			wr.batchStart = time.Now()
+		}
+		wr.Buffer.Write(d.B)
+		return
+	}
+	if wr.spill != nil {
+		err := wr.spill.Write(d.B)
+		if err == nil {
+			wr.spilledTotal += int64(len(d.B))
+			wr.spillErr = false
+			return
+		}
+		if !wr.spillErr {
+			// Goroutine to not block on our own log message.
+			go log.Printf("net_writer: spill to %s: %v, dropping messages", wr.spill.dir, err)
+			wr.spillErr = true
+		}
+	}
+	wr.droppedTotal++
+	wr.droppedBytes += int64(len(d.B))
+}
+
+// fill reads spilled messages back into the empty memory buffer.
+// Must hold the mutex.
+func (wr *NetWriter) fill() {
+	if wr.spill == nil || wr.spill.Len() == 0 {
+		return
+	}
+	n := spillReadChunk
+	if wr.memLimit > 0 && n > wr.memLimit {
+		n = wr.memLimit
+	}
+	if _, err := wr.Buffer.ReadFrom(io.LimitReader(wr.spill, int64(n))); err != nil {
+		go log.Printf("net_writer: read from %s: %v, dropping spilled messages", wr.spill.dir, err)
+		wr.droppedBytes += wr.spill.Len()
+		wr.spill.Discard()
+	}
+}
+
+// pending returns true if there's data in memory to send.
+func (wr *NetWriter) pending() bool {
+	return wr.Buffer.Len() > 0 || len(wr.batch) > 0
+}
+
+// batchWait returns how long to wait for more messages before sending.
+// Must hold the mutex.
+func (wr *NetWriter) batchWait() time.Duration {
+	if wr.batchDelay <= 0 || len(wr.batch) > 0 || wr.Buffer.Len() >= wr.batchSize {
+		return 0
+	}
+	return wr.batchDelay - time.Since(wr.batchStart)
+}
+
+// send writes the buffer to the connection. If compressing, a batch of at
+// most batchSize bytes is compressed and flushed. On errors the batch is kept
+// to be sent again on the next connection.
+// Must hold the mutex.
+func (wr *NetWriter) send() error {
+	if wr.gz == nil {
+		n, err := wr.Buffer.WriteTo(wr.Conn)
+		wr.sentBytes += n
+		wr.wireBytes += n
+		if err == nil {
+			wr.batches++
+		}
+		return err
+	}
+	if len(wr.batch) == 0 {
+		wr.batch = append(wr.batch, wr.Buffer.Next(wr.batchSize)...)
+	}
+	if wr.zbuf.Len() == 0 {
+		wr.gz.Write(wr.batch)
+		wr.gz.Flush()
+	}
+	n, err := wr.zbuf.WriteTo(wr.Conn)
+	wr.wireBytes += n
+	if err != nil {
+		// The rest of the stream is useless, start over.
+		wr.zbuf.Reset()
+		wr.gz.Reset(&wr.zbuf)
+		return err
+	}
+	wr.sentBytes += int64(len(wr.batch))
+	wr.batches++
+	wr.batch = wr.batch[:0]
+	return nil
+}
+
 func netWriterLoop(wr *NetWriter) {
+	defer close(wr.done)
 	running := true
-	for running || wr.Buffer.Len() > 0 {
+	for running || wr.pending() {
 		wait := running
+		var delay time.Duration
 		wr.Mutex.Lock()
 		for more := true; more; {
 			select {
 			case d := <-wr.data:
-				wr.Buffer.Write(d)
+				wr.queue(d)
 			default:
 				more = false
 			}
 		}
-		if wr.Buffer.Len() > 0 {
+		if running && wr.Conn != nil && !wr.pending() {
+			wr.fill()
+		}
+		if running && wr.pending() {
+			delay = wr.batchWait()
+		}
+		if delay <= 0 && (wr.pending() || (running && wr.spill != nil && wr.spill.Len() > 0)) {
 			wait = false
 			if wr.Conn == nil {
+				if !running && wr.spill != nil {
+					// Keep it for the next start.
+					wr.Mutex.Unlock()
+					break
+				}
 				// Unlock while connecting
 				wr.Mutex.Unlock()
 				wr.Connect()
 				wr.Mutex.Lock()
-			} else {
-				_, err := wr.Buffer.WriteTo(wr.Conn)
-				if err != nil {
+				if wr.gz != nil {
+					// Start a new stream on the new connection.
+					wr.zbuf.Reset()
+					wr.gz.Reset(&wr.zbuf)
+				}
+			} else if wr.pending() {
+				if err := wr.send(); err != nil {
 					// Trigger eofReader
 					wr.Conn.Close()
 					wait = true
+					if !running && wr.spill != nil {
+						wr.Mutex.Unlock()
+						break
+					}
 				}
 			}
 		}
 		wr.Mutex.Unlock()
 		if wait {
+			var timer *time.Timer
+			var timeout <-chan time.Time
+			if delay > 0 {
+				timer = time.NewTimer(delay)
+				timeout = timer.C
+			}
 			select {
 			case disc, ok := <-wr.signal:
 				if !ok || disc == shutdown {
 					running = false
+					if wr.Conn != nil && wr.spill != nil {
+						wr.Conn.SetWriteDeadline(time.Now().Add(shutdownWriteTimeout))
+					}
 				} else if disc == disconnect {
 					wr.Conn.Close()
 					wr.Conn = nil
 				}
 			case d := <-wr.data:
 				wr.Mutex.Lock()
-				wr.Buffer.Write(d)
+				wr.queue(d)
 				wr.Mutex.Unlock()
+			case <-timeout:
+			}
+			if timer != nil {
+				timer.Stop()
+			}
+		}
+	}
+	if wr.spill != nil {
+		wr.Mutex.Lock()
+		for more := true; more; {
+			select {
+			case d := <-wr.data:
+				wr.queue(d)
+			default:
+				more = false
 			}
 		}
+		head := append(wr.batch, wr.Buffer.Bytes()...)
+		if err := wr.spill.Close(head); err != nil {
+			log.Printf("net_writer: close %s: %v", wr.spill.dir, err)
+		}
+		wr.batch = nil
+		wr.Buffer.Reset()
+		wr.Mutex.Unlock()
 	}
 	if wr.Conn != nil {
+		if wr.gz != nil && !wr.pending() {
+			wr.gz.Close()
+			wr.zbuf.WriteTo(wr.Conn)
+		}
 		wr.Conn.Close()
 	}
 }
@@ -127,8 +336,35 @@ func netWriterLoop(wr *NetWriter) {
 // NewNetWriter creates a writer for the given address.
 // It will try to connect but connection refused is ignored, while other errors
 // are reported.
-func NewNetWriter(network, address string) (*NetWriter, error) {
-	wr := &NetWriter{network: network, address: address, signal: make(chan netmsg, 1), data: make(chan []byte, 1024)}
+func NewNetWriter(network, address string, conf NetWriterConfig) (*NetWriter, error) {
+	wr := &NetWriter{
+		network:  network,
+		address:  address,
+		signal:   make(chan netmsg, 1),
+		data:     make(chan *plogd.Buffer, 1024),
+		memLimit: conf.MemLimit,
+		done:     make(chan struct{}),
+
+		batchDelay: conf.BatchDelay,
+		batchSize:  conf.BatchSize,
+	}
+	if wr.batchSize <= 0 {
+		wr.batchSize = defaultBatchSize
+	}
+	switch conf.Compress {
+	case "", "none":
+	case "gzip":
+		wr.gz, _ = gzip.NewWriterLevel(&wr.zbuf, gzip.BestSpeed)
+	default:
+		return nil, fmt.Errorf("unknown compression %q", conf.Compress)
+	}
+	if conf.SpillDir != "" {
+		var err error
+		wr.spill, err = openSpillQueue(conf.SpillDir, conf.SpillSegmentSize, conf.SpillLimit, conf.SpillSync)
+		if err != nil {
+			return nil, err
+		}
+	}
 	// Do the first connect here to detect more serious problems
 	if err := wr.Connect(); err != nil {
 		close(wr.signal)
@@ -138,9 +374,14 @@ func NewNetWriter(network, address string) (*NetWriter, error) {
 	return wr, nil
 }
 
-// Close signals the writer to close. It's asynchronous.
+// Close signals the writer to close. It's asynchronous, unless spilling to
+// disk is enabled. Then it waits for the buffer to be either sent or
+// spilled.
 func (wr *NetWriter) Close() error {
 	wr.signal <- shutdown
+	if wr.spill != nil {
+		<-wr.done
+	}
 	return nil
 }
 
@@ -151,12 +392,13 @@ func (wr *NetWriter) WriteMessage(ctx context.Context, msg plogd.LogMessage) {
 	if msg.Host == "" {
 		msg.Host = wr.LocalIP
 	}
-	body, err := msg.MarshalJSON()
+	buf := plogd.GetBuffer()
+	body, err := msg.AppendJSON(buf.B)
 	if err != nil {
 		panic(err)
 	}
-	body = append(body, '\n')
-	wr.data <- body
+	buf.B = append(body, '\n')
+	wr.data <- buf
 }
 
 // ResetBuffer replaces the output buffer, returning the previous contents.
@@ -170,3 +412,23 @@ func (wr *NetWriter) ResetBuffer(newbuf []byte) []byte {
 	wr.Mutex.Unlock()
 	return ret
 }
+
+// Stats returns the buffer metrics, which are kept in the plogd state.
+func (wr *NetWriter) Stats() map[string]interface{} {
+	wr.Mutex.Lock()
+	defer wr.Mutex.Unlock()
+	var spilled int64
+	if wr.spill != nil {
+		spilled = wr.spill.Len()
+	}
+	return map[string]interface{}{
+		"buffered_bytes":   wr.Buffer.Len() + len(wr.batch),
+		"spilled_bytes":    int(spilled),
+		"spilled_total":    int(wr.spilledTotal),
+		"dropped_messages": wr.droppedTotal,
+		"dropped_bytes":    int(wr.droppedBytes),
+		"sent_bytes":       int(wr.sentBytes),
+		"wire_bytes":       int(wr.wireBytes),
+		"batches":          wr.batches,
+	}
+}
@@ -2,13 +2,243 @@
 
 package main
 
-import "testing"
+import (
+	"bufio"
+	"compress/gzip"
+	"context"
+	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/schibsted/sebase/plog/pkg/plogd"
+)
 
 func TestConnRefused(t *testing.T) {
-	wr := &NetWriter{network: "tcp", address: "localhost:1", signal: make(chan netmsg, 1), data: make(chan []byte, 1024)}
+	wr := &NetWriter{network: "tcp", address: "localhost:1", signal: make(chan netmsg, 1), data: make(chan *plogd.Buffer, 1024)}
 	err := wr.Connect()
 	if err != nil {
 		t.Fatalf("%T %#v", err, err)
 	}
 	wr.Close()
 }
+
+func testLine(i int) *plogd.Buffer {
+	buf := plogd.GetBuffer()
+	buf.B = append(buf.B, fmt.Sprintf("message %03d\n", i)...)
+	return buf
+}
+
+func waitStats(t *testing.T, wr *NetWriter, key string) {
+	t.Helper()
+	timeout := time.After(5 * time.Second)
+	for wr.Stats()[key] == 0 {
+		select {
+		case <-timeout:
+			t.Fatalf("Timed out waiting for %s: %v", key, wr.Stats())
+		case <-time.After(10 * time.Millisecond):
+		}
+	}
+}
+
+func TestNetWriterSpill(t *testing.T) {
+	dir, err := ioutil.TempDir("", "spill")
+	checkFatal(t, err)
+	defer os.RemoveAll(dir)
+
+	// Find a free port, but don't listen on it yet.
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	checkFatal(t, err)
+	addr := l.Addr().String()
+	l.Close()
+
+	wr, err := NewNetWriter("tcp", addr, NetWriterConfig{MemLimit: 100, SpillDir: dir, SpillSegmentSize: 64, SpillSync: spillSyncNever})
+	checkFatal(t, err)
+	for i := 0; i < 50; i++ {
+		wr.data <- testLine(i)
+	}
+	waitStats(t, wr, "spilled_bytes")
+
+	l, err = net.Listen("tcp", addr)
+	checkFatal(t, err)
+	defer l.Close()
+	conn, err := l.Accept()
+	checkFatal(t, err)
+	defer conn.Close()
+
+	scanner := bufio.NewScanner(conn)
+	for i := 0; i < 50; i++ {
+		if !scanner.Scan() {
+			t.Fatal(scanner.Err())
+		}
+		if expect := fmt.Sprintf("message %03d", i); scanner.Text() != expect {
+			t.Fatalf("Expected %q, got %q", expect, scanner.Text())
+		}
+	}
+	wr.Close()
+	stats := wr.Stats()
+	if stats["spilled_bytes"] != 0 || stats["buffered_bytes"] != 0 || stats["spilled_total"] == 0 || stats["dropped_messages"] != 0 {
+		t.Errorf("Unexpected stats %v", stats)
+	}
+}
+
+func TestNetWriterDrop(t *testing.T) {
+	wr, err := NewNetWriter("tcp", "localhost:1", NetWriterConfig{MemLimit: 100})
+	checkFatal(t, err)
+	for i := 0; i < 50; i++ {
+		wr.data <- testLine(i)
+	}
+	waitStats(t, wr, "dropped_messages")
+	stats := wr.Stats()
+	if stats["buffered_bytes"].(int) > 100 {
+		t.Errorf("Buffer above limit: %v", stats)
+	}
+	wr.Close()
+}
+
+type countingReader struct {
+	r io.Reader
+	n *int64
+}
+
+func (cr countingReader) Read(p []byte) (int, error) {
+	n, err := cr.r.Read(p)
+	atomic.AddInt64(cr.n, int64(n))
+	return n, err
+}
+
+// testReceiver accepts connections on l and sends the received lines to
+// the returned channel, decompressing them if compressed is set. The bytes
+// read from the connections are counted in wire.
+func testReceiver(t testing.TB, l net.Listener, compressed bool, wire *int64) <-chan string {
+	lines := make(chan string, 1024)
+	go func() {
+		for {
+			conn, err := l.Accept()
+			if err != nil {
+				close(lines)
+				return
+			}
+			var r io.Reader = countingReader{conn, wire}
+			if compressed {
+				gz, err := gzip.NewReader(r)
+				if err != nil {
+					t.Error(err)
+					conn.Close()
+					continue
+				}
+				r = gz
+			}
+			scanner := bufio.NewScanner(r)
+			for scanner.Scan() {
+				lines <- scanner.Text()
+			}
+			conn.Close()
+		}
+	}()
+	return lines
+}
+
+func expectLines(t *testing.T, lines <-chan string, from, to int) {
+	t.Helper()
+	for i := from; i < to; i++ {
+		select {
+		case line := <-lines:
+			if expect := fmt.Sprintf("message %03d", i); line != expect {
+				t.Fatalf("Expected %q, got %q", expect, line)
+			}
+		case <-time.After(5 * time.Second):
+			t.Fatalf("Timed out waiting for message %d", i)
+		}
+	}
+}
+
+func TestNetWriterGzip(t *testing.T) {
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	checkFatal(t, err)
+	defer l.Close()
+	var wire int64
+	lines := testReceiver(t, l, true, &wire)
+
+	wr, err := NewNetWriter("tcp", l.Addr().String(), NetWriterConfig{Compress: "gzip", BatchDelay: 20 * time.Millisecond, BatchSize: 4096})
+	checkFatal(t, err)
+	for i := 0; i < 1000; i++ {
+		wr.data <- testLine(i)
+	}
+	expectLines(t, lines, 0, 1000)
+
+	stats := wr.Stats()
+	if stats["sent_bytes"] != 1000*len("message 000\n") || stats["wire_bytes"].(int) >= stats["sent_bytes"].(int) {
+		t.Errorf("Unexpected stats %v", stats)
+	}
+	if stats["batches"].(int) >= 100 {
+		t.Errorf("Expected batching, got %v", stats)
+	}
+
+	// Reconnect starts a new stream.
+	wr.Mutex.Lock()
+	wr.Conn.Close()
+	wr.Mutex.Unlock()
+	time.Sleep(100 * time.Millisecond)
+	for i := 1000; i < 1100; i++ {
+		wr.data <- testLine(i)
+	}
+	expectLines(t, lines, 1000, 1100)
+	wr.Close()
+}
+
+func benchmarkNetWriter(b *testing.B, compress string) {
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	checkFatal(b, err)
+	defer l.Close()
+	var wire int64
+	lines := testReceiver(b, l, compress == "gzip", &wire)
+
+	wr, err := NewNetWriter("tcp", l.Addr().String(), NetWriterConfig{Compress: compress, BatchDelay: 10 * time.Millisecond})
+	checkFatal(b, err)
+	defer wr.Close()
+
+	msg := plogd.LogMessage{
+		Prog: "search",
+		Type: "query",
+		Message: map[string]interface{}{
+			"remote_addr": json.RawMessage(`"::ffff:127.0.0.1"`),
+			"input":       "J0 print_parse:2 indonly:brown,grown attrind:quick",
+			"tot_bytes":   418,
+			"log":         []interface{}{map[string]interface{}{"DEBUG": "parsed query"}, map[string]interface{}{"INFO": "query done"}},
+		},
+	}
+	done := make(chan struct{})
+	go func() {
+		for i := 0; i < b.N; i++ {
+			<-lines
+		}
+		close(done)
+	}()
+	ctx := context.Background()
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		msg.Timestamp = time.Now()
+		msg.Message.(map[string]interface{})["tot_bytes"] = i
+		wr.WriteMessage(ctx, msg)
+	}
+	<-done
+	b.StopTimer()
+	stats := wr.Stats()
+	b.ReportMetric(float64(stats["sent_bytes"].(int))/float64(b.N), "B/msg")
+	b.ReportMetric(float64(atomic.LoadInt64(&wire))/float64(b.N), "wire-B/msg")
+}
+
+func BenchmarkNetWriterPlain(b *testing.B) {
+	benchmarkNetWriter(b, "none")
+}
+
+func BenchmarkNetWriterGzip(b *testing.B) {
+	benchmarkNetWriter(b, "gzip")
+}
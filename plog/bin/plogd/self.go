@@ -6,6 +6,7 @@ import (
 	"context"
 	"fmt"
 	"os"
+	"time"
 
 	"github.com/schibsted/sebase/plog/internal/pkg/plogproto"
 	"github.com/schibsted/sebase/plog/pkg/plog"
@@ -90,6 +91,52 @@ func (s selfSessionLevel) LogCtxMsg(ctx context.Context, msg string, kvs ...inte
 	}
 }
 
+// How often the plogd state is updated.
+const selfStateInterval = 10 * time.Second
+
+// selfState keeps metrics from a stats function in the plogd state, under
+// the given key. They can then be queried over HTTP, and are output with the
+// state at shutdown.
+type selfState struct {
+	output SessionOutput
+	key    string
+	stats  func() map[string]interface{}
+	stop   chan struct{}
+	done   chan struct{}
+}
+
+func newSelfState(dataStore *DataStorage, key string, stats func() map[string]interface{}) (*selfState, error) {
+	output, err := dataStore.findOutput("plogd", plogproto.CtxType_state)
+	if err != nil {
+		return nil, err
+	}
+	s := &selfState{output, key, stats, make(chan struct{}), make(chan struct{})}
+	go s.run(selfStateInterval)
+	return s, nil
+}
+
+func (s *selfState) run(interval time.Duration) {
+	defer close(s.done)
+	t := time.NewTicker(interval)
+	defer t.Stop()
+	for {
+		s.output.Write(s.key, s.stats())
+		select {
+		case <-t.C:
+		case <-s.stop:
+			s.output.Write(s.key, s.stats())
+			s.output.Close(true, false)
+			return
+		}
+	}
+}
+
+// Close stops updating the state and releases the state session.
+func (s *selfState) Close() {
+	close(s.stop)
+	<-s.done
+}
+
 var stderrLogger = slog.DefaultLogger{stderrPrintf}
 
 func stderrPrintf(format string, v ...interface{}) {
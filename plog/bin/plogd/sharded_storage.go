@@ -0,0 +1,373 @@
+// Copyright 2018 Schibsted
+
+package main
+
+import (
+	"context"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/schibsted/sebase/plog/internal/pkg/plogproto"
+	"github.com/schibsted/sebase/plog/pkg/plogd"
+)
+
+/*
+ * Sharded storage, used if DataStorage.Sharded is set.
+ *
+ * The root sessions are shared per program and type like for the channel
+ * based storage, but the dicts and lists below them are plain nodes without
+ * any goroutine or channel. Each tree of nodes below a root session is
+ * placed in a shard by a sequence number, and the nodes are only accessed
+ * while holding the lock of the shard. Writes are applied directly, and when
+ * a node is complete its value is added to the parent node.
+ *
+ * Anything that reaches the root session, typically a completed top level
+ * dict, is collected while holding the shard lock and passed on after
+ * releasing it. Log messages are then written to the output, and state
+ * updates are applied to the program state under its own lock.
+ *
+ * The resulting messages and state are the same as with the channel based
+ * storage.
+ */
+
+const (
+	storageShards = 64
+	// Freed nodes kept per shard for reuse.
+	shardFreeNodes = 256
+)
+
+type shardedStorage struct {
+	store  *DataStorage
+	seq    uint64
+	shards [storageShards]storageShard
+
+	lock  sync.Mutex
+	progs map[string]*shardedProg
+}
+
+type storageShard struct {
+	sync.Mutex
+	free []*shardedNode
+	// Keep the shards on separate cache lines.
+	_ [32]byte
+}
+
+type shardedProg struct {
+	name string
+	ctx  context.Context
+	// Protected by shardedStorage.lock.
+	roots map[plogproto.CtxType]*shardedRoot
+
+	stateLock sync.Mutex
+	state     map[string]interface{}
+}
+
+type shardedRoot struct {
+	storage *shardedStorage
+	prog    *shardedProg
+	stype   plogproto.CtxType
+	refs    int32
+}
+
+// rootOp is something to pass on to the root session once the shard lock
+// is released, either a message or a release of a reference.
+type rootOp struct {
+	release bool
+	key     string
+	value   interface{}
+	ts      time.Time
+}
+
+type shardedNode struct {
+	shard   *storageShard
+	root    *shardedRoot
+	parent  *shardedNode // nil for top level nodes.
+	refs    int
+	key     string
+	confKey string
+	start   time.Time
+	isState bool
+	isList  bool
+	dicts   bool
+	dict    map[string]interface{}
+	list    []interface{}
+}
+
+func (store *DataStorage) shardedStorage() *shardedStorage {
+	store.shardedOnce.Do(func() {
+		store.sharded = &shardedStorage{store: store, progs: make(map[string]*shardedProg)}
+	})
+	return store.sharded
+}
+
+func (s *shardedStorage) findOutput(prog string, stype plogproto.CtxType) SessionOutput {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+
+	p := s.progs[prog]
+	if p == nil {
+		p = &shardedProg{
+			name:  prog,
+			ctx:   progCtx(prog),
+			roots: make(map[plogproto.CtxType]*shardedRoot),
+			state: make(map[string]interface{}),
+		}
+		s.progs[prog] = p
+	}
+	r := p.roots[stype]
+	if r != nil {
+		// Might be 0 if it's being released, which then leaves it alone.
+		atomic.AddInt32(&r.refs, 1)
+		return r
+	}
+	r = &shardedRoot{storage: s, prog: p, stype: stype, refs: 1}
+	p.roots[stype] = r
+	return r
+}
+
+func (s *shardedStorage) callbackState(prog string, cb func(map[string]interface{})) (bool, error) {
+	s.lock.Lock()
+	p := s.progs[prog]
+	s.lock.Unlock()
+	if p == nil {
+		return false, ErrorProgNotFound
+	}
+	// The caller might wait for the callback, so don't call it here.
+	go func() {
+		p.stateLock.Lock()
+		defer p.stateLock.Unlock()
+		cb(p.state)
+	}()
+	return true, nil
+}
+
+/* root session */
+
+func (r *shardedRoot) write(key string, value interface{}, ts time.Time) {
+	store := r.storage.store
+	if r.stype != plogproto.CtxType_log {
+		r.prog.stateLock.Lock()
+		updateState(r.prog.state, r.stype, key, value, key)
+		r.prog.stateLock.Unlock()
+		if store.testStatePing != nil {
+			close(store.testStatePing)
+		}
+		return
+	}
+	var tsp *time.Time
+	if !ts.IsZero() {
+		tsp = &ts
+	}
+	store.Output.WriteMessage(r.prog.ctx, plogd.LogMessage{time.Now(), r.prog.name, key, value, tsp, "", nil})
+}
+
+func (r *shardedRoot) release() {
+	if atomic.AddInt32(&r.refs, -1) != 0 {
+		return
+	}
+	s := r.storage
+	p := r.prog
+	s.lock.Lock()
+	if atomic.LoadInt32(&r.refs) != 0 || p.roots[r.stype] != r {
+		// Picked up again by findOutput.
+		s.lock.Unlock()
+		return
+	}
+	delete(p.roots, r.stype)
+	last := len(p.roots) == 0
+	if last {
+		delete(s.progs, p.name)
+	}
+	s.lock.Unlock()
+
+	if last {
+		p.stateLock.Lock()
+		dumpState(p.ctx, s.store, p.name, p.state)
+		p.stateLock.Unlock()
+	}
+}
+
+func (r *shardedRoot) apply(ops []rootOp) {
+	for _, op := range ops {
+		if op.release {
+			r.release()
+		} else {
+			r.write(op.key, op.value, op.ts)
+		}
+	}
+}
+
+func (r *shardedRoot) Write(key string, value interface{}) error {
+	r.write(key, value, time.Time{})
+	return nil
+}
+
+func (r *shardedRoot) Close(proper, lastRef bool) {
+	if !proper {
+		r.write(interruptedKey, true, time.Time{})
+	}
+	r.release()
+}
+
+func (r *shardedRoot) ConfKey() string {
+	return r.prog.name
+}
+
+func (r *shardedRoot) open(key string, isList, dicts bool) *shardedNode {
+	atomic.AddInt32(&r.refs, 1)
+	s := r.storage
+	shard := &s.shards[atomic.AddUint64(&s.seq, 1)%storageShards]
+	shard.Lock()
+	n := shard.alloc()
+	shard.Unlock()
+	n.init(shard, r, nil, key, r.prog.name+"."+key, r.stype != plogproto.CtxType_log, isList, dicts)
+	return n
+}
+
+// OpenDict creates a new top level dictionary node.
+func (r *shardedRoot) OpenDict(key string) (SessionOutput, error) {
+	return r.open(key, false, false), nil
+}
+
+// OpenList creates a new top level list node.
+func (r *shardedRoot) OpenList(key string, dicts bool) (SessionOutput, error) {
+	return r.open(key, true, dicts), nil
+}
+
+/* nodes */
+
+// Must hold the lock.
+func (shard *storageShard) alloc() *shardedNode {
+	if l := len(shard.free); l > 0 {
+		n := shard.free[l-1]
+		shard.free = shard.free[:l-1]
+		return n
+	}
+	return &shardedNode{}
+}
+
+// Must hold the lock.
+func (shard *storageShard) recycle(n *shardedNode) {
+	*n = shardedNode{}
+	if len(shard.free) < shardFreeNodes {
+		shard.free = append(shard.free, n)
+	}
+}
+
+func (n *shardedNode) init(shard *storageShard, root *shardedRoot, parent *shardedNode, key, confKey string, isState, isList, dicts bool) {
+	n.shard = shard
+	n.root = root
+	n.parent = parent
+	n.refs = 1
+	n.key = key
+	n.confKey = confKey
+	n.start = time.Now()
+	n.isState = isState
+	n.isList = isList
+	n.dicts = dicts
+	if isList {
+		n.list = make([]interface{}, 0, 10)
+	} else if !isState {
+		n.dict = make(map[string]interface{})
+	}
+}
+
+// Must hold the shard lock.
+func (n *shardedNode) toParent(key string, value interface{}, ts time.Time, ops *[]rootOp) {
+	if n.parent != nil {
+		n.parent.deliver(key, value, ts, false, ops)
+	} else {
+		*ops = append(*ops, rootOp{key: key, value: value, ts: ts})
+	}
+}
+
+// Must hold the shard lock.
+func (n *shardedNode) deliver(key string, value interface{}, ts time.Time, lastRef bool, ops *[]rootOp) {
+	switch {
+	case n.isList:
+		if lastRef {
+			return
+		}
+		if n.dicts {
+			n.list = append(n.list, map[string]interface{}{key: value})
+		} else if key != interruptedKey {
+			n.list = append(n.list, value)
+		}
+	case lastRef:
+		n.toParent(n.key, nil, n.start, ops)
+	case n.isState:
+		n.toParent(n.key, map[string]interface{}{key: value}, n.start, ops)
+	default:
+		n.dict[key] = value
+	}
+}
+
+// Must hold the shard lock. Once the last reference is gone the value is
+// added to the parent and the node is recycled.
+func (n *shardedNode) release(ops *[]rootOp) {
+	n.refs--
+	if n.refs > 0 {
+		return
+	}
+	if n.isList {
+		n.toParent(n.key, n.list, n.start, ops)
+	} else if !n.isState {
+		n.toParent(n.key, n.dict, n.start, ops)
+	}
+	if n.parent != nil {
+		n.parent.release(ops)
+	} else {
+		*ops = append(*ops, rootOp{release: true})
+	}
+	n.shard.recycle(n)
+}
+
+func (n *shardedNode) Write(key string, value interface{}) error {
+	var ops []rootOp
+	root := n.root
+	n.shard.Lock()
+	n.deliver(key, value, time.Time{}, false, &ops)
+	n.shard.Unlock()
+	root.apply(ops)
+	return nil
+}
+
+func (n *shardedNode) Close(proper, lastRef bool) {
+	var ops []rootOp
+	root := n.root
+	shard := n.shard
+	shard.Lock()
+	if !proper {
+		n.deliver(interruptedKey, true, time.Time{}, false, &ops)
+	}
+	if lastRef {
+		n.deliver("", nil, time.Time{}, true, &ops)
+	}
+	n.release(&ops)
+	shard.Unlock()
+	root.apply(ops)
+}
+
+func (n *shardedNode) ConfKey() string {
+	return n.confKey
+}
+
+func (n *shardedNode) open(key string, isList, dicts bool) *shardedNode {
+	n.shard.Lock()
+	n.refs++
+	c := n.shard.alloc()
+	c.init(n.shard, n.root, n, key, n.confKey+"."+key, n.isState, isList, dicts)
+	n.shard.Unlock()
+	return c
+}
+
+// OpenDict creates a new dictionary node in the same shard.
+func (n *shardedNode) OpenDict(key string) (SessionOutput, error) {
+	return n.open(key, false, false), nil
+}
+
+// OpenList creates a new list node in the same shard.
+func (n *shardedNode) OpenList(key string, dicts bool) (SessionOutput, error) {
+	return n.open(key, true, dicts), nil
+}
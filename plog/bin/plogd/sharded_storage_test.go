@@ -0,0 +1,143 @@
+// Copyright 2018 Schibsted
+
+package main
+
+import (
+	"context"
+	"fmt"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/schibsted/sebase/plog/internal/pkg/plogproto"
+	"github.com/schibsted/sebase/plog/pkg/plogd"
+)
+
+// Runs the storage tests again with the sharded storage, they should give
+// the same results.
+func TestShardedStorage(t *testing.T) {
+	dataStore.Sharded = true
+	defer func() { dataStore.Sharded = false }()
+
+	tests := []struct {
+		name string
+		f    func(*testing.T)
+	}{
+		{"HelloGoodbye", TestHelloGoodbye},
+		{"SinglePublish", TestSinglePublish},
+		{"Subprog", TestSubprog},
+		{"Dict", TestDict},
+		{"List", TestList},
+		{"ListOfDicts", TestListOfDicts},
+		{"Transaction", TestTransaction},
+		{"SimpleState", TestSimpleState},
+		{"DeepState", TestDeepState},
+		{"StateSessionsInterrupted", TestStateSessionsInterrupted},
+		{"CounterState", testShardedCounterState},
+		{"ServerQuery", TestServerQuery},
+	}
+	for _, test := range tests {
+		t.Run(test.name, test.f)
+	}
+}
+
+// Like TestCounterState, but waits using CallbackState.
+func testShardedCounterState(t *testing.T) {
+	sconn := testConnect()
+	defer sconn.Close()
+	sID := hello(t, sconn, plogproto.CtxType_count, 0, "test", "counters", "foo", "bar")
+
+	sconn.SendKeyValue(sID, "name", []byte(`"bar"`))
+	sconn.SendKeyValue(sID, "test", []byte(`2`))
+	sconn.SendKeyValue(sID, "test", []byte(`1`))
+	sconn.SendKeyValue(sID, "test", []byte(`-2`))
+
+	for done := false; !done; {
+		one := make(chan struct{})
+		b, err := dataStore.CallbackState("test", func(state map[string]interface{}) {
+			js := fmt.Sprint(state)
+			done = js == "map[counters:map[foo:map[bar:map[name:bar test:1]]]]"
+			close(one)
+		})
+		if !b {
+			t.Fatal(err)
+		}
+		<-one
+	}
+
+	goodbye(t, sconn, sID)
+
+	checkLog(t, "test", "state", `{"counters":{"foo":{}}}`)
+}
+
+type benchOutput struct {
+	n    int64
+	want int64
+	done chan struct{}
+}
+
+func (o *benchOutput) WriteMessage(ctx context.Context, msg plogd.LogMessage) {
+	if atomic.AddInt64(&o.n, 1) == atomic.LoadInt64(&o.want) {
+		close(o.done)
+	}
+}
+
+func (o *benchOutput) Close() error {
+	return nil
+}
+
+// benchmarkStorage keeps benchStorageOpen request contexts open per
+// goroutine, each logging a few keys and a list of log lines before being
+// closed and output.
+const benchStorageOpen = 256
+
+func benchmarkStorage(b *testing.B, sharded bool) {
+	out := &benchOutput{want: int64(b.N), done: make(chan struct{})}
+	store := &DataStorage{Output: out, Sharded: sharded}
+	root, err := store.findOutput("bench", plogproto.CtxType_log)
+	if err != nil {
+		b.Fatal(err)
+	}
+
+	b.ReportAllocs()
+	b.ResetTimer()
+	start := time.Now()
+	b.RunParallel(func(pb *testing.PB) {
+		var open [benchStorageOpen]SessionOutput
+		for i := 0; pb.Next(); i++ {
+			slot := &open[i%benchStorageOpen]
+			if *slot != nil {
+				(*slot).Close(true, false)
+			}
+			dict, _ := root.OpenDict("query")
+			dict.Write("remote_addr", "::ffff:127.0.0.1")
+			dict.Write("input", "J0 print_parse:2 indonly:brown,grown attrind:quick")
+			dict.Write("tot_bytes", 418)
+			dict.Write("ndocs", 2)
+			lines, _ := dict.OpenList("log", true)
+			lines.Write("DEBUG", "parsed query")
+			lines.Write("INFO", "query done")
+			lines.Close(true, false)
+			*slot = dict
+		}
+		for _, dict := range open {
+			if dict != nil {
+				dict.Close(true, false)
+			}
+		}
+	})
+	<-out.done
+	b.StopTimer()
+	b.ReportMetric(float64(b.N)/time.Since(start).Seconds(), "ctx/s")
+
+	root.Close(true, false)
+	store.Close()
+}
+
+func BenchmarkStorageChannels(b *testing.B) {
+	benchmarkStorage(b, false)
+}
+
+func BenchmarkStorageSharded(b *testing.B) {
+	benchmarkStorage(b, true)
+}
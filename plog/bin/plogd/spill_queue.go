@@ -0,0 +1,255 @@
+// Copyright 2018 Schibsted
+
+package main
+
+import (
+	"errors"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+)
+
+// spillSync is the fsync policy for the spill queue.
+type spillSync int
+
+const (
+	// Leave it to the OS.
+	spillSyncNever spillSync = iota
+	// Sync each segment when it's complete.
+	spillSyncSegment
+	// Sync after every write.
+	spillSyncAlways
+)
+
+func parseSpillSync(s string) (spillSync, error) {
+	switch s {
+	case "never":
+		return spillSyncNever, nil
+	case "segment":
+		return spillSyncSegment, nil
+	case "always":
+		return spillSyncAlways, nil
+	}
+	return 0, fmt.Errorf("unknown spill fsync policy %q", s)
+}
+
+const (
+	spillSuffix = ".spill"
+	// Sequence number of the first segment in an empty queue. Leaves room
+	// for segments to be put in front of it, see Close.
+	spillFirstSeq = 1 << 32
+)
+
+var errSpillFull = errors.New("spill queue full")
+
+/*
+ * spillQueue is a FIFO of bytes on disk, stored in append-only segment
+ * files in a directory. The files are named by a sequence number, are
+ * written up to the segment size and removed once fully read.
+ *
+ * Segments found in the directory when opening are added to the queue, so
+ * data spilled before a restart is still sent. If plogd crashed, the
+ * first segment might be partially sent again.
+ */
+type spillQueue struct {
+	dir         string
+	segmentSize int64
+	limit       int64
+	sync        spillSync
+
+	segs  []uint64
+	w     *os.File
+	wsize int64
+	r     *os.File
+	roff  int64
+	// Bytes not yet read.
+	size int64
+}
+
+func openSpillQueue(dir string, segmentSize, limit int64, sync spillSync) (*spillQueue, error) {
+	if err := os.MkdirAll(dir, 0755); err != nil {
+		return nil, err
+	}
+	files, err := ioutil.ReadDir(dir)
+	if err != nil {
+		return nil, err
+	}
+	q := &spillQueue{dir: dir, segmentSize: segmentSize, limit: limit, sync: sync}
+	for _, fi := range files {
+		name := fi.Name()
+		if !strings.HasSuffix(name, spillSuffix) {
+			continue
+		}
+		seq, err := strconv.ParseUint(strings.TrimSuffix(name, spillSuffix), 16, 64)
+		if err != nil {
+			continue
+		}
+		q.segs = append(q.segs, seq)
+		q.size += fi.Size()
+	}
+	sort.Slice(q.segs, func(i, j int) bool { return q.segs[i] < q.segs[j] })
+	return q, nil
+}
+
+func (q *spillQueue) segPath(seq uint64) string {
+	return filepath.Join(q.dir, fmt.Sprintf("%016x%s", seq, spillSuffix))
+}
+
+// Len returns the number of unread bytes.
+func (q *spillQueue) Len() int64 {
+	return q.size
+}
+
+func (q *spillQueue) closeWriter() error {
+	if q.w == nil {
+		return nil
+	}
+	var err error
+	if q.sync != spillSyncNever {
+		err = q.w.Sync()
+	}
+	if cerr := q.w.Close(); err == nil {
+		err = cerr
+	}
+	q.w = nil
+	return err
+}
+
+// Write appends p to the queue. Either all of p is written or nothing.
+func (q *spillQueue) Write(p []byte) error {
+	if q.limit > 0 && q.size+int64(len(p)) > q.limit {
+		return errSpillFull
+	}
+	if q.w == nil || q.wsize >= q.segmentSize {
+		if err := q.closeWriter(); err != nil {
+			return err
+		}
+		seq := uint64(spillFirstSeq)
+		if len(q.segs) > 0 {
+			seq = q.segs[len(q.segs)-1] + 1
+		}
+		f, err := os.OpenFile(q.segPath(seq), os.O_WRONLY|os.O_CREATE|os.O_EXCL|os.O_APPEND, 0644)
+		if err != nil {
+			return err
+		}
+		q.w = f
+		q.wsize = 0
+		q.segs = append(q.segs, seq)
+	}
+	n, err := q.w.Write(p)
+	if err == nil && q.sync == spillSyncAlways {
+		err = q.w.Sync()
+	}
+	if err != nil {
+		// Don't leave a partial message behind.
+		if n > 0 {
+			q.w.Truncate(q.wsize)
+		}
+		return err
+	}
+	q.wsize += int64(n)
+	q.size += int64(n)
+	return nil
+}
+
+// Read reads from the oldest segment, removing it once read. Returns io.EOF
+// when the queue is empty.
+func (q *spillQueue) Read(p []byte) (int, error) {
+	for q.size > 0 && len(q.segs) > 0 {
+		if q.r == nil {
+			f, err := os.Open(q.segPath(q.segs[0]))
+			if err != nil {
+				return 0, err
+			}
+			q.r = f
+			q.roff = 0
+		}
+		n, err := q.r.Read(p)
+		q.roff += int64(n)
+		q.size -= int64(n)
+		if n > 0 {
+			return n, nil
+		}
+		if err != io.EOF {
+			return 0, err
+		}
+		if len(q.segs) == 1 {
+			break
+		}
+		q.r.Close()
+		q.r = nil
+		os.Remove(q.segPath(q.segs[0]))
+		q.segs = q.segs[1:]
+	}
+	// Everything is read, start over.
+	q.Discard()
+	return 0, io.EOF
+}
+
+// Discard removes all data in the queue.
+func (q *spillQueue) Discard() {
+	q.closeWriter()
+	if q.r != nil {
+		q.r.Close()
+		q.r = nil
+	}
+	for _, seq := range q.segs {
+		os.Remove(q.segPath(seq))
+	}
+	q.segs = nil
+	q.roff = 0
+	q.size = 0
+}
+
+// Close closes the queue. The unsent head is written to a new first segment,
+// together with the unread part of the current segment, so that it's sent
+// first and nothing is sent twice when the queue is opened again.
+func (q *spillQueue) Close(head []byte) error {
+	err := q.closeWriter()
+	if len(head) == 0 && q.roff == 0 {
+		if q.r != nil {
+			q.r.Close()
+			q.r = nil
+		}
+		return err
+	}
+	seq := uint64(spillFirstSeq)
+	if len(q.segs) > 0 {
+		seq = q.segs[0] - 1
+	}
+	f, ferr := os.OpenFile(q.segPath(seq), os.O_WRONLY|os.O_CREATE|os.O_EXCL, 0644)
+	if ferr != nil {
+		return ferr
+	}
+	_, ferr = f.Write(head)
+	if ferr == nil && q.r != nil {
+		_, ferr = io.Copy(f, q.r)
+		if ferr == nil {
+			q.r.Close()
+			q.r = nil
+			os.Remove(q.segPath(q.segs[0]))
+			q.segs = q.segs[1:]
+		}
+	}
+	if ferr == nil && q.sync != spillSyncNever {
+		ferr = f.Sync()
+	}
+	if cerr := f.Close(); ferr == nil {
+		ferr = cerr
+	}
+	if ferr != nil {
+		os.Remove(f.Name())
+		return ferr
+	}
+	q.segs = append([]uint64{seq}, q.segs...)
+	if q.r != nil {
+		q.r.Close()
+		q.r = nil
+	}
+	return err
+}
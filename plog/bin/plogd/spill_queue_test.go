@@ -0,0 +1,49 @@
+// Copyright 2018 Schibsted
+
+package main
+
+import (
+	"io/ioutil"
+	"os"
+	"testing"
+)
+
+func TestSpillQueue(t *testing.T) {
+	dir, err := ioutil.TempDir("", "spill")
+	checkFatal(t, err)
+	defer os.RemoveAll(dir)
+
+	q, err := openSpillQueue(dir, 10, 100, spillSyncSegment)
+	checkFatal(t, err)
+	for _, s := range []string{"aaaaaaa\n", "bbbbbbb\n", "ccccccc\n", "ddddddd\n"} {
+		checkFatal(t, q.Write([]byte(s)))
+	}
+	if len(q.segs) != 2 || q.Len() != 32 {
+		t.Fatalf("Unexpected queue %v, %d bytes", q.segs, q.Len())
+	}
+	if err := q.Write(make([]byte, 70)); err != errSpillFull {
+		t.Errorf("Expected errSpillFull, got %v", err)
+	}
+
+	buf := make([]byte, 12)
+	n, err := q.Read(buf)
+	checkFatal(t, err)
+	if string(buf[:n]) != "aaaaaaa\nbbbb" {
+		t.Errorf("Unexpected read %q", buf[:n])
+	}
+	// Put back what wasn't sent.
+	checkFatal(t, q.Close(buf[8:n]))
+
+	q, err = openSpillQueue(dir, 10, 0, spillSyncNever)
+	checkFatal(t, err)
+	checkFatal(t, q.Write([]byte("eeeeeee\n")))
+	data, err := ioutil.ReadAll(q)
+	checkFatal(t, err)
+	if string(data) != "bbbbbbb\nccccccc\nddddddd\neeeeeee\n" {
+		t.Errorf("Unexpected data %q", data)
+	}
+	files, _ := ioutil.ReadDir(dir)
+	if len(files) != 0 || q.Len() != 0 {
+		t.Errorf("Queue not empty after read: %d files, %d bytes", len(files), q.Len())
+	}
+}
@@ -53,7 +53,13 @@ type DataStorage struct {
 	ProgStore map[string]*Storage
 	ProgGroup sync.WaitGroup
 	Output    plogd.OutputWriter
+	// Use the sharded storage engine instead of a goroutine per session.
+	// Must be set before the first session is opened.
+	Sharded   bool
 	dumpEmpty bool
+
+	shardedOnce sync.Once
+	sharded     *shardedStorage
 	// For tests
 	testStatePing chan struct{}
 }
@@ -223,7 +229,7 @@ func sendState(ctx context.Context, dataStore *DataStorage, prog, keyPath string
 	dataStore.Output.WriteMessage(ctx, outMsg)
 }
 
-func updateState(dataStore *DataStorage, progStore *Storage, node map[string]interface{}, stype plogproto.CtxType, key string, value interface{}, confKey string) {
+func updateState(node map[string]interface{}, stype plogproto.CtxType, key string, value interface{}, confKey string) {
 	if value == nil {
 		delete(node, key)
 		return
@@ -236,7 +242,7 @@ func updateState(dataStore *DataStorage, progStore *Storage, node map[string]int
 			node[key] = m
 		}
 		for k, v := range value {
-			updateState(dataStore, progStore, m, stype, k, v, confKey+"."+k)
+			updateState(m, stype, k, v, confKey+"."+k)
 		}
 	case int:
 		if stype == plogproto.CtxType_count {
@@ -245,7 +251,7 @@ func updateState(dataStore *DataStorage, progStore *Storage, node map[string]int
 			}
 			if value == 0 {
 				/* Recurse with a delete. */
-				updateState(dataStore, progStore, node, stype, key, nil, confKey)
+				updateState(node, stype, key, nil, confKey)
 				return
 			}
 		}
@@ -255,9 +261,9 @@ func updateState(dataStore *DataStorage, progStore *Storage, node map[string]int
 	}
 }
 
-func dumpState(ctx context.Context, dataStore *DataStorage, progStore *Storage) {
-	if len(progStore.State) > 0 || dataStore.dumpEmpty {
-		outMsg := plogd.LogMessage{time.Now(), progStore.Prog, "state", progStore.State, nil, "", nil}
+func dumpState(ctx context.Context, dataStore *DataStorage, prog string, state map[string]interface{}) {
+	if len(state) > 0 || dataStore.dumpEmpty {
+		outMsg := plogd.LogMessage{time.Now(), prog, "state", state, nil, "", nil}
 		dataStore.Output.WriteMessage(ctx, outMsg)
 	}
 }
@@ -327,7 +333,7 @@ func progStoreHandler(dataStore *DataStorage, progStore *Storage) {
 				go progStoreMuxer(muxCh, ch)
 			case confKey := <-progStore.sendState:
 				if confKey == "" {
-					dumpState(ctx, dataStore, progStore)
+					dumpState(ctx, dataStore, progStore.Prog, progStore.State)
 				} else {
 					sendForKeyPath(ctx, dataStore, progStore, confKey)
 				}
@@ -347,7 +353,7 @@ func progStoreHandler(dataStore *DataStorage, progStore *Storage) {
 				}
 
 				if inMsg.stype != plogproto.CtxType_log {
-					updateState(dataStore, progStore, progStore.State, inMsg.stype, inMsg.key, inMsg.value, inMsg.key)
+					updateState(progStore.State, inMsg.stype, inMsg.key, inMsg.value, inMsg.key)
 					if dataStore.testStatePing != nil {
 						close(dataStore.testStatePing)
 					}
@@ -374,10 +380,14 @@ cbState:
 		}
 	}
 
-	dumpState(ctx, dataStore, progStore)
+	dumpState(ctx, dataStore, progStore.Prog, progStore.State)
 }
 
 func (store *DataStorage) findOutput(prog string, stype plogproto.CtxType) (SessionOutput, error) {
+	if store.Sharded {
+		return store.shardedStorage().findOutput(prog, stype), nil
+	}
+
 	store.lock.Lock()
 	defer store.lock.Unlock()
 
@@ -440,6 +450,10 @@ var (
 // err will be one of:
 // ErrorProgNotFound, ErrorTooManyConcurrentRequests
 func (store *DataStorage) CallbackState(prog string, cb func(map[string]interface{})) (bool, error) {
+	if store.Sharded {
+		return store.shardedStorage().callbackState(prog, cb)
+	}
+
 	store.lock.Lock()
 	defer store.lock.Unlock()
 
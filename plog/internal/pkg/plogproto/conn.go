@@ -9,6 +9,7 @@ import (
 	"io"
 	"net"
 	"net/url"
+	"os"
 	"sync"
 
 	proto "github.com/golang/protobuf/proto"
@@ -19,13 +20,19 @@ import (
 const (
 	// DefaultSock is the default path to listen on / connect to.
 	DefaultSock = "/run/plog/plog.sock"
+
+	// SeqpacketSize is the largest packet read on seqpacket connections.
+	// Frames larger than this are split over several packets by plog.c.
+	SeqpacketSize = 4096
 )
 
 // Listener is a convenience listener type. Set seqpacket to true in case
-// that's the socket type used.
+// that's the socket type used. Set ShmSize to hand out shared memory rings
+// of that size to clients asking for them, see shm.go.
 type Listener struct {
 	net.Listener
 	Seqpacket bool
+	ShmSize   int
 }
 
 // Accept on the contained listener and wrap the returned connection.
@@ -34,12 +41,17 @@ func (l Listener) Accept() (*Reader, error) {
 	if err != nil {
 		return nil, err
 	}
-	return NewReader(c, l.Seqpacket), nil
+	r := NewReader(c, l.Seqpacket)
+	r.ShmSize = l.ShmSize
+	return r, nil
 }
 
 // NewClientConn parses sock either as a URL or a path and opens a connection
 // there.  If sock is empty string the DefaultSock value is used.
 // The underlying WriteCloser can be cast to net.Conn if necessary.
+// If the PLOG_SHM environment variable is set and the scheme is unix, a
+// shared memory ring is requested from the server, using the plain
+// connection if that fails.
 func NewClientConn(sock string) (*Writer, error) {
 	surl, err := url.Parse(sock)
 	if err != nil {
@@ -60,6 +72,11 @@ func NewClientConn(sock string) (*Writer, error) {
 	case "tcp", "tcp4", "tcp6":
 		conn, err = net.Dial(surl.Scheme, surl.Host)
 	case "unix", "unixpacket":
+		if surl.Scheme == "unix" && os.Getenv("PLOG_SHM") != "" {
+			if w, err := dialShm(surl.Path); err == nil {
+				return w, nil
+			}
+		}
 		conn, err = net.Dial(surl.Scheme, surl.Path)
 	default:
 		return nil, fmt.Errorf("Bad scheme in PLOG_SOCKET url")
@@ -72,27 +89,71 @@ type Reader struct {
 	br *bufio.Reader
 	io.Closer
 	Seqpacket bool
+	// ShmSize is the size of the shared memory ring handed out if the
+	// client asks for one. Zero to refuse.
+	ShmSize int
+
+	rc       io.ReadCloser
+	received bool
+	shmLock  sync.Mutex
+	shm      *shmConsumer
 }
 
 // NewReader creates a new reader for plog messages.
 func NewReader(rc io.ReadCloser, seqpacket bool) *Reader {
-	return &Reader{bufio.NewReader(rc), rc, seqpacket}
+	// With seqpacket each read returns at most a packet, the rest of it is
+	// lost if the buffer is too small.
+	return &Reader{br: bufio.NewReaderSize(rc, SeqpacketSize), Closer: rc, Seqpacket: seqpacket, rc: rc}
 }
 
-// Receive overwrites *msg with a message received from the connection.
-func (r *Reader) Receive(msg *Plog) error {
+func (r *Reader) readFrame() ([]byte, error) {
 	var l uint32
 	if err := binary.Read(r.br, binary.BigEndian, &l); err != nil {
-		return err
+		return nil, err
 	}
 	data := make([]byte, l)
 	_, err := io.ReadFull(r.br, data)
+	if err != nil {
+		return nil, err
+	}
+	return data, nil
+}
+
+// Receive overwrites *msg with a message received from the connection.
+func (r *Reader) Receive(msg *Plog) error {
+	if r.shm != nil {
+		return r.shm.receive(func(data []byte) error {
+			return proto.Unmarshal(data, msg)
+		})
+	}
+	data, err := r.readFrame()
 	if err != nil {
 		return err
 	}
+	if !r.received {
+		r.received = true
+		// A zero length first frame asks for shared memory.
+		if len(data) == 0 {
+			if err := r.serveShm(); err != nil {
+				return err
+			}
+			return r.Receive(msg)
+		}
+	}
 	return proto.Unmarshal(data, msg)
 }
 
+// Close the connection and the shared memory ring, if any. Can be called
+// while another goroutine is in Receive.
+func (r *Reader) Close() error {
+	r.shmLock.Lock()
+	if r.shm != nil {
+		r.shm.Close()
+	}
+	r.shmLock.Unlock()
+	return r.Closer.Close()
+}
+
 // Writer for sending plog messages.
 // Has closer for easier use.
 type Writer struct {
@@ -100,6 +161,8 @@ type Writer struct {
 	io.Closer
 	Seqpacket bool
 	sync.Mutex
+
+	shm *shmProducer
 }
 
 // NewWriter creates a new writer for plog messages.
@@ -114,15 +177,24 @@ func (w *Writer) Send(msg *Plog) error {
 		return err
 	}
 
-	// Use a simple len prefix.
+	if w.shm != nil {
+		return w.sendShm(data)
+	}
+
 	w.Lock()
 	defer w.Unlock()
+	return w.writeFrame(data)
+}
+
+// writeFrame writes data on the connection. Must be called with the lock held.
+func (w *Writer) writeFrame(data []byte) error {
+	// Use a simple len prefix.
 	l := uint32(len(data))
 	if err := binary.Write(w.bw, binary.BigEndian, l); err != nil {
 		return err
 	}
 	// bufio.Writer always write all or return an error.
-	_, err = w.bw.Write(data)
+	_, err := w.bw.Write(data)
 	if err != nil {
 		return err
 	}
@@ -130,6 +202,14 @@ func (w *Writer) Send(msg *Plog) error {
 	return w.bw.Flush()
 }
 
+// Close the connection and the shared memory ring, if any.
+func (w *Writer) Close() error {
+	if w.shm != nil {
+		w.shm.Close()
+	}
+	return w.Closer.Close()
+}
+
 // SendOpen is a convenience wrapper for sending only the open message.
 func (w *Writer) SendOpen(ctxID uint64, msg *OpenContext) error {
 	return w.Send(&Plog{CtxId: &ctxID, Open: msg})
@@ -0,0 +1,325 @@
+// Copyright 2018 Schibsted
+
+package plogproto
+
+import (
+	"errors"
+	"io"
+	"os"
+	"sync"
+	"sync/atomic"
+	"time"
+	"unsafe"
+)
+
+// Shared memory transport.
+//
+// A client asks for a shared memory ring by sending a zero length frame as
+// the first thing on a new unix stream connection. The server replies with
+// shmReplyOK and two fds, the ring and an eventfd, or with shmReplyNo to keep
+// using the socket. Older servers close the connection instead.
+//
+// The ring is a header page followed by the data area, which is a power of
+// two in size. Producers reserve space by advancing reserve with compare and
+// swap, and commit a record by storing its header last. The consumer reads at
+// tail and clears what it has read, so uncommitted space is always zero.
+// Records are an 8 byte header, where the low 32 bits are the length and the
+// high 32 bits the flags, followed by the encoded plog message padded to 8
+// bytes. When a record doesn't fit before the end of the ring, a pad record
+// fills up the rest. Messages too large for the ring are sent as frames on
+// the socket, with a socket record marking their place in the ring.
+//
+// When the consumer runs out of records it sets sleeping and waits on the
+// eventfd, which producers write to after committing if sleeping is set.
+// The consumer sets closed when it stops reading.
+//
+// The C client in plog/lib/plog.c uses the same format.
+const (
+	shmMagic   = 0x53474c50 // "PLGS"
+	shmVersion = 1
+
+	shmHdrSize     = 4096
+	shmOffMagic    = 0
+	shmOffVersion  = 4
+	shmOffSize     = 8
+	shmOffReserve  = 64
+	shmOffTail     = 128
+	shmOffSleeping = 192
+	shmOffClosed   = 256
+
+	shmRecHdrSize   = 8
+	shmRecPad       = 1 << 0
+	shmRecSocket    = 1 << 1
+	shmRecCommitted = 1 << 31
+
+	// DefaultShmSize is the default size of the data area of the rings
+	// handed out by the server.
+	DefaultShmSize = 4 << 20
+)
+
+var (
+	shmReplyOK = []byte("PLOGSHM1")
+	shmReplyNo = []byte("PLOGSOCK")
+
+	errShmUnsupported = errors.New("shared memory transport not supported")
+	errShmClosed      = errors.New("shared memory ring closed")
+)
+
+type shmRing struct {
+	mem  []byte
+	data []byte
+	mask uint64
+	efd  *os.File
+}
+
+func (r *shmRing) u64(off uint64) *uint64 {
+	return (*uint64)(unsafe.Pointer(&r.mem[off]))
+}
+
+func (r *shmRing) u32(off uint64) *uint32 {
+	return (*uint32)(unsafe.Pointer(&r.mem[off]))
+}
+
+func (r *shmRing) rec(pos uint64) *uint64 {
+	return (*uint64)(unsafe.Pointer(&r.data[pos&r.mask]))
+}
+
+func (r *shmRing) init(mem []byte) error {
+	r.mem = mem
+	if len(mem) < shmHdrSize {
+		return errShmUnsupported
+	}
+	size := atomic.LoadUint64(r.u64(shmOffSize))
+	if atomic.LoadUint32(r.u32(shmOffMagic)) != shmMagic || atomic.LoadUint32(r.u32(shmOffVersion)) != shmVersion ||
+		size == 0 || size&(size-1) != 0 || uint64(len(mem)) < shmHdrSize+size {
+		return errShmUnsupported
+	}
+	r.data = mem[shmHdrSize : shmHdrSize+size]
+	r.mask = size - 1
+	return nil
+}
+
+func (r *shmRing) wake() {
+	var one = [8]byte{1}
+	r.efd.Write(one[:])
+}
+
+func shmAlign(l uint64) uint64 {
+	return (l + shmRecHdrSize - 1) &^ (shmRecHdrSize - 1)
+}
+
+// Consumer side, used by Reader.
+type shmConsumer struct {
+	shmRing
+	frames chan []byte
+	done   chan struct{}
+
+	closeOnce sync.Once
+	closed    chan struct{}
+}
+
+func (c *shmConsumer) ready() bool {
+	tail := atomic.LoadUint64(c.u64(shmOffTail))
+	return atomic.LoadUint64(c.rec(tail))&(shmRecCommitted<<32) != 0
+}
+
+func (c *shmConsumer) wait() error {
+	sleeping := c.u32(shmOffSleeping)
+	atomic.StoreUint32(sleeping, 1)
+	defer atomic.StoreUint32(sleeping, 0)
+	if c.ready() {
+		return nil
+	}
+	select {
+	case <-c.closed:
+		return errShmClosed
+	case <-c.done:
+		if !c.ready() {
+			return io.EOF
+		}
+		return nil
+	default:
+	}
+	// The timeout is only a safety net, producers wake us up.
+	c.efd.SetReadDeadline(time.Now().Add(100 * time.Millisecond))
+	var buf [8]byte
+	_, err := c.efd.Read(buf[:])
+	if err != nil && !os.IsTimeout(err) {
+		select {
+		case <-c.closed:
+			return errShmClosed
+		default:
+		}
+		return err
+	}
+	return nil
+}
+
+// receive calls f with the next message, either from the ring or the socket.
+// The data passed is only valid during the call.
+func (c *shmConsumer) receive(f func(data []byte) error) error {
+	tailp := c.u64(shmOffTail)
+	for {
+		tail := atomic.LoadUint64(tailp)
+		hdr := atomic.LoadUint64(c.rec(tail))
+		if hdr&(shmRecCommitted<<32) == 0 {
+			if err := c.wait(); err != nil {
+				return err
+			}
+			continue
+		}
+		l := uint64(uint32(hdr))
+		flags := uint32(hdr >> 32)
+		off := tail & c.mask
+		reclen := shmAlign(shmRecHdrSize + l)
+
+		var err error
+		switch {
+		case flags&shmRecPad != 0:
+		case flags&shmRecSocket != 0:
+			select {
+			case data, ok := <-c.frames:
+				if !ok {
+					err = io.ErrUnexpectedEOF
+				} else {
+					err = f(data)
+				}
+			case <-c.closed:
+				err = errShmClosed
+			}
+		default:
+			err = f(c.data[off+shmRecHdrSize : off+shmRecHdrSize+l])
+		}
+
+		rec := c.data[off : off+reclen]
+		for i := range rec {
+			rec[i] = 0
+		}
+		atomic.StoreUint64(tailp, tail+reclen)
+		if flags&shmRecPad == 0 {
+			return err
+		}
+	}
+}
+
+// readSocket passes frames read from the socket to receive, until EOF.
+func (c *shmConsumer) readSocket(r *Reader) {
+	defer c.wake()
+	defer close(c.done)
+	defer close(c.frames)
+	for {
+		data, err := r.readFrame()
+		if err != nil {
+			return
+		}
+		select {
+		case c.frames <- data:
+		case <-c.closed:
+			return
+		}
+	}
+}
+
+func (c *shmConsumer) Close() error {
+	c.closeOnce.Do(func() {
+		atomic.StoreUint32(c.u32(shmOffClosed), 1)
+		close(c.closed)
+		c.efd.Close()
+	})
+	return nil
+}
+
+// refuseShm tells the client to keep using the socket.
+func (r *Reader) refuseShm() error {
+	w, ok := r.rc.(io.Writer)
+	if !ok {
+		return errShmUnsupported
+	}
+	_, err := w.Write(shmReplyNo)
+	return err
+}
+
+// Producer side, used by Writer.
+type shmProducer struct {
+	shmRing
+	dead int32
+}
+
+// watch marks the ring as dead once the server closes the connection. The
+// server doesn't write anything after the handshake.
+func (p *shmProducer) watch(conn io.Reader) {
+	var buf [1]byte
+	conn.Read(buf[:])
+	atomic.StoreInt32(&p.dead, 1)
+}
+
+func (p *shmProducer) alive() bool {
+	return atomic.LoadInt32(&p.dead) == 0 && atomic.LoadUint32(p.u32(shmOffClosed)) == 0
+}
+
+// maxInline is the largest message written to the ring.
+func (p *shmProducer) maxInline() int {
+	return int(p.mask+1) / 4
+}
+
+func (p *shmProducer) commit(pos uint64, l int, flags uint32) {
+	atomic.StoreUint64(p.rec(pos), uint64(l)|uint64(flags|shmRecCommitted)<<32)
+}
+
+// write adds a record with data to the ring, waiting for space if needed.
+func (p *shmProducer) write(data []byte, flags uint32) error {
+	need := shmAlign(shmRecHdrSize + uint64(len(data)))
+	size := p.mask + 1
+	reservep := p.u64(shmOffReserve)
+	tailp := p.u64(shmOffTail)
+	for {
+		if !p.alive() {
+			return errShmClosed
+		}
+		pos := atomic.LoadUint64(reservep)
+		tail := atomic.LoadUint64(tailp)
+		contig := size - pos&p.mask
+		want := need
+		if need > contig {
+			want += contig
+		}
+		if pos+want-tail > size {
+			p.wake()
+			time.Sleep(50 * time.Microsecond)
+			continue
+		}
+		if !atomic.CompareAndSwapUint64(reservep, pos, pos+want) {
+			continue
+		}
+		if need > contig {
+			p.commit(pos, int(contig-shmRecHdrSize), shmRecPad)
+			pos += contig
+		}
+		off := pos & p.mask
+		copy(p.data[off+shmRecHdrSize:], data)
+		p.commit(pos, len(data), flags)
+		if atomic.LoadUint32(p.u32(shmOffSleeping)) != 0 {
+			p.wake()
+		}
+		return nil
+	}
+}
+
+func (p *shmProducer) Close() error {
+	atomic.StoreInt32(&p.dead, 1)
+	return p.efd.Close()
+}
+
+// sendShm writes data on the ring, or on the socket with a marker in the
+// ring if it's too large.
+func (w *Writer) sendShm(data []byte) error {
+	if len(data) <= w.shm.maxInline() {
+		return w.shm.write(data, 0)
+	}
+	w.Lock()
+	defer w.Unlock()
+	if err := w.writeFrame(data); err != nil {
+		return err
+	}
+	return w.shm.write(nil, shmRecSocket)
+}
@@ -0,0 +1,174 @@
+// Copyright 2018 Schibsted
+
+package plogproto
+
+import (
+	"bytes"
+	"io/ioutil"
+	"net"
+	"os"
+	"runtime"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+func newEventfd() (int, error) {
+	fd, _, errno := syscall.RawSyscall(syscall.SYS_EVENTFD2, 0, syscall.O_CLOEXEC|syscall.O_NONBLOCK, 0)
+	if errno != 0 {
+		return -1, errno
+	}
+	return int(fd), nil
+}
+
+func shmDir() string {
+	if st, err := os.Stat("/dev/shm"); err == nil && st.IsDir() {
+		return "/dev/shm"
+	}
+	return os.TempDir()
+}
+
+// newShmConsumer creates a ring with a data area of at least size bytes.
+// Returns the unlinked file backing it and the eventfd, to be sent to the
+// client.
+func newShmConsumer(size int) (*shmConsumer, *os.File, int, error) {
+	sz := uint64(64 << 10)
+	for sz < uint64(size) {
+		sz <<= 1
+	}
+	f, err := ioutil.TempFile(shmDir(), "plog-shm-")
+	if err != nil {
+		return nil, nil, -1, err
+	}
+	os.Remove(f.Name())
+	if err := f.Truncate(int64(shmHdrSize + sz)); err != nil {
+		f.Close()
+		return nil, nil, -1, err
+	}
+	mem, err := syscall.Mmap(int(f.Fd()), 0, int(shmHdrSize+sz), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		f.Close()
+		return nil, nil, -1, err
+	}
+	efd, err := newEventfd()
+	if err != nil {
+		syscall.Munmap(mem)
+		f.Close()
+		return nil, nil, -1, err
+	}
+
+	c := &shmConsumer{
+		frames: make(chan []byte),
+		done:   make(chan struct{}),
+		closed: make(chan struct{}),
+	}
+	c.mem = mem
+	atomic.StoreUint64(c.u64(shmOffSize), sz)
+	atomic.StoreUint32(c.u32(shmOffVersion), shmVersion)
+	atomic.StoreUint32(c.u32(shmOffMagic), shmMagic)
+	c.init(mem)
+	c.efd = os.NewFile(uintptr(efd), "plog-eventfd")
+	runtime.SetFinalizer(c, func(c *shmConsumer) {
+		syscall.Munmap(c.mem)
+	})
+	return c, f, efd, nil
+}
+
+// serveShm answers a request for a shared memory ring.
+func (r *Reader) serveShm() error {
+	uc, ok := r.rc.(*net.UnixConn)
+	if !ok || r.Seqpacket || r.ShmSize <= 0 {
+		return r.refuseShm()
+	}
+	c, f, efd, err := newShmConsumer(r.ShmSize)
+	if err != nil {
+		return r.refuseShm()
+	}
+	_, _, err = uc.WriteMsgUnix(shmReplyOK, syscall.UnixRights(int(f.Fd()), efd), nil)
+	f.Close()
+	if err != nil {
+		c.Close()
+		return err
+	}
+	r.shmLock.Lock()
+	r.shm = c
+	r.shmLock.Unlock()
+	go c.readSocket(r)
+	return nil
+}
+
+// dialShm connects to path and asks for a shared memory ring. Returns a
+// plain writer if the server refuses.
+func dialShm(path string) (*Writer, error) {
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{Name: path, Net: "unix"})
+	if err != nil {
+		return nil, err
+	}
+	w, err := requestShm(conn)
+	if err != nil {
+		conn.Close()
+		return nil, err
+	}
+	return w, nil
+}
+
+func requestShm(conn *net.UnixConn) (*Writer, error) {
+	if _, err := conn.Write(make([]byte, 4)); err != nil {
+		return nil, err
+	}
+	reply := make([]byte, len(shmReplyOK))
+	oob := make([]byte, syscall.CmsgSpace(2*4))
+	conn.SetReadDeadline(time.Now().Add(time.Second))
+	n, oobn, _, _, err := conn.ReadMsgUnix(reply, oob)
+	conn.SetReadDeadline(time.Time{})
+	if err != nil {
+		return nil, err
+	}
+	var fds []int
+	if cmsgs, err := syscall.ParseSocketControlMessage(oob[:oobn]); err == nil {
+		for i := range cmsgs {
+			if rights, err := syscall.ParseUnixRights(&cmsgs[i]); err == nil {
+				fds = append(fds, rights...)
+			}
+		}
+	}
+	if !bytes.Equal(reply[:n], shmReplyOK) || len(fds) != 2 {
+		for _, fd := range fds {
+			syscall.Close(fd)
+		}
+		if bytes.Equal(reply[:n], shmReplyNo) {
+			return NewWriter(conn, false), nil
+		}
+		return nil, errShmUnsupported
+	}
+
+	memfd, efd := fds[0], fds[1]
+	var st syscall.Stat_t
+	err = syscall.Fstat(memfd, &st)
+	var mem []byte
+	if err == nil {
+		mem, err = syscall.Mmap(memfd, 0, int(st.Size), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	}
+	syscall.Close(memfd)
+	if err != nil {
+		syscall.Close(efd)
+		return nil, err
+	}
+	p := &shmProducer{}
+	if err := p.init(mem); err != nil {
+		syscall.Munmap(mem)
+		syscall.Close(efd)
+		return nil, err
+	}
+	syscall.CloseOnExec(efd)
+	syscall.SetNonblock(efd, true)
+	p.efd = os.NewFile(uintptr(efd), "plog-eventfd")
+	runtime.SetFinalizer(p, func(p *shmProducer) {
+		syscall.Munmap(p.mem)
+	})
+
+	w := NewWriter(conn, false)
+	w.shm = p
+	go p.watch(conn)
+	return w, nil
+}
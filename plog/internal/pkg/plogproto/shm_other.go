@@ -0,0 +1,14 @@
+// Copyright 2018 Schibsted
+
+//go:build !linux
+// +build !linux
+
+package plogproto
+
+func (r *Reader) serveShm() error {
+	return r.refuseShm()
+}
+
+func dialShm(path string) (*Writer, error) {
+	return nil, errShmUnsupported
+}
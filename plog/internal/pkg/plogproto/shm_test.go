@@ -0,0 +1,141 @@
+// Copyright 2018 Schibsted
+
+package plogproto
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"net"
+	"os"
+	"path/filepath"
+	"sync"
+	"testing"
+)
+
+func testShmListen(t *testing.T, shmSize int) (string, chan *Reader, func()) {
+	dir, err := ioutil.TempDir("", "plogshm")
+	if err != nil {
+		t.Fatal(err)
+	}
+	path := filepath.Join(dir, "plog.sock")
+	l, err := net.Listen("unix", path)
+	if err != nil {
+		os.RemoveAll(dir)
+		t.Fatal(err)
+	}
+	ch := make(chan *Reader, 1)
+	go func() {
+		pl := Listener{Listener: l, ShmSize: shmSize}
+		for {
+			r, err := pl.Accept()
+			if err != nil {
+				close(ch)
+				return
+			}
+			ch <- r
+		}
+	}()
+	os.Setenv("PLOG_SHM", "1")
+	return path, ch, func() {
+		os.Unsetenv("PLOG_SHM")
+		l.Close()
+		os.RemoveAll(dir)
+	}
+}
+
+// testShmTraffic sends from several goroutines, including messages too
+// large for the ring, and checks that they're all received in order.
+// The handshake needs the server to be receiving, so that's done while
+// connecting.
+func testShmTraffic(t *testing.T, path string, ch chan *Reader, shm bool) {
+	const writers = 4
+	const n = 2000
+	large := bytes.Repeat([]byte("x"), 100<<10)
+
+	recvErr := make(chan error, 1)
+	rch := make(chan *Reader, 1)
+	go func() {
+		r := <-ch
+		rch <- r
+		var next [writers]int
+		var msg Plog
+		for i := 0; i < writers*n; i++ {
+			if err := r.Receive(&msg); err != nil {
+				recvErr <- err
+				return
+			}
+			id := msg.GetCtxId() - 1
+			if id >= writers || len(msg.Msg) != 1 {
+				recvErr <- fmt.Errorf("unexpected message %v", msg)
+				return
+			}
+			j := next[id]
+			next[id]++
+			if l := len(msg.Msg[0].Value); (j%500 == 0) != (l == len(large)) {
+				recvErr <- fmt.Errorf("writer %d message %d has length %d", id, j, l)
+				return
+			}
+		}
+		recvErr <- nil
+	}()
+
+	w, err := NewClientConn(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer w.Close()
+	if (w.shm != nil) != shm {
+		t.Fatalf("expected shared memory %v", shm)
+	}
+	r := <-rch
+	defer r.Close()
+
+	var wg sync.WaitGroup
+	for i := 0; i < writers; i++ {
+		wg.Add(1)
+		go func(id uint64) {
+			defer wg.Done()
+			for j := 0; j < n; j++ {
+				value := []byte("value")
+				if j%500 == 0 {
+					value = large
+				}
+				if err := w.SendKeyValue(id, "k", value); err != nil {
+					t.Error(err)
+					return
+				}
+			}
+		}(uint64(i + 1))
+	}
+	if err := <-recvErr; err != nil {
+		t.Fatal(err)
+	}
+	wg.Wait()
+
+	if !shm {
+		return
+	}
+	// Writes fail once the server is gone.
+	r.Close()
+	for i := 0; ; i++ {
+		if w.SendKeyValue(1, "k", []byte("v")) != nil {
+			break
+		}
+		if i > 1e6 {
+			t.Fatal("expected send to fail")
+		}
+	}
+}
+
+func TestShm(t *testing.T) {
+	path, ch, cleanup := testShmListen(t, 64<<10)
+	defer cleanup()
+	testShmTraffic(t, path, ch, true)
+}
+
+func TestShmRefused(t *testing.T) {
+	path, ch, cleanup := testShmListen(t, 0)
+	defer cleanup()
+	testShmTraffic(t, path, ch, false)
+}
@@ -23,13 +23,14 @@
 
 #include "plog.h"
 #include "logging.h"
+#include "sbp/buf_string.h"
 #include "sbp/memalloc_functions.h"
 
 static struct {
-	int level;
 	bool use_plog;
 	char appname[256];
-} _log = { -1, true };
+} _log = { true };
+int log_current_level = -1;
 static pthread_key_t log_tsd;
 static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
 
@@ -86,7 +87,7 @@ logging_plog_ctx(void) {
 		int save_errno = errno;
 		pthread_mutex_lock(&logging_ctx_lock);
 		if (!logging_ctx)
-			logging_ctx = plog_open_log(NULL, _log.appname);
+			logging_ctx = plog_open_log_flags(NULL, _log.appname, PLOG_NO_SAMPLING);
 		pthread_mutex_unlock(&logging_ctx_lock);
 		errno = save_errno;
 	}
@@ -94,13 +95,13 @@ logging_plog_ctx(void) {
 }
 
 int
-vlog_printf(int level, const char *fmt, va_list ap) {
+(vlog_printf)(int level, const char *fmt, va_list ap) {
 	int res = 0;
 	char *ptr;
 	char *log_string = NULL;
 	char *logfmt;
 
-	if (level > _log.level)
+	if (level > log_current_level)
 		return 0;
 
 	log_string = pthread_getspecific(log_tsd);
@@ -123,16 +124,73 @@ vlog_printf(int level, const char *fmt, va_list ap) {
 }
 
 int
-log_printf(int level, const char *fmt, ...) {
+(log_printf)(int level, const char *fmt, ...) {
 	va_list ap;
 
 	va_start(ap, fmt);
-	int res = vlog_printf(level, fmt, ap);
+	int res = (vlog_printf)(level, fmt, ap);
 	va_end(ap);
 
 	return res;
 }
 
+static void
+log_kv_syslog(int level, const char *log_string, const char *msg, const struct log_kv *kvs, size_t nkvs) {
+	struct buf_string buf = {};
+
+	if (log_string)
+		bscat(&buf, "(%s): ", log_string);
+	bswrite(&buf, msg, strlen(msg));
+	for (size_t i = 0 ; i < nkvs ; i++) {
+		switch (kvs[i].type) {
+		case LOG_KV_STRING:
+			bscat(&buf, " %s=%s", kvs[i].key, kvs[i].v.s ?: "(null)");
+			break;
+		case LOG_KV_INT:
+			bscat(&buf, " %s=%d", kvs[i].key, kvs[i].v.i);
+			break;
+		case LOG_KV_BOOL:
+			bscat(&buf, " %s=%s", kvs[i].key, kvs[i].v.b ? "true" : "false");
+			break;
+		}
+	}
+	syslog(level, "%s", buf.buf);
+	free(buf.buf);
+}
+
+void
+log_kv_array(int level, const char *msg, const struct log_kv *kvs, size_t nkvs) {
+	if (level > log_current_level)
+		return;
+
+	const char *log_string = pthread_getspecific(log_tsd);
+
+	if (!_log.use_plog) {
+		log_kv_syslog(level, log_string, msg, kvs, nkvs);
+		return;
+	}
+
+	/* Buffered, so that the whole dictionary is sent as a single message on close. */
+	struct plog_ctx *ctx = plog_open_dict_flags(logging_plog_ctx(), level_name(level), PLOG_BUFFERED);
+	if (log_string)
+		plog_string(ctx, "thread", log_string);
+	plog_string(ctx, "message", msg);
+	for (size_t i = 0 ; i < nkvs ; i++) {
+		switch (kvs[i].type) {
+		case LOG_KV_STRING:
+			plog_string(ctx, kvs[i].key, kvs[i].v.s);
+			break;
+		case LOG_KV_INT:
+			plog_int(ctx, kvs[i].key, kvs[i].v.i);
+			break;
+		case LOG_KV_BOOL:
+			plog_bool(ctx, kvs[i].key, kvs[i].v.b);
+			break;
+		}
+	}
+	plog_close(ctx);
+}
+
 void
 log_backtrace(int level, int skip) {
 	void *btbuf[50];
@@ -186,7 +244,7 @@ log_register_thread(const char *fmt, ...) {
 
 int
 log_level(void) {
-	return _log.level;
+	return log_current_level;
 }
 
 static int
@@ -194,7 +252,7 @@ log_setup_options(const char *appname, const char *level, int options) {
 
 	pthread_once(&log_key_once, log_thread_once);
 
-	_log.level = get_priority_from_level(level, LOG_INFO);
+	log_current_level = get_priority_from_level(level, LOG_INFO);
 	strlcpy(_log.appname, appname, sizeof(_log.appname));
 
 	openlog(_log.appname, options, LOG_LOCAL0);
@@ -239,8 +297,8 @@ log_enable_plog(bool enable) {
 
 void
 log_change_level(const char *level, const char **oldl, const char **newl) {
-	*oldl = level_name_lc(_log.level);
+	*oldl = level_name_lc(log_current_level);
 	if (level != NULL)
-		_log.level = get_priority_from_level(level, _log.level);
-	*newl = level_name_lc(_log.level);
+		log_current_level = get_priority_from_level(level, log_current_level);
+	*newl = level_name_lc(log_current_level);
 }
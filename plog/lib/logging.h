@@ -13,6 +13,7 @@ extern "C"
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <syslog.h>
 
 struct plog_ctx *logging_plog_ctx(void);
@@ -22,6 +23,68 @@ int get_priority_from_level(const char* level, int default_priority);
 
 int log_printf(int level, const char* fmt, ...) FORMAT_PRINTF(2, 3) VISIBILITY_HIDDEN;
 int vlog_printf(int level, const char *fmt, va_list ap) FORMAT_PRINTF(2, 0) VISIBILITY_HIDDEN;
+
+/*
+ * Messages with a level above LOG_COMPILE_LEVEL are removed at compile time
+ * by the macros below, when the level is a constant. Define it before
+ * including this file, e.g. to LOG_INFO to drop all debug logging.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+/* Use log_level() instead, this is only for log_enabled. */
+extern int log_current_level VISIBILITY_HIDDEN;
+
+#define log_enabled(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= log_current_level)
+
+/*
+ * Check the level before calling the functions, so that the arguments
+ * aren't evaluated and no va_list is set up for messages that aren't logged.
+ * Use (log_printf)(...) to bypass this.
+ */
+#define log_printf(level, ...) (log_enabled(level) ? (log_printf)(level, __VA_ARGS__) : 0)
+#define vlog_printf(level, fmt, ap) (log_enabled(level) ? (vlog_printf)(level, fmt, ap) : 0)
+
+/*
+ * Structured logging. Logs msg and the key value pairs as a dictionary with
+ * the level name as key, e.g.
+ *
+ * log_kv(LOG_DEBUG, "fd_pool: using existing fd", LOG_KV_STR("peer", peer), LOG_KV_INT("fd", fd));
+ *
+ * The values are encoded directly into the plog message, no format string
+ * is involved. Like log_printf, nothing is evaluated unless the level is
+ * enabled. String values are copied, they only need to be valid during the
+ * call. Without plog, the pairs are appended to msg as key=value for syslog.
+ */
+enum log_kv_type {
+	LOG_KV_STRING,
+	LOG_KV_INT,
+	LOG_KV_BOOL,
+};
+
+struct log_kv {
+	const char *key;
+	enum log_kv_type type;
+	union {
+		const char *s;
+		int i;
+		bool b;
+	} v;
+};
+
+#define LOG_KV_STR(k, val) { .key = (k), .type = LOG_KV_STRING, .v.s = (val) }
+#define LOG_KV_INT(k, val) { .key = (k), .type = LOG_KV_INT, .v.i = (val) }
+#define LOG_KV_BOOL(k, val) { .key = (k), .type = LOG_KV_BOOL, .v.b = (val) }
+
+#define log_kv(level, msg, ...) do { \
+		if (log_enabled(level)) { \
+			const struct log_kv _log_kvs[] = { __VA_ARGS__ }; \
+			log_kv_array(level, msg, _log_kvs, sizeof(_log_kvs) / sizeof(_log_kvs[0])); \
+		} \
+	} while (0)
+
+void log_kv_array(int level, const char *msg, const struct log_kv *kvs, size_t nkvs) VISIBILITY_HIDDEN;
 void log_backtrace(int level, int skip) VISIBILITY_HIDDEN;
 
 int log_setup(const char *appname, const char *level) VISIBILITY_HIDDEN;
@@ -14,14 +14,17 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -34,6 +37,20 @@ struct plog_conn {
 	uint64_t refs;
 	uint64_t generation;
 	time_t last_reconnect;
+
+	struct plog_async *async;
+	bool seqpacket;
+
+	/* Held for reading while writing to shm, for writing when replacing it. */
+	pthread_rwlock_t shm_lock;
+	struct plog_shm *shm;
+};
+
+/* Growing buffer, reused between sends. */
+struct plog_wbuf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
 };
 
 struct plog_ctx {
@@ -52,11 +69,17 @@ struct plog_ctx {
 	int flags;
 	int failed_writes;
 
-	Plogproto__Plog buffer;
-	size_t msgalloced;
+	/* Encoded open_context, sent along with the next messages when pending. */
+	struct plog_wbuf open;
+	bool open_pending;
+	bool close_pending;
+
+	/* Encoded plog_message fields not yet sent. */
+	struct plog_wbuf msgs;
+	size_t n_msg;
 };
 
-struct plog_conn plog_default_conn = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct plog_conn plog_default_conn = { .lock = PTHREAD_MUTEX_INITIALIZER, .shm_lock = PTHREAD_RWLOCK_INITIALIZER };
 static uint64_t plog_ctx_id;
 
 static enum plog_charset plog_charset;
@@ -66,57 +89,1094 @@ plog_set_global_charset(enum plog_charset cs) {
 	plog_charset = cs;
 }
 
+static bool
+plog_writev_all(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+/*
+ * On SOCK_SEQPACKET connections the frames are still a byte stream, but
+ * plogd reads each packet into a buffer of PLOG_SEQPACKET_MAX bytes, so
+ * they're cut into packets of at most that size, without regard to frame
+ * boundaries. All the packets are sent with sendmmsg, so a batch of small
+ * messages from the async flusher costs a syscall per PLOG_MMSG_MAX packets.
+ */
+#define PLOG_SEQPACKET_MAX 4096
+#define PLOG_MMSG_MAX 64
+#define PLOG_MMSG_IOV 64
+
+static bool
+plog_sendmmsg_all(int fd, const struct iovec *iov, int iovcnt) {
+	struct mmsghdr msgs[PLOG_MMSG_MAX];
+	struct iovec piov[PLOG_MMSG_MAX][PLOG_MMSG_IOV];
+	int idx = 0;
+	size_t off = 0;
+
+	while (1) {
+		int nmsg = 0;
+		while (nmsg < PLOG_MMSG_MAX) {
+			/* Empty packets would be read as EOF. */
+			while (idx < iovcnt && off == iov[idx].iov_len) {
+				idx++;
+				off = 0;
+			}
+			if (idx == iovcnt)
+				break;
+
+			struct msghdr *mh = &msgs[nmsg].msg_hdr;
+			size_t room = PLOG_SEQPACKET_MAX;
+			memset(mh, 0, sizeof(*mh));
+			mh->msg_iov = piov[nmsg];
+			while (room > 0 && idx < iovcnt && mh->msg_iovlen < PLOG_MMSG_IOV) {
+				size_t l = iov[idx].iov_len - off;
+				if (l > room)
+					l = room;
+				if (l > 0) {
+					piov[nmsg][mh->msg_iovlen++] = (struct iovec){ (char *)iov[idx].iov_base + off, l };
+					room -= l;
+					off += l;
+				}
+				if (off == iov[idx].iov_len) {
+					idx++;
+					off = 0;
+				}
+			}
+			nmsg++;
+		}
+		if (nmsg == 0)
+			return true;
+
+		for (int sent = 0 ; sent < nmsg ; ) {
+			int n = sendmmsg(fd, msgs + sent, nmsg - sent, 0);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			sent += n;
+		}
+	}
+}
+
+/*
+ * Shared memory transport, used when PLOG_SHM is set in the environment.
+ * Right after connecting, a zero length frame asks plogd for a ring. It
+ * answers PLOGSHM1 with the ring and an eventfd passed along, or PLOGSOCK to
+ * keep using the socket. Older versions close the connection, in which case
+ * we connect again without asking.
+ *
+ * The ring is a header page followed by a power of two sized data area.
+ * Writers reserve space with a compare and swap on reserve and commit records
+ * by storing their header last, so there's no lock between them. plogd reads
+ * from tail and clears what it has read. Records are a 64 bit header, length
+ * in the low half and flags in the high half, followed by the message without
+ * the length prefix, padded to 8 bytes. Pad records skip to the start of the
+ * ring. Messages larger than a quarter of the ring are written to the socket,
+ * with a socket record marking their place.
+ * plogd sets sleeping before waiting on the eventfd, and closed when it stops
+ * reading. The format is documented further in plogproto/shm.go.
+ */
+#define PLOG_SHM_MAGIC 0x53474c50
+#define PLOG_SHM_VERSION 1
+#define PLOG_SHM_HDR_SIZE 4096
+#define PLOG_SHM_OFF_MAGIC 0
+#define PLOG_SHM_OFF_VERSION 4
+#define PLOG_SHM_OFF_SIZE 8
+#define PLOG_SHM_OFF_RESERVE 64
+#define PLOG_SHM_OFF_TAIL 128
+#define PLOG_SHM_OFF_SLEEPING 192
+#define PLOG_SHM_OFF_CLOSED 256
+
+#define PLOG_SHM_REC_PAD       (1U << 0)
+#define PLOG_SHM_REC_SOCKET    (1U << 1)
+#define PLOG_SHM_REC_COMMITTED (1U << 31)
+#define PLOG_SHM_ALIGN(l) (((l) + 7) & ~(uint64_t)7)
+
+#define PLOG_SHM_REPLY_LEN 8
+#define PLOG_SHM_TIMEOUT_MS 1000
+
+struct plog_shm {
+	uint8_t *mem;
+	size_t mapsize;
+	uint8_t *data;
+	uint64_t mask;
+	int efd;
+};
+
+#define PLOG_SHM_U64(shm, off) ((uint64_t *)((shm)->mem + (off)))
+#define PLOG_SHM_U32(shm, off) ((uint32_t *)((shm)->mem + (off)))
+
+static void
+plog_shm_free(struct plog_shm *shm) {
+	if (!shm)
+		return;
+	munmap(shm->mem, shm->mapsize);
+	close(shm->efd);
+	free(shm);
+}
+
+/*
+ * Asks for a ring on a newly connected fd. Returns NULL if we didn't get one,
+ * setting *usable to whether the fd can still be used for plain writes.
+ */
+static struct plog_shm *
+plog_shm_open(int fd, bool *usable) {
+	static const uint8_t request[4];
+	char reply[PLOG_SHM_REPLY_LEN];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} cmsg;
+	struct iovec iov = { reply, sizeof(reply) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf) };
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int fds[2] = { -1, -1 };
+	ssize_t n;
+
+	*usable = false;
+	if (write(fd, request, sizeof(request)) != sizeof(request))
+		return NULL;
+	if (poll(&pfd, 1, PLOG_SHM_TIMEOUT_MS) != 1)
+		return NULL;
+	while ((n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	if (n != sizeof(reply))
+		return NULL;
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh) ; c ; c = CMSG_NXTHDR(&mh, c)) {
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds)))
+			memcpy(fds, CMSG_DATA(c), sizeof(fds));
+	}
+	if (memcmp(reply, "PLOGSHM1", sizeof(reply)) != 0 || fds[0] < 0) {
+		if (fds[0] >= 0) {
+			close(fds[0]);
+			close(fds[1]);
+		}
+		*usable = memcmp(reply, "PLOGSOCK", sizeof(reply)) == 0;
+		return NULL;
+	}
+
+	struct plog_shm *shm = NULL;
+	struct stat st;
+	void *mem = MAP_FAILED;
+	if (fstat(fds[0], &st) == 0 && st.st_size > PLOG_SHM_HDR_SIZE)
+		mem = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (mem == MAP_FAILED) {
+		close(fds[1]);
+		return NULL;
+	}
+
+	shm = zmalloc(sizeof(*shm));
+	shm->mem = mem;
+	shm->mapsize = st.st_size;
+	shm->efd = fds[1];
+	uint64_t size = __atomic_load_n(PLOG_SHM_U64(shm, PLOG_SHM_OFF_SIZE), __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(PLOG_SHM_U32(shm, PLOG_SHM_OFF_MAGIC), __ATOMIC_ACQUIRE) != PLOG_SHM_MAGIC
+			|| __atomic_load_n(PLOG_SHM_U32(shm, PLOG_SHM_OFF_VERSION), __ATOMIC_ACQUIRE) != PLOG_SHM_VERSION
+			|| size == 0 || (size & (size - 1)) || size > shm->mapsize - PLOG_SHM_HDR_SIZE) {
+		plog_shm_free(shm);
+		return NULL;
+	}
+	shm->data = shm->mem + PLOG_SHM_HDR_SIZE;
+	shm->mask = size - 1;
+	return shm;
+}
+
+static void
+plog_shm_wake(struct plog_shm *shm) {
+	uint64_t one = 1;
+	if (write(shm->efd, &one, sizeof(one)) < 0) {
+		/* Nothing to do, the reader times out eventually. */
+	}
+}
+
+/*
+ * Reserves a record of len bytes, waiting for plogd to make room if needed.
+ * Returns NULL if plogd stopped reading, which is noticed by the socket
+ * becoming readable, as it's not written to after the handshake.
+ */
+static uint8_t *
+plog_shm_reserve(struct plog_shm *shm, int fd, size_t len, uint64_t *posp) {
+	uint64_t need = PLOG_SHM_ALIGN(8 + len);
+	uint64_t size = shm->mask + 1;
+	uint64_t *reserve = PLOG_SHM_U64(shm, PLOG_SHM_OFF_RESERVE);
+	uint64_t *tail = PLOG_SHM_U64(shm, PLOG_SHM_OFF_TAIL);
+
+	while (1) {
+		if (__atomic_load_n(PLOG_SHM_U32(shm, PLOG_SHM_OFF_CLOSED), __ATOMIC_ACQUIRE))
+			return NULL;
+		uint64_t pos = __atomic_load_n(reserve, __ATOMIC_ACQUIRE);
+		uint64_t contig = size - (pos & shm->mask);
+		uint64_t want = need > contig ? need + contig : need;
+		if (pos + want - __atomic_load_n(tail, __ATOMIC_ACQUIRE) > size) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			plog_shm_wake(shm);
+			int r = poll(&pfd, 1, 1);
+			if (r > 0 || (r < 0 && errno != EINTR))
+				return NULL;
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(reserve, &pos, pos + want, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+		if (need > contig) {
+			__atomic_store_n((uint64_t *)(shm->data + (pos & shm->mask)),
+					(contig - 8) | (uint64_t)(PLOG_SHM_REC_PAD | PLOG_SHM_REC_COMMITTED) << 32, __ATOMIC_RELEASE);
+			pos += contig;
+		}
+		*posp = pos;
+		return shm->data + (pos & shm->mask) + 8;
+	}
+}
+
+static void
+plog_shm_commit(struct plog_shm *shm, uint64_t pos, size_t len, uint32_t flags) {
+	__atomic_store_n((uint64_t *)(shm->data + (pos & shm->mask)),
+			len | (uint64_t)(flags | PLOG_SHM_REC_COMMITTED) << 32, __ATOMIC_RELEASE);
+	__sync_synchronize();
+	if (__atomic_load_n(PLOG_SHM_U32(shm, PLOG_SHM_OFF_SLEEPING), __ATOMIC_RELAXED))
+		plog_shm_wake(shm);
+}
+
+/* Copies n bytes out of iov, advancing it. */
+static void
+plog_iov_copy(struct iovec **iov, int *iovcnt, uint8_t *dst, size_t n) {
+	while (n > 0) {
+		size_t l = (*iov)->iov_len < n ? (*iov)->iov_len : n;
+		if (dst) {
+			memcpy(dst, (*iov)->iov_base, l);
+			dst += l;
+		}
+		(*iov)->iov_base = (char *)(*iov)->iov_base + l;
+		(*iov)->iov_len -= l;
+		n -= l;
+		while (*iovcnt > 0 && (*iov)->iov_len == 0) {
+			(*iov)++;
+			(*iovcnt)--;
+		}
+	}
+}
+
+/* Writes the length prefixed frames in iov to the ring. Called with shm_lock held for reading. */
+static bool
+plog_shm_writev(struct plog_conn *conn, struct plog_shm *shm, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0 && iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	}
+	while (iovcnt > 0) {
+		uint8_t prefix[4];
+		uint64_t pos;
+
+		plog_iov_copy(&iov, &iovcnt, prefix, sizeof(prefix));
+		size_t len = (size_t)prefix[0] << 24 | prefix[1] << 16 | prefix[2] << 8 | prefix[3];
+
+		if (len <= (shm->mask + 1) / 4) {
+			uint8_t *rec = plog_shm_reserve(shm, conn->fd, len, &pos);
+			if (!rec)
+				return false;
+			plog_iov_copy(&iov, &iovcnt, rec, len);
+			plog_shm_commit(shm, pos, len, 0);
+			continue;
+		}
+
+		/* Too large for the ring, goes on the socket with a marker in order. */
+		uint8_t *frame = xmalloc(sizeof(prefix) + len);
+		memcpy(frame, prefix, sizeof(prefix));
+		plog_iov_copy(&iov, &iovcnt, frame + sizeof(prefix), len);
+		struct iovec fiov = { frame, sizeof(prefix) + len };
+		pthread_mutex_lock(&conn->lock);
+		bool ok = plog_writev_all(conn->fd, &fiov, 1) && plog_shm_reserve(shm, conn->fd, 0, &pos);
+		if (ok)
+			plog_shm_commit(shm, pos, 0, PLOG_SHM_REC_SOCKET);
+		pthread_mutex_unlock(&conn->lock);
+		free(frame);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+/* Writes complete frames to the connection. iov is modified. */
+static bool
+plog_conn_writev(struct plog_conn *conn, struct iovec *iov, int iovcnt) {
+	bool ok;
+
+	pthread_rwlock_rdlock(&conn->shm_lock);
+	if (conn->shm) {
+		ok = plog_shm_writev(conn, conn->shm, iov, iovcnt);
+	} else {
+		pthread_mutex_lock(&conn->lock);
+		if (conn->fd <= 0)
+			ok = false;
+		else if (conn->seqpacket)
+			ok = plog_sendmmsg_all(conn->fd, iov, iovcnt);
+		else
+			ok = plog_writev_all(conn->fd, iov, iovcnt);
+		pthread_mutex_unlock(&conn->lock);
+	}
+	pthread_rwlock_unlock(&conn->shm_lock);
+	return ok;
+}
+
+static int
+plog_connect_path(const char *path, int type) {
+	int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_un unaddr = {0};
+	unaddr.sun_family = AF_UNIX;
+	strlcpy(unaddr.sun_path, path, sizeof(unaddr.sun_path));
+	if (connect(fd, (struct sockaddr*)&unaddr, sizeof(unaddr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Writes path with the suffix from replaced by to into buf, if it has it and it fits. */
+static bool
+plog_replace_suffix(char *buf, size_t bufsz, const char *path, const char *from, const char *to) {
+	size_t plen = strlen(path), flen = strlen(from);
+	if (plen < flen || strcmp(path + plen - flen, from) != 0)
+		return false;
+	return (size_t)snprintf(buf, bufsz, "%.*s%s", (int)(plen - flen), path, to) < bufsz;
+}
+
+/*
+ * plogd listens on both plog.sock and plog-packet.sock in the same directory
+ * by default. The packet socket is preferred, unless a shared memory ring is
+ * wanted as that's only handed out on the stream one. Other paths are tried
+ * as a stream socket first.
+ */
+static int
+plog_connect(bool *seqpacket) {
+	const char *path = getenv("PLOG_SOCKET");
+	if (path == NULL)
+		path = "/run/plog/plog.sock";
+	char alt[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+	const char *spath = path, *ppath = path;
+
+	if (plog_replace_suffix(alt, sizeof(alt), path, "/plog-packet.sock", "/plog.sock"))
+		spath = alt;
+	else if (plog_replace_suffix(alt, sizeof(alt), path, "/plog.sock", "/plog-packet.sock"))
+		ppath = alt;
+
+	bool packet_first = spath != ppath && !getenv("PLOG_SHM");
+	for (int i = 0 ; i < 2 ; i++) {
+		bool packet = (i == 0) == packet_first;
+		int fd = plog_connect_path(packet ? ppath : spath, packet ? SOCK_SEQPACKET : SOCK_STREAM);
+		if (fd >= 0) {
+			*seqpacket = packet;
+			return fd;
+		}
+	}
+	return -1;
+}
+
 static bool
 plog_reconnect(struct plog_conn *conn) {
 	uint64_t gen = conn->generation;
+	pthread_rwlock_wrlock(&conn->shm_lock);
 	pthread_mutex_lock(&conn->lock);
 	if (gen == conn->generation) {
 		// Should perhaps use >= 0 but zero-initialized is nice and fd
 		// 0 should be really uncommon.
 		if (conn->fd > 0)
 			close(conn->fd);
+		plog_shm_free(conn->shm);
+		conn->shm = NULL;
 		struct timespec ts;
 		clock_gettime(CLOCK_MONOTONIC, &ts);
 		if (ts.tv_sec < conn->last_reconnect + 5) {
 			conn->fd = -1;
-			pthread_mutex_unlock(&conn->lock);
-			return false;
+			goto out;
 		}
 		conn->last_reconnect = ts.tv_sec;
-		conn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
-		if (conn->fd < 0) {
-			pthread_mutex_unlock(&conn->lock);
-			return false;
+		conn->fd = plog_connect(&conn->seqpacket);
+		if (conn->fd >= 0 && !conn->seqpacket && getenv("PLOG_SHM")) {
+			bool usable;
+			conn->shm = plog_shm_open(conn->fd, &usable);
+			if (!conn->shm && !usable) {
+				close(conn->fd);
+				conn->fd = plog_connect(&conn->seqpacket);
+			}
 		}
-		struct sockaddr_un unaddr = {0};
-		const char *path = getenv("PLOG_SOCKET");
-		if (path == NULL)
-			path = "/run/plog/plog.sock";
-		unaddr.sun_family = AF_UNIX;
-		strlcpy(unaddr.sun_path, path, sizeof(unaddr.sun_path));
-		if (connect(conn->fd, (struct sockaddr*)&unaddr, sizeof(unaddr)) < 0) {
-			close(conn->fd);
-			conn->fd = -1;
-		} else {
+		if (conn->fd >= 0)
 			conn->generation++;
-		}
 	}
+out:
 	pthread_mutex_unlock(&conn->lock);
+	pthread_rwlock_unlock(&conn->shm_lock);
 
 	return conn->fd >= 0;
 }
 
+static void
+plog_conn_close(struct plog_conn *conn) {
+	pthread_rwlock_wrlock(&conn->shm_lock);
+	pthread_mutex_lock(&conn->lock);
+	if (conn->fd > 0)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->last_reconnect = 0;
+	plog_shm_free(conn->shm);
+	conn->shm = NULL;
+	pthread_mutex_unlock(&conn->lock);
+	pthread_rwlock_unlock(&conn->shm_lock);
+}
+
+/*
+ * Messages are encoded directly in the protobuf wire format of plog.proto,
+ * into buffers kept in the ctx. Only the frame length and ctx_id are added
+ * when sending, so once the buffers have grown nothing is allocated per
+ * message.
+ */
+#define PB_VARINT 0
+#define PB_LEN 2
+#define PB_TAG(field, type) ((field) << 3 | (type))
+
+#define PLOG_FIELD_CTX_ID PB_TAG(1, PB_VARINT)
+#define PLOG_FIELD_OPEN   PB_TAG(2, PB_LEN)
+#define PLOG_FIELD_MSG    PB_TAG(3, PB_LEN)
+#define PLOG_FIELD_CLOSE  PB_TAG(4, PB_VARINT)
+
+#define OPEN_FIELD_CTXTYPE PB_TAG(1, PB_VARINT)
+#define OPEN_FIELD_KEY     PB_TAG(2, PB_LEN)
+#define OPEN_FIELD_PARENT  PB_TAG(3, PB_VARINT)
+
+#define MSG_FIELD_KEY   PB_TAG(2, PB_LEN)
+#define MSG_FIELD_VALUE PB_TAG(3, PB_LEN)
+
+/* Frame length, ctx_id and open field header. */
+#define PLOG_FRAME_HDR_MAX (4 + 1 + 10 + 1 + 10)
+
+static const uint8_t plog_close_field[] = { PLOG_FIELD_CLOSE, 1 };
+
+static inline size_t
+pb_varint_len(uint64_t v) {
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static inline uint8_t *
+pb_put_varint(uint8_t *p, uint64_t v) {
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline uint8_t *
+pb_put_bytes(uint8_t *p, uint8_t tag, const void *data, size_t len) {
+	*p++ = tag;
+	p = pb_put_varint(p, len);
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static inline bool
+pb_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+	*v = 0;
+	for (int shift = 0 ; *p < end && shift < 64 ; shift += 7) {
+		uint8_t b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/* Returns a pointer to room for n more bytes. Update len after writing. */
+static uint8_t *
+plog_wbuf_reserve(struct plog_wbuf *wb, size_t n) {
+	if (wb->len + n > wb->size) {
+		wb->size = wb->size * 2 ?: 256;
+		while (wb->len + n > wb->size)
+			wb->size *= 2;
+		wb->data = xrealloc(wb->data, wb->size);
+	}
+	return wb->data + wb->len;
+}
+
+static void
+plog_encode_open(struct plog_ctx *ctx) {
+	size_t len = 1 + pb_varint_len(ctx->ctype);
+	for (size_t i = 0 ; i < ctx->n_key ; i++) {
+		size_t kl = strlen(ctx->key[i]);
+		len += 1 + pb_varint_len(kl) + kl;
+	}
+	if (ctx->pctx)
+		len += 1 + pb_varint_len(ctx->pctx->id);
+
+	uint8_t *p = plog_wbuf_reserve(&ctx->open, len);
+	*p++ = OPEN_FIELD_CTXTYPE;
+	p = pb_put_varint(p, ctx->ctype);
+	for (size_t i = 0 ; i < ctx->n_key ; i++)
+		p = pb_put_bytes(p, OPEN_FIELD_KEY, ctx->key[i], strlen(ctx->key[i]));
+	if (ctx->pctx) {
+		*p++ = OPEN_FIELD_PARENT;
+		p = pb_put_varint(p, ctx->pctx->id);
+	}
+	ctx->open.len = p - ctx->open.data;
+}
+
+/*
+ * Sets up iov to write out the pending data as a length prefixed plog
+ * message, using hdr for the header. Returns the total length.
+ */
+static size_t
+plog_frame(struct plog_ctx *ctx, uint8_t hdr[PLOG_FRAME_HDR_MAX], struct iovec iov[4], int *iovcnt) {
+	size_t body = 1 + pb_varint_len(ctx->id) + ctx->msgs.len;
+	if (ctx->open_pending)
+		body += 1 + pb_varint_len(ctx->open.len) + ctx->open.len;
+	if (ctx->close_pending)
+		body += sizeof(plog_close_field);
+
+	uint32_t sz = htonl(body);
+	memcpy(hdr, &sz, sizeof(sz));
+	uint8_t *p = hdr + sizeof(sz);
+	*p++ = PLOG_FIELD_CTX_ID;
+	p = pb_put_varint(p, ctx->id);
+	if (ctx->open_pending) {
+		*p++ = PLOG_FIELD_OPEN;
+		p = pb_put_varint(p, ctx->open.len);
+	}
+
+	int n = 0;
+	iov[n++] = (struct iovec){ hdr, p - hdr };
+	if (ctx->open_pending)
+		iov[n++] = (struct iovec){ ctx->open.data, ctx->open.len };
+	if (ctx->msgs.len)
+		iov[n++] = (struct iovec){ ctx->msgs.data, ctx->msgs.len };
+	if (ctx->close_pending)
+		iov[n++] = (struct iovec){ (void *)plog_close_field, sizeof(plog_close_field) };
+	*iovcnt = n;
+	return sizeof(sz) + body;
+}
+
+/* Iterates the encoded messages, returns false at the end. */
+static bool
+plog_next_msg(const uint8_t **p, const uint8_t *end, const char **key, size_t *klen, const char **value, size_t *vlen) {
+	uint64_t len;
+	if (*p >= end || *(*p)++ != PLOG_FIELD_MSG || !pb_get_varint(p, end, &len))
+		return false;
+	const uint8_t *mend = *p + len;
+	*key = *value = "";
+	*klen = *vlen = 0;
+	while (*p < mend) {
+		uint8_t tag = *(*p)++;
+		if (!pb_get_varint(p, mend, &len))
+			return false;
+		if (tag == MSG_FIELD_KEY) {
+			*key = (const char *)*p;
+			*klen = len;
+		} else if (tag == MSG_FIELD_VALUE) {
+			*value = (const char *)*p;
+			*vlen = len;
+		}
+		*p += len;
+	}
+	return true;
+}
+
 static void
 plog_clear_buffer(struct plog_ctx *ctx) {
-	free(ctx->buffer.open);
-	ctx->buffer.open = NULL;
-	for (size_t i = 0 ; i < ctx->buffer.n_msg ; i++) {
-		free(ctx->buffer.msg[i]->key);
-		free(ctx->buffer.msg[i]->value.data);
+	ctx->open_pending = false;
+	ctx->close_pending = false;
+	ctx->msgs.len = 0;
+	ctx->n_msg = 0;
+}
+
+/*
+ * Async mode. Each thread logging to the conn gets its own single producer,
+ * single consumer ring of records, so producers never take a shared lock.
+ * Records are a header followed by the framed message, padded to the header
+ * size. A record that doesn't fit before the end of the ring is preceded by a
+ * pad record skipping to the start. Messages larger than half the ring are
+ * malloced and referenced from the record instead.
+ *
+ * Records are stamped with a sequence number allocated while holding the ctx
+ * lock, and the flusher writes them in sequence order across the rings. That
+ * keeps messages for a ctx, and contexts opened from other threads, in order.
+ * A record can be published after one with a higher sequence number in another
+ * ring, so while a producer is between taking a number and publishing, its
+ * ring's reserving holds a lower bound of that number and the flusher stops
+ * short of it.
+ */
+struct plog_async_rec {
+	uint32_t len;
+	uint32_t flags;
+	uint64_t seq;
+};
+#define PLOG_REC_PAD      (1 << 0)
+#define PLOG_REC_INDIRECT (1 << 1)
+#define PLOG_REC_ALIGN(l) (((l) + sizeof(struct plog_async_rec) - 1) & ~(sizeof(struct plog_async_rec) - 1))
+
+struct plog_ring {
+	struct plog_async *async;
+	uint64_t async_id;
+	int refs;
+	bool dead;
+
+	uint8_t *buf;
+	size_t size;
+	uint64_t head;
+	uint64_t reserving;
+	uint64_t tail __attribute__((aligned(64)));
+
+	struct plog_ring *next;
+	struct plog_ring *thread_next;
+};
+
+struct plog_async {
+	struct plog_conn *conn;
+	uint64_t id;
+	size_t ring_size;
+	enum plog_async_policy policy;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t space;
+	struct plog_ring *rings;
+	bool running;
+	int sleeping;
+	int waiters;
+
+	uint64_t seq;
+	uint64_t dropped;
+};
+
+#define PLOG_ASYNC_DEFAULT_RING (1 << 20)
+#define PLOG_ASYNC_FLUSH_MS 10
+
+static uint64_t plog_async_id;
+static pthread_once_t plog_ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t plog_ring_key;
+static __thread struct plog_ring *plog_thread_rings;
+
+static void
+plog_ring_release(struct plog_ring *ring) {
+	if (__sync_sub_and_fetch(&ring->refs, 1) == 0) {
+		free(ring->buf);
+		free(ring);
+	}
+}
+
+static void
+plog_ring_thread_exit(void *v) {
+	struct plog_ring *ring = v;
+	while (ring) {
+		struct plog_ring *next = ring->thread_next;
+		__atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+		plog_ring_release(ring);
+		ring = next;
+	}
+}
+
+static void
+plog_ring_key_init(void) {
+	pthread_key_create(&plog_ring_key, plog_ring_thread_exit);
+}
+
+static struct plog_ring *
+plog_thread_ring(struct plog_async *as) {
+	struct plog_ring **rp = &plog_thread_rings;
+	struct plog_ring *ring;
+
+	bool removed = false;
+
+	while ((ring = *rp)) {
+		if (ring->async == as && ring->async_id == as->id)
+			break;
+		if (__atomic_load_n(&ring->async, __ATOMIC_ACQUIRE) == NULL) {
+			/* Async mode was stopped, the flusher let go of it. */
+			*rp = ring->thread_next;
+			plog_ring_release(ring);
+			removed = true;
+			continue;
+		}
+		rp = &ring->thread_next;
+	}
+	if (removed)
+		pthread_setspecific(plog_ring_key, plog_thread_rings);
+	if (ring)
+		return ring;
+
+	ring = zmalloc(sizeof(*ring));
+	ring->async = as;
+	ring->async_id = as->id;
+	ring->refs = 2;
+	ring->size = as->ring_size;
+	ring->buf = xmalloc(ring->size);
+
+	pthread_once(&plog_ring_key_once, plog_ring_key_init);
+	ring->thread_next = plog_thread_rings;
+	plog_thread_rings = ring;
+	pthread_setspecific(plog_ring_key, ring);
+
+	pthread_mutex_lock(&as->lock);
+	ring->next = as->rings;
+	as->rings = ring;
+	pthread_mutex_unlock(&as->lock);
+	return ring;
+}
+
+static void
+plog_async_wake(struct plog_async *as) {
+	if (__atomic_load_n(&as->sleeping, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&as->lock);
+		pthread_cond_signal(&as->wake);
+		pthread_mutex_unlock(&as->lock);
+	}
+}
+
+/*
+ * Reserves space for a record with len bytes of payload, adding a pad record
+ * if needed. Returns NULL if the ring is full and the policy is to drop.
+ */
+static struct plog_async_rec *
+plog_ring_reserve(struct plog_async *as, struct plog_ring *ring, size_t len) {
+	size_t need = PLOG_REC_ALIGN(sizeof(struct plog_async_rec) + len);
+	size_t mask = ring->size - 1;
+
+	while (1) {
+		uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		size_t contig = ring->size - (ring->head & mask);
+		size_t want = need > contig ? need + contig : need;
+
+		if (ring->size - (ring->head - tail) >= want) {
+			if (need > contig) {
+				struct plog_async_rec *pad = (struct plog_async_rec *)(ring->buf + (ring->head & mask));
+				pad->len = contig - sizeof(*pad);
+				pad->flags = PLOG_REC_PAD;
+				pad->seq = 0;
+				__atomic_store_n(&ring->head, ring->head + contig, __ATOMIC_RELEASE);
+			}
+			return (struct plog_async_rec *)(ring->buf + (ring->head & mask));
+		}
+
+		if (as->policy == PLOG_ASYNC_DROP)
+			return NULL;
+
+		pthread_mutex_lock(&as->lock);
+		__sync_add_and_fetch(&as->waiters, 1);
+		if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == tail) {
+			pthread_cond_signal(&as->wake);
+			pthread_cond_wait(&as->space, &as->lock);
+		}
+		__sync_sub_and_fetch(&as->waiters, 1);
+		pthread_mutex_unlock(&as->lock);
 	}
-	ctx->buffer.n_msg = 0;
-	ctx->buffer.has_close = false;
-	ctx->buffer.close = false;
+}
+
+// Must hold ctx->lock when calling this.
+static bool
+plog_async_send(struct plog_ctx *ctx, struct plog_async *as) {
+	struct plog_ring *ring = plog_thread_ring(as);
+	uint8_t hdr[PLOG_FRAME_HDR_MAX];
+	struct iovec iov[4];
+	int iovcnt;
+	size_t flen = plog_frame(ctx, hdr, iov, &iovcnt);
+	bool indirect = flen > ring->size / 2;
+	struct plog_async_rec *rec = plog_ring_reserve(as, ring, indirect ? sizeof(void*) : flen);
+
+	if (!rec) {
+		__sync_add_and_fetch(&as->dropped, 1);
+		__sync_add_and_fetch(&ctx->failed_writes, 1);
+		plog_clear_buffer(ctx);
+		return true;
+	}
+
+	uint8_t *frame = (uint8_t *)(rec + 1);
+	if (indirect) {
+		frame = xmalloc(flen);
+		memcpy(rec + 1, &frame, sizeof(frame));
+	}
+	for (int i = 0 ; i < iovcnt ; i++) {
+		memcpy(frame, iov[i].iov_base, iov[i].iov_len);
+		frame += iov[i].iov_len;
+	}
+
+	rec->len = flen;
+	rec->flags = indirect ? PLOG_REC_INDIRECT : 0;
+	__atomic_store_n(&ring->reserving, __atomic_load_n(&as->seq, __ATOMIC_SEQ_CST) + 1, __ATOMIC_SEQ_CST);
+	rec->seq = __atomic_add_fetch(&as->seq, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ring->head, ring->head + PLOG_REC_ALIGN(sizeof(*rec) + (indirect ? sizeof(void*) : flen)), __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->reserving, 0, __ATOMIC_RELEASE);
+
+	plog_async_wake(as);
+	plog_clear_buffer(ctx);
+	return true;
+}
+
+struct plog_drain_ring {
+	struct plog_ring *ring;
+	uint64_t pos;
+	uint64_t head;
+};
+
+static struct plog_async_rec *
+plog_drain_peek(struct plog_drain_ring *fr, uint64_t upto) {
+	struct plog_ring *ring = fr->ring;
+	while (fr->pos < fr->head) {
+		struct plog_async_rec *rec = (struct plog_async_rec *)(ring->buf + (fr->pos & (ring->size - 1)));
+		if (!(rec->flags & PLOG_REC_PAD))
+			return rec->seq <= upto ? rec : NULL;
+		fr->pos += sizeof(*rec) + rec->len;
+	}
+	return NULL;
+}
+
+/*
+ * Writes out what's currently in the rings, merging them by sequence number,
+ * up to the first number that might not be published yet. Those records are
+ * left for the next call and *held is set.
+ * Called by the flusher with as->lock held, which is dropped while writing.
+ * Returns the number of messages handled.
+ */
+static int
+plog_async_drain(struct plog_async *as, bool *held) {
+	*held = false;
+
+	int nrings = 0;
+	for (struct plog_ring *ring = as->rings ; ring ; ring = ring->next)
+		nrings++;
+	if (nrings == 0)
+		return 0;
+
+	/*
+	 * Everything up to upto was numbered before this load. Each of those
+	 * records is either published before its ring's head is loaded below,
+	 * or its producer is still reserving, bounding upto under it.
+	 */
+	uint64_t upto = __atomic_load_n(&as->seq, __ATOMIC_SEQ_CST);
+	struct plog_drain_ring frs[nrings];
+	bool empty = true;
+	int i = 0;
+	for (struct plog_ring *ring = as->rings ; ring ; ring = ring->next) {
+		uint64_t reserving = __atomic_load_n(&ring->reserving, __ATOMIC_SEQ_CST);
+		if (reserving && reserving <= upto)
+			upto = reserving - 1;
+		frs[i].ring = ring;
+		frs[i].pos = ring->tail;
+		frs[i].head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (frs[i].pos != frs[i].head)
+			empty = false;
+		i++;
+	}
+	/* Keep the lock if there's nothing to do, so that a stop can't be missed. */
+	if (empty)
+		return 0;
+	pthread_mutex_unlock(&as->lock);
+
+	int total = 0;
+	while (1) {
+		struct iovec iov[IOV_MAX];
+		void *indirect[IOV_MAX];
+		int iovcnt = 0, nindirect = 0;
+
+		while (iovcnt < IOV_MAX) {
+			struct plog_drain_ring *best = NULL;
+			struct plog_async_rec *brec = NULL;
+			for (i = 0 ; i < nrings ; i++) {
+				struct plog_async_rec *rec = plog_drain_peek(&frs[i], upto);
+				if (rec && (!brec || rec->seq < brec->seq)) {
+					best = &frs[i];
+					brec = rec;
+				}
+			}
+			if (!best)
+				break;
+
+			void *data = brec + 1;
+			size_t reclen = brec->len;
+			if (brec->flags & PLOG_REC_INDIRECT) {
+				memcpy(&data, brec + 1, sizeof(data));
+				indirect[nindirect++] = data;
+				reclen = sizeof(data);
+			}
+			iov[iovcnt].iov_base = data;
+			iov[iovcnt].iov_len = brec->len;
+			iovcnt++;
+			best->pos += PLOG_REC_ALIGN(sizeof(*brec) + reclen);
+		}
+		if (iovcnt == 0)
+			break;
+
+		struct plog_conn *conn = as->conn;
+		bool ok = plog_conn_writev(conn, iov, iovcnt);
+		if (!ok) {
+			/* Contexts are reopened by the producers when they see the new generation. */
+			__sync_add_and_fetch(&as->dropped, iovcnt);
+			plog_reconnect(conn);
+		}
+
+		for (i = 0 ; i < nindirect ; i++)
+			free(indirect[i]);
+		for (i = 0 ; i < nrings ; i++)
+			__atomic_store_n(&frs[i].ring->tail, frs[i].pos, __ATOMIC_RELEASE);
+		total += iovcnt;
+
+		__sync_synchronize();
+		if (__atomic_load_n(&as->waiters, __ATOMIC_RELAXED)) {
+			pthread_mutex_lock(&as->lock);
+			pthread_cond_broadcast(&as->space);
+			pthread_mutex_unlock(&as->lock);
+		}
+	}
+
+	for (i = 0 ; i < nrings ; i++) {
+		if (frs[i].pos != frs[i].head)
+			*held = true;
+	}
+
+	pthread_mutex_lock(&as->lock);
+	return total;
+}
+
+static void
+plog_async_reap(struct plog_async *as) {
+	struct plog_ring **rp = &as->rings;
+	struct plog_ring *ring;
+
+	while ((ring = *rp)) {
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			*rp = ring->next;
+			plog_ring_release(ring);
+			continue;
+		}
+		rp = &ring->next;
+	}
+}
+
+static void *
+plog_async_thread(void *v) {
+	struct plog_async *as = v;
+
+	pthread_mutex_lock(&as->lock);
+	while (1) {
+		bool held;
+		int n = plog_async_drain(as, &held);
+		plog_async_reap(as);
+		if (n > 0)
+			continue;
+		/* Held records are published shortly, wait for them before stopping. */
+		if (!as->running && !held)
+			break;
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PLOG_ASYNC_FLUSH_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		__atomic_store_n(&as->sleeping, 1, __ATOMIC_RELEASE);
+		pthread_cond_timedwait(&as->wake, &as->lock, &ts);
+		__atomic_store_n(&as->sleeping, 0, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&as->lock);
+	return NULL;
+}
+
+int
+plog_start_async(struct plog_conn *conn, size_t ring_size, enum plog_async_policy policy) {
+	if (!conn)
+		conn = &plog_default_conn;
+	if (conn->async) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	struct plog_async *as = zmalloc(sizeof(*as));
+	as->conn = conn;
+	as->id = __sync_add_and_fetch(&plog_async_id, 1);
+	as->policy = policy;
+	as->ring_size = PLOG_ASYNC_DEFAULT_RING;
+	if (ring_size) {
+		/* Room for at least a few records, and a power of two. */
+		as->ring_size = 1024;
+		while (as->ring_size < ring_size)
+			as->ring_size <<= 1;
+	}
+	pthread_mutex_init(&as->lock, NULL);
+	pthread_cond_init(&as->wake, NULL);
+	pthread_cond_init(&as->space, NULL);
+	as->running = true;
+
+	int err = pthread_create(&as->thread, NULL, plog_async_thread, as);
+	if (err) {
+		pthread_mutex_destroy(&as->lock);
+		pthread_cond_destroy(&as->wake);
+		pthread_cond_destroy(&as->space);
+		free(as);
+		errno = err;
+		return -1;
+	}
+	conn->async = as;
+	return 0;
+}
+
+void
+plog_stop_async(struct plog_conn *conn) {
+	if (!conn)
+		conn = &plog_default_conn;
+	struct plog_async *as = conn->async;
+	if (!as)
+		return;
+	conn->async = NULL;
+
+	pthread_mutex_lock(&as->lock);
+	as->running = false;
+	pthread_cond_signal(&as->wake);
+	pthread_mutex_unlock(&as->lock);
+	pthread_join(as->thread, NULL);
+
+	/* Rings still owned by threads are dropped by them on next use, or exit. */
+	while (as->rings) {
+		struct plog_ring *ring = as->rings;
+		as->rings = ring->next;
+		__atomic_store_n(&ring->async, NULL, __ATOMIC_RELEASE);
+		plog_ring_release(ring);
+	}
+	pthread_mutex_destroy(&as->lock);
+	pthread_cond_destroy(&as->wake);
+	pthread_cond_destroy(&as->space);
+	free(as);
+
+	if (conn->refs == 0)
+		plog_conn_close(conn);
+}
+
+uint64_t
+plog_async_dropped(struct plog_conn *conn) {
+	struct plog_async *as = (conn ?: &plog_default_conn)->async;
+	return as ? as->dropped : 0;
 }
 
 // Must hold ctx->lock when calling this.
@@ -125,40 +1185,20 @@ plog_send(struct plog_ctx *ctx, bool flush) {
 	if (!flush && (ctx->flags & PLOG_BUFFERED))
 		return true;
 
-	ctx->buffer.has_ctx_id = true;
-	ctx->buffer.ctx_id = ctx->id;
-
 	// Disallow fd 0 as it's the "uninitialized" value.
 	if (ctx->conn->fd <= 0)
 		return false;
 
-	uint8_t buf[1024];
-	struct ProtobufCBufferSimple pbuf = PROTOBUF_C_BUFFER_SIMPLE_INIT(buf);
-	plogproto__plog__pack_to_buffer(&ctx->buffer, (ProtobufCBuffer*)&pbuf);
+	struct plog_async *as = ctx->conn->async;
+	if (as)
+		return plog_async_send(ctx, as);
 
-	pthread_mutex_lock(&ctx->conn->lock);
-	bool ret = false;
-	if (ctx->conn->fd <= 0)
-		goto out;
-
-	uint32_t sz = htonl(pbuf.len);
-	ssize_t l = write(ctx->conn->fd, &sz, sizeof(sz));
-	if (l != sizeof(sz))
-		goto out;
-	ssize_t ssz = pbuf.len;
-	for (l = 0 ; l < ssz ; ) {
-		ssize_t n = write(ctx->conn->fd, pbuf.data + l, ssz - l);
-		if (n == -1) {
-			if (errno != EINTR)
-				break;
-			n = 0;
-		}
-		l += n;
-	}
-	ret = l == ssz;
-out:
-	pthread_mutex_unlock(&ctx->conn->lock);
-	PROTOBUF_C_BUFFER_SIMPLE_CLEAR(&pbuf);
+	uint8_t hdr[PLOG_FRAME_HDR_MAX];
+	struct iovec iov[4];
+	int iovcnt;
+	plog_frame(ctx, hdr, iov, &iovcnt);
+
+	bool ret = plog_conn_writev(ctx->conn, iov, iovcnt);
 	if (ret)
 		plog_clear_buffer(ctx);
 	return ret;
@@ -181,17 +1221,22 @@ recurse_fallback_session_id(struct buf_string *tgt, struct plog_ctx *ctx) {
 
 static void
 plog_fallback(struct plog_ctx *ctx) {
-	if (ctx->buffer.n_msg == 0)
+	if (ctx->n_msg == 0)
 		return;
 
 	struct buf_string session_id = {0};
 	recurse_fallback_session_id(&session_id, ctx);
 	if (session_id.pos > 0)
 		bswrite(&session_id, " ", 1);
-	for (size_t i = 0 ; i < ctx->buffer.n_msg ; i++) {
-		const Plogproto__PlogMessage *msg = ctx->buffer.msg[i];
-		int sltype = get_priority_from_level(msg->key, LOG_INFO);
-		syslog(LOG_LOCAL0 | sltype, "%s%s: %.*s", session_id.buf ?: "", msg->key, (int)msg->value.len, msg->value.data);
+	const uint8_t *p = ctx->msgs.data, *end = p + ctx->msgs.len;
+	const char *key, *value;
+	size_t klen, vlen;
+	while (plog_next_msg(&p, end, &key, &klen, &value, &vlen)) {
+		char level[16] = "";
+		if (klen < sizeof(level))
+			memcpy(level, key, klen);
+		int sltype = get_priority_from_level(level, LOG_INFO);
+		syslog(LOG_LOCAL0 | sltype, "%s%.*s: %.*s", session_id.buf ?: "", (int)klen, key, (int)vlen, value);
 	}
 	plog_clear_buffer(ctx);
 	free(session_id.buf);
@@ -211,20 +1256,9 @@ plog_fallback_ts(struct plog_ctx *ctx, const char *key, time_t ts) {
 // Must hold ctx->lock when calling this.
 static bool
 plog_opencontext(struct plog_ctx *ctx) {
-	Plogproto__OpenContext *open = ctx->buffer.open;
-
-	if (!open) {
-		ctx->buffer.open = open = malloc(sizeof(*open));
-		plogproto__open_context__init(open);
-	}
-	open->has_ctxtype = true;
-	open->ctxtype = ctx->ctype;
-	open->n_key = ctx->n_key;
-	open->key = ctx->key;
-	if (ctx->pctx) {
-		open->has_parent_ctx_id = true;
-		open->parent_ctx_id = ctx->pctx->id;
-	}
+	if (!ctx->open.len)
+		plog_encode_open(ctx);
+	ctx->open_pending = true;
 
 	return plog_send(ctx, false);
 }
@@ -252,29 +1286,165 @@ plog_conn_retain(struct plog_ctx *ctx, struct plog_conn *conn) {
 static void
 plog_conn_release(struct plog_conn *conn) {
 	uint64_t refs = __sync_sub_and_fetch(&conn->refs, 1);
-	if (refs == 0) {
-		pthread_mutex_lock(&conn->lock);
-		if (conn->fd > 0)
-			close(conn->fd);
-		conn->fd = -1;
-		conn->last_reconnect = 0;
-		pthread_mutex_unlock(&conn->lock);
+	/* In async mode, plog_stop_async closes it after writing the queue. */
+	if (refs == 0 && !conn->async)
+		plog_conn_close(conn);
+}
+
+/*
+ * Sampling of log contexts, decided in plog_open_log. Rules are per appname,
+ * with an optional default rule for the others. A rule first keeps one in
+ * one_in contexts, then applies a token bucket to those. Contexts not kept
+ * aren't created at all, NULL is returned instead.
+ * The number of contexts dropped is logged, at most once per
+ * PLOG_SAMPLING_REPORT_S seconds, as deltas in a count context with the key
+ * plog_sampling.<appname>, or plog_sampling.default for the default rule.
+ */
+#define PLOG_SAMPLING_REPORT_S 1.0
+
+struct plog_sampling {
+	struct plog_sampling *next;
+	char *appname;
+	unsigned int one_in;
+	double rate;
+	double burst;
+
+	pthread_mutex_t lock;
+	uint64_t seen;
+	double tokens;
+	double last_fill;
+
+	uint64_t sampled;
+	uint64_t limited;
+	double last_report;
+	struct plog_ctx *count_ctx;
+};
+
+static pthread_rwlock_t plog_sampling_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct plog_sampling *plog_sampling_rules;
+
+static double
+plog_sampling_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Must hold rule->lock. */
+static void
+plog_sampling_report(struct plog_sampling *rule, struct plog_conn *conn, double now) {
+	if (!rule->count_ctx) {
+		const char *path[] = { rule->appname ?: "default" };
+		rule->count_ctx = plog_open_count(conn, "plog_sampling", 1, path);
+	}
+	if (rule->sampled)
+		plog_int(rule->count_ctx, "sampled", rule->sampled > INT_MAX ? INT_MAX : (int)rule->sampled);
+	if (rule->limited)
+		plog_int(rule->count_ctx, "rate_limited", rule->limited > INT_MAX ? INT_MAX : (int)rule->limited);
+	rule->sampled = 0;
+	rule->limited = 0;
+	rule->last_report = now;
+}
+
+static bool
+plog_sample(struct plog_conn *conn, const char *appname) {
+	if (!__atomic_load_n(&plog_sampling_rules, __ATOMIC_ACQUIRE))
+		return true;
+
+	bool keep = true;
+	struct plog_sampling *rule, *def = NULL;
+
+	pthread_rwlock_rdlock(&plog_sampling_lock);
+	for (rule = plog_sampling_rules ; rule ; rule = rule->next) {
+		if (!rule->appname)
+			def = rule;
+		else if (strcmp(rule->appname, appname) == 0)
+			break;
 	}
+	if ((rule = rule ?: def)) {
+		double now = plog_sampling_now();
+
+		pthread_mutex_lock(&rule->lock);
+		if (rule->one_in > 1 && rule->seen++ % rule->one_in != 0) {
+			keep = false;
+			rule->sampled++;
+		} else if (rule->rate > 0) {
+			rule->tokens += (now - rule->last_fill) * rule->rate;
+			if (rule->tokens > rule->burst)
+				rule->tokens = rule->burst;
+			rule->last_fill = now;
+			if (rule->tokens >= 1) {
+				rule->tokens -= 1;
+			} else {
+				keep = false;
+				rule->limited++;
+			}
+		}
+		if ((rule->sampled || rule->limited) && now - rule->last_report >= PLOG_SAMPLING_REPORT_S)
+			plog_sampling_report(rule, conn, now);
+		pthread_mutex_unlock(&rule->lock);
+	}
+	pthread_rwlock_unlock(&plog_sampling_lock);
+	return keep;
+}
+
+static void
+plog_sampling_free(struct plog_sampling *rule) {
+	if (rule->sampled || rule->limited)
+		plog_sampling_report(rule, rule->count_ctx ? rule->count_ctx->conn : NULL, plog_sampling_now());
+	plog_close(rule->count_ctx);
+	pthread_mutex_destroy(&rule->lock);
+	free(rule->appname);
+	free(rule);
+}
+
+void
+plog_set_sampling(const char *appname, unsigned int one_in, double rate, double burst) {
+	struct plog_sampling *rule = NULL;
+
+	if (one_in > 1 || rate > 0) {
+		rule = zmalloc(sizeof(*rule));
+		rule->appname = appname ? xstrdup(appname) : NULL;
+		rule->one_in = one_in;
+		rule->rate = rate;
+		rule->burst = burst >= 1 ? burst : (rate > 1 ? rate : 1);
+		rule->tokens = rule->burst;
+		rule->last_fill = plog_sampling_now();
+		pthread_mutex_init(&rule->lock, NULL);
+	}
+
+	pthread_rwlock_wrlock(&plog_sampling_lock);
+	struct plog_sampling **rp = &plog_sampling_rules, *old = NULL;
+	for (; *rp ; rp = &(*rp)->next) {
+		if ((*rp)->appname == appname || ((*rp)->appname && appname && strcmp((*rp)->appname, appname) == 0)) {
+			old = *rp;
+			*rp = old->next;
+			break;
+		}
+	}
+	if (rule) {
+		rule->next = plog_sampling_rules;
+		__atomic_store_n(&plog_sampling_rules, rule, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock(&plog_sampling_lock);
+
+	if (old)
+		plog_sampling_free(old);
 }
 
 static struct plog_ctx *
-plog_open_root(struct plog_conn *conn, const char *appname, Plogproto__CtxType ctype, int npath, const char *path[]) {
+plog_open_root(struct plog_conn *conn, const char *appname, Plogproto__CtxType ctype, int npath, const char *path[], int flags) {
 	struct plog_ctx *ctx = zmalloc(sizeof(*ctx));
 	pthread_mutex_init(&ctx->lock, NULL);
 	plog_conn_retain(ctx, conn ?: &plog_default_conn);
 	ctx->ctype = ctype;
+	ctx->flags = flags;
 	ctx->id = __sync_add_and_fetch(&plog_ctx_id, 1);
 	ctx->n_key = npath + 1;
 	ctx->key = xmalloc(ctx->n_key * sizeof(*ctx->key));
 	ctx->key[0] = xstrdup(appname);
 	for (int i = 0 ; i < npath ; i++)
 		ctx->key[i + 1] = xstrdup(path[i]);
-	plogproto__plog__init(&ctx->buffer);
 
 	if (!plog_opencontext(ctx)) {
 		plog_reconnect(ctx->conn);
@@ -288,19 +1458,26 @@ plog_open_root(struct plog_conn *conn, const char *appname, Plogproto__CtxType c
 }
 
 struct plog_ctx *
-plog_open_log(struct plog_conn *conn, const char *appname) {
+plog_open_log_flags(struct plog_conn *conn, const char *appname, int flags) {
 	assert(strchr(appname, '.') == NULL);
-	return plog_open_root(conn, appname, PLOGPROTO__CTX_TYPE__log, 0, NULL);
+	if (!(flags & PLOG_NO_SAMPLING) && !plog_sample(conn ?: &plog_default_conn, appname))
+		return NULL;
+	return plog_open_root(conn, appname, PLOGPROTO__CTX_TYPE__log, 0, NULL, flags);
+}
+
+struct plog_ctx *
+plog_open_log(struct plog_conn *conn, const char *appname) {
+	return plog_open_log_flags(conn, appname, 0);
 }
 
 struct plog_ctx *
 plog_open_state(struct plog_conn *conn, const char *appname) {
-	return plog_open_root(conn, appname, PLOGPROTO__CTX_TYPE__state, 0, NULL);
+	return plog_open_root(conn, appname, PLOGPROTO__CTX_TYPE__state, 0, NULL, 0);
 }
 
 struct plog_ctx *
 plog_open_count(struct plog_conn *conn, const char *appname, int npath, const char *path[]) {
-	return plog_open_root(conn, appname, PLOGPROTO__CTX_TYPE__count, npath, path);
+	return plog_open_root(conn, appname, PLOGPROTO__CTX_TYPE__count, npath, path, 0);
 }
 
 static struct plog_ctx *
@@ -316,7 +1493,6 @@ plog_open_sub(struct plog_ctx *pctx, const char *key, Plogproto__CtxType ctype,
 	ctx->n_key = 1;
 	ctx->key = xmalloc(sizeof(*ctx->key));
 	ctx->key[0] = xstrdup(key);
-	plogproto__plog__init(&ctx->buffer);
 
 	if (!plog_opencontext(ctx)) {
 		plog_reconnect(ctx->conn);
@@ -357,6 +1533,10 @@ plog_flush(struct plog_ctx *ctx) {
 	if (!ctx)
 		return;
 
+	/* The flusher reconnects on errors, contexts need to be reopened before sending more. */
+	if (ctx->conn->async && ctx->generation != ctx->conn->generation)
+		plog_check_generation(ctx);
+
 	pthread_mutex_lock(&ctx->lock);
 	bool ok = plog_send(ctx, true);
 	pthread_mutex_unlock(&ctx->lock);
@@ -374,9 +1554,8 @@ static void
 plog_free(struct plog_ctx *ctx) {
 	plog_conn_release(ctx->conn);
 	free(ctx->streamtmp);
-	for (size_t i = 0 ; i < ctx->msgalloced ; i++)
-		free(ctx->buffer.msg[i]);
-	free(ctx->buffer.msg);
+	free(ctx->open.data);
+	free(ctx->msgs.data);
 	for (size_t i = 0 ; i < ctx->n_key ; i++)
 		free(ctx->key[i]);
 	free(ctx->key);
@@ -396,8 +1575,7 @@ int
 plog_close(struct plog_ctx *ctx) {
 	if (!ctx)
 		return 0;
-	ctx->buffer.has_close = true;
-	ctx->buffer.close = true;
+	ctx->close_pending = true;
 	if (!plog_send(ctx, true)) {
 		plog_reconnect(ctx->conn);
 		plog_check_generation(ctx);
@@ -542,25 +1720,17 @@ static void
 plog_publish(struct plog_ctx *ctx, const char *key, ssize_t klen, const char *coded_value, size_t vlen) {
 	if (!key)
 		key = PLOG_DEFAULT_KEY;
+	size_t kl = klen >= 0 ? (size_t)klen : strlen(key);
+	size_t len = 1 + pb_varint_len(kl) + kl + 1 + pb_varint_len(vlen) + vlen;
+
 	pthread_mutex_lock(&ctx->lock);
-	if (ctx->buffer.n_msg >= ctx->msgalloced) {
-		ctx->msgalloced = ctx->msgalloced * 2 ?: (ctx->flags & PLOG_BUFFERED) ? 4 : 1;
-		ctx->buffer.msg = xrealloc(ctx->buffer.msg, ctx->msgalloced * sizeof(*ctx->buffer.msg));
-		for (size_t i = ctx->buffer.n_msg ; i < ctx->msgalloced ; i++) {
-			ctx->buffer.msg[i] = xmalloc(sizeof (*ctx->buffer.msg[i]));
-			plogproto__plog_message__init(ctx->buffer.msg[i]);
-		}
-	}
-	Plogproto__PlogMessage *msg = ctx->buffer.msg[ctx->buffer.n_msg++];
-	if (klen >= 0)
-		msg->key = xstrdup(key);
-	else
-		msg->key = xstrndup(key, klen);
-	msg->has_value = true;
-	msg->value.len = vlen;
-	msg->value.data = xmalloc(vlen + 1);
-	memcpy(msg->value.data, coded_value, vlen);
-	msg->value.data[vlen] = '\0';
+	uint8_t *p = plog_wbuf_reserve(&ctx->msgs, 1 + pb_varint_len(len) + len);
+	*p++ = PLOG_FIELD_MSG;
+	p = pb_put_varint(p, len);
+	p = pb_put_bytes(p, MSG_FIELD_KEY, key, kl);
+	p = pb_put_bytes(p, MSG_FIELD_VALUE, coded_value, vlen);
+	ctx->msgs.len = p - ctx->msgs.data;
+	ctx->n_msg++;
 	pthread_mutex_unlock(&ctx->lock);
 	if (!(ctx->flags & PLOG_BUFFERED))
 		plog_flush(ctx);
@@ -770,7 +1940,7 @@ plog_xerr_printx(const char *fmt, va_list ap) {
 void
 plog_init_x_err(const char *appname) {
 	plog_close(x_err_ctx);
-	x_err_ctx = plog_open_log(NULL, appname);
+	x_err_ctx = plog_open_log_flags(NULL, appname, PLOG_NO_SAMPLING);
 	x_err_init_custom(plog_xerr_print, plog_xerr_printx);
 }
 
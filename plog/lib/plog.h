@@ -7,6 +7,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
@@ -37,6 +38,12 @@ struct plog_ctx;
  * Usually you pass NULL as conn. The plog_default_conn will in that case
  * be used.
  *
+ * The connection goes to the unix socket in PLOG_SOCKET, or
+ * /run/plog/plog.sock by default. If PLOG_SHM is set in the environment,
+ * messages are written to a shared memory ring handed out by plogd instead,
+ * saving the syscall per message. Plain socket writes are used if plogd
+ * doesn't support it.
+ *
  * For plog_open_state, you can add periods (.) in appname to directly
  * open a sub state. Logs are currently not allowed to do this, there
  * appname must not contain dots.
@@ -45,6 +52,7 @@ struct plog_ctx;
  */
 
 struct plog_ctx *plog_open_log(struct plog_conn *conn, const char *appname);
+struct plog_ctx *plog_open_log_flags(struct plog_conn *conn, const char *appname, int flags);
 struct plog_ctx *plog_open_state(struct plog_conn *conn, const char *appname);
 struct plog_ctx *plog_open_count(struct plog_conn *conn, const char *appname, int npath, const char *path[]);
 
@@ -66,9 +74,54 @@ int plog_close(struct plog_ctx *ctx);
 #define PLOG_BUFFERED  (1 << 0)
 void plog_set_flags(struct plog_ctx *ctx, int flags);
 
+/*
+ * Client side sampling of log contexts, to shed logging cost under load.
+ * Applies to plog_open_log for appname, or to all appnames without a rule of
+ * their own if appname is NULL. One in one_in contexts is kept, and then at
+ * most rate contexts per second, allowing bursts of burst contexts (0 for the
+ * same as rate). For the others plog_open_log returns NULL, which all the
+ * functions here accept and ignore.
+ * one_in <= 1 and rate <= 0 removes the rule. Replacing or removing a rule
+ * is not cheap, it's meant to be done at startup or on config reload.
+ *
+ * Dropped contexts are counted in a count context plog_sampling.<appname>,
+ * or plog_sampling.default, as "sampled" and "rate_limited".
+ *
+ * Use PLOG_NO_SAMPLING with plog_open_log_flags for contexts that should
+ * always be opened, e.g. long lived ones.
+ */
+#define PLOG_NO_SAMPLING (1 << 1)
+void plog_set_sampling(const char *appname, unsigned int one_in, double rate, double burst);
+
 /* Flush a buffered ctx. Contexts are unbuffered by default. */
 void plog_flush(struct plog_ctx *ctx);
 
+/*
+ * Async mode for a connection, NULL for the default one.
+ * Instead of writing each message to the socket while holding the connection
+ * lock, messages are packed into a ring buffer owned by the calling thread,
+ * and a background thread writes them in batches with writev.
+ * ring_size is the size in bytes of each thread's ring, rounded up to a power
+ * of two, or 0 for the default of 1 MB.
+ * When a ring is full, PLOG_ASYNC_DROP drops the message, counting it in
+ * plog_async_dropped and the failed writes of the ctx, while PLOG_ASYNC_BLOCK
+ * waits for the background thread to make room.
+ * Messages lost when a write to the socket fails are also counted as dropped,
+ * there's no syslog fallback for them.
+ *
+ * plog_stop_async writes out all queued messages and stops the thread, also
+ * closing the connection if all contexts using it are closed. It must not be
+ * called while other threads are logging on the connection.
+ * plog_start_async returns -1 and sets errno on failure.
+ */
+enum plog_async_policy {
+	PLOG_ASYNC_DROP,
+	PLOG_ASYNC_BLOCK,
+};
+int plog_start_async(struct plog_conn *conn, size_t ring_size, enum plog_async_policy policy);
+void plog_stop_async(struct plog_conn *conn);
+uint64_t plog_async_dropped(struct plog_conn *conn);
+
 /*
  * Cancel a plog, if it was buffered. Otherwise it's too late.
  */
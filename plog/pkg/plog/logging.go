@@ -38,6 +38,7 @@ import (
 	"fmt"
 	"log"
 
+	"github.com/schibsted/sebase/plog/internal/pkg/plogproto"
 	"github.com/schibsted/sebase/util/pkg/slog"
 	"golang.org/x/crypto/ssh/terminal"
 )
@@ -51,9 +52,10 @@ var SetupLevel = Info
 // calls log.SetOutput(plog.Info) to redirect log.Printf output to this
 // package, as well as log.SetFlags(0). Finally checks if FallbackWriter is a
 // TTY. If so, changes FallbackFormatter to FallbackFormatterSimple.
+// Default is never dropped by SetSampling.
 func Setup(appname, lvl string) {
 	SetupLevel = LogLevel(lvl, SetupLevel)
-	Default = NewPlogLog(appname)
+	Default = openRoot([]string{appname}, plogproto.CtxType_log)
 	log.SetOutput(Info)
 	log.SetFlags(0)
 
@@ -54,7 +54,13 @@ func IfEnabled(lvl Level) *Plog {
 
 // NewPlogLog opens a new root logging plog context.
 // If you called Setup, then you should probably use Default instead of this.
+// Root contexts connect to PLOG_SOCKET, and use a shared memory ring with
+// plogd if PLOG_SHM is set, see plogproto.NewClientConn.
+// Returns nil if the context is dropped by sampling, see SetSampling.
 func NewPlogLog(appname string) *Plog {
+	if !sample(appname) {
+		return nil
+	}
 	return openRoot([]string{appname}, plogproto.CtxType_log)
 }
 
@@ -294,7 +300,7 @@ func (r *refconn) retain() (*refconn, uint64) {
 
 func (r *refconn) release() {
 	refs := atomic.AddUint64(&r.refs, ^uint64(0))
-	if refs == 0 {
+	if refs == 0 && r.Writer != nil {
 		r.Close()
 	}
 }
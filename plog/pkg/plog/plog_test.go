@@ -22,7 +22,7 @@ func init() {
 	}
 	port := l.Addr().(*net.TCPAddr).Port
 	testSock = fmt.Sprintf("tcp://localhost:%v", port)
-	pl := plogproto.Listener{l, false}
+	pl := plogproto.Listener{Listener: l}
 	go func() {
 		for {
 			conn, err := pl.Accept()
@@ -0,0 +1,154 @@
+// Copyright 2020 Schibsted
+
+package plog
+
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// SamplingReportInterval is how often at most the number of contexts dropped
+// by sampling is logged.
+var SamplingReportInterval = time.Second
+
+type samplingRule struct {
+	appname string
+	oneIn   uint64
+	rate    float64
+	burst   float64
+
+	sync.Mutex
+	seen       uint64
+	tokens     float64
+	lastFill   time.Time
+	sampled    int
+	limited    int
+	lastReport time.Time
+	count      *Plog
+}
+
+var samplingLock sync.RWMutex
+var samplingRules map[string]*samplingRule
+var samplingDefault *samplingRule
+var samplingEnabled int32
+
+// SetSampling adds client side sampling of the log contexts opened with
+// NewPlogLog for appname, or for all appnames without a rule of their own if
+// appname is empty. One in oneIn contexts is kept, and then at most rate
+// contexts per second, allowing bursts of burst contexts (0 for the same as
+// rate). For the others NewPlogLog returns nil, which is safe to log to.
+// oneIn <= 1 and rate <= 0 removes the rule.
+//
+// Dropped contexts are counted in a count context plog_sampling.<appname>,
+// or plog_sampling.default, as "sampled" and "rate_limited".
+//
+// Setup never samples the Default context.
+func SetSampling(appname string, oneIn uint64, rate, burst float64) {
+	var rule *samplingRule
+	if oneIn > 1 || rate > 0 {
+		rule = &samplingRule{appname: appname, oneIn: oneIn, rate: rate, burst: burst}
+		if rule.burst < 1 {
+			rule.burst = rate
+			if rule.burst < 1 {
+				rule.burst = 1
+			}
+		}
+		rule.tokens = rule.burst
+		rule.lastFill = time.Now()
+	}
+
+	samplingLock.Lock()
+	var old *samplingRule
+	if appname == "" {
+		old = samplingDefault
+		samplingDefault = rule
+	} else {
+		old = samplingRules[appname]
+		if rule != nil {
+			if samplingRules == nil {
+				samplingRules = make(map[string]*samplingRule)
+			}
+			samplingRules[appname] = rule
+		} else {
+			delete(samplingRules, appname)
+		}
+	}
+	enabled := int32(0)
+	if samplingDefault != nil || len(samplingRules) > 0 {
+		enabled = 1
+	}
+	atomic.StoreInt32(&samplingEnabled, enabled)
+	samplingLock.Unlock()
+
+	if old != nil {
+		old.Lock()
+		old.report(time.Now())
+		old.count.Close()
+		old.Unlock()
+	}
+}
+
+// Must hold the lock.
+func (rule *samplingRule) report(now time.Time) {
+	if rule.sampled == 0 && rule.limited == 0 {
+		return
+	}
+	if rule.count == nil {
+		key := rule.appname
+		if key == "" {
+			key = "default"
+		}
+		rule.count = NewPlogCount("plog_sampling", key)
+	}
+	if rule.sampled > 0 {
+		rule.count.Log("sampled", rule.sampled)
+	}
+	if rule.limited > 0 {
+		rule.count.Log("rate_limited", rule.limited)
+	}
+	rule.sampled = 0
+	rule.limited = 0
+	rule.lastReport = now
+}
+
+func sample(appname string) bool {
+	if atomic.LoadInt32(&samplingEnabled) == 0 {
+		return true
+	}
+	samplingLock.RLock()
+	defer samplingLock.RUnlock()
+	rule := samplingRules[appname]
+	if rule == nil {
+		rule = samplingDefault
+	}
+	if rule == nil {
+		return true
+	}
+
+	now := time.Now()
+	keep := true
+	rule.Lock()
+	defer rule.Unlock()
+	rule.seen++
+	if rule.oneIn > 1 && (rule.seen-1)%rule.oneIn != 0 {
+		keep = false
+		rule.sampled++
+	} else if rule.rate > 0 {
+		rule.tokens += now.Sub(rule.lastFill).Seconds() * rule.rate
+		if rule.tokens > rule.burst {
+			rule.tokens = rule.burst
+		}
+		rule.lastFill = now
+		if rule.tokens >= 1 {
+			rule.tokens--
+		} else {
+			keep = false
+			rule.limited++
+		}
+	}
+	if now.Sub(rule.lastReport) >= SamplingReportInterval {
+		rule.report(now)
+	}
+	return keep
+}
@@ -0,0 +1,46 @@
+// Copyright 2020 Schibsted
+
+package plog
+
+import (
+	"io/ioutil"
+	"os"
+	"testing"
+)
+
+func testSamplingOpen(appname string, n int) int {
+	opened := 0
+	for i := 0; i < n; i++ {
+		ctx := NewPlogLog(appname)
+		if ctx != nil {
+			opened++
+		}
+		ctx.Close()
+	}
+	return opened
+}
+
+func TestSampling(t *testing.T) {
+	os.Setenv("PLOG_SOCKET", "unix:///nonexistent/plog.sock")
+	defer os.Unsetenv("PLOG_SOCKET")
+	FallbackWriter = ioutil.Discard
+	defer func() { FallbackWriter = os.Stderr }()
+
+	SetSampling("sampled", 4, 0, 0)
+	SetSampling("limited", 0, 0.001, 5)
+	if n := testSamplingOpen("sampled", 20); n != 5 {
+		t.Errorf("expected 5 sampled contexts, got %d", n)
+	}
+	if n := testSamplingOpen("limited", 20); n != 5 {
+		t.Errorf("expected 5 rate limited contexts, got %d", n)
+	}
+	if n := testSamplingOpen("other", 20); n != 20 {
+		t.Errorf("expected 20 other contexts, got %d", n)
+	}
+
+	SetSampling("sampled", 0, 0, 0)
+	SetSampling("limited", 0, 0, 0)
+	if n := testSamplingOpen("limited", 20); n != 20 {
+		t.Errorf("expected 20 contexts after removing rule, got %d", n)
+	}
+}
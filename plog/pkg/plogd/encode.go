@@ -0,0 +1,281 @@
+// Copyright 2019 Schibsted
+
+package plogd
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"math"
+	"sort"
+	"strconv"
+	"sync"
+	"time"
+	"unicode/utf8"
+)
+
+// Buffer is a pooled byte slice to encode messages into, see GetBuffer.
+type Buffer struct {
+	B []byte
+}
+
+// Buffers larger than this aren't put back in the pool.
+const maxPooledBuffer = 64 << 10
+
+var bufferPool = sync.Pool{
+	New: func() interface{} {
+		return &Buffer{B: make([]byte, 0, 1024)}
+	},
+}
+
+// GetBuffer returns an empty buffer from the pool. Call Free when done with
+// it.
+func GetBuffer() *Buffer {
+	return bufferPool.Get().(*Buffer)
+}
+
+// Free returns the buffer to the pool. It must not be used afterwards.
+func (b *Buffer) Free() {
+	if cap(b.B) > maxPooledBuffer {
+		return
+	}
+	b.B = b.B[:0]
+	bufferPool.Put(b)
+}
+
+// AppendJSON appends the JSON encoding of msg to buf. The fields are written
+// in struct order, followed by the KV fields sorted by key. Map keys in the
+// message are sorted as well. The types found in messages, i.e. maps, slices,
+// strings, numbers, bools and json.RawMessage, are encoded directly, other
+// types are passed to encoding/json.
+func (msg *LogMessage) AppendJSON(buf []byte) ([]byte, error) {
+	var err error
+	buf = append(buf, `{"@timestamp":`...)
+	if buf, err = appendTime(buf, msg.Timestamp); err != nil {
+		return buf, err
+	}
+	buf = append(buf, `,"prog":`...)
+	buf = appendString(buf, msg.Prog)
+	buf = append(buf, `,"type":`...)
+	buf = appendString(buf, msg.Type)
+	buf = append(buf, `,"message":`...)
+	if buf, err = appendValue(buf, msg.Message); err != nil {
+		return buf, err
+	}
+	if msg.StartTimestamp != nil {
+		buf = append(buf, `,"start_timestamp":`...)
+		if buf, err = appendTime(buf, *msg.StartTimestamp); err != nil {
+			return buf, err
+		}
+	}
+	if msg.Host != "" {
+		buf = append(buf, `,"host":`...)
+		buf = appendString(buf, msg.Host)
+	}
+	if len(msg.KV) > 0 {
+		var arr [16]string
+		for _, k := range sortedKeys(msg.KV, arr[:0]) {
+			// Same as ToMap, the envelope wins over KV for the fields it writes.
+			switch k {
+			case "@timestamp", "prog", "type", "message":
+				continue
+			case "start_timestamp":
+				if msg.StartTimestamp != nil {
+					continue
+				}
+			case "host":
+				if msg.Host != "" {
+					continue
+				}
+			}
+			buf = append(buf, ',')
+			buf = appendString(buf, k)
+			buf = append(buf, ':')
+			if buf, err = appendValue(buf, msg.KV[k]); err != nil {
+				return buf, err
+			}
+		}
+	}
+	return append(buf, '}'), nil
+}
+
+func appendValue(buf []byte, v interface{}) ([]byte, error) {
+	switch v := v.(type) {
+	case nil:
+		return append(buf, "null"...), nil
+	case string:
+		return appendString(buf, v), nil
+	case bool:
+		return strconv.AppendBool(buf, v), nil
+	case float64:
+		return appendFloat(buf, v)
+	case int:
+		return strconv.AppendInt(buf, int64(v), 10), nil
+	case int64:
+		return strconv.AppendInt(buf, v, 10), nil
+	case json.RawMessage:
+		return appendRaw(buf, v)
+	case map[string]interface{}:
+		return appendMap(buf, v)
+	case []interface{}:
+		return appendSlice(buf, v)
+	case time.Time:
+		return appendTime(buf, v)
+	}
+	data, err := json.Marshal(v)
+	if err != nil {
+		return buf, err
+	}
+	return append(buf, data...), nil
+}
+
+func appendMap(buf []byte, m map[string]interface{}) ([]byte, error) {
+	var err error
+	var arr [16]string
+	buf = append(buf, '{')
+	for i, k := range sortedKeys(m, arr[:0]) {
+		if i > 0 {
+			buf = append(buf, ',')
+		}
+		buf = appendString(buf, k)
+		buf = append(buf, ':')
+		if buf, err = appendValue(buf, m[k]); err != nil {
+			return buf, err
+		}
+	}
+	return append(buf, '}'), nil
+}
+
+func appendSlice(buf []byte, s []interface{}) ([]byte, error) {
+	var err error
+	buf = append(buf, '[')
+	for i, v := range s {
+		if i > 0 {
+			buf = append(buf, ',')
+		}
+		if buf, err = appendValue(buf, v); err != nil {
+			return buf, err
+		}
+	}
+	return append(buf, ']'), nil
+}
+
+// sortedKeys returns the keys of m sorted, using keys for storage if it's
+// large enough. Small maps are insertion sorted to not let keys escape.
+func sortedKeys(m map[string]interface{}, keys []string) []string {
+	if len(m) > cap(keys) {
+		keys = make([]string, 0, len(m))
+		for k := range m {
+			keys = append(keys, k)
+		}
+		sort.Strings(keys)
+		return keys
+	}
+	for k := range m {
+		keys = append(keys, k)
+		for i := len(keys) - 1; i > 0 && keys[i] < keys[i-1]; i-- {
+			keys[i], keys[i-1] = keys[i-1], keys[i]
+		}
+	}
+	return keys
+}
+
+// appendFloat formats f like encoding/json does.
+func appendFloat(buf []byte, f float64) ([]byte, error) {
+	if math.IsInf(f, 0) || math.IsNaN(f) {
+		return buf, fmt.Errorf("plogd: unsupported float value %v", f)
+	}
+	format := byte('f')
+	if abs := math.Abs(f); abs != 0 && (abs < 1e-6 || abs >= 1e21) {
+		format = 'e'
+	}
+	buf = strconv.AppendFloat(buf, f, format, -1, 64)
+	if format == 'e' {
+		// Clean up e-09 to e-9.
+		n := len(buf)
+		if n >= 4 && buf[n-4] == 'e' && buf[n-3] == '-' && buf[n-2] == '0' {
+			buf[n-2] = buf[n-1]
+			buf = buf[:n-1]
+		}
+	}
+	return buf, nil
+}
+
+func appendTime(buf []byte, t time.Time) ([]byte, error) {
+	if y := t.Year(); y < 0 || y >= 10000 {
+		// Let encoding/json report the error.
+		data, err := t.MarshalJSON()
+		return append(buf, data...), err
+	}
+	buf = append(buf, '"')
+	buf = t.AppendFormat(buf, time.RFC3339Nano)
+	return append(buf, '"'), nil
+}
+
+// appendRaw appends already encoded JSON. Clients send compact JSON, so it's
+// only validated and checked for newlines, which would break line based
+// outputs. If there are any it's compacted.
+func appendRaw(buf []byte, raw json.RawMessage) ([]byte, error) {
+	if len(raw) == 0 {
+		return append(buf, "null"...), nil
+	}
+	if bytes.IndexAny(raw, "\r\n") < 0 && json.Valid(raw) {
+		return append(buf, raw...), nil
+	}
+	var b bytes.Buffer
+	if err := json.Compact(&b, raw); err != nil {
+		return buf, err
+	}
+	return append(buf, b.Bytes()...), nil
+}
+
+const hexDigits = "0123456789abcdef"
+
+// appendString appends s as a JSON string, escaped the same way as by
+// encoding/json, including HTML characters.
+func appendString(buf []byte, s string) []byte {
+	buf = append(buf, '"')
+	start := 0
+	for i := 0; i < len(s); {
+		if c := s[i]; c < utf8.RuneSelf {
+			if c >= 0x20 && c != '"' && c != '\\' && c != '<' && c != '>' && c != '&' {
+				i++
+				continue
+			}
+			buf = append(buf, s[start:i]...)
+			switch c {
+			case '"', '\\':
+				buf = append(buf, '\\', c)
+			case '\n':
+				buf = append(buf, '\\', 'n')
+			case '\r':
+				buf = append(buf, '\\', 'r')
+			case '\t':
+				buf = append(buf, '\\', 't')
+			default:
+				buf = append(buf, '\\', 'u', '0', '0', hexDigits[c>>4], hexDigits[c&0xf])
+			}
+			i++
+			start = i
+			continue
+		}
+		r, size := utf8.DecodeRuneInString(s[i:])
+		if r == utf8.RuneError && size == 1 {
+			buf = append(buf, s[start:i]...)
+			buf = append(buf, `\ufffd`...)
+			i += size
+			start = i
+			continue
+		}
+		if r == '\u2028' || r == '\u2029' {
+			buf = append(buf, s[start:i]...)
+			buf = append(buf, '\\', 'u', '2', '0', '2', hexDigits[r&0xf])
+			i += size
+			start = i
+			continue
+		}
+		i += size
+	}
+	buf = append(buf, s[start:]...)
+	return append(buf, '"')
+}
@@ -3,7 +3,6 @@
 package plogd
 
 import (
-	"encoding/json"
 	"time"
 )
 
@@ -24,12 +23,9 @@ type LogMessage struct {
 }
 
 // MarshalJSON creates a proper JSON type, incorporating the KV map as needed.
+// See AppendJSON, which can also be used with a pooled Buffer.
 func (msg *LogMessage) MarshalJSON() ([]byte, error) {
-	if len(msg.KV) == 0 {
-		type alias LogMessage
-		return json.Marshal((*alias)(msg))
-	}
-	return json.Marshal(msg.ToMap())
+	return msg.AppendJSON(nil)
 }
 
 // ToMap creates a map[string]interface{} representation of the message.
@@ -0,0 +1,182 @@
+// Copyright 2019 Schibsted
+
+package plogd
+
+import (
+	"encoding/json"
+	"reflect"
+	"strings"
+	"testing"
+	"time"
+)
+
+// The previous encoding/json based MarshalJSON, to compare with.
+func marshalReflect(msg *LogMessage) ([]byte, error) {
+	if len(msg.KV) == 0 {
+		type alias LogMessage
+		return json.Marshal((*alias)(msg))
+	}
+	return json.Marshal(msg.ToMap())
+}
+
+func testMessage() LogMessage {
+	ts := time.Date(2019, 5, 1, 12, 30, 0, 123456789, time.UTC)
+	start := ts.Add(-time.Second)
+	return LogMessage{
+		Timestamp:      ts,
+		Prog:           "search",
+		Type:           "query",
+		StartTimestamp: &start,
+		Message: map[string]interface{}{
+			"remote_addr": json.RawMessage(`"::ffff:127.0.0.1"`),
+			"input":       "J0 \"print_parse\":2 <indonly> & \\ \n\t\x01   åäö \xff",
+			"tot_bytes":   float64(418),
+			"small":       1e-7,
+			"large":       1e21,
+			"frac":        -0.25,
+			"count":       3,
+			"ok":          true,
+			"nothing":     nil,
+			"log": []interface{}{
+				map[string]interface{}{"INFO": "query done"},
+				json.RawMessage(`{"a": [1, 2]}`),
+				json.RawMessage("{\n\"b\":1}"),
+			},
+			"other": []string{"not", "interface"},
+		},
+	}
+}
+
+func TestAppendJSON(t *testing.T) {
+	msg := testMessage()
+	expect, err := marshalReflect(&msg)
+	if err != nil {
+		t.Fatal(err)
+	}
+	got, err := msg.AppendJSON(nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	// Raw messages are not compacted unless they contain newlines, so
+	// compare values. Without those the output is identical.
+	var ev, gv interface{}
+	if err := json.Unmarshal(expect, &ev); err != nil {
+		t.Fatal(err)
+	}
+	if err := json.Unmarshal(got, &gv); err != nil {
+		t.Fatalf("%v: %s", err, got)
+	}
+	if !reflect.DeepEqual(ev, gv) {
+		t.Errorf("Expected %s, got %s", expect, got)
+	}
+	if strings.Contains(string(got), "\n") {
+		t.Errorf("Newline in output: %s", got)
+	}
+
+	delete(msg.Message.(map[string]interface{}), "log")
+	expect, _ = marshalReflect(&msg)
+	got, _ = msg.AppendJSON(nil)
+	if string(got) != string(expect) {
+		t.Errorf("Expected %s, got %s", expect, got)
+	}
+}
+
+func TestAppendJSONKV(t *testing.T) {
+	msg := testMessage()
+	msg.Host = "10.0.0.1"
+	msg.KV = map[string]interface{}{"subprog": "sub", "prog": "ignored", "a": 1}
+	got, err := msg.AppendJSON(nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !strings.HasSuffix(string(got), `,"host":"10.0.0.1","a":1,"subprog":"sub"}`) {
+		t.Errorf("Unexpected KV encoding: %s", got)
+	}
+	if !strings.HasPrefix(string(got), `{"@timestamp":"2019-05-01T12:30:00.123456789Z","prog":"search","type":"query",`) {
+		t.Errorf("Unexpected envelope: %s", got)
+	}
+	if len(msg.KV) != 3 {
+		t.Errorf("KV modified: %v", msg.KV)
+	}
+
+	// KV fields named like empty envelope fields are kept, as with ToMap.
+	msg.Host = ""
+	msg.StartTimestamp = nil
+	msg.KV = map[string]interface{}{"host": "kvhost", "start_timestamp": "kvstart", "type": "ignored"}
+	got, err = msg.AppendJSON(nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	expect, _ := marshalReflect(&msg)
+	var ev, gv interface{}
+	json.Unmarshal(expect, &ev)
+	if err := json.Unmarshal(got, &gv); err != nil {
+		t.Fatalf("%v: %s", err, got)
+	}
+	if !reflect.DeepEqual(ev, gv) {
+		t.Errorf("Expected %s, got %s", expect, got)
+	}
+}
+
+func TestAppendJSONError(t *testing.T) {
+	for _, v := range []interface{}{json.RawMessage(`{"a":`), map[string]interface{}{"f": func() {}}} {
+		msg := LogMessage{Message: v}
+		if _, err := msg.AppendJSON(nil); err == nil {
+			t.Errorf("Expected error for %#v", v)
+		}
+	}
+}
+
+func benchMessages() (small, large LogMessage) {
+	small = LogMessage{Timestamp: time.Now(), Prog: "trans", Type: "INFO", Message: json.RawMessage(`"incoming connection"`)}
+
+	large = testMessage()
+	var lines []interface{}
+	for i := 0; i < 50; i++ {
+		lines = append(lines, map[string]interface{}{"DEBUG": json.RawMessage(`"starting validator v_bool for transinfo"`)})
+	}
+	m := large.Message.(map[string]interface{})
+	m["log"] = lines
+	delete(m, "other")
+	for i := 0; i < 20; i++ {
+		m["key"+string(rune('a'+i))] = float64(i)
+	}
+	large.KV = map[string]interface{}{"subprog": "sub"}
+	return
+}
+
+func BenchmarkMarshalSmallReflect(b *testing.B) {
+	msg, _ := benchMessages()
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		marshalReflect(&msg)
+	}
+}
+
+func BenchmarkMarshalSmallAppend(b *testing.B) {
+	msg, _ := benchMessages()
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		buf := GetBuffer()
+		buf.B, _ = msg.AppendJSON(buf.B)
+		buf.Free()
+	}
+}
+
+func BenchmarkMarshalLargeReflect(b *testing.B) {
+	_, msg := benchMessages()
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		marshalReflect(&msg)
+	}
+}
+
+func BenchmarkMarshalLargeAppend(b *testing.B) {
+	_, msg := benchMessages()
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		buf := GetBuffer()
+		buf.B, _ = msg.AppendJSON(buf.B)
+		buf.Free()
+	}
+}
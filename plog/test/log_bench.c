@@ -0,0 +1,69 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Logging front end benchmark. Measures the cost of log_printf and log_kv
+ * calls for a disabled level, compared to calling the log_printf function
+ * directly, which is what the macro used to be. Also compares the enabled
+ * calls, writing plog messages to /dev/null.
+ *
+ * Usage: log_bench [iterations]
+ */
+
+#include "../lib/plog.c"
+#include "../lib/logging.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Keeps the compiler from hoisting the level check out of the loops. */
+#define BARRIER() __asm__ volatile("" ::: "memory")
+
+static double
+elapsed(const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[]) {
+	int iterations = 10000000;
+	const char *peer = "10.0.0.1:8080";
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd <= 0)
+		xerr(1, "open(/dev/null)");
+	plog_default_conn.fd = fd;
+
+	log_setup("log_bench", "info");
+
+	struct timespec start;
+
+	printf("%-16s %10s\n", "", "ns/call");
+
+#define RUN(name, n, call) do { \
+		clock_gettime(CLOCK_MONOTONIC, &start); \
+		for (int i = 0 ; i < (n) ; i++) { \
+			call; \
+			BARRIER(); \
+		} \
+		printf("%-16s %10.2f\n", name, elapsed(&start) * 1e9 / (n)); \
+	} while (0)
+
+	RUN("call disabled", iterations, (log_printf)(LOG_DEBUG, "fd_pool: using existing fd %d to %s", i, peer));
+	RUN("printf disabled", iterations, log_printf(LOG_DEBUG, "fd_pool: using existing fd %d to %s", i, peer));
+	RUN("kv disabled", iterations, log_kv(LOG_DEBUG, "fd_pool: using existing fd", LOG_KV_INT("fd", i), LOG_KV_STR("peer", peer)));
+
+	/* Enabled calls are much slower, run fewer of them. */
+	int enabled = iterations / 10 ?: 1;
+	RUN("printf enabled", enabled, log_printf(LOG_INFO, "fd_pool: using existing fd %d to %s", i, peer));
+	RUN("kv enabled", enabled, log_kv(LOG_INFO, "fd_pool: using existing fd", LOG_KV_INT("fd", i), LOG_KV_STR("peer", peer)));
+
+	log_shutdown();
+	return 0;
+}
@@ -0,0 +1,182 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Message encoding benchmark, comparing the direct wire encoder used by
+ * plog_publish with building a Plogproto__Plog and packing it with
+ * protobuf-c, which is what it used to do. Both write to /dev/null so that
+ * mostly the encoding is measured.
+ *
+ * Allocations are counted by wrapping malloc, only with glibc.
+ *
+ * Usage: plog_encode_bench [iterations]
+ */
+
+#include "../lib/plog.c"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t nallocs;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+void *
+malloc(size_t sz) {
+	nallocs++;
+	return __libc_malloc(sz);
+}
+
+void *
+calloc(size_t n, size_t sz) {
+	nallocs++;
+	return __libc_calloc(n, sz);
+}
+
+void *
+realloc(void *ptr, size_t sz) {
+	nallocs++;
+	return __libc_realloc(ptr, sz);
+}
+
+void
+free(void *ptr) {
+	__libc_free(ptr);
+}
+#endif
+
+/* The previous encoder, kept as a baseline. */
+struct old_ctx {
+	uint64_t id;
+	int fd;
+	Plogproto__Plog buffer;
+	size_t msgalloced;
+};
+
+static void
+old_send(struct old_ctx *ctx) {
+	ctx->buffer.has_ctx_id = true;
+	ctx->buffer.ctx_id = ctx->id;
+
+	uint8_t buf[1024];
+	struct ProtobufCBufferSimple pbuf = PROTOBUF_C_BUFFER_SIMPLE_INIT(buf);
+	plogproto__plog__pack_to_buffer(&ctx->buffer, (ProtobufCBuffer*)&pbuf);
+
+	uint32_t sz = htonl(pbuf.len);
+	if (write(ctx->fd, &sz, sizeof(sz)) == sizeof(sz))
+		write(ctx->fd, pbuf.data, pbuf.len);
+	PROTOBUF_C_BUFFER_SIMPLE_CLEAR(&pbuf);
+
+	for (size_t i = 0 ; i < ctx->buffer.n_msg ; i++) {
+		free(ctx->buffer.msg[i]->key);
+		free(ctx->buffer.msg[i]->value.data);
+	}
+	ctx->buffer.n_msg = 0;
+}
+
+static void
+old_publish(struct old_ctx *ctx, const char *key, const char *coded_value, size_t vlen) {
+	if (ctx->buffer.n_msg >= ctx->msgalloced) {
+		ctx->msgalloced = ctx->msgalloced * 2 ?: 1;
+		ctx->buffer.msg = xrealloc(ctx->buffer.msg, ctx->msgalloced * sizeof(*ctx->buffer.msg));
+		for (size_t i = ctx->buffer.n_msg ; i < ctx->msgalloced ; i++) {
+			ctx->buffer.msg[i] = xmalloc(sizeof (*ctx->buffer.msg[i]));
+			plogproto__plog_message__init(ctx->buffer.msg[i]);
+		}
+	}
+	Plogproto__PlogMessage *msg = ctx->buffer.msg[ctx->buffer.n_msg++];
+	msg->key = xstrdup(key);
+	msg->has_value = true;
+	msg->value.len = vlen;
+	msg->value.data = xmalloc(vlen + 1);
+	memcpy(msg->value.data, coded_value, vlen);
+	msg->value.data[vlen] = '\0';
+	old_send(ctx);
+}
+
+static void
+old_int(struct old_ctx *ctx, const char *key, int value) {
+	char vbuf[32];
+	int vlen = snprintf(vbuf, sizeof(vbuf), "%d", value);
+	old_publish(ctx, key, vbuf, vlen);
+}
+
+static void
+old_string(struct old_ctx *ctx, const char *key, const char *value) {
+	ssize_t vlen = -1;
+	char encbuf[8192], *vbuf;
+	char *fb = json_encode_buf(encbuf, sizeof(encbuf), 1, value, &vbuf, &vlen);
+	old_publish(ctx, key, vbuf, vlen);
+	free(fb);
+}
+
+static double
+elapsed(const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+report(const char *name, int iterations, double t, uint64_t allocs) {
+	printf("%-14s %12.1f %14.2f\n", name, t * 1e9 / iterations, (double)allocs / iterations);
+}
+
+int
+main(int argc, char *argv[]) {
+	int iterations = 1000000;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd <= 0)
+		xerr(1, "open(/dev/null)");
+
+	struct plog_conn conn = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = fd };
+	struct plog_ctx *root = plog_open_log(&conn, "bench");
+	struct plog_ctx *ctx = plog_open_dict(root, "dict");
+	struct old_ctx octx = { .id = ctx->id, .fd = fd };
+	plogproto__plog__init(&octx.buffer);
+
+	char small[] = "A short log line";
+	char large[2000];
+	memset(large, 'x', sizeof(large) - 1);
+	large[sizeof(large) - 1] = '\0';
+
+	/* Warm up, growing the buffers. */
+	old_string(&octx, "k", large);
+	plog_string(ctx, "k", large);
+
+	struct timespec start;
+	uint64_t allocs;
+
+	printf("%-14s %12s %14s\n", "", "ns/msg", "allocs/msg");
+
+#define RUN(name, call) do { \
+		allocs = nallocs; \
+		clock_gettime(CLOCK_MONOTONIC, &start); \
+		for (int i = 0 ; i < iterations ; i++) \
+			call; \
+		report(name, iterations, elapsed(&start), nallocs - allocs); \
+	} while (0)
+
+	RUN("old int", old_int(&octx, "count", i));
+	RUN("new int", plog_int(ctx, "count", i));
+	RUN("old string", old_string(&octx, "line", small));
+	RUN("new string", plog_string(ctx, "line", small));
+	RUN("old 2k string", old_string(&octx, "line", large));
+	RUN("new 2k string", plog_string(ctx, "line", large));
+
+	for (size_t i = 0 ; i < octx.msgalloced ; i++)
+		free(octx.buffer.msg[i]);
+	free(octx.buffer.msg);
+	plog_close(ctx);
+	plog_close(root);
+	return 0;
+}
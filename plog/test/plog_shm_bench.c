@@ -0,0 +1,85 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Transport throughput benchmark, logging from a number of threads over the
+ * unix socket and over the shared memory ring. Needs a plogd listening on
+ * PLOG_SOCKET, e.g.
+ *
+ *   plogd -unix-socket /tmp/plog.sock -file /dev/null &
+ *   PLOG_SOCKET=/tmp/plog.sock plog_shm_bench
+ *
+ * Messages sent are counted when the client is done with them, so as long as
+ * there are many more than fit in the socket buffer or the ring, this is
+ * close to the rate plogd receives them at.
+ *
+ * Usage: plog_shm_bench [threads] [messages per thread]
+ */
+
+#include "../lib/plog.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static int nmsgs = 200000;
+
+static void *
+bench_thread(void *v) {
+	struct plog_ctx *dict = plog_open_dict(v, "bench");
+	for (int i = 0 ; i < nmsgs ; i++)
+		plog_int(dict, "i", i);
+	plog_close(dict);
+	return NULL;
+}
+
+static double
+elapsed(const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+run(const char *name, bool shm, int nthreads) {
+	struct plog_conn conn = { .lock = PTHREAD_MUTEX_INITIALIZER, .shm_lock = PTHREAD_RWLOCK_INITIALIZER };
+	pthread_t thr[nthreads];
+	struct timespec start;
+
+	if (shm)
+		setenv("PLOG_SHM", "1", 1);
+	else
+		unsetenv("PLOG_SHM");
+
+	struct plog_ctx *root = plog_open_log(&conn, "bench");
+	if (conn.fd <= 0)
+		xerrx(1, "Failed to connect to plogd, check PLOG_SOCKET");
+	if (shm && !conn.shm)
+		xerrx(1, "plogd didn't hand out a shared memory ring");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0 ; i < nthreads ; i++)
+		pthread_create(&thr[i], NULL, bench_thread, root);
+	for (int i = 0 ; i < nthreads ; i++)
+		pthread_join(thr[i], NULL);
+	double t = elapsed(&start);
+	int failed = plog_close(root);
+
+	double n = (double)nthreads * nmsgs;
+	printf("%-8s %14.0f %12.1f %8d\n", name, n / t, t * 1e9 / n, failed);
+}
+
+int
+main(int argc, char *argv[]) {
+	int nthreads = 4;
+
+	if (argc > 1)
+		nthreads = atoi(argv[1]);
+	if (argc > 2)
+		nmsgs = atoi(argv[2]);
+
+	printf("%d threads, %d messages each\n", nthreads, nmsgs);
+	printf("%-8s %14s %12s %8s\n", "", "msgs/s", "ns/msg", "failed");
+	run("socket", false, nthreads);
+	run("shm", true, nthreads);
+	return 0;
+}
@@ -1,10 +1,13 @@
 // Copyright 2018 Schibsted
 
 #include "../lib/plog.c"
+#include "../lib/logging.h"
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 
 #define TEST(cond, ...) test(cond, __func__, __FILE__, __LINE__, #cond, __VA_ARGS__)
 static void
@@ -87,9 +90,583 @@ test_encode_latin2(void) {
 	plog_set_global_charset(PLOG_UTF8);
 }
 
+static void
+test_encode_wire(void) {
+	struct plog_ctx pctx = { .id = 7 };
+	char *keys[] = { "a", "bc" };
+	struct plog_ctx ctx = {
+		.pctx = &pctx,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.id = 300,
+		.ctype = PLOGPROTO__CTX_TYPE__dict,
+		.n_key = 2,
+		.key = keys,
+		.flags = PLOG_BUFFERED,
+	};
+	char big[1000];
+	memset(big, 'x', sizeof(big));
+
+	plog_encode_open(&ctx);
+	ctx.open_pending = true;
+	plog_publish(&ctx, "keyXX", 3, "\"v\"", 3);
+	plog_publish(&ctx, NULL, -1, big, sizeof(big));
+	ctx.close_pending = true;
+
+	uint8_t hdr[PLOG_FRAME_HDR_MAX];
+	struct iovec iov[4];
+	int iovcnt;
+	size_t flen = plog_frame(&ctx, hdr, iov, &iovcnt);
+	uint8_t frame[flen];
+	size_t off = 0;
+	for (int i = 0 ; i < iovcnt ; i++) {
+		memcpy(frame + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	TEST(off == flen, "Frame length %zu, expected %zu", off, flen);
+
+	uint32_t sz;
+	memcpy(&sz, frame, sizeof(sz));
+	TEST(ntohl(sz) == flen - 4, "Bad length prefix %u", ntohl(sz));
+
+	Plogproto__Plog *plog = plogproto__plog__unpack(NULL, flen - 4, frame + 4);
+	TEST(plog != NULL, "Failed to unpack");
+	TEST(plog->has_ctx_id && plog->ctx_id == 300, "Bad ctx_id");
+	TEST(plog->open && plog->open->ctxtype == PLOGPROTO__CTX_TYPE__dict, "Bad open");
+	TEST(plog->open->n_key == 2 && strcmp(plog->open->key[1], "bc") == 0, "Bad open keys");
+	TEST(plog->open->has_parent_ctx_id && plog->open->parent_ctx_id == 7, "Bad parent");
+	TEST(plog->n_msg == 2, "Unexpected n_msg %zu", plog->n_msg);
+	TEST(strcmp(plog->msg[0]->key, "key") == 0, "Bad key %s", plog->msg[0]->key);
+	TEST(plog->msg[0]->value.len == 3 && memcmp(plog->msg[0]->value.data, "\"v\"", 3) == 0, "Bad value");
+	TEST(strcmp(plog->msg[1]->key, PLOG_DEFAULT_KEY) == 0, "Bad default key %s", plog->msg[1]->key);
+	TEST(plog->msg[1]->value.len == sizeof(big), "Bad value length %zu", plog->msg[1]->value.len);
+	TEST(plog->has_close && plog->close, "Missing close");
+	plogproto__plog__free_unpacked(plog, NULL);
+
+	const uint8_t *p = ctx.msgs.data;
+	const char *key, *value;
+	size_t klen, vlen;
+	int n = 0;
+	while (plog_next_msg(&p, ctx.msgs.data + ctx.msgs.len, &key, &klen, &value, &vlen))
+		n++;
+	TEST(n == 2 && klen == 3 && vlen == sizeof(big), "Bad message iteration");
+
+	free(ctx.open.data);
+	free(ctx.msgs.data);
+}
+
+struct async_reader {
+	char path[32];
+	struct sockaddr_un unaddr;
+	int lfd;
+	int fd;
+	pthread_mutex_t lock;
+	bool hold;
+	pthread_cond_t cond;
+
+	/* Hand out a shared memory ring if asked for. */
+	bool shm;
+	bool shm_used;
+	int nsocket;
+
+	/* Listen on plog-packet.sock with SOCK_SEQPACKET. */
+	bool seqpacket;
+	int npackets;
+	int nframes;
+
+	int nopen;
+	int nclose;
+	int nmsg;
+	int nunopened;
+	bool ordered;
+	long sum;
+	/* Last value seen per ctx id, for checking order. */
+	int last[256];
+	bool opened[256];
+};
+
+static bool
+read_all(int fd, void *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len);
+		if (n <= 0)
+			return false;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return true;
+}
+
+static void
+async_reader_handle(struct async_reader *r, const uint8_t *buf, size_t len) {
+	Plogproto__Plog *plog = plogproto__plog__unpack(NULL, len, buf);
+	uint64_t id = plog->ctx_id;
+	if (id >= 256) {
+		r->ordered = false;
+	} else {
+		if (plog->open) {
+			r->opened[id] = true;
+			r->nopen++;
+		}
+		for (size_t i = 0 ; i < plog->n_msg ; i++) {
+			const char *value = (char *)plog->msg[i]->value.data;
+			if (!r->opened[id])
+				r->nunopened++;
+			r->nmsg++;
+			/* Only integers are checked for order. */
+			if (value[0] == '"')
+				continue;
+			int val = atoi(value);
+			r->sum += val;
+			if (val <= r->last[id])
+				r->ordered = false;
+			r->last[id] = val;
+		}
+		if (plog->has_close && plog->close)
+			r->nclose++;
+	}
+	plogproto__plog__free_unpacked(plog, NULL);
+}
+
+static bool
+async_reader_frame(struct async_reader *r) {
+	uint32_t sz;
+	if (!read_all(r->fd, &sz, sizeof(sz)))
+		return false;
+	uint8_t *buf = xmalloc(ntohl(sz) + 1);
+	bool ok = read_all(r->fd, buf, ntohl(sz));
+	if (ok)
+		async_reader_handle(r, buf, ntohl(sz));
+	free(buf);
+	return ok;
+}
+
+/* Consumer side of the shared memory transport, as done by plogd. */
+static void
+async_reader_shm(struct async_reader *r) {
+	const size_t size = 1 << 16;
+	char tmpl[] = "/tmp/plog_shm.XXXXXX";
+	int memfd = mkstemp(tmpl);
+	TEST(memfd >= 0, "mkstemp: %m");
+	unlink(tmpl);
+	TEST(ftruncate(memfd, PLOG_SHM_HDR_SIZE + size) == 0, "ftruncate: %m");
+	uint8_t *mem = mmap(NULL, PLOG_SHM_HDR_SIZE + size, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+	TEST(mem != MAP_FAILED, "mmap: %m");
+	int efd = eventfd(0, EFD_CLOEXEC);
+	TEST(efd >= 0, "eventfd: %m");
+
+	struct plog_shm shm = { .mem = mem, .data = mem + PLOG_SHM_HDR_SIZE, .mask = size - 1 };
+	*PLOG_SHM_U64(&shm, PLOG_SHM_OFF_SIZE) = size;
+	*PLOG_SHM_U32(&shm, PLOG_SHM_OFF_VERSION) = PLOG_SHM_VERSION;
+	*PLOG_SHM_U32(&shm, PLOG_SHM_OFF_MAGIC) = PLOG_SHM_MAGIC;
+
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} cmsg = {};
+	struct iovec iov = { "PLOGSHM1", 8 };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf) };
+	struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(c), (int[]){ memfd, efd }, 2 * sizeof(int));
+	TEST(sendmsg(r->fd, &mh, 0) == 8, "sendmsg: %m");
+	close(memfd);
+	r->shm_used = true;
+
+	uint64_t *tail = PLOG_SHM_U64(&shm, PLOG_SHM_OFF_TAIL);
+	uint32_t *sleeping = PLOG_SHM_U32(&shm, PLOG_SHM_OFF_SLEEPING);
+	while (1) {
+		uint64_t pos = *tail;
+		uint64_t *hdrp = (uint64_t *)(shm.data + (pos & shm.mask));
+		uint64_t hdr = __atomic_load_n(hdrp, __ATOMIC_ACQUIRE);
+		if (!(hdr >> 32 & PLOG_SHM_REC_COMMITTED)) {
+			__atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+			if (!(__atomic_load_n(hdrp, __ATOMIC_SEQ_CST) >> 32 & PLOG_SHM_REC_COMMITTED)) {
+				struct pollfd pfd[2] = { { .fd = efd, .events = POLLIN }, { .fd = r->fd, .events = POLLIN } };
+				char c;
+				poll(pfd, 2, 10);
+				if (pfd[0].revents) {
+					uint64_t v;
+					TEST(read(efd, &v, sizeof(v)) == sizeof(v), "read eventfd: %m");
+				}
+				/* EOF with nothing in the ring, we're done. */
+				if (pfd[1].revents && recv(r->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0
+						&& !(__atomic_load_n(hdrp, __ATOMIC_ACQUIRE) >> 32 & PLOG_SHM_REC_COMMITTED))
+					break;
+			}
+			__atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		uint32_t len = hdr;
+		uint32_t flags = hdr >> 32;
+		if (flags & PLOG_SHM_REC_SOCKET) {
+			TEST(async_reader_frame(r), "Missing socket frame");
+			r->nsocket++;
+		} else if (!(flags & PLOG_SHM_REC_PAD)) {
+			async_reader_handle(r, (uint8_t *)(hdrp + 1), len);
+		}
+		uint64_t reclen = PLOG_SHM_ALIGN(8 + len);
+		memset(hdrp, 0, reclen);
+		__atomic_store_n(tail, pos + reclen, __ATOMIC_RELEASE);
+	}
+	*PLOG_SHM_U32(&shm, PLOG_SHM_OFF_CLOSED) = 1;
+	munmap(mem, PLOG_SHM_HDR_SIZE + size);
+	close(efd);
+}
+
+/* Packets are read into a fixed size buffer like plogd does, frames can span them. */
+static void
+async_reader_seqpacket(struct async_reader *r) {
+	struct buf_string stream = {};
+	size_t pos = 0;
+	char pkt[PLOG_SEQPACKET_MAX];
+	ssize_t n;
+
+	while ((n = recv(r->fd, pkt, sizeof(pkt), MSG_TRUNC)) > 0) {
+		TEST(n <= (ssize_t)sizeof(pkt), "Packet too large: %zd", n);
+		r->npackets++;
+		bswrite(&stream, pkt, n);
+		while (stream.pos - pos >= 4) {
+			uint32_t sz;
+			memcpy(&sz, stream.buf + pos, sizeof(sz));
+			if (stream.pos - pos - 4 < ntohl(sz))
+				break;
+			async_reader_handle(r, (uint8_t *)stream.buf + pos + 4, ntohl(sz));
+			r->nframes++;
+			pos += 4 + ntohl(sz);
+		}
+	}
+	TEST(pos == (size_t)stream.pos, "Partial frame at EOF");
+	free(stream.buf);
+}
+
+static void *
+async_reader_thread(void *v) {
+	struct async_reader *r = v;
+	r->fd = accept(r->lfd, NULL, NULL);
+
+	pthread_mutex_lock(&r->lock);
+	while (r->hold)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+
+	if (r->seqpacket) {
+		async_reader_seqpacket(r);
+		close(r->fd);
+		return NULL;
+	}
+
+	uint32_t sz;
+	bool first = true;
+	while (read_all(r->fd, &sz, sizeof(sz))) {
+		if (first && sz == 0) {
+			if (r->shm) {
+				async_reader_shm(r);
+				break;
+			}
+			TEST(write(r->fd, "PLOGSOCK", 8) == 8, "write: %m");
+			continue;
+		}
+		first = false;
+		uint8_t *buf = xmalloc(ntohl(sz) + 1);
+		bool ok = read_all(r->fd, buf, ntohl(sz));
+		if (ok)
+			async_reader_handle(r, buf, ntohl(sz));
+		free(buf);
+		if (!ok)
+			break;
+	}
+	close(r->fd);
+	return NULL;
+}
+
+static void
+async_reader_start(struct async_reader *r, pthread_t *thr, bool hold) {
+	strlcpy(r->path, "/tmp/plog_test.XXXXXX", sizeof(r->path));
+	TEST(mkdtemp(r->path) != NULL, "mkdtemp: %m");
+
+	r->unaddr.sun_family = AF_UNIX;
+	snprintf(r->unaddr.sun_path, sizeof(r->unaddr.sun_path), "%s/%s", r->path, r->seqpacket ? "plog-packet.sock" : "plog.sock");
+	r->lfd = socket(AF_UNIX, r->seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+	TEST(bind(r->lfd, (struct sockaddr *)&r->unaddr, sizeof(r->unaddr)) == 0, "bind: %m");
+	TEST(listen(r->lfd, 1) == 0, "listen: %m");
+	/* The client finds plog-packet.sock on its own. */
+	char path[sizeof(r->unaddr.sun_path)];
+	snprintf(path, sizeof(path), "%s/plog.sock", r->path);
+	setenv("PLOG_SOCKET", path, 1);
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->hold = hold;
+	r->ordered = true;
+	pthread_create(thr, NULL, async_reader_thread, r);
+}
+
+static void
+async_reader_release(struct async_reader *r) {
+	pthread_mutex_lock(&r->lock);
+	r->hold = false;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+#define ASYNC_THREADS 4
+#define ASYNC_MSGS 5000
+
+struct async_writer {
+	struct plog_ctx *root;
+	int dropped;
+};
+
+static void *
+async_writer_thread(void *v) {
+	struct async_writer *w = v;
+	struct plog_ctx *dict = plog_open_dict(w->root, "dict");
+	for (int i = 1 ; i <= ASYNC_MSGS ; i++)
+		plog_int(dict, "i", i);
+	w->dropped = plog_close(dict);
+	return NULL;
+}
+
+static void
+test_async(enum plog_async_policy policy) {
+	struct plog_conn conn = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	struct async_reader r = {};
+	pthread_t rthr, wthr[ASYNC_THREADS];
+	struct async_writer w[ASYNC_THREADS] = {};
+
+	/* For the drop policy, hold the reader back until the socket buffer and rings fill up. */
+	async_reader_start(&r, &rthr, policy == PLOG_ASYNC_DROP);
+
+	TEST(plog_start_async(&conn, 4096, policy) == 0, "plog_start_async: %m");
+	struct plog_ctx *root = plog_open_log(&conn, "test");
+	TEST(conn.fd > 0, "Not connected");
+
+	for (int i = 0 ; i < ASYNC_THREADS ; i++) {
+		w[i].root = root;
+		pthread_create(&wthr[i], NULL, async_writer_thread, &w[i]);
+	}
+	int dropped = 0;
+	for (int i = 0 ; i < ASYNC_THREADS ; i++) {
+		pthread_join(wthr[i], NULL);
+		dropped += w[i].dropped;
+	}
+	async_reader_release(&r);
+
+	plog_close(root);
+	uint64_t adropped = plog_async_dropped(&conn);
+	plog_stop_async(&conn);
+	pthread_join(rthr, NULL);
+	close(r.lfd);
+	unlink(r.unaddr.sun_path);
+	rmdir(r.path);
+
+	TEST(r.ordered, "Messages out of order");
+	TEST(r.nopen + adropped >= ASYNC_THREADS + 1, "Unexpected number of opens: %d", r.nopen);
+	if (policy == PLOG_ASYNC_BLOCK) {
+		TEST(adropped == 0, "Unexpected drops: %" PRIu64, adropped);
+		TEST(r.nunopened == 0, "Messages before open: %d", r.nunopened);
+		TEST(r.nmsg == ASYNC_THREADS * ASYNC_MSGS, "Unexpected number of messages: %d", r.nmsg);
+		TEST(r.nclose == ASYNC_THREADS + 1, "Unexpected number of closes: %d", r.nclose);
+	} else {
+		TEST(adropped > 0, "Expected drops");
+		TEST(r.nopen + r.nmsg + r.nclose + adropped == ASYNC_THREADS * (ASYNC_MSGS + 2) + 2,
+				"Messages lost: %d + %d + %d received, %" PRIu64 " dropped", r.nopen, r.nmsg, r.nclose, adropped);
+		TEST((uint64_t)dropped <= adropped, "Dropped messages not counted as failed writes");
+	}
+}
+
+static void
+test_shm(bool server_shm) {
+	struct plog_conn conn = { .lock = PTHREAD_MUTEX_INITIALIZER, .shm_lock = PTHREAD_RWLOCK_INITIALIZER };
+	struct async_reader r = { .shm = server_shm };
+	pthread_t rthr, wthr[ASYNC_THREADS];
+	struct async_writer w[ASYNC_THREADS] = {};
+
+	setenv("PLOG_SHM", "1", 1);
+	async_reader_start(&r, &rthr, false);
+	struct plog_ctx *root = plog_open_log(&conn, "test");
+	TEST(conn.fd > 0, "Not connected");
+	TEST((conn.shm != NULL) == server_shm, "Unexpected transport");
+
+	for (int i = 0 ; i < ASYNC_THREADS ; i++) {
+		w[i].root = root;
+		pthread_create(&wthr[i], NULL, async_writer_thread, &w[i]);
+	}
+	/* Larger than a quarter of the ring, sent on the socket. */
+	char *big = xmalloc(20000);
+	memset(big, 'x', 20000 - 1);
+	big[20000 - 1] = '\0';
+	struct plog_ctx *dict = plog_open_dict(root, "big");
+	for (int i = 1 ; i <= 10 ; i++) {
+		plog_int(dict, "i", i);
+		plog_string(dict, "big", big);
+	}
+	plog_close(dict);
+	free(big);
+
+	int dropped = 0;
+	for (int i = 0 ; i < ASYNC_THREADS ; i++) {
+		pthread_join(wthr[i], NULL);
+		dropped += w[i].dropped;
+	}
+	plog_close(root);
+	pthread_join(rthr, NULL);
+	close(r.lfd);
+	unlink(r.unaddr.sun_path);
+	rmdir(r.path);
+	unsetenv("PLOG_SHM");
+
+	TEST(dropped == 0, "Failed writes: %d", dropped);
+	TEST(r.ordered, "Messages out of order");
+	TEST(r.shm_used == server_shm, "Unexpected transport on the server");
+	TEST(!server_shm || r.nsocket == 10, "Unexpected socket messages: %d", r.nsocket);
+	TEST(r.nunopened == 0, "Messages before open: %d", r.nunopened);
+	TEST(r.nopen == ASYNC_THREADS + 2, "Unexpected number of opens: %d", r.nopen);
+	TEST(r.nmsg == ASYNC_THREADS * ASYNC_MSGS + 20, "Unexpected number of messages: %d", r.nmsg);
+	TEST(r.nclose == ASYNC_THREADS + 2, "Unexpected number of closes: %d", r.nclose);
+}
+
+static void
+test_seqpacket(bool async) {
+	struct plog_conn conn = { .lock = PTHREAD_MUTEX_INITIALIZER, .shm_lock = PTHREAD_RWLOCK_INITIALIZER };
+	struct async_reader r = { .seqpacket = true };
+	pthread_t rthr, wthr[ASYNC_THREADS];
+	struct async_writer w[ASYNC_THREADS] = {};
+
+	async_reader_start(&r, &rthr, false);
+	if (async)
+		TEST(plog_start_async(&conn, 0, PLOG_ASYNC_BLOCK) == 0, "plog_start_async: %m");
+	struct plog_ctx *root = plog_open_log(&conn, "test");
+	TEST(conn.fd > 0 && conn.seqpacket, "Not connected with seqpacket");
+
+	for (int i = 0 ; i < ASYNC_THREADS ; i++) {
+		w[i].root = root;
+		pthread_create(&wthr[i], NULL, async_writer_thread, &w[i]);
+	}
+	/* Spans several packets. */
+	char *big = xmalloc(3 * PLOG_SEQPACKET_MAX);
+	memset(big, 'x', 3 * PLOG_SEQPACKET_MAX - 1);
+	big[3 * PLOG_SEQPACKET_MAX - 1] = '\0';
+	plog_string(root, "big", big);
+	free(big);
+
+	int dropped = 0;
+	for (int i = 0 ; i < ASYNC_THREADS ; i++) {
+		pthread_join(wthr[i], NULL);
+		dropped += w[i].dropped;
+	}
+	plog_close(root);
+	if (async)
+		plog_stop_async(&conn);
+	pthread_join(rthr, NULL);
+	close(r.lfd);
+	unlink(r.unaddr.sun_path);
+	rmdir(r.path);
+
+	TEST(dropped == 0, "Failed writes: %d", dropped);
+	TEST(r.ordered, "Messages out of order");
+	TEST(r.nunopened == 0, "Messages before open: %d", r.nunopened);
+	TEST(r.nmsg == ASYNC_THREADS * ASYNC_MSGS + 1, "Unexpected number of messages: %d", r.nmsg);
+	TEST(r.nclose == ASYNC_THREADS + 1, "Unexpected number of closes: %d", r.nclose);
+	/* The flusher batches many frames into each packet. */
+	TEST(!async || r.npackets * 4 < r.nframes, "%d packets for %d frames", r.npackets, r.nframes);
+}
+
+static void
+test_sampling(void) {
+	struct plog_conn conn = { .lock = PTHREAD_MUTEX_INITIALIZER, .shm_lock = PTHREAD_RWLOCK_INITIALIZER };
+	struct async_reader r = {};
+	pthread_t rthr;
+	int nsampled = 0, nlimited = 0, nother = 0;
+	struct plog_ctx *ctx;
+
+	async_reader_start(&r, &rthr, false);
+	/* Keeps the connection open. */
+	struct plog_ctx *root = plog_open_log_flags(&conn, "test", PLOG_NO_SAMPLING);
+
+	plog_set_sampling("sampled", 4, 0, 0);
+	plog_set_sampling("limited", 0, 0.001, 5);
+	for (int i = 0 ; i < 20 ; i++) {
+		if ((ctx = plog_open_log(&conn, "sampled"))) {
+			nsampled++;
+			plog_close(ctx);
+		}
+		if ((ctx = plog_open_log(&conn, "limited"))) {
+			nlimited++;
+			plog_close(ctx);
+		}
+		if ((ctx = plog_open_log(&conn, "other"))) {
+			nother++;
+			plog_close(ctx);
+		}
+	}
+	ctx = plog_open_log_flags(&conn, "sampled", PLOG_NO_SAMPLING);
+	TEST(ctx != NULL, "Expected PLOG_NO_SAMPLING to open");
+	plog_close(ctx);
+
+	plog_set_sampling("sampled", 0, 0, 0);
+	plog_set_sampling("limited", 0, 0, 0);
+	ctx = plog_open_log(&conn, "sampled");
+	TEST(ctx != NULL, "Expected open after removing the rule");
+	plog_close(ctx);
+
+	plog_close(root);
+	pthread_join(rthr, NULL);
+	close(r.lfd);
+	unlink(r.unaddr.sun_path);
+	rmdir(r.path);
+
+	TEST(nsampled == 5, "Unexpected number of sampled contexts: %d", nsampled);
+	TEST(nlimited == 5, "Unexpected number of rate limited contexts: %d", nlimited);
+	TEST(nother == 20, "Unexpected number of other contexts: %d", nother);
+	/* The dropped counts are the only integers logged. */
+	TEST(r.sum == 30, "Unexpected dropped count %ld", r.sum);
+	TEST(r.nopen == r.nclose && r.nopen == 1 + 30 + 2 + 2, "Unexpected number of opens: %d", r.nopen);
+}
+
+static void
+test_log_kv(void) {
+	struct async_reader r = {};
+	pthread_t rthr;
+	int evaluated = 0;
+
+	async_reader_start(&r, &rthr, false);
+	log_setup("test", "info");
+
+	/* Disabled levels don't evaluate the arguments. */
+	log_printf(LOG_DEBUG, "not logged %d", ++evaluated);
+	log_kv(LOG_DEBUG, "not logged", LOG_KV_INT("n", ++evaluated));
+	TEST(!log_enabled(LOG_DEBUG) && log_enabled(LOG_INFO), "Unexpected log_enabled");
+
+	log_kv(LOG_INFO, "logged", LOG_KV_INT("n", 42), LOG_KV_STR("s", "x"), LOG_KV_BOOL("b", true));
+	log_shutdown();
+
+	pthread_join(rthr, NULL);
+	close(r.lfd);
+	unlink(r.unaddr.sun_path);
+	rmdir(r.path);
+
+	TEST(evaluated == 0, "Arguments evaluated for disabled level");
+	/* The logging context and the dictionary. */
+	TEST(r.nopen == 2 && r.nclose == 2, "Unexpected number of opens: %d, closes: %d", r.nopen, r.nclose);
+	TEST(r.nmsg == 4, "Unexpected number of messages: %d", r.nmsg);
+	TEST(r.sum == 42, "Unexpected integer value: %ld", r.sum);
+}
+
 int
 main(int argc, const char *argv[]) {
 	test_json_encode_buf_malloc();
 	test_encode_latin2();
+	test_encode_wire();
+	test_async(PLOG_ASYNC_BLOCK);
+	test_async(PLOG_ASYNC_DROP);
+	test_shm(true);
+	test_shm(false);
+	test_seqpacket(false);
+	test_seqpacket(true);
+	test_sampling();
+	test_log_kv();
 	return 0;
 }
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "sbalance.h"
 #include "sbp/atomic.h"
@@ -25,9 +26,30 @@ void sbalance_rand_init(struct sbalance_connection *, uint32_t);
 void sbalance_rand_reinit(struct sbalance_connection *);
 int sbalance_rcycle_next(struct sbalance_connection *);
 
+void sbalance_ewma_init(struct sbalance_connection *, uint32_t);
+void sbalance_ring_init(struct sbalance_connection *, uint32_t);
+
 static struct sb_strategy strat_seq = { sbalance_seq_init, sbalance_seq_reinit, sbalance_seq_next };
 static struct sb_strategy strat_rand = { sbalance_rand_init, sbalance_rand_reinit, sbalance_rcycle_next };
 static struct sb_strategy strat_hash = { sbalance_hash_init, sbalance_rand_reinit, sbalance_rcycle_next };
+static struct sb_strategy strat_ewma = { sbalance_ewma_init, sbalance_rand_reinit, sbalance_rcycle_next };
+static struct sb_strategy strat_ring = { sbalance_ring_init, sbalance_rand_reinit, sbalance_rcycle_next };
+
+/* Weight of new latency samples, as a shift. 3 means 1/8. */
+#define SB_EWMA_SHIFT 3
+/* The latency average is halved this often while not updated. */
+#define SB_EWMA_DECAY_MS 1000
+
+/* Virtual nodes on the ring for the cheapest services, others get fewer. */
+#define SB_RING_VNODES 160
+
+struct sb_ring {
+	unsigned int npoints;
+	struct sb_ring_point {
+		uint32_t pos;
+		unsigned int serv;
+	} points[];
+};
 
 struct sbalance *
 sbalance_create(unsigned int retries, unsigned int failcost, unsigned int softfailcost, enum sbalance_strat strat) {
@@ -46,6 +68,12 @@ sbalance_create(unsigned int retries, unsigned int failcost, unsigned int softfa
 	case ST_HASH:
 		sb->sb_strat = &strat_hash;
 		break;
+	case ST_EWMA:
+		sb->sb_strat = &strat_ewma;
+		break;
+	case ST_RING:
+		sb->sb_strat = &strat_ring;
+		break;
 	}
 
 	sb->sb_refs = 1;
@@ -71,6 +99,7 @@ sbalance_release(struct sbalance *sb, void (*free_f)(void *)) {
 		}
 	}
 	free(sb->sb_service);
+	free(sb->sb_ring);
 	free(sb);
 }
 
@@ -79,13 +108,31 @@ sbalance_release(struct sbalance *sb, void (*free_f)(void *)) {
  */
 void
 sbalance_add_serv(struct sbalance *sb, int cost, void *data) {
+	char key[32];
+
+	snprintf(key, sizeof(key), "%u", sb->sb_nserv);
+	sbalance_add_serv_key(sb, cost, data, key);
+}
+
+/*
+ * The key identifies the service on the hash ring for ST_RING.
+ */
+void
+sbalance_add_serv_key(struct sbalance *sb, int cost, void *data, const char *key) {
 	if (cost == 0)
 		cost = 1;
 
+	free(sb->sb_ring);
+	sb->sb_ring = NULL;
+
 	sb->sb_service = xrealloc(sb->sb_service, sizeof(*sb->sb_service) * (sb->sb_nserv + 1));
 	sb->sb_service[sb->sb_nserv].cost = cost;
 	sb->sb_service[sb->sb_nserv].tempfailcost = 0;
 	sb->sb_service[sb->sb_nserv].data = data;
+	sb->sb_service[sb->sb_nserv].outstanding = 0;
+	sb->sb_service[sb->sb_nserv].ewma_us = 0;
+	sb->sb_service[sb->sb_nserv].ewma_stamp_ms = 0;
+	sb->sb_service[sb->sb_nserv].ring_key = sbalance_hash_string(key);
 	sb->sb_nserv++;
 }
 
@@ -95,37 +142,87 @@ sbalance_strat(struct sbalance *sb) {
 		return ST_SEQ;
 	if (sb->sb_strat == &strat_rand)
 		return ST_RANDOM;
+	if (sb->sb_strat == &strat_ewma)
+		return ST_EWMA;
+	if (sb->sb_strat == &strat_ring)
+		return ST_RING;
 	return ST_HASH;
 }
 
+void
+sbalance_set_load_bound(struct sbalance *sb, double factor) {
+	sb->sb_loadbound = factor;
+}
+
+static uint64_t
+sbalance_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+sbalance_release_pending(struct sbalance_connection *sc) {
+	if (!sc->sc_pending)
+		return;
+	sc->sc_pending = false;
+	atomic_xadd_int(&sc->sc_sb->sb_service[sc->sc_last].outstanding, -1);
+	atomic_xadd_int(&sc->sc_sb->sb_outstanding, -1);
+}
+
 void
 sbalance_conn_new(struct sbalance_connection *sc, struct sbalance *sb, uint32_t hash) {
 	sc->sc_sb = sbalance_retain(sb);
+	sc->sc_pending = false;
 
 	(*sb->sb_strat->strat_init)(sc, hash);
 }
 
+void
+sbalance_serv_status(struct sbalance *sb, unsigned int serv, enum sbalance_conn_status status) {
+	switch (status) {
+	case SBCS_START:
+		sb->sb_service[serv].tempfailcost = 0;
+		break;
+	case SBCS_FAIL:
+		sb->sb_service[serv].tempfailcost = sb->sb_failcost;
+		break;
+	case SBCS_TEMPFAIL:
+		sb->sb_service[serv].tempfailcost = sb->sb_softfailcost;
+		break;
+	}
+}
+
+void
+sbalance_copy_stats(struct sbalance *dst, const struct sbalance *src, bool (*same)(const void *a, const void *b)) {
+	for (unsigned int i = 0 ; i < dst->sb_nserv ; i++) {
+		for (unsigned int j = 0 ; j < src->sb_nserv ; j++) {
+			if (!same(dst->sb_service[i].data, src->sb_service[j].data))
+				continue;
+			dst->sb_service[i].tempfailcost = src->sb_service[j].tempfailcost;
+			dst->sb_service[i].ewma_us = src->sb_service[j].ewma_us;
+			dst->sb_service[i].ewma_stamp_ms = src->sb_service[j].ewma_stamp_ms;
+			break;
+		}
+	}
+}
+
 void *
 sbalance_conn_next(struct sbalance_connection *sc, enum sbalance_conn_status status) {
 	struct sbalance *sb = sc->sc_sb;
-	int newcost = 0;
 
 	if (sb->sb_nserv == 0)
 		return NULL;
 
+	sbalance_release_pending(sc);
+
 	/*
 	 * If the last connection failed for some reason, account for it in the temporary
 	 * cost. Note, that we don't recalculate anything for this connection, this is
 	 * for future use.
 	 */
-	if (status != SBCS_START) {
-		if (status == SBCS_FAIL)
-			newcost = sb->sb_failcost;
-		else
-			newcost = sb->sb_softfailcost;
-
-		sb->sb_service[sc->sc_last].tempfailcost = newcost;
-	}
+	if (status != SBCS_START)
+		sbalance_serv_status(sb, sc->sc_last, status);
 
 
 	if (sc->sc_first == 0) {
@@ -136,7 +233,14 @@ sbalance_conn_next(struct sbalance_connection *sc, enum sbalance_conn_status sta
 
 	sc->sc_first--;
 
-	return sc->sc_sb->sb_service[sc->sc_last = (*sb->sb_strat->strat_next)(sc)].data;
+	sc->sc_last = (*sb->sb_strat->strat_next)(sc);
+	if (sb->sb_strat == &strat_ewma || (sb->sb_strat == &strat_ring && sb->sb_loadbound > 0)) {
+		atomic_xadd_int(&sb->sb_service[sc->sc_last].outstanding, 1);
+		atomic_xadd_int(&sb->sb_outstanding, 1);
+		sc->sc_pending = true;
+	}
+
+	return sb->sb_service[sc->sc_last].data;
 }
 
 void
@@ -153,6 +257,31 @@ sbalance_conn_done(struct sbalance_connection *sc) {
 	if (sb && sb->sb_nserv && sc->sc_retries >= 0 && sb->sb_service[sc->sc_last].tempfailcost) {
 		sb->sb_service[sc->sc_last].tempfailcost = 0;
 	}
+
+	if (sb)
+		sbalance_release_pending(sc);
+}
+
+void
+sbalance_conn_report(struct sbalance_connection *sc, unsigned int latency_us) {
+	if (!sc->sc_pending)
+		return;
+
+	struct sb_service *serv = &sc->sc_sb->sb_service[sc->sc_last];
+
+	/*
+	 * Racy read-modify-write, concurrent reports might lose a sample,
+	 * which doesn't matter for an average.
+	 */
+	int64_t ewma = serv->ewma_us;
+	if (serv->ewma_stamp_ms)
+		ewma += ((int64_t)latency_us - ewma) >> SB_EWMA_SHIFT;
+	else
+		ewma = latency_us;
+	serv->ewma_us = ewma;
+	serv->ewma_stamp_ms = sbalance_now_ms();
+
+	sbalance_release_pending(sc);
 }
 
 void
@@ -222,6 +351,153 @@ sbalance_hash_init(struct sbalance_connection *sc, uint32_t hash) {
 	sc->sc_retries = sb->sb_retries;
 }
 
+static double
+sbalance_ewma_score(struct sb_service *serv, uint64_t now) {
+	uint64_t ewma = serv->ewma_us;
+	uint64_t age = now - serv->ewma_stamp_ms;
+
+	if (age >= SB_EWMA_DECAY_MS)
+		ewma >>= age / SB_EWMA_DECAY_MS < 32 ? age / SB_EWMA_DECAY_MS : 32;
+
+	return (double)(serv->tempfailcost ?: serv->cost) * (ewma + 1) * (serv->outstanding + 1);
+}
+
+void
+sbalance_ewma_init(struct sbalance_connection *sc, uint32_t hash) {
+	struct sbalance *sb = sc->sc_sb;
+	unsigned int pick = 0;
+
+	if (sb->sb_nserv > 1) {
+		uint64_t now = sbalance_now_ms();
+		unsigned int a = arc4random_uniform(sb->sb_nserv);
+		unsigned int b = arc4random_uniform(sb->sb_nserv - 1);
+
+		if (b >= a)
+			b++;
+		pick = sbalance_ewma_score(&sb->sb_service[b], now) < sbalance_ewma_score(&sb->sb_service[a], now) ? b : a;
+	}
+
+	sc->sc_offs = pick;
+	sc->sc_first = 1;
+	sc->sc_retries = sb->sb_retries;
+}
+
+/* Murmur3 finalizer, spreads the bits of weak hashes over the ring. */
+static uint32_t
+sbalance_mix32(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static int
+sbalance_ring_point_cmp(const void *a, const void *b) {
+	const struct sb_ring_point *pa = a, *pb = b;
+
+	if (pa->pos != pb->pos)
+		return pa->pos < pb->pos ? -1 : 1;
+	return (int)pa->serv - (int)pb->serv;
+}
+
+static struct sb_ring *
+sbalance_ring_build(struct sbalance *sb) {
+	unsigned int mincost = sb->sb_service[0].cost;
+	unsigned int npoints = 0;
+	unsigned int i, j;
+
+	for (i = 1; i < sb->sb_nserv; i++) {
+		if (sb->sb_service[i].cost < mincost)
+			mincost = sb->sb_service[i].cost;
+	}
+	for (i = 0; i < sb->sb_nserv; i++)
+		npoints += SB_RING_VNODES * mincost / sb->sb_service[i].cost ?: 1;
+
+	struct sb_ring *ring = xmalloc(sizeof(*ring) + npoints * sizeof(ring->points[0]));
+	ring->npoints = 0;
+	for (i = 0; i < sb->sb_nserv; i++) {
+		unsigned int vn = SB_RING_VNODES * mincost / sb->sb_service[i].cost ?: 1;
+
+		for (j = 0; j < vn; j++) {
+			ring->points[ring->npoints].pos = sbalance_mix32(sb->sb_service[i].ring_key + j * 0x9e3779b9);
+			ring->points[ring->npoints].serv = i;
+			ring->npoints++;
+		}
+	}
+	qsort(ring->points, ring->npoints, sizeof(ring->points[0]), sbalance_ring_point_cmp);
+
+	return ring;
+}
+
+/*
+ * The ring is built on first use, after all services are added. Threads
+ * racing to build it will agree on one of them.
+ */
+static struct sb_ring *
+sbalance_ring(struct sbalance *sb) {
+	struct sb_ring *ring = sb->sb_ring;
+
+	if (ring)
+		return ring;
+
+	ring = sbalance_ring_build(sb);
+	if (atomic_cas_ptr(&sb->sb_ring, NULL, ring) != NULL) {
+		free(ring);
+		ring = sb->sb_ring;
+	}
+	return ring;
+}
+
+void
+sbalance_ring_init(struct sbalance_connection *sc, uint32_t hash) {
+	struct sbalance *sb = sc->sc_sb;
+
+	sc->sc_offs = 0;
+	sc->sc_first = 1;
+	sc->sc_retries = sb->sb_retries;
+
+	if (sb->sb_nserv == 0)
+		return;
+
+	struct sb_ring *ring = sbalance_ring(sb);
+	uint32_t pos = sbalance_mix32(hash ?: arc4random());
+	unsigned int lo = 0, hi = ring->npoints;
+
+	/* First point at or after pos, wrapping around. */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (ring->points[mid].pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == ring->npoints)
+		lo = 0;
+
+	if (sb->sb_loadbound > 0) {
+		/* Bounded loads, walk on until finding a service below the cap. There's always one. */
+		double avg = sb->sb_loadbound * (sb->sb_outstanding + 1) / sb->sb_nserv;
+		int cap = avg;
+		unsigned int i;
+
+		if (cap < avg)
+			cap++;
+
+		for (i = 0; i < ring->npoints; i++) {
+			unsigned int p = (lo + i) % ring->npoints;
+
+			if (sb->sb_service[ring->points[p].serv].outstanding + 1 <= cap) {
+				lo = p;
+				break;
+			}
+		}
+	}
+
+	sc->sc_offs = ring->points[lo].serv;
+}
+
 int
 sbalance_rcycle_next(struct sbalance_connection *sc) {
 	if (sc->sc_offs != -1)
@@ -38,6 +38,26 @@
  *
  * sbalance_conn_done should be called so that we can know when a
  * failed connection has started to respond again.
+ *
+ * The ST_EWMA strategy also takes the latency and the number of
+ * outstanding requests of each service into account. The first service
+ * is picked by comparing two random services ("power of two choices")
+ * and taking the one with the lowest cost * latency * (outstanding + 1),
+ * where latency is an exponentially weighted moving average of the
+ * values passed to sbalance_conn_report. A service is outstanding
+ * from when it's returned by sbalance_conn_next until the next call
+ * to sbalance_conn_next, sbalance_conn_report or sbalance_conn_done.
+ * The average decays while a service is not reported on, so that slow
+ * services are tried again after a while.
+ * Fallbacks are random, as for ST_RANDOM.
+ *
+ * The ST_RING strategy picks the first service from a consistent hash
+ * ring, with virtual nodes weighted by cost, so that adding or removing
+ * a service only moves the hashes mapped to it. Services should be added
+ * with sbalance_add_serv_key to be identified by something more stable
+ * than their position. With sbalance_set_load_bound, services having
+ * more than factor times the average number of outstanding connections
+ * are skipped over on the ring. Fallbacks are random.
  */
 
 #include "sbp/rcycle.h"
@@ -56,10 +76,20 @@ struct sbalance {
 		unsigned int cost;
 		unsigned int tempfailcost;
 		void *data;
+
+		/* Only used by ST_EWMA and ST_RING. */
+		int outstanding;
+		unsigned int ewma_us;
+		uint64_t ewma_stamp_ms;
+		uint32_t ring_key;
 	} *sb_service;
 
 	struct sb_strategy *sb_strat;
 	int sb_refs;
+
+	struct sb_ring *sb_ring;
+	double sb_loadbound;
+	int sb_outstanding;
 };
 
 struct sbalance_connection {
@@ -72,6 +102,7 @@ struct sbalance_connection {
 	int sc_offs;
 
 	unsigned int sc_last;
+	bool sc_pending;
 };
 
 enum sbalance_conn_status {
@@ -83,7 +114,9 @@ enum sbalance_conn_status {
 enum sbalance_strat {
 	ST_SEQ,
 	ST_RANDOM,
-	ST_HASH
+	ST_HASH,
+	ST_EWMA,
+	ST_RING
 };
 
 struct sbalance *sbalance_create(unsigned int retries, unsigned int failcost, unsigned int softfailcost, enum sbalance_strat);
@@ -92,13 +125,35 @@ struct sbalance *sbalance_retain(struct sbalance *sb);
 void sbalance_release(struct sbalance *sb, void (*free_f)(void *));
 
 void sbalance_add_serv(struct sbalance *sb, int cost, void *data);
+void sbalance_add_serv_key(struct sbalance *sb, int cost, void *data, const char *key);
+
+/* ST_RING only, ignored by the other strategies. 0 (the default) disables. Set before use. */
+void sbalance_set_load_bound(struct sbalance *sb, double factor);
 
 enum sbalance_strat sbalance_strat(struct sbalance *sb);
 
+/*
+ * Copy the temporary fail costs and latency averages of the services in
+ * src to the ones in dst that same says are the same service, e.g. when
+ * replacing an sbalance with one for an updated set of services.
+ * The outstanding counts are not copied, they belong to src.
+ */
+void sbalance_copy_stats(struct sbalance *dst, const struct sbalance *src, bool (*same)(const void *a, const void *b));
+
 uint32_t sbalance_hash_string(const char *);
 
 void sbalance_conn_new(struct sbalance_connection *sc, struct sbalance *sb, uint32_t hash);
 void *sbalance_conn_next(struct sbalance_connection *sc, enum sbalance_conn_status status);
 void sbalance_conn_done(struct sbalance_connection *sc);
 
+/*
+ * Set the status of a service directly, by its index (sc_last when it was
+ * returned). For users trying several services at once, where the one
+ * failing isn't necessarily the last one returned. SBCS_START clears it.
+ */
+void sbalance_serv_status(struct sbalance *sb, unsigned int serv, enum sbalance_conn_status status);
+
+/* Report the time it took to use the service last returned by sbalance_conn_next. No-op except for ST_EWMA. */
+void sbalance_conn_report(struct sbalance_connection *sc, unsigned int latency_us);
+
 #endif /*COMMON_SBALANCE_H*/
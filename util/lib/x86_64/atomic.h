@@ -29,6 +29,37 @@ x86_atomic_cas_ptr(volatile void *ptr, void *expect, void *set)
 	return (void*)x86_atomic_cas_ul((u_long *)ptr, (u_long)expect, (u_long)set);
 }
 
+/*
+ * Pointer with a generation tag, swapped as one unit to avoid ABA problems
+ * in lock-free lists. The tag is incremented on every successful swap.
+ */
+struct atomic_tagptr {
+	void *ptr;
+	u_long tag;
+} __attribute__((aligned(16)));
+
+static __inline int
+x86_atomic_cas_tagptr(volatile struct atomic_tagptr *tp, struct atomic_tagptr expect, void *set)
+{
+	char res;
+	u_long ntag = expect.tag + 1;
+	__asm volatile("lock cmpxchg16b %1; setz %0"
+			: "=q" (res), "+m" (*tp), "+a" (expect.ptr), "+d" (expect.tag)
+			: "b" (set), "c" (ntag) : "memory", "cc");
+	return (res);
+}
+
+/* Non-atomic read, only useful as the expected value for atomic_cas_tagptr. */
+static __inline struct atomic_tagptr
+x86_atomic_read_tagptr(volatile struct atomic_tagptr *tp)
+{
+	struct atomic_tagptr res;
+	res.tag = tp->tag;
+	__asm volatile("" ::: "memory");
+	res.ptr = tp->ptr;
+	return (res);
+}
+
 #if 0
 static __inline int
 atomic_xadd_int(volatile int *ptr, int add)
@@ -44,5 +75,7 @@ atomic_xadd_int(volatile int *ptr, int add)
 
 #define atomic_cas_int x86_atomic_cas_int
 #define atomic_cas_ptr x86_atomic_cas_ptr
+#define atomic_cas_tagptr x86_atomic_cas_tagptr
+#define atomic_read_tagptr x86_atomic_read_tagptr
 
 #endif /*_ATOMIC_H*/
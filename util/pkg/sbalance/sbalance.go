@@ -11,6 +11,8 @@ import (
 	"hash/fnv"
 	"io"
 	"math/rand"
+	"sync/atomic"
+	"time"
 )
 
 // What kind of strategy should be used to iterate the nodes.
@@ -18,15 +20,32 @@ import (
 // Random first picks a random node based on cost, with random fallback.
 // Hash works like random, but seeds the RNG with the seed given, thus generating
 // the same sequence for the same seed.
+// EWMA picks the first node by comparing two random nodes ("power of two choices")
+// and taking the one with the lowest cost * latency * (outstanding + 1), with random
+// fallback. Latency is a moving average of the values given to Reporter.Report,
+// decaying while a node isn't reported on. A node is outstanding from when it's
+// returned by Next until the next call to Next, Report or Close.
+// Same semantics as ST_EWMA in the C sbalance.
 type BalanceStrat int
 
 const (
 	StratSeq BalanceStrat = iota
 	StratRandom
 	StratHash
+	StratEWMA
+)
+
+const (
+	ewmaShift   = 3    // Weight of new latency samples, 1/8.
+	ewmaDecayMs = 1000 // The latency average is halved this often while not updated.
 )
 
 type nodeData struct {
+	// Only used by StratEWMA, accessed atomically.
+	ewmaUs      int64
+	ewmaStampMs int64 // 0 if never reported.
+	outstanding int32
+
 	cost    int
 	effcost int
 	node    interface{}
@@ -45,7 +64,7 @@ type Service struct {
 // Add a node to the service. This function is not thread safe and can't be used
 // while you're connecting to the nodes.
 func (sb *Service) AddNode(node interface{}, cost int) {
-	sb.nodes = append(sb.nodes, nodeData{cost, cost, node})
+	sb.nodes = append(sb.nodes, nodeData{cost: cost, effcost: cost, node: node})
 }
 
 // Number of nodes.
@@ -73,6 +92,12 @@ type Connection interface {
 	Close() error
 }
 
+// Optionally implemented by a Connection that wants to know how long it took
+// to use the node last returned by Next. Only the StratEWMA connections do.
+type Reporter interface {
+	Report(latency time.Duration)
+}
+
 // The reason you're calling Connection.Next.
 // Start for the first call or when you want to move to the next node even
 // when the current was used successfully.
@@ -92,6 +117,26 @@ func (sb *Service) NewConn(seed []byte) Connection {
 	return stratImpl[sb.Strat](sb, seed)
 }
 
+// Copy the latency averages and failure costs of the nodes in src to the
+// nodes that same says are the same node, e.g. when replacing a Service with
+// one for an updated set of nodes. Outstanding counts are not copied.
+// Like AddNode, this can't be used while you're connecting to the nodes in sb.
+func (sb *Service) CopyStats(src *Service, same func(a, b interface{}) bool) {
+	for i := range sb.nodes {
+		for j := range src.nodes {
+			if !same(sb.nodes[i].node, src.nodes[j].node) {
+				continue
+			}
+			sb.nodes[i].ewmaUs = atomic.LoadInt64(&src.nodes[j].ewmaUs)
+			sb.nodes[i].ewmaStampMs = atomic.LoadInt64(&src.nodes[j].ewmaStampMs)
+			if src.nodes[j].effcost != src.nodes[j].cost {
+				sb.nodes[i].effcost = src.nodes[j].effcost
+			}
+			break
+		}
+	}
+}
+
 // Return the default and effective (current) costs for the given node at idx.
 func (sb *Service) GetCosts(idx int) (cost, effcost int) {
 	return sb.nodes[idx].cost, sb.nodes[idx].effcost
@@ -101,6 +146,7 @@ var stratImpl = [...]func(*Service, []byte) Connection{
 	seqInit,
 	randInit,
 	hashInit,
+	ewmaInit,
 }
 
 type seqConn struct {
@@ -149,7 +195,7 @@ func hashInit(sb *Service, seed []byte) Connection {
 	return rcycleInit(sb, bytes.NewReader(seed))
 }
 
-func rcycleInit(sb *Service, r io.Reader) Connection {
+func rcycleInit(sb *Service, r io.Reader) *rcycleConn {
 	// Ignore errors from Copy
 	h := fnv.New64a()
 	io.Copy(h, r)
@@ -216,3 +262,86 @@ func (conn *rcycleConn) Close() error {
 	}
 	return nil
 }
+
+var epoch = time.Now()
+
+// Monotonic milliseconds, never 0.
+func nowMs() int64 {
+	return int64(time.Since(epoch)/time.Millisecond) + 1
+}
+
+type ewmaConn struct {
+	rcycleConn
+	pending bool
+}
+
+func ewmaInit(sb *Service, seed []byte) Connection {
+	conn := &ewmaConn{rcycleConn: *rcycleInit(sb, &io.LimitedReader{crand.Reader, 8})}
+
+	if n := len(sb.nodes); n > 1 {
+		now := nowMs()
+		a := conn.rng.Intn(n)
+		b := conn.rng.Intn(n - 1)
+		if b >= a {
+			b++
+		}
+		if sb.nodes[b].ewmaScore(now) < sb.nodes[a].ewmaScore(now) {
+			a = b
+		}
+		conn.first = a
+	}
+	return conn
+}
+
+func (nd *nodeData) ewmaScore(now int64) float64 {
+	ewma := atomic.LoadInt64(&nd.ewmaUs)
+	if age := now - atomic.LoadInt64(&nd.ewmaStampMs); age >= ewmaDecayMs {
+		shift := age / ewmaDecayMs
+		if shift > 32 {
+			shift = 32
+		}
+		ewma >>= uint(shift)
+	}
+	return float64(nd.effcost) * float64(ewma+1) * float64(atomic.LoadInt32(&nd.outstanding)+1)
+}
+
+func (conn *ewmaConn) releasePending() {
+	if conn.pending {
+		conn.pending = false
+		atomic.AddInt32(&conn.sb.nodes[conn.last].outstanding, -1)
+	}
+}
+
+func (conn *ewmaConn) Next(status ConnStatus) interface{} {
+	conn.releasePending()
+	node := conn.rcycleConn.Next(status)
+	if node != nil {
+		atomic.AddInt32(&conn.sb.nodes[conn.last].outstanding, 1)
+		conn.pending = true
+	}
+	return node
+}
+
+func (conn *ewmaConn) Report(latency time.Duration) {
+	if !conn.pending {
+		return
+	}
+	nd := &conn.sb.nodes[conn.last]
+	sample := int64(latency / time.Microsecond)
+	// Racy read-modify-write, concurrent reports might lose a sample,
+	// which doesn't matter for an average.
+	ewma := atomic.LoadInt64(&nd.ewmaUs)
+	if atomic.LoadInt64(&nd.ewmaStampMs) != 0 {
+		ewma += (sample - ewma) >> ewmaShift
+	} else {
+		ewma = sample
+	}
+	atomic.StoreInt64(&nd.ewmaUs, ewma)
+	atomic.StoreInt64(&nd.ewmaStampMs, nowMs())
+	conn.releasePending()
+}
+
+func (conn *ewmaConn) Close() error {
+	conn.releasePending()
+	return conn.rcycleConn.Close()
+}
@@ -0,0 +1,172 @@
+// Copyright 2018 Schibsted
+
+package sbalance
+
+import (
+	"container/heap"
+	"math/rand"
+	"sort"
+	"testing"
+	"time"
+)
+
+// Discrete event simulation of requests spread over a set of nodes, where
+// one node is alive but slow. Each node slows down further with the number
+// of requests it's handling. Returns the request latencies, sorted.
+func simulate(strat BalanceStrat, nreq int) []time.Duration {
+	const (
+		nnodes       = 10
+		interarrival = time.Millisecond
+	)
+	base := make([]time.Duration, nnodes)
+	for i := range base {
+		base[i] = time.Millisecond
+	}
+	base[0] = 20 * time.Millisecond
+
+	sb := Service{FailCost: 100, SoftFailCost: 10, Strat: strat}
+	for i := 0; i < nnodes; i++ {
+		sb.AddNode(i, 1)
+	}
+
+	rng := rand.New(rand.NewSource(4711))
+	busy := make([]int, nnodes)
+	lat := make([]time.Duration, 0, nreq)
+	var inflight simQueue
+	var now time.Duration
+
+	complete := func(r *simReq) {
+		now = r.done
+		busy[r.node]--
+		if rep, ok := r.conn.(Reporter); ok {
+			rep.Report(r.lat)
+		}
+		r.conn.Close()
+		lat = append(lat, r.lat)
+	}
+
+	for i := 0; i < nreq; i++ {
+		arrival := now + time.Duration(rng.ExpFloat64()*float64(interarrival))
+		for len(inflight) > 0 && inflight[0].done <= arrival {
+			complete(heap.Pop(&inflight).(*simReq))
+		}
+		now = arrival
+
+		conn := sb.NewConn(nil)
+		node := conn.Next(Start).(int)
+		busy[node]++
+		l := time.Duration(float64(base[node]) * (0.5 + rng.ExpFloat64()*0.5) * (1 + float64(busy[node]-1)/8))
+		heap.Push(&inflight, &simReq{conn, node, now + l, l})
+	}
+	for len(inflight) > 0 {
+		complete(heap.Pop(&inflight).(*simReq))
+	}
+
+	sort.Slice(lat, func(i, j int) bool { return lat[i] < lat[j] })
+	return lat
+}
+
+type simReq struct {
+	conn Connection
+	node int
+	done time.Duration
+	lat  time.Duration
+}
+
+type simQueue []*simReq
+
+func (q simQueue) Len() int            { return len(q) }
+func (q simQueue) Less(i, j int) bool  { return q[i].done < q[j].done }
+func (q simQueue) Swap(i, j int)       { q[i], q[j] = q[j], q[i] }
+func (q *simQueue) Push(x interface{}) { *q = append(*q, x.(*simReq)) }
+func (q *simQueue) Pop() interface{} {
+	old := *q
+	r := old[len(old)-1]
+	*q = old[:len(old)-1]
+	return r
+}
+
+func percentile(lat []time.Duration, p float64) time.Duration {
+	return lat[int(float64(len(lat)-1)*p)]
+}
+
+func TestEWMASimulation(t *testing.T) {
+	rnd := simulate(StratRandom, 100000)
+	ewma := simulate(StratEWMA, 100000)
+
+	t.Logf("Simulated latency, one slow node of ten")
+	for _, p := range []float64{0.5, 0.9, 0.99, 0.999} {
+		t.Logf("p%-5v random: %-12v ewma: %v", p*100, percentile(rnd, p), percentile(ewma, p))
+	}
+
+	if percentile(ewma, 0.99)*2 > percentile(rnd, 0.99) {
+		t.Errorf("Expected ewma p99 %v to be less than half of random p99 %v", percentile(ewma, 0.99), percentile(rnd, 0.99))
+	}
+}
+
+func TestEWMAOutstanding(t *testing.T) {
+	sb := Service{Retries: 1, FailCost: 100, SoftFailCost: 10, Strat: StratEWMA}
+	for i := 0; i < 4; i++ {
+		sb.AddNode(i, 1)
+	}
+
+	conns := make([]Connection, 8)
+	for i := range conns {
+		conns[i] = sb.NewConn(nil)
+		conns[i].Next(Start)
+	}
+	for i := range sb.nodes {
+		if o := sb.nodes[i].outstanding; o < 1 || o > 3 {
+			t.Errorf("Node %v: expected 1-3 outstanding, got %v", i, o)
+		}
+	}
+
+	// Fallback to the next node moves the outstanding request.
+	conns[0].Next(Fail)
+	conns[1].(Reporter).Report(time.Millisecond)
+	for _, conn := range conns {
+		conn.Close()
+	}
+	for i := range sb.nodes {
+		if o := sb.nodes[i].outstanding; o != 0 {
+			t.Errorf("Node %v: expected 0 outstanding, got %v", i, o)
+		}
+	}
+}
+
+func benchmarkSim(b *testing.B, strat BalanceStrat) {
+	var lat []time.Duration
+	for i := 0; i < b.N; i++ {
+		lat = simulate(strat, 20000)
+	}
+	b.ReportMetric(float64(percentile(lat, 0.5))/1e6, "p50-ms")
+	b.ReportMetric(float64(percentile(lat, 0.99))/1e6, "p99-ms")
+}
+
+func BenchmarkSimRandom(b *testing.B) {
+	benchmarkSim(b, StratRandom)
+}
+
+func BenchmarkSimEWMA(b *testing.B) {
+	benchmarkSim(b, StratEWMA)
+}
+
+func TestEWMACopyStats(t *testing.T) {
+	src := &Service{Strat: StratEWMA, FailCost: 10}
+	src.AddNode(1, 1)
+	src.AddNode(2, 1)
+	src.nodes[1].ewmaUs = 1000
+	src.nodes[1].ewmaStampMs = nowMs()
+	src.nodes[0].effcost = src.FailCost
+
+	sb := &Service{Strat: StratEWMA, FailCost: 10}
+	sb.AddNode(2, 5)
+	sb.AddNode(3, 1)
+	sb.CopyStats(src, func(a, b interface{}) bool { return a == b })
+	if sb.nodes[0].ewmaUs != 1000 || sb.nodes[0].ewmaStampMs == 0 || sb.nodes[0].effcost != 5 {
+		t.Errorf("Node 2: stats not copied: %+v", sb.nodes[0])
+	}
+	if sb.nodes[1].ewmaStampMs != 0 || sb.nodes[1].effcost != 1 {
+		t.Errorf("Node 3: unexpected stats: %+v", sb.nodes[1])
+	}
+}
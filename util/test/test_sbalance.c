@@ -333,6 +333,243 @@ hash_same_test(bool print)
 	return ret;
 }
 
+/*
+ * A slow service should stop getting picked first, and outstanding counts
+ * should go back to zero.
+ */
+static int
+ewma_test(bool print)
+{
+	struct t t;
+	int ret = 0;
+	int i;
+
+	t_init(&t, ST_EWMA, 0, 100, 100, true);
+
+	for (i = 0; i < 1000; i++) {
+		sbalance_conn_new(&t.sc, t.sb, 0);
+		int *ap = sbalance_conn_next(&t.sc, SBCS_START);
+		if (t.sb->sb_service[*ap].outstanding != 1)
+			ret = 1;
+		sbalance_conn_report(&t.sc, *ap == 0 ? 100000 : 1000);
+		if (i >= 100) {
+			t.ac++;
+			t.c[*ap]++;
+		}
+		sbalance_conn_done(&t.sc);
+		sbalance_release(t.sb, NULL);
+	}
+
+	if (t.c[0] != 0)
+		ret = 1;
+	for (i = 0; i < BUCKETS; i++) {
+		if (t.sb->sb_service[i].outstanding != 0)
+			ret = 1;
+		if (i > 0 && t.c[i] < 100)
+			ret = 1;
+	}
+
+	/* Outstanding requests count as well. */
+	struct sbalance_connection busy[20];
+	for (i = 0; i < 20; i++) {
+		sbalance_conn_new(&busy[i], t.sb, 0);
+		sbalance_conn_next(&busy[i], SBCS_START);
+	}
+	for (i = 1; i < BUCKETS; i++) {
+		if (t.sb->sb_service[i].outstanding > 10)
+			ret = 1;
+	}
+	for (i = 0; i < 20; i++) {
+		sbalance_conn_done(&busy[i]);
+		sbalance_release(busy[i].sc_sb, NULL);
+	}
+
+	if (print || ret) {
+		printf("EWMA, slow first bucket\n");
+		t_print(&t);
+	}
+	t_done(&t);
+
+	return ret;
+}
+
+static bool
+same_int(const void *a, const void *b)
+{
+	return *(const int *)a == *(const int *)b;
+}
+
+static int
+copy_stats_test(bool print)
+{
+	struct t t;
+	int ret = 0;
+
+	t_init(&t, ST_EWMA, 0, 100, 50, true);
+	t.sb->sb_service[1].tempfailcost = 100;
+	t.sb->sb_service[2].ewma_us = 5000;
+	t.sb->sb_service[2].ewma_stamp_ms = 1;
+	t.sb->sb_service[2].outstanding = 3;
+
+	/* The replacement lacks the first service. */
+	struct sbalance *sb = sbalance_create(0, 100, 50, ST_EWMA);
+	for (int i = 1; i < BUCKETS; i++)
+		sbalance_add_serv(sb, 10, &t.a[i]);
+	sbalance_copy_stats(sb, t.sb, same_int);
+
+	if (sb->sb_service[0].tempfailcost != 100)
+		ret = 1;
+	if (sb->sb_service[1].ewma_us != 5000 || sb->sb_service[1].ewma_stamp_ms != 1)
+		ret = 1;
+	if (sb->sb_service[1].outstanding != 0)
+		ret = 1;
+	for (int i = 2; i < BUCKETS - 1; i++) {
+		if (sb->sb_service[i].tempfailcost || sb->sb_service[i].ewma_us)
+			ret = 1;
+	}
+
+	if (print || ret)
+		printf("Copy stats\n");
+	sbalance_release(sb, NULL);
+	sbalance_release(t.sb, NULL);
+
+	return ret;
+}
+
+#define RING_NODES 10
+#define RING_KEYS 10000
+
+static struct sbalance *
+ring_create(int skip, int *a)
+{
+	struct sbalance *sb = sbalance_create(0, 100, 100, ST_RING);
+	char key[32];
+
+	for (int i = 0; i < RING_NODES; i++) {
+		a[i] = i;
+		if (i == skip)
+			continue;
+		snprintf(key, sizeof(key), "10.0.0.%d 8080", i);
+		sbalance_add_serv_key(sb, 10, &a[i], key);
+	}
+	return sb;
+}
+
+static int
+ring_lookup(struct sbalance *sb, uint32_t hash)
+{
+	struct sbalance_connection sc;
+
+	sbalance_conn_new(&sc, sb, hash);
+	int *ap = sbalance_conn_next(&sc, SBCS_START);
+	sbalance_conn_done(&sc);
+	sbalance_release(sb, NULL);
+	return *ap;
+}
+
+/*
+ * Removing one node should only move the keys that were on it.
+ */
+static int
+ring_test(bool print)
+{
+	static int before[RING_KEYS];
+	int a[RING_NODES];
+	int counts[RING_NODES] = {0};
+	int moved = 0, moved_other = 0;
+	int ret = 0;
+	int i;
+
+	struct sbalance *sb = ring_create(-1, a);
+	for (i = 0; i < RING_KEYS; i++) {
+		before[i] = ring_lookup(sb, i + 1);
+		counts[before[i]]++;
+	}
+	sbalance_release(sb, NULL);
+
+	for (i = 0; i < RING_NODES; i++) {
+		if (counts[i] < RING_KEYS / RING_NODES / 2 || counts[i] > RING_KEYS / RING_NODES * 3 / 2)
+			ret = 1;
+	}
+
+	sb = ring_create(3, a);
+	for (i = 0; i < RING_KEYS; i++) {
+		int after = ring_lookup(sb, i + 1);
+		if (after != before[i]) {
+			moved++;
+			if (before[i] != 3)
+				moved_other++;
+		}
+	}
+	sbalance_release(sb, NULL);
+
+	if (moved != counts[3] || moved_other != 0)
+		ret = 1;
+
+	if (print || ret) {
+		printf("Ring, one of %d nodes removed: %d of %d keys moved, %d from other nodes\n", RING_NODES, moved, RING_KEYS, moved_other);
+		for (i = 0; i < RING_NODES; i++)
+			printf("%.5d ", counts[i]);
+		printf("\n");
+	}
+
+	return ret;
+}
+
+/*
+ * With a load bound, a single hot key spills over to other nodes.
+ */
+static int
+ring_bounded_test(bool print)
+{
+	struct sbalance_connection sc[100];
+	int a[RING_NODES];
+	int ret = 0;
+	int i;
+
+	struct sbalance *sb = ring_create(-1, a);
+	sbalance_set_load_bound(sb, 1.25);
+
+	for (i = 0; i < 100; i++) {
+		sbalance_conn_new(&sc[i], sb, 4711);
+		sbalance_conn_next(&sc[i], SBCS_START);
+	}
+	for (i = 0; i < RING_NODES; i++) {
+		if (sb->sb_service[i].outstanding > 13)
+			ret = 1;
+	}
+	if (print || ret) {
+		printf("Ring, bounded load, same hash\n");
+		for (i = 0; i < RING_NODES; i++)
+			printf("%.5d ", sb->sb_service[i].outstanding);
+		printf("\n");
+	}
+	for (i = 0; i < 100; i++) {
+		sbalance_conn_done(&sc[i]);
+		sbalance_release(sb, NULL);
+	}
+	if (sb->sb_outstanding != 0)
+		ret = 1;
+	sbalance_release(sb, NULL);
+
+	/* Other strategies ignore the load bound. */
+	sb = sbalance_create(0, 100, 100, ST_RANDOM);
+	sbalance_set_load_bound(sb, 1.25);
+	for (i = 0; i < RING_NODES; i++)
+		sbalance_add_serv(sb, 1, &a[i]);
+	sbalance_conn_new(&sc[0], sb, 0);
+	sbalance_conn_next(&sc[0], SBCS_START);
+	if (sb->sb_outstanding != 0) {
+		printf("Random, load bound counted outstanding\n");
+		ret = 1;
+	}
+	sbalance_conn_done(&sc[0]);
+	sbalance_release(sb, NULL);
+	sbalance_release(sb, NULL);
+
+	return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -344,6 +581,10 @@ main(int argc, char **argv)
 	ret |= h1_test(print);
 	ret |= h2_test(print);
 	ret |= hash_same_test(print);
+	ret |= ewma_test(print);
+	ret |= copy_stats_test(print);
+	ret |= ring_test(print);
+	ret |= ring_bounded_test(print);
 
 	return ret;
 }
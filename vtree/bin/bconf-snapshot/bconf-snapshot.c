@@ -0,0 +1,61 @@
+// Copyright 2018 Schibsted
+
+/*
+	Compiles a bconf configuration file into a snapshot that can be
+	mmap'd with bconf_snapshot_open() and used as a vtree.
+
+	$ bconf-snapshot --appl trans bconf.txt /dev/shm/trans.bconf
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sbp/bconf.h"
+#include "sbp/bconf_snapshot.h"
+#include "sbp/bconfig.h"
+#include "sbp/error_functions.h"
+#include "sbp/popt.h"
+
+static const char *appl;
+static const char *host;
+
+POPT_USAGE("[--appl name [--host id]] <input> <output>");
+POPT_PURPOSE("Compile a bconf file into a snapshot file.");
+POPT_ARGUMENT("input", "Bconf file to read, using config_init().");
+POPT_ARGUMENT("output", "Snapshot file to write. It's replaced atomically.");
+POPT_STRING("appl", NULL, &appl, "Merge the *.* and *.<appl> nodes like load_bconf_file() instead of compiling the whole tree.");
+POPT_STRING("host", NULL, &host, "Host id used with --appl, to also merge <host>.* and <host>.<appl>.");
+POPT_DESCRIPTION("\n$ENV{} values and includes are resolved when compiling.\n");
+
+int
+main(int argc, char *argv[]) {
+	popt_parse_ptrs(&argc, &argv);
+
+	if (argc != 2)
+		popt_usage(NULL, false);
+
+	struct bconf_node *root = config_init(argv[0]);
+	if (!root)
+		xerr(1, "config_init(%s)", argv[0]);
+
+	if (appl) {
+		struct bconf_node *merged = NULL;
+
+		config_merge_bconf(&merged, root, host, appl);
+		bconf_free(&root);
+		root = merged;
+	} else if (host) {
+		xerrx(1, "--host requires --appl");
+	}
+
+	if (bconf_snapshot_write(root, argv[1]) < 0)
+		xerr(1, "bconf_snapshot_write(%s)", argv[1]);
+
+	struct bconf_snapshot *snap = bconf_snapshot_open(argv[1]);
+	if (!snap)
+		xerr(1, "bconf_snapshot_open(%s)", argv[1]);
+	printf("%s: %d nodes, %zu bytes\n", argv[1], bconf_snapshot_nodes(snap), bconf_snapshot_size(snap));
+	bconf_snapshot_close(snap);
+
+	bconf_free(&root);
+	return 0;
+}
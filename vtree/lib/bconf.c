@@ -9,11 +9,42 @@
 #include "sbp/memalloc_functions.h"
 #include "sbp/mempool.h"
 #include <limits.h>
+#include <stdint.h>
+#if __has_include("sbp/xxhash.h")
+#include "sbp/xxhash.h"
+#else
+#include <xxhash.h>
+#endif
 
 #define NODE_VAL 1
 #define NODE_LIST 2
 #define NODE_BIN 3
 
+/*
+ * Nodes with at least this many children get a hash index, built on the
+ * first lookup. Smaller nodes are binary searched.
+ */
+#define INDEX_MIN_COUNT 32
+
+struct bconf_index {
+	uint32_t mask;
+	struct bconf_index_slot {
+		uint32_t hash;
+		struct bconf_node *node;
+	} slots[];
+};
+
+/*
+ * Bumped whenever a node is added to or freed from any tree, see
+ * bconf_generation. Starts at 1 since 0 means not tracked.
+ */
+static unsigned long generation = 1;
+
+static inline void
+generation_bump(void) {
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+}
+
 struct bconf_node {
 	char *value;
 	char *key;
@@ -26,6 +57,14 @@ struct bconf_node {
 
 	int sublen;
 	int count;
+
+	/*
+	 * Lazily built by node_search, reset whenever sub_nodes changes.
+	 * Not used for nodes allocated from a mempool since they're not
+	 * freed individually.
+	 */
+	struct bconf_index *index;
+	bool noindex;
 };
 
 /*
@@ -82,6 +121,80 @@ keycomp(const struct bconf_node *node, const char *substring, size_t substringle
 }
 
 
+static inline uint32_t
+index_hash(const char *key, size_t keylen) {
+	return XXH32(key, keylen, 0);
+}
+
+static void
+index_insert(struct bconf_index *index, struct bconf_node *n) {
+	uint32_t hash = index_hash(n->key, n->klen);
+	uint32_t slot = hash & index->mask;
+
+	while (index->slots[slot].node)
+		slot = (slot + 1) & index->mask;
+	index->slots[slot].hash = hash;
+	index->slots[slot].node = n;
+}
+
+static struct bconf_index *
+index_build(const struct bconf_node *node) {
+	size_t nslots = 1;
+
+	/* Keep the load factor at or below 1/2. */
+	while (nslots < (size_t)node->count * 2)
+		nslots *= 2;
+
+	struct bconf_index *index = xmalloc(sizeof(*index) + nslots * sizeof(index->slots[0]));
+	index->mask = nslots - 1;
+	memset(index->slots, 0, nslots * sizeof(index->slots[0]));
+	for (int i = 0; i < node->count; i++)
+		index_insert(index, node->sub_nodes[i]);
+	return index;
+}
+
+/*
+ * Returns the index of node, building it if needed. Lookups might be done
+ * concurrently from several threads, so the index is published with a
+ * compare and swap and the loser frees its copy.
+ */
+static const struct bconf_index *
+node_index(const struct bconf_node *node) {
+	struct bconf_index **indexp = (struct bconf_index **)&node->index;
+	struct bconf_index *index = __atomic_load_n(indexp, __ATOMIC_ACQUIRE);
+
+	if (index)
+		return index;
+
+	struct bconf_index *expected = NULL;
+	index = index_build(node);
+	if (!__atomic_compare_exchange_n(indexp, &expected, index, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(index);
+		index = expected;
+	}
+	return index;
+}
+
+static void
+node_index_reset(struct bconf_node *node) {
+	free(node->index);
+	node->index = NULL;
+}
+
+static struct bconf_node *
+index_search(const struct bconf_index *index, const char *key, size_t keylen) {
+	uint32_t hash = index_hash(key, keylen);
+	uint32_t slot = hash & index->mask;
+	const struct bconf_index_slot *s;
+
+	while ((s = &index->slots[slot])->node) {
+		if (s->hash == hash && s->node->klen == keylen && memcmp(s->node->key, key, keylen) == 0)
+			return s->node;
+		slot = (slot + 1) & index->mask;
+	}
+	return NULL;
+}
+
 static struct bconf_node *
 node_search(const struct bconf_node *node, const char *key, size_t keylen) {
 	int i, ns, no;
@@ -90,6 +203,9 @@ node_search(const struct bconf_node *node, const char *key, size_t keylen) {
 	if (node->type != NODE_LIST)
 		return NULL;
 
+	if (node->count >= INDEX_MIN_COUNT && !node->noindex)
+		return index_search(node_index(node), key, keylen);
+
 	/*
 	 * Binary search for the element.
 	 */
@@ -175,6 +291,14 @@ node_insert(struct mempool *pool, struct bconf_node *node, struct bconf_node *n)
 	}
 	node->sub_nodes[no] = n;
 	node->count++;
+	generation_bump();
+	/* Rebuilt on the next lookup if it's too small. */
+	if (pool)
+		node->noindex = true;
+	if (node->index && (size_t)node->count * 2 <= node->index->mask + 1)
+		index_insert(node->index, n);
+	else
+		node_index_reset(node);
 
 	/*
 	 * Record if we have a '*' element.
@@ -430,6 +554,327 @@ bconf_add_data_pool(struct mempool *pool, struct bconf_node **root, const char *
 }
 
 
+struct bconf_builder_key {
+	const char *key;
+	size_t klen;
+};
+
+/*
+ * The keys are stored as one string, separated by sep and preceded by an
+ * extra sep, followed by the value. The key at each level is found from
+ * the key at the level above, starting with the empty key at the extra sep.
+ * The position in the entries array gives the order they were added in.
+ */
+struct bconf_builder_entry {
+	int keyc;
+	char sep;
+	bool sortleaf;
+	const char *value;
+	size_t vlen;
+
+	/* Key at the level being built. */
+	struct bconf_builder_key sortkey;
+};
+
+struct bconf_builder {
+	struct mempool *pool;
+	struct bconf_builder_entry *entries;
+	int nentries;
+	int aentries;
+};
+
+struct bconf_builder *
+bconf_builder_new(void) {
+	struct bconf_builder *b = zmalloc(sizeof(*b));
+
+	b->pool = mempool_create(64 * 1024);
+	return b;
+}
+
+void
+bconf_builder_free(struct bconf_builder *b) {
+	if (!b)
+		return;
+	mempool_free(b->pool);
+	free(b->entries);
+	free(b);
+}
+
+/* Returns where to write klen bytes of keys, which are NUL terminated by this function. */
+static char *
+builder_entry(struct bconf_builder *b, int keyc, char sep, size_t klen, const char *value, ssize_t vlen) {
+	if (b->nentries == b->aentries) {
+		b->aentries = b->aentries ? b->aentries * 2 : 1024;
+		b->entries = xrealloc(b->entries, b->aentries * sizeof(*b->entries));
+	}
+	if (value && vlen < 0)
+		vlen = strlen(value);
+
+	struct bconf_builder_entry *e = &b->entries[b->nentries++];
+	char *buf = mempool_alloc(b->pool, klen + 2 + (value ? vlen + 1 : 0));
+
+	buf[0] = sep;
+	buf[klen + 1] = '\0';
+	e->keyc = keyc;
+	e->sep = sep;
+	e->sortkey.key = buf;
+	e->sortkey.klen = 0;
+	if (value) {
+		char *v = buf + klen + 2;
+		memcpy(v, value, vlen);
+		v[vlen] = '\0';
+		e->value = v;
+		e->vlen = vlen;
+	} else {
+		e->value = NULL;
+		e->vlen = 0;
+	}
+	return buf + 1;
+}
+
+void
+bconf_builder_add(struct bconf_builder *b, const char *key, const char *value) {
+	size_t klen;
+	int keyc = 1;
+
+	for (klen = 0; key[klen]; klen++) {
+		if (key[klen] == '.')
+			keyc++;
+	}
+	memcpy(builder_entry(b, keyc, '.', klen, value, -1), key, klen);
+}
+
+void
+bconf_builder_addv(struct bconf_builder *b, int keyc, const char **keyv, const char *value, ssize_t vlen) {
+	size_t klen = keyc - 1;
+
+	if (keyc <= 0)
+		return;
+	for (int i = 0; i < keyc; i++)
+		klen += strlen(keyv[i]);
+
+	char *k = builder_entry(b, keyc, '\0', klen, value, vlen);
+	for (int i = 0; i < keyc; i++) {
+		size_t l = strlen(keyv[i]);
+		memcpy(k, keyv[i], l);
+		k[l] = '\0';
+		k += l + 1;
+	}
+}
+
+/* Same order as keycomp(). */
+static int
+builder_keycomp(const struct bconf_builder_key *a, const struct bconf_builder_key *b) {
+	if (a->klen != b->klen && isdigit(a->key[0]) && isdigit(b->key[0]))
+		return a->klen < b->klen ? -1 : 1;
+
+	int res = memcmp(a->key, b->key, a->klen < b->klen ? a->klen : b->klen);
+	if (res)
+		return res;
+	return (a->klen > b->klen) - (a->klen < b->klen);
+}
+
+/*
+ * Sorts the entries of a level by key, so the children of the node end up
+ * consecutive and in order. For the same key, the entries ending at this
+ * level come first, in the order added.
+ */
+static int
+builder_entrycomp(const void *av, const void *bv) {
+	const struct bconf_builder_entry *a = *(struct bconf_builder_entry *const *)av;
+	const struct bconf_builder_entry *b = *(struct bconf_builder_entry *const *)bv;
+	int res = builder_keycomp(&a->sortkey, &b->sortkey);
+
+	if (res)
+		return res;
+	if (a->sortleaf != b->sortleaf)
+		return a->sortleaf ? -1 : 1;
+	return (a > b) - (a < b);
+}
+
+static void
+builder_sort(struct bconf_builder_entry **e, int n, int depth) {
+	bool sorted = true;
+
+	for (int i = 0; i < n; i++) {
+		const char *k = e[i]->sortkey.key + e[i]->sortkey.klen + 1;
+		const char *end = k;
+
+		while (*end != e[i]->sep && *end)
+			end++;
+		e[i]->sortkey.key = k;
+		e[i]->sortkey.klen = end - k;
+		e[i]->sortleaf = e[i]->keyc == depth + 1;
+		if (sorted && i > 0 && builder_entrycomp(&e[i - 1], &e[i]) > 0)
+			sorted = false;
+	}
+	/* Config files are usually written in order already. */
+	if (sorted)
+		return;
+	if (n > 8) {
+		qsort(e, n, sizeof(*e), builder_entrycomp);
+		return;
+	}
+	for (int i = 1; i < n; i++) {
+		struct bconf_builder_entry *tmp = e[i];
+		int j = i;
+
+		for (; j > 0 && builder_entrycomp(&e[j - 1], &tmp) > 0; j--)
+			e[j] = e[j - 1];
+		e[j] = tmp;
+	}
+}
+
+static int builder_build(struct bconf_node *node, struct bconf_builder_entry **e, int n, int depth);
+
+/*
+ * Adds the entries e, which all have the key of child at depth, to child.
+ * The entries are applied as if they were added one by one in order, so
+ * the first one decides if a new node is a list or a value, later values
+ * replace earlier ones and entries conflicting with the node type are
+ * skipped. Returns the number of skipped entries.
+ */
+static int
+builder_apply(struct bconf_node *child, struct bconf_builder_entry **e, int n, int depth) {
+	struct bconf_builder_entry *first = NULL, *last = NULL;
+	int nleaf, nvalues = 0;
+
+	for (nleaf = 0; nleaf < n && e[nleaf]->sortleaf; nleaf++) {
+		if (e[nleaf]->value) {
+			last = e[nleaf];
+			nvalues++;
+		}
+	}
+
+	/*
+	 * List nodes without children are left untyped, as by
+	 * bconf_add_listnodev. If there are both values and sub keys, the
+	 * first one added decides.
+	 */
+	if (!child->type && nleaf < n) {
+		if (nvalues) {
+			for (int i = 0; i < n; i++) {
+				if ((e[i]->value || !e[i]->sortleaf) && (!first || e[i] < first))
+					first = e[i];
+			}
+		}
+		if (!first || !first->sortleaf)
+			child->type = NODE_LIST;
+	}
+
+	int conflicts = 0;
+	if (last && bconf_add_dataX(NULL, child, (char *)last->value, last->vlen, BCONF_DUP) == -1)
+		conflicts += nvalues;
+	if (nleaf < n) {
+		if (child->type == NODE_LIST)
+			conflicts += builder_build(child, e + nleaf, n - nleaf, depth + 1);
+		else
+			conflicts += n - nleaf;
+	}
+	return conflicts;
+}
+
+static int
+builder_group_end(struct bconf_builder_entry **e, int i, int n) {
+	int j = i + 1;
+
+	while (j < n && builder_keycomp(&e[i]->sortkey, &e[j]->sortkey) == 0)
+		j++;
+	return j;
+}
+
+/*
+ * Adds the entries e, which all have keys longer than depth, to node. The
+ * new children are created in order, so they're appended to a new array
+ * which is at most merged once with the existing children.
+ */
+static int
+builder_build(struct bconf_node *node, struct bconf_builder_entry **e, int n, int depth) {
+	if (node->type && node->type != NODE_LIST)
+		return n;
+	node->type = NODE_LIST;
+
+	builder_sort(e, n, depth);
+
+	int nold = node->count;
+	struct bconf_node **added = NULL;
+	int nadded = 0, aadded = 0;
+	int conflicts = 0;
+
+	for (int i = 0, j; i < n; i = j) {
+		const struct bconf_builder_key *key = &e[i]->sortkey;
+		struct bconf_node *child = nold ? node_search(node, key->key, key->klen) : NULL;
+
+		j = builder_group_end(e, i, n);
+		if (!child) {
+			child = mempool_alloc(NULL, sizeof(*child) + key->klen + 1);
+			child->key = (char*)(child + 1);
+			memcpy(child->key, key->key, key->klen);
+			child->key[key->klen] = '\0';
+			child->klen = key->klen;
+			if (nadded == aadded) {
+				aadded = aadded ? aadded * 2 : 2;
+				added = xrealloc(added, aadded * sizeof(*added));
+			}
+			added[nadded++] = child;
+			if (child->key[0] == '*' && child->key[1] == '\0')
+				node->star = child;
+		}
+		conflicts += builder_apply(child, e + i, j - i, depth);
+	}
+
+	if (nadded == 0) {
+		free(added);
+		return conflicts;
+	}
+
+	if (nold == 0) {
+		free(node->sub_nodes);
+		node->sub_nodes = added;
+		node->sublen = aadded;
+	} else {
+		struct bconf_node **merged = xmalloc((nold + nadded) * sizeof(*merged));
+		int i = 0, j = 0, k = 0;
+
+		while (i < nold && j < nadded) {
+			if (keycomp(node->sub_nodes[i], added[j]->key, added[j]->klen) < 0)
+				merged[k++] = node->sub_nodes[i++];
+			else
+				merged[k++] = added[j++];
+		}
+		while (i < nold)
+			merged[k++] = node->sub_nodes[i++];
+		while (j < nadded)
+			merged[k++] = added[j++];
+		free(node->sub_nodes);
+		free(added);
+		node->sub_nodes = merged;
+		node->sublen = nold + nadded;
+	}
+	node->count = nold + nadded;
+	node_index_reset(node);
+	generation_bump();
+	return conflicts;
+}
+
+int
+bconf_builder_finish(struct bconf_builder *b, struct bconf_node **root) {
+	int conflicts = 0;
+
+	if (b->nentries > 0) {
+		struct bconf_builder_entry **e = xmalloc(b->nentries * sizeof(*e));
+
+		for (int i = 0; i < b->nentries; i++)
+			e[i] = &b->entries[i];
+		if (!*root)
+			*root = zmalloc(sizeof(**root));
+		conflicts = builder_build(*root, e, b->nentries, 0);
+		free(e);
+	}
+	bconf_builder_free(b);
+	return conflicts ? -1 : 0;
+}
+
 struct bconf_node *
 bconf_get(struct bconf_node *root, const char *key) {
 	struct bconf_node *n = root; 
@@ -541,6 +986,13 @@ bconf_byindex(struct bconf_node *node, int index) {
 	return NULL;
 }
 
+unsigned long
+bconf_generation(const struct bconf_node *node) {
+	if (node && node->noindex)
+		return 0;
+	return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
 int 
 bconf_count(const struct bconf_node *node) {
 	if (node)
@@ -717,12 +1169,15 @@ bconf_free(struct bconf_node **root) {
 	if (node == NULL)
 		return;
 
+	generation_bump();
+
 	if (node->type == NODE_LIST) {
 		for (i = 0; i < node->count; i++)
 			bconf_free(&node->sub_nodes[i]);
 	}
 
 	free(node->sub_nodes);
+	free(node->index);
 
 	if (node->type != NODE_BIN && node->value)
 		free(node->value);
@@ -824,6 +1279,7 @@ bconf_deletev(struct bconf_node **root, int argc, const char **argv) {
 			n->star = NULL;
 		bconf_free(&sub);
 		memmove(n->sub_nodes + i, n->sub_nodes + i + 1, (n->count - i) * sizeof(*n->sub_nodes));
+		node_index_reset(n);
 		return true;
 	}
 
@@ -851,6 +1307,7 @@ bconf_filter_to_keys(struct bconf_node **root, struct bconf_node *filter) {
 			n->star = NULL;
 		bconf_free(&sub);
 		memmove(n->sub_nodes + i, n->sub_nodes + i + 1, (n->count - i) * sizeof(*n->sub_nodes));
+		node_index_reset(n);
 		ret++;
 	}
 	return ret;
@@ -32,6 +32,26 @@ struct bconf_node *bconf_add_listnode(struct bconf_node **root, const char *key)
 
 void bconf_add_data_pool(struct mempool *, struct bconf_node **, const char *, const char *) NONNULL(2,3,4);
 
+/*
+ * Bulk loading. Adding many keys one by one is slow for wide nodes since
+ * every insert moves the children after it. A builder instead collects the
+ * keys, sorts them once and creates each node's children in one go.
+ *
+ * The result is the same as calling bconf_add_data / bconf_add_datav in the
+ * same order, with BCONF_DUP. A NULL value to bconf_builder_addv adds a list
+ * node, like bconf_add_listnodev, and vlen < 0 means strlen(value).
+ *
+ * bconf_builder_finish adds everything to *root, creating it if NULL, and
+ * frees the builder. It returns -1 if some keys conflicted with the node
+ * type already there, those keys are skipped. Other keys are still added.
+ */
+struct bconf_builder;
+struct bconf_builder *bconf_builder_new(void);
+void bconf_builder_add(struct bconf_builder *, const char *key, const char *value) NONNULL_ALL;
+void bconf_builder_addv(struct bconf_builder *, int keyc, const char **keyv, const char *value, ssize_t vlen) NONNULL(1,3);
+int bconf_builder_finish(struct bconf_builder *, struct bconf_node **root) NONNULL_ALL;
+void bconf_builder_free(struct bconf_builder *);
+
 #define BCONF_REF 0
 #define BCONF_DUP 1
 #define BCONF_OWN 2
@@ -67,6 +87,14 @@ size_t bconf_klen(const struct bconf_node *) FUNCTION_PURE;
 size_t bconf_vlen(const struct bconf_node *) FUNCTION_PURE;
 void bconf_free(struct bconf_node **);
 
+/*
+ * Changes whenever a node is added to or freed from any bconf tree, so
+ * node pointers found by a lookup can be cached until it changes. Returns
+ * 0 if node was allocated from a mempool, those can't be tracked since
+ * they're not freed with bconf_free. Replacing a value doesn't change it.
+ */
+unsigned long bconf_generation(const struct bconf_node *node);
+
 const char *bconf_get_string(struct bconf_node*, const char*) FUNCTION_PURE;
 const char *bconf_get_string_default(struct bconf_node*, const char*, const char*) FUNCTION_PURE;
 int bconf_get_int(struct bconf_node*, const char*) FUNCTION_PURE;
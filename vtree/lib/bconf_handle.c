@@ -0,0 +1,206 @@
+// Copyright 2018 Schibsted
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "bconf.h"
+#include "bconf_handle.h"
+#include "sbp/memalloc_functions.h"
+
+/*
+ * Epoch based reclamation. Each reader thread has a slot holding the
+ * global epoch it saw when it pinned, or 0 while not pinned. A publisher
+ * swaps in the new root, bumps the epoch and retires the old root with
+ * the new epoch. Readers pinning after that will see the new root, so
+ * the old one can be freed once no slot holds an older epoch.
+ *
+ * The slots are only added or scanned with the lock held, readers only
+ * touch their own slot.
+ */
+struct bconf_reader {
+	unsigned long epoch;
+	int nest;
+	bool used;
+	struct bconf_reader *next;
+};
+
+struct bconf_retired {
+	struct bconf_node *root;
+	unsigned long epoch;
+	struct bconf_retired *next;
+};
+
+struct bconf_handle {
+	struct bconf_node *root;
+	unsigned long version;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long epoch = 1;
+static struct bconf_reader *readers;
+static struct bconf_retired *retired;
+
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static __thread struct bconf_reader *reader_self;
+
+static void
+reader_thread_exit(void *v) {
+	struct bconf_reader *r = v;
+
+	pthread_mutex_lock(&lock);
+	r->nest = 0;
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+	r->used = false;
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+reader_key_init(void) {
+	pthread_key_create(&reader_key, reader_thread_exit);
+}
+
+static struct bconf_reader *
+reader_register(void) {
+	struct bconf_reader *r;
+
+	pthread_once(&reader_key_once, reader_key_init);
+
+	pthread_mutex_lock(&lock);
+	for (r = readers; r && r->used; r = r->next)
+		;
+	if (!r) {
+		r = zmalloc(sizeof(*r));
+		r->next = readers;
+		readers = r;
+	}
+	r->used = true;
+	pthread_mutex_unlock(&lock);
+
+	pthread_setspecific(reader_key, r);
+	reader_self = r;
+	return r;
+}
+
+/*
+ * Unlinks the retired trees no reader can see and returns them, to be
+ * freed without the lock held. Must be called with the lock held.
+ */
+static struct bconf_retired *
+reclaim_locked(int *waiting) {
+	unsigned long oldest = ULONG_MAX;
+	struct bconf_retired *freed = NULL, **rp = &retired, *t;
+	struct bconf_reader *r;
+
+	/* Pairs with the fence in bconf_handle_pin. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = readers; r; r = r->next) {
+		unsigned long e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+
+		if (e && e < oldest)
+			oldest = e;
+	}
+
+	*waiting = 0;
+	while ((t = *rp)) {
+		if (t->epoch <= oldest) {
+			*rp = t->next;
+			t->next = freed;
+			freed = t;
+		} else {
+			rp = &t->next;
+			(*waiting)++;
+		}
+	}
+	return freed;
+}
+
+static void
+free_retired(struct bconf_retired *t) {
+	while (t) {
+		struct bconf_retired *next = t->next;
+
+		bconf_free(&t->root);
+		free(t);
+		t = next;
+	}
+}
+
+struct bconf_handle *
+bconf_handle_new(struct bconf_node *root) {
+	struct bconf_handle *handle = zmalloc(sizeof(*handle));
+
+	handle->root = root;
+	handle->version = 1;
+	return handle;
+}
+
+void
+bconf_handle_free(struct bconf_handle *handle) {
+	if (!handle)
+		return;
+	bconf_free(&handle->root);
+	free(handle);
+	bconf_handle_reclaim();
+}
+
+struct bconf_node *
+bconf_handle_pin(struct bconf_handle *handle) {
+	struct bconf_reader *r = reader_self ?: reader_register();
+
+	if (r->nest++ == 0) {
+		__atomic_store_n(&r->epoch, __atomic_load_n(&epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		/* The slot must be visible before the root is read. */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return __atomic_load_n(&handle->root, __ATOMIC_ACQUIRE);
+}
+
+void
+bconf_handle_unpin(struct bconf_handle *handle) {
+	struct bconf_reader *r = reader_self;
+
+	if (--r->nest == 0)
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+unsigned long
+bconf_handle_publish(struct bconf_handle *handle, struct bconf_node *root) {
+	struct bconf_retired *old = xmalloc(sizeof(*old));
+	struct bconf_retired *freed;
+	unsigned long version;
+	int waiting;
+
+	pthread_mutex_lock(&lock);
+	old->root = __atomic_exchange_n(&handle->root, root, __ATOMIC_SEQ_CST);
+	old->epoch = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+	old->next = retired;
+	retired = old;
+	version = handle->version + 1;
+	__atomic_store_n(&handle->version, version, __ATOMIC_RELEASE);
+	freed = reclaim_locked(&waiting);
+	pthread_mutex_unlock(&lock);
+
+	free_retired(freed);
+	return version;
+}
+
+unsigned long
+bconf_handle_version(struct bconf_handle *handle) {
+	return __atomic_load_n(&handle->version, __ATOMIC_ACQUIRE);
+}
+
+int
+bconf_handle_reclaim(void) {
+	struct bconf_retired *freed;
+	int waiting;
+
+	pthread_mutex_lock(&lock);
+	freed = reclaim_locked(&waiting);
+	pthread_mutex_unlock(&lock);
+
+	free_retired(freed);
+	return waiting;
+}
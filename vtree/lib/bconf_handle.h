@@ -0,0 +1,60 @@
+// Copyright 2018 Schibsted
+
+#ifndef BCONF_HANDLE_H
+#define BCONF_HANDLE_H
+
+#include "sbp/macros.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bconf_node;
+struct bconf_handle;
+
+/*
+ * A bconf handle holds the current version of a bconf tree which can be
+ * replaced while other threads are reading it, e.g. to reload the config
+ * on SIGHUP.
+ *
+ * Readers pin the current tree, use it as any bconf tree and then unpin
+ * it. Pinning is cheap, a couple of stores to the thread's own reader
+ * slot, and never blocks. Pins nest, and the tree must not be modified
+ * or kept after the unpin. Each thread calling bconf_handle_pin gets a
+ * slot, which is reused when the thread exits.
+ *
+ *	struct bconf_node *root = bconf_handle_pin(handle);
+ *	const char *v = bconf_get_string(root, "some.key");
+ *	...
+ *	bconf_handle_unpin(handle);
+ *
+ * bconf_handle_publish replaces the tree with a new one, built by the
+ * caller without any locks held. The old tree is freed with bconf_free
+ * once all readers that pinned before the swap have unpinned. This is
+ * checked on each publish and on bconf_handle_reclaim, so a reader that
+ * keeps a pin delays freeing but never blocks the publisher.
+ *
+ * The handle owns all trees given to it. Publishers are serialized.
+ */
+struct bconf_handle *bconf_handle_new(struct bconf_node *root);
+
+/* No thread may have the handle pinned. Frees the current tree. */
+void bconf_handle_free(struct bconf_handle *handle);
+
+struct bconf_node *bconf_handle_pin(struct bconf_handle *handle) NONNULL_ALL;
+void bconf_handle_unpin(struct bconf_handle *handle) NONNULL_ALL;
+
+/* Returns the version of the new tree, the first one is version 1. */
+unsigned long bconf_handle_publish(struct bconf_handle *handle, struct bconf_node *root) NONNULL(1);
+
+/* Current version, which might already have changed when it's returned. */
+unsigned long bconf_handle_version(struct bconf_handle *handle) NONNULL_ALL;
+
+/* Frees the old trees no reader can see anymore. Returns the number still waiting. */
+int bconf_handle_reclaim(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
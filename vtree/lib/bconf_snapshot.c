@@ -0,0 +1,614 @@
+// Copyright 2018 Schibsted
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bconf.h"
+#include "bconf_snapshot.h"
+#include "sbp/memalloc_functions.h"
+#include "vtree.h"
+
+/*
+ * File format, in host byte order:
+ *
+ *   header
+ *   nodes, in breadth first order
+ *   string table, NUL terminated keys and values
+ *
+ * The children of a node are consecutive in the node array and sorted the
+ * same way as in struct bconf_node, so they can be binary searched. All
+ * offsets in the nodes are relative to the node itself, which makes the
+ * format position independent. A node pointer is enough to get to all its
+ * data, which is what's stored in the vtree data.
+ */
+
+#define SNAP_MAGIC "BCONFSNP"
+#define SNAP_VERSION 1
+#define SNAP_BYTEORDER 0x01020304
+
+struct snap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	uint32_t nnodes;
+	/* Offset of the root node from the start of the file. */
+	uint32_t root;
+};
+
+struct snap_node {
+	int32_t key;
+	/* 0 if there's no value. */
+	int32_t value;
+	uint32_t klen;
+	uint32_t vlen;
+	/* Offset of the first child. */
+	int32_t children;
+	uint32_t count;
+	/* Offset of the '*' child, 0 if there is none. */
+	int32_t star;
+};
+
+struct bconf_snapshot {
+	void *base;
+	size_t size;
+	const struct snap_node *root;
+};
+
+#define SNAP_KEY(n) ((const char *)(n) + (n)->key)
+#define SNAP_VALUE(n) ((n)->value ? (const char *)(n) + (n)->value : NULL)
+#define SNAP_CHILD(n, i) ((const struct snap_node *)((const char *)(n) + (n)->children) + (i))
+#define SNAP_STAR(n) ((n)->star ? (const struct snap_node *)((const char *)(n) + (n)->star) : NULL)
+
+/* Writing */
+
+static void
+snap_count(struct bconf_node *n, int *nnodes, size_t *strsize) {
+	int count = bconf_count(n);
+
+	(*nnodes)++;
+	*strsize += bconf_klen(n) + 1;
+	if (bconf_value(n))
+		*strsize += bconf_vlen(n) + 1;
+	for (int i = 0; i < count; i++)
+		snap_count(bconf_byindex(n, i), nnodes, strsize);
+}
+
+static int32_t
+snap_add_string(char *buf, size_t *spos, size_t self, const char *str, size_t len) {
+	size_t pos = *spos;
+
+	memcpy(buf + pos, str, len);
+	buf[pos + len] = '\0';
+	*spos = pos + len + 1;
+	return pos - self;
+}
+
+static char *
+snap_compile(struct bconf_node *root, size_t *sizep) {
+	int nnodes = 0;
+	size_t strsize = 0;
+
+	snap_count(root, &nnodes, &strsize);
+
+	size_t nodes_off = sizeof(struct snap_header);
+	size_t strings_off = nodes_off + nnodes * sizeof(struct snap_node);
+	size_t size = strings_off + strsize;
+	if (size > INT32_MAX) {
+		errno = EFBIG;
+		return NULL;
+	}
+
+	char *buf = zmalloc(size);
+	struct snap_header *h = (struct snap_header *)buf;
+	memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+	h->version = SNAP_VERSION;
+	h->byteorder = SNAP_BYTEORDER;
+	h->size = size;
+	h->nnodes = nnodes;
+	h->root = nodes_off;
+
+	struct snap_node *nodes = (struct snap_node *)(buf + nodes_off);
+	struct bconf_node **queue = xmalloc(nnodes * sizeof(*queue));
+	size_t spos = strings_off;
+	int tail = 1;
+
+	/* The root can be NULL, the accessors handle that. */
+	queue[0] = root;
+	for (int head = 0; head < tail; head++) {
+		struct bconf_node *bn = queue[head];
+		struct snap_node *sn = &nodes[head];
+		size_t self = nodes_off + head * sizeof(*sn);
+		const char *value = bconf_value(bn);
+
+		sn->klen = bconf_klen(bn);
+		sn->key = snap_add_string(buf, &spos, self, bconf_key(bn) ?: "", sn->klen);
+		if (value) {
+			sn->vlen = bconf_vlen(bn);
+			sn->value = snap_add_string(buf, &spos, self, value, sn->vlen);
+		}
+		sn->count = bconf_count(bn);
+		if (sn->count)
+			sn->children = nodes_off + tail * sizeof(*sn) - self;
+		for (int i = 0; i < (int)sn->count; i++) {
+			struct bconf_node *child = bconf_byindex(bn, i);
+			const char *key = bconf_key(child);
+
+			if (key[0] == '*' && key[1] == '\0')
+				sn->star = nodes_off + tail * sizeof(*sn) - self;
+			queue[tail++] = child;
+		}
+	}
+	free(queue);
+
+	*sizep = size;
+	return buf;
+}
+
+int
+bconf_snapshot_write(struct bconf_node *root, const char *filename) {
+	size_t size;
+	char *buf = snap_compile(root, &size);
+	if (!buf)
+		return -1;
+
+	char *tmp;
+	xasprintf(&tmp, "%s.XXXXXX", filename);
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		int e = errno;
+		free(tmp);
+		free(buf);
+		errno = e;
+		return -1;
+	}
+
+	int res = 0;
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = write(fd, buf + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			res = -1;
+			break;
+		}
+		done += n;
+	}
+	if (res == 0)
+		res = fchmod(fd, 0644);
+	if (res == 0)
+		res = fsync(fd);
+	if (close(fd) < 0)
+		res = -1;
+	if (res == 0)
+		res = rename(tmp, filename);
+
+	if (res < 0) {
+		int e = errno;
+		unlink(tmp);
+		errno = e;
+	}
+	free(tmp);
+	free(buf);
+	return res;
+}
+
+/* Reading */
+
+/*
+ * Checks that a string at off from a node at self is in the string table,
+ * with a NUL at len.
+ */
+static bool
+snap_check_string(const char *base, uint64_t strings, uint64_t size, uint64_t self, int32_t off, uint32_t len) {
+	int64_t pos = (int64_t)self + off;
+
+	if (pos < (int64_t)strings || (uint64_t)pos + len >= size)
+		return false;
+	return base[pos + len] == '\0';
+}
+
+/*
+ * Checks every offset in the file against its size, so that the lookups
+ * can't be made to read outside the mapping. Children must come after their
+ * parent, as written by snap_compile, so walking the tree always ends.
+ */
+static bool
+snap_check(const char *base, uint64_t size) {
+	const struct snap_header *h = (const struct snap_header *)base;
+	const uint64_t nsize = sizeof(struct snap_node);
+
+	if (h->root < sizeof(*h) || h->root % _Alignof(struct snap_node) != 0 || h->nnodes == 0 ||
+			h->root + h->nnodes * nsize > size)
+		return false;
+
+	uint64_t strings = h->root + h->nnodes * nsize;
+	for (uint64_t i = 0; i < h->nnodes; i++) {
+		uint64_t self = h->root + i * nsize;
+		const struct snap_node *n = (const struct snap_node *)(base + self);
+
+		if (!snap_check_string(base, strings, size, self, n->key, n->klen))
+			return false;
+		if (n->value && !snap_check_string(base, strings, size, self, n->value, n->vlen))
+			return false;
+		if (n->count == 0) {
+			if (n->star)
+				return false;
+			continue;
+		}
+
+		int64_t first = (int64_t)self + n->children;
+		if (first <= (int64_t)self || (uint64_t)first > strings || (first - h->root) % nsize != 0 ||
+				n->count > (strings - first) / nsize)
+			return false;
+		if (n->star && (n->star < n->children || (n->star - n->children) % nsize != 0 ||
+				(uint64_t)(n->star - n->children) / nsize >= n->count))
+			return false;
+	}
+	return true;
+}
+
+struct bconf_snapshot *
+bconf_snapshot_open(const char *filename) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return NULL;
+	}
+	if ((size_t)st.st_size < sizeof(struct snap_header) + sizeof(struct snap_node)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int e = errno;
+	close(fd);
+	if (base == MAP_FAILED) {
+		errno = e;
+		return NULL;
+	}
+
+	const struct snap_header *h = base;
+	if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0 || h->version != SNAP_VERSION ||
+			h->byteorder != SNAP_BYTEORDER || h->size != (uint64_t)st.st_size ||
+			!snap_check(base, st.st_size)) {
+		munmap(base, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct bconf_snapshot *snap = xmalloc(sizeof(*snap));
+	snap->base = base;
+	snap->size = st.st_size;
+	snap->root = (const struct snap_node *)((const char *)base + h->root);
+	return snap;
+}
+
+void
+bconf_snapshot_close(struct bconf_snapshot *snap) {
+	if (!snap)
+		return;
+	munmap(snap->base, snap->size);
+	free(snap);
+}
+
+int
+bconf_snapshot_nodes(const struct bconf_snapshot *snap) {
+	return ((const struct snap_header *)snap->base)->nnodes;
+}
+
+size_t
+bconf_snapshot_size(const struct bconf_snapshot *snap) {
+	return snap->size;
+}
+
+/* Lookups, these follow the bconf.c functions. */
+
+static inline int
+snap_keycomp(const struct snap_node *node, const char *substring, size_t substringlen) {
+	const char *key = SNAP_KEY(node);
+	int res;
+	unsigned int i;
+
+	/* Same as keycomp in bconf.c, see the comments there. */
+	if (isdigit(key[0]) && isdigit(*substring) &&
+	    (res = node->klen - substringlen) != 0)
+		return res;
+
+	for (i = 0; i < substringlen; i++) {
+		if ((res = (unsigned char)key[i] - (unsigned char)substring[i]) != 0)
+			return res;
+	}
+
+	return (unsigned char)key[i];
+}
+
+static const struct snap_node *
+snap_search(const struct snap_node *node, const char *key, size_t keylen) {
+	int i, ns, no;
+	int res;
+
+	no = 0;
+	ns = node->count;
+
+	while (ns > 0) {
+		int even = ~ns & 1;
+
+		ns /= 2;
+		i = no + ns;
+
+		res = snap_keycomp(SNAP_CHILD(node, i), key, keylen);
+		if (res == 0)
+			return SNAP_CHILD(node, i);
+		if (res > 0)
+			continue;
+		no += ns + 1;
+		ns -= even;
+	}
+
+	return NULL;
+}
+
+static const struct snap_node *
+snap_get(const struct snap_node *n, const char *key) {
+	const char *tmp;
+
+	if (key == NULL || n == NULL)
+		return NULL;
+
+	do {
+		const struct snap_node *star = SNAP_STAR(n);
+
+		tmp = key;
+		while (*tmp != '.' && *tmp)
+			tmp++;
+
+		n = snap_search(n, key, tmp - key);
+
+		if (n == NULL) {
+			if (star == NULL)
+				return NULL;
+			n = star;
+		}
+		key = tmp + 1;
+	} while (*tmp);
+
+	return n;
+}
+
+static const struct snap_node *
+snap_vasget(const struct snap_node *n, const char *sentinel, int argc, const char **argv) {
+	for (int i = 0; i < argc && argv[i] != sentinel; i++)
+		n = snap_get(n, argv[i]);
+	return n;
+}
+
+static inline int
+snap_count_children(const struct snap_node *n) {
+	return n ? (int)n->count : 0;
+}
+
+static inline const struct snap_node *
+snap_byindex(const struct snap_node *n, int i) {
+	if (n && (int)n->count > i)
+		return SNAP_CHILD(n, i);
+	return NULL;
+}
+
+static inline const char *
+snap_value(const struct snap_node *n) {
+	return n ? SNAP_VALUE(n) : NULL;
+}
+
+static inline const char *
+snap_key(const struct snap_node *n) {
+	return n ? SNAP_KEY(n) : NULL;
+}
+
+/* Vtree, these follow the bconf_api_node functions in bconf_vtree.c. */
+
+static const struct vtree_dispatch bconf_snapshot_api;
+
+static void
+snap_node_vtree(struct vtree_chain *dst, const struct snap_node *n) {
+	dst->fun = &bconf_snapshot_api;
+	dst->data = (void *)n;
+	dst->next = NULL;
+}
+
+static int
+snap_vtree_getlen(struct vtree_chain *vchain, enum vtree_cacheable *cc, int argc, const char **argv) {
+	return snap_count_children(snap_vasget(vchain->data, NULL, argc, argv));
+}
+
+static const char *
+snap_vtree_get(struct vtree_chain *vchain, enum vtree_cacheable *cc, int argc, const char **argv) {
+	return snap_value(snap_vasget(vchain->data, NULL, argc, argv));
+}
+
+static int
+snap_vtree_haskey(struct vtree_chain *vchain, enum vtree_cacheable *cc, int argc, const char **argv) {
+	return snap_vasget(vchain->data, NULL, argc, argv) != NULL;
+}
+
+static void
+snap_fetch_cleanup(struct vtree_loop_var *loop) {
+	free(loop->l.list);
+}
+
+static void
+snap_fetch_keyvals_cleanup(struct vtree_keyvals *loop) {
+	free(loop->list);
+}
+
+static int
+snap_loop_argoff(const char **argv) {
+	int argoff;
+
+	for (argoff = 0; argv[argoff] != VTREE_LOOP && argv[argoff] != NULL; argoff++)
+		;
+	return argoff + 1;
+}
+
+static void
+snap_vtree_fetch_keys(struct vtree_chain *vchain, struct vtree_loop_var *loop, enum vtree_cacheable *cc, int argc, const char **argv) {
+	const struct snap_node *node = snap_vasget(vchain->data, NULL, argc, argv);
+
+	loop->len = snap_count_children(node);
+	if (!loop->len) {
+		loop->l.list = NULL;
+		loop->cleanup = NULL;
+		return;
+	}
+
+	loop->l.list = xmalloc(loop->len * sizeof(*loop->l.list));
+	for (int i = 0; i < loop->len; i++)
+		loop->l.list[i] = SNAP_KEY(SNAP_CHILD(node, i));
+	loop->cleanup = snap_fetch_cleanup;
+}
+
+static void
+snap_vtree_fetch_values(struct vtree_chain *vchain, struct vtree_loop_var *loop, enum vtree_cacheable *cc, int argc, const char **argv) {
+	const struct snap_node *node = snap_vasget(vchain->data, VTREE_LOOP, argc, argv);
+	int argoff = snap_loop_argoff(argv);
+
+	loop->len = snap_count_children(node);
+	if (!loop->len) {
+		loop->l.list = NULL;
+		loop->cleanup = NULL;
+		return;
+	}
+
+	loop->l.list = xmalloc(loop->len * sizeof(*loop->l.list));
+	for (int i = 0; i < loop->len; i++) {
+		const char *val = snap_value(snap_vasget(SNAP_CHILD(node, i), NULL, argc - argoff, argv + argoff));
+		loop->l.list[i] = val ?: "";
+	}
+	loop->cleanup = snap_fetch_cleanup;
+}
+
+static void
+snap_vtree_fetch_byval(struct vtree_chain *vchain, struct vtree_loop_var *loop, enum vtree_cacheable *cc, const char *value, int argc, const char **argv) {
+	const struct snap_node *node = snap_vasget(vchain->data, VTREE_LOOP, argc, argv);
+	int argoff = snap_loop_argoff(argv);
+	int len = snap_count_children(node);
+
+	loop->len = 0;
+	loop->l.list = NULL;
+	loop->cleanup = NULL;
+	if (!len)
+		return;
+
+	loop->l.list = xmalloc(len * sizeof(*loop->l.list));
+	for (int i = 0; i < len; i++) {
+		const struct snap_node *n = SNAP_CHILD(node, i);
+		const char *val = snap_value(snap_vasget(n, NULL, argc - argoff, argv + argoff));
+
+		if (val && strcmp(value, val) == 0)
+			loop->l.list[loop->len++] = SNAP_KEY(n);
+	}
+
+	if (!loop->len) {
+		free(loop->l.list);
+		loop->l.list = NULL;
+		return;
+	}
+	loop->cleanup = snap_fetch_cleanup;
+}
+
+static struct vtree_chain *
+snap_vtree_getnode(struct vtree_chain *vchain, enum vtree_cacheable *cc, struct vtree_chain *dst, int argc, const char **argv) {
+	const struct snap_node *node = snap_vasget(vchain->data, NULL, argc, argv);
+
+	*cc = VTCACHE_CANT;
+	if (!node)
+		return NULL;
+	snap_node_vtree(dst, node);
+	return dst;
+}
+
+static void
+snap_vtree_fetch_nodes(struct vtree_chain *vchain, struct vtree_loop_var *loop, enum vtree_cacheable *cc, int argc, const char **argv) {
+	const struct snap_node *node = snap_vasget(vchain->data, NULL, argc, argv);
+
+	loop->len = snap_count_children(node);
+	if (!loop->len) {
+		loop->l.vlist = NULL;
+		loop->cleanup = NULL;
+		return;
+	}
+
+	loop->l.vlist = xmalloc(loop->len * sizeof(*loop->l.vlist));
+	for (int i = 0; i < loop->len; i++)
+		snap_node_vtree(&loop->l.vlist[i], SNAP_CHILD(node, i));
+	loop->cleanup = snap_fetch_cleanup;
+}
+
+static void
+snap_vtree_fetch_keys_and_values(struct vtree_chain *vchain, struct vtree_keyvals *loop, enum vtree_cacheable *cc, int argc, const char **argv) {
+	const struct snap_node *node = snap_vasget(vchain->data, VTREE_LOOP, argc, argv);
+	int argoff = snap_loop_argoff(argv);
+
+	loop->type = vktUnknown;
+	loop->len = snap_count_children(node);
+	if (!loop->len) {
+		loop->list = NULL;
+		loop->cleanup = NULL;
+		return;
+	}
+
+	loop->list = xmalloc(loop->len * sizeof(*loop->list));
+	for (int i = 0; i < loop->len; i++) {
+		const struct snap_node *n = SNAP_CHILD(node, i);
+		const char *val;
+
+		loop->list[i].key = SNAP_KEY(n);
+
+		n = snap_vasget(n, NULL, argc - argoff, argv + argoff);
+		if (!n) {
+			loop->list[i].type = vkvNone;
+		} else if ((val = SNAP_VALUE(n))) {
+			loop->list[i].type = vkvValue;
+			loop->list[i].v.value = val;
+		} else {
+			loop->list[i].type = vkvNode;
+			snap_node_vtree(&loop->list[i].v.node, n);
+		}
+	}
+	loop->cleanup = snap_fetch_keyvals_cleanup;
+}
+
+static const struct vtree_dispatch bconf_snapshot_api = {
+	snap_vtree_getlen,
+	snap_vtree_get,
+	snap_vtree_haskey,
+	snap_vtree_fetch_keys,
+	snap_vtree_fetch_values,
+	snap_vtree_fetch_byval,
+	snap_vtree_getnode,
+	snap_vtree_fetch_nodes,
+	snap_vtree_fetch_keys_and_values,
+	NULL, /* Nothing to free, the nodes are in the mapping. */
+	NULL, /* getnode_path */
+};
+
+struct vtree_chain *
+bconf_snapshot_vtree(struct vtree_chain *dst, struct bconf_snapshot *snap) {
+	snap_node_vtree(dst, snap->root);
+	return dst;
+}
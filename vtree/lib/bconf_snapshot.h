@@ -0,0 +1,51 @@
+// Copyright 2018 Schibsted
+
+#ifndef BCONF_SNAPSHOT_H
+#define BCONF_SNAPSHOT_H
+
+#include "vtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bconf_node;
+struct bconf_snapshot;
+
+/*
+ * A bconf snapshot is a bconf tree compiled into a flat binary file that
+ * is mmap'd read-only, so it's loaded without parsing and the pages are
+ * shared between all processes using the same file. The tree can't be
+ * modified, but lookups behave like on the bconf it was compiled from,
+ * including '.' in keys and '*' nodes.
+ *
+ * The file is written to a temporary file which is then renamed, so
+ * processes that have the old file open are not affected when it's
+ * replaced.
+ *
+ * Values are copied as vlen bytes followed by a NUL. Binary values are
+ * thus copied as is, which is only useful if they don't contain pointers.
+ */
+
+/* Returns 0 on success, -1 with errno set on failure. */
+int bconf_snapshot_write(struct bconf_node *root, const char *filename);
+
+/* Returns NULL with errno set on failure, EINVAL if the file is not a valid snapshot. */
+struct bconf_snapshot *bconf_snapshot_open(const char *filename);
+void bconf_snapshot_close(struct bconf_snapshot *snap);
+
+/* Number of nodes and size in bytes. */
+int bconf_snapshot_nodes(const struct bconf_snapshot *snap) FUNCTION_PURE;
+size_t bconf_snapshot_size(const struct bconf_snapshot *snap) FUNCTION_PURE;
+
+/*
+ * Vtree for the root of the snapshot. Freeing it does not close the
+ * snapshot, which must be kept open while the vtree is used.
+ */
+struct vtree_chain *bconf_snapshot_vtree(struct vtree_chain *dst, struct bconf_snapshot *snap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,6 +17,7 @@ static struct vtree_chain *_bconf_getnode(struct vtree_chain *vchain, enum vtree
 static void vtree_bconf_fetch_nodes(struct bconf_node *node, struct vtree_loop_var *loop, int argc, const char **argv);
 static struct vtree_chain *_bconf_node_getnode(struct vtree_chain *vchain, enum vtree_cacheable *cc, struct vtree_chain *dst, int argc, const char **argv);
 static void vtree_bconf_fetch_keys_and_values(struct bconf_node *node, struct vtree_keyvals *loop, int argc, const char **argv);
+static const struct vtree_dispatch bconf_api_node;
 
 static int
 _bconf_getlen(struct vtree_chain *vchain, enum vtree_cacheable *cc, int argc, const char **argv) {
@@ -333,6 +334,35 @@ _bconf_node_fetch_keys_and_values(struct vtree_chain *vchain, struct vtree_keyva
 	vtree_bconf_fetch_keys_and_values(vchain->data, loop, argc, argv);
 }
 
+static struct vtree_chain *
+bconf_node_vtree(struct vtree_chain *dst, struct bconf_node *node) {
+	if (!node)
+		return NULL;
+	dst->data = node;
+	dst->fun = &bconf_api_node;
+	dst->next = NULL;
+	return dst;
+}
+
+/*
+ * The constant start of the path is looked up once and the node it leads
+ * to is cached in the path, until any bconf node is added or freed.
+ */
+static struct vtree_chain *
+_bconf_node_getnode_path(struct vtree_chain *vchain, struct vtree_path *path, struct vtree_chain *dst, int argc, const char **argv) {
+	struct bconf_node *root = vchain->data;
+	unsigned long gen = bconf_generation(root);
+	void *prefix, *unused;
+
+	if (!vtree_path_cache_get(path, gen, root, NULL, &prefix, &unused)) {
+		prefix = bconf_vasget(root, NULL, path->prefixc, argv);
+		vtree_path_cache_set(path, gen, root, NULL, prefix, NULL);
+	}
+	if (!prefix)
+		return NULL;
+	return bconf_node_vtree(dst, bconf_vasget(prefix, NULL, argc - path->prefixc, argv + path->prefixc));
+}
+
 static void
 _bconf_free(struct vtree_chain *vchain) {
 	free(vchain->data);
@@ -349,6 +379,8 @@ static const struct vtree_dispatch bconf_api_node = {
 	_bconf_node_getnode,
 	_bconf_node_fetch_nodes,
 	_bconf_node_fetch_keys_and_values,
+	NULL,
+	_bconf_node_getnode_path,
 };
 
 static void
@@ -371,6 +403,7 @@ static const struct vtree_dispatch bconf_api_node_own = {
 	_bconf_node_fetch_nodes,
 	_bconf_node_fetch_keys_and_values,
 	_bconf_node_free,
+	_bconf_node_getnode_path,
 };
 
 static struct vtree_chain *
@@ -418,6 +451,28 @@ _bconf_node_getnode(struct vtree_chain *vchain, enum vtree_cacheable *cc, struct
 	return NULL;
 }
 
+static struct vtree_chain *
+_bconf_getnode_path(struct vtree_chain *vchain, struct vtree_path *path, struct vtree_chain *dst, int argc, const char **argv) {
+	struct ctemplates_vtree_data *d = vchain->data;
+	unsigned long gen = bconf_generation(d->bconf_lowprio);
+	void *low, *high;
+	struct bconf_node *node;
+
+	if (!bconf_generation(d->bconf_highprio))
+		gen = 0;
+	if (!vtree_path_cache_get(path, gen, d->bconf_lowprio, d->bconf_highprio, &low, &high)) {
+		low = bconf_vasget(d->bconf_lowprio, NULL, path->prefixc, argv);
+		high = bconf_vasget(d->bconf_highprio, NULL, path->prefixc, argv);
+		vtree_path_cache_set(path, gen, d->bconf_lowprio, d->bconf_highprio, low, high);
+	}
+
+	if (high && (node = bconf_vasget(high, NULL, argc - path->prefixc, argv + path->prefixc)))
+		return bconf_node_vtree(dst, node);
+	if (low)
+		return bconf_node_vtree(dst, bconf_vasget(low, NULL, argc - path->prefixc, argv + path->prefixc));
+	return NULL;
+}
+
 static void
 vtree_bconf_fetch_nodes(struct bconf_node *node, struct vtree_loop_var *loop, int argc, const char **argv) {
 	int i;
@@ -492,7 +547,8 @@ static const struct vtree_dispatch bconf_api_vtree = {
 	_bconf_getnode,
 	_bconf_fetch_nodes,
 	_bconf_fetch_keys_and_values,
-	_bconf_free
+	_bconf_free,
+	_bconf_getnode_path,
 };
 
 void
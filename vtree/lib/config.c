@@ -13,7 +13,7 @@
 #include "sbp/error_functions.h"
 
 static int
-config_init_file(const char *filename, struct bconf_node **rootp, bool allow_env) {
+config_init_file(const char *filename, struct bconf_builder *builder, bool allow_env) {
 	FILE *fp;
 	char buf[1024];
 	char *ptr;
@@ -42,13 +42,13 @@ config_init_file(const char *filename, struct bconf_node **rootp, bool allow_env
 					continue;
 			}
 			if (n[0] == '/') {
-				config_init_file(n, rootp, allow_env);
+				config_init_file(n, builder, allow_env);
 			} else {
 				char *dir = xstrdup(filename);
 				int res UNUSED;
 
 				xasprintf(&n, "%s/%s", dirname(dir), n);
-				res = config_init_file(n, rootp, allow_env);
+				res = config_init_file(n, builder, allow_env);
 
 				free(dir);
 				free(n);
@@ -86,7 +86,7 @@ config_init_file(const char *filename, struct bconf_node **rootp, bool allow_env
 		}
 
 		if (value)
-			bconf_add_data(rootp, key, value);
+			bconf_builder_add(builder, key, value);
 	}
 
 	fclose(fp);
@@ -94,14 +94,29 @@ config_init_file(const char *filename, struct bconf_node **rootp, bool allow_env
 	return 0;
 }
 
+/*
+ * Parses filename and its includes into a builder, then builds the tree in
+ * one go. A key conflicting with another one is fatal, as with bconf_add_data.
+ */
+static int
+config_load_file(const char *filename, struct bconf_node **rootp, bool allow_env) {
+	struct bconf_builder *builder = bconf_builder_new();
+
+	if (config_init_file(filename, builder, allow_env) != 0) {
+		bconf_builder_free(builder);
+		return -1;
+	}
+	if (bconf_builder_finish(builder, rootp) != 0)
+		xerrx(1, "config: %s: can not add node, possible conflict", filename);
+	return 0;
+}
+
 struct bconf_node *
 config_init(const char *filename) {
 	struct bconf_node *config_root = NULL;
 
-	if (config_init_file(filename, &config_root, true) != 0) {
-		bconf_free(&config_root);
+	if (config_load_file(filename, &config_root, true) != 0)
 		return NULL;
-	}
 
 	return config_root;
 }
@@ -114,10 +129,8 @@ load_bconf_file(const char *appl, struct bconf_node **root, const char *filename
 		host = bconf_get_string(*root, "blocket_id");
 
 	struct bconf_node *tmproot = NULL;
-	if (config_init_file(filename, &tmproot, false) != 0) {
-		bconf_free(&tmproot);
+	if (config_load_file(filename, &tmproot, false) != 0)
 		return -1;
-	}
 
 	int r = config_merge_bconf(root, tmproot, host, appl);
 
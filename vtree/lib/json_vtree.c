@@ -15,13 +15,21 @@
 
 struct j_stack {
 	int count;
-	struct bconf_node *node;
+	int keyc;
 };
 
+/*
+ * Values are added to a builder with their full path, keyv[0 .. keyc - 1]
+ * of the current level followed by the key of the value.
+ */
 struct j_ctx {
 	int stack;
 	struct j_stack st[MAX_DEPTH];
 	char next_key[MAX_KEYLEN];
+	char keys[MAX_DEPTH][MAX_KEYLEN];
+	const char *keyv[MAX_DEPTH + 1];
+	struct bconf_builder *builder;
+	bool root_list;
 };
 
 static int
@@ -36,31 +44,39 @@ json_vtree_next_key(struct j_ctx *c) {
 	return *c->next_key ? c->next_key : NULL;
 }
 
+static void
+json_vtree_add(struct j_ctx *c, const char *value, size_t l) {
+	struct j_stack * s = &c->st[c->stack];
+	const char *key = json_vtree_next_key(c);
+
+	if (!key)
+		return;
+	c->keyv[s->keyc] = key;
+	bconf_builder_addv(c->builder, s->keyc + 1, c->keyv, value, l);
+}
+
 static int
 json_vtree_boolean(void *ctx, int boolean) {
 	struct j_ctx * c = ctx;
-	struct j_stack * s = &c->st[c->stack];
 
 	if (boolean)
-		bconf_add_datav(&s->node, 1, (const char *[]){ json_vtree_next_key(c) }, "true", BCONF_REF);
+		json_vtree_add(c, "true", 4);
 	return 1;
 }
 
 static int
 json_vtree_number(void *ctx, const char *str, size_t l) {
 	struct j_ctx * c = ctx;
-	struct j_stack * s = &c->st[c->stack];
 
-	bconf_add_datav(&s->node, 1, (const char *[]){ json_vtree_next_key(c) }, xstrndup(str, l), BCONF_OWN);
+	json_vtree_add(c, str, l);
 	return 1;
 }
 
 static int
 json_vtree_string(void *ctx, const unsigned char *str, size_t l) {
 	struct j_ctx * c = ctx;
-	struct j_stack * s = &c->st[c->stack];
 
-	bconf_add_datav(&s->node, 1, (const char *[]){ json_vtree_next_key(c) }, xstrndup((const char*)str, l), BCONF_OWN);
+	json_vtree_add(c, (const char*)str, l);
 	return 1;
 }
 
@@ -75,17 +91,29 @@ json_vtree_map_key(void *ctx, const unsigned char *str, size_t l) {
 	return 1; 
 }
 
-static int
-json_vtree_start_map(void *ctx) {
-	struct j_ctx * c = ctx;
+static void
+json_vtree_push(struct j_ctx *c, int count) {
 	struct j_stack * s = &c->st[c->stack];
-	struct bconf_node *node;
 	const char *key = json_vtree_next_key(c);
-
-	node = bconf_add_listnodev(&s->node, 1, (const char *[]){key});
+	int keyc = s->keyc;
+
+	if (key) {
+		strlcpy(c->keys[keyc], key, MAX_KEYLEN);
+		c->keyv[keyc] = c->keys[keyc];
+		keyc++;
+		/* Adds the list node, in case it's empty. */
+		bconf_builder_addv(c->builder, keyc, c->keyv, NULL, 0);
+	} else {
+		c->root_list = true;
+	}
 	struct j_stack * next = &c->st[++c->stack];
-	next->node = node;
-	next->count = -1;
+	next->keyc = keyc;
+	next->count = count;
+}
+
+static int
+json_vtree_start_map(void *ctx) {
+	json_vtree_push(ctx, -1);
 	return 1;
 }
 
@@ -99,14 +127,7 @@ json_vtree_end_map(void *ctx) {
 
 static int
 json_vtree_start_array(void *ctx) {
-	struct j_ctx * c = ctx;
-	struct j_stack * s = &c->st[c->stack];
-	struct bconf_node *node;
-
-	node = bconf_add_listnodev(&s->node, 1, (const char *[]){json_vtree_next_key(c)});
-	struct j_stack * next = &c->st[++c->stack];
-	next->node = node;
-	next->count = 0;
+	json_vtree_push(ctx, 0);
 	return 1;
 }
 
@@ -141,6 +162,7 @@ json_vtree(struct vtree_chain *dst, const char *root_name, const char *json_str,
 int
 json_bconf(struct bconf_node **dst, const char *root_name, const char *json_str, ssize_t jsonlen, int validate_utf8) { 
 	struct j_ctx c = {};
+	struct bconf_node *root = NULL;
 	int res = 0;
 
 	if (jsonlen < 0)
@@ -149,6 +171,7 @@ json_bconf(struct bconf_node **dst, const char *root_name, const char *json_str,
 	if (root_name)
 		strlcpy(c.next_key, root_name, MAX_KEYLEN);
 	c.st[0].count = -1;
+	c.builder = bconf_builder_new();
 
 	yajl_handle hand = yajl_alloc(&json_vtree_cbs, NULL, &c);
 	yajl_config(hand, yajl_allow_comments, 1);
@@ -159,27 +182,29 @@ json_bconf(struct bconf_node **dst, const char *root_name, const char *json_str,
 	if (stat == yajl_status_ok)
 		stat = yajl_complete_parse(hand);
 
+	if (bconf_builder_finish(c.builder, &root) != 0)
+		xerrx(1, "json_bconf: Node list/value conflict");
+	if (!root && c.root_list)
+		root = bconf_add_listnode(&root, NULL);
+
 	if (stat != yajl_status_ok) {
 		unsigned char *error = yajl_get_error(hand, 1, (const unsigned char*)json_str, jsonlen);
 		/* Check if root_name is a value node, or if root_name.error already exists. Otherwise set it to the error. */
-		if (bconf_value(bconf_get(c.st[0].node, root_name))) {
+		if (root_name && bconf_value(bconf_get(root, root_name))) {
 			/* XXX do something */;
-		} else if (bconf_vget(c.st[0].node, root_name, "error", NULL)) {
+		} else if (root_name && bconf_vget(root, root_name, "error", NULL)) {
 			/* XXX do something */;
 		} else {
 			if (root_name)
-				bconf_add_datav(&c.st[0].node, 2, (const char*[]){ root_name, "error" }, (const char*)error, BCONF_DUP);
+				bconf_add_datav(&root, 2, (const char*[]){ root_name, "error" }, (const char*)error, BCONF_DUP);
 			else
-				bconf_add_datav(&c.st[1].node, 1, (const char*[]){ "error" }, (const char*)error, BCONF_DUP);
+				bconf_add_datav(&root, 1, (const char*[]){ "error" }, (const char*)error, BCONF_DUP);
 		}
 		yajl_free_error(hand, error);
 		res = 1;
 	}
 
-	if (root_name)
-		*dst = c.st[0].node;
-	else
-		*dst = c.st[1].node;
+	*dst = root;
 
 	yajl_free(hand);
 
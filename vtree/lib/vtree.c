@@ -469,6 +469,250 @@ vtree_fetch_keys_and_values_cachev(struct vtree_chain *vchain, struct vtree_keyv
 		*cc = c;
 }
 
+/*
+ * Compiled paths
+ */
+struct vtree_path *
+vtree_path_compile(const char *template) {
+	size_t tlen = strlen(template);
+	int argc = tlen ? 1 : 0;
+	const char *c;
+
+	for (c = template; *c; c++) {
+		if (*c == '.')
+			argc++;
+	}
+
+	struct vtree_path *path = zmalloc(sizeof(*path) + argc * (sizeof(*path->argv) + 1) + tlen + 1);
+	char *buf;
+	int i;
+
+	path->argc = argc;
+	path->argv = (const char **)(path + 1);
+	path->holes = (char *)(path->argv + argc);
+	buf = memcpy(path->holes + argc, template, tlen + 1);
+	path->prefixc = argc;
+
+	for (i = 0; i < argc; i++) {
+		char *part = buf;
+
+		while (*buf != '.' && *buf)
+			buf++;
+		*buf++ = '\0';
+
+		if (part[0] == '%' && (part[1] == 'd' || part[1] == 's') && part[2] == '\0') {
+			path->holes[i] = part[1];
+			if (path->prefixc == argc)
+				path->prefixc = i;
+		} else {
+			path->argv[i] = part;
+		}
+	}
+	return path;
+}
+
+void
+vtree_path_free(struct vtree_path *path) {
+	free(path);
+}
+
+static const char *
+vtree_path_int(char *end, int v) {
+	unsigned int u = v < 0 ? -(unsigned int)v : (unsigned int)v;
+
+	*--end = '\0';
+	do {
+		*--end = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		*--end = '-';
+	return end;
+}
+
+/* ibuf needs room for one formatted int per element. */
+static void
+vtree_path_args(struct vtree_path *path, const char **argv, char (*ibuf)[12], va_list ap) {
+	int i;
+
+	for (i = 0; i < path->argc; i++) {
+		switch (path->holes[i]) {
+		case 'd':
+			argv[i] = vtree_path_int(ibuf[i] + sizeof(ibuf[i]), va_arg(ap, int));
+			break;
+		case 's':
+			argv[i] = va_arg(ap, const char *);
+			break;
+		default:
+			argv[i] = path->argv[i];
+			break;
+		}
+	}
+}
+
+#define VTREE_PATH_ARGS(path, start, argv) \
+	const char *argv[(path)->argc + 1]; \
+	char argv##_ibuf[(path)->argc + 1][12]; \
+	do { \
+		va_list VPA_ap; \
+		va_start(VPA_ap, start); \
+		vtree_path_args(path, argv, argv##_ibuf, VPA_ap); \
+		va_end(VPA_ap); \
+	} while (0)
+
+const char *
+vtree_path_get(struct vtree_chain *vchain, struct vtree_path *path, ...) {
+	enum vtree_cacheable c = VTCACHE_CAN;
+	const char *res;
+
+	if (!vchain || !vchain->fun)
+		return NULL;
+
+	VTREE_PATH_ARGS(path, path, argv);
+
+	if (vchain->fun->getnode_path) {
+		struct vtree_chain node = {0};
+
+		if (!vchain->fun->getnode_path(vchain, path, &node, path->argc, argv))
+			return NULL;
+		res = bpv_get(&node, &c, 0, argv);
+		vtree_free(&node);
+		return res;
+	}
+	return bpv_get(vchain, &c, path->argc, argv);
+}
+
+int
+vtree_path_getint(struct vtree_chain *vchain, struct vtree_path *path, ...) {
+	enum vtree_cacheable c = VTCACHE_CAN;
+	const char *res;
+
+	if (!vchain || !vchain->fun)
+		return 0;
+
+	VTREE_PATH_ARGS(path, path, argv);
+
+	if (vchain->fun->getnode_path) {
+		struct vtree_chain node = {0};
+
+		if (!vchain->fun->getnode_path(vchain, path, &node, path->argc, argv))
+			return 0;
+		res = bpv_get(&node, &c, 0, argv);
+		vtree_free(&node);
+	} else {
+		res = bpv_get(vchain, &c, path->argc, argv);
+	}
+	return res ? atoi(res) : 0;
+}
+
+int
+vtree_path_haskey(struct vtree_chain *vchain, struct vtree_path *path, ...) {
+	enum vtree_cacheable c = VTCACHE_CAN;
+
+	if (!vchain || !vchain->fun)
+		return 0;
+
+	VTREE_PATH_ARGS(path, path, argv);
+
+	if (vchain->fun->getnode_path) {
+		struct vtree_chain node = {0};
+		int res = vchain->fun->getnode_path(vchain, path, &node, path->argc, argv) != NULL;
+
+		vtree_free(&node);
+		return res;
+	}
+	return bpv_haskey(vchain, &c, path->argc, argv);
+}
+
+int
+vtree_path_getlen(struct vtree_chain *vchain, struct vtree_path *path, ...) {
+	enum vtree_cacheable c = VTCACHE_CAN;
+
+	if (!vchain || !vchain->fun)
+		return 0;
+
+	VTREE_PATH_ARGS(path, path, argv);
+
+	if (vchain->fun->getnode_path) {
+		struct vtree_chain node = {0};
+		int res;
+
+		if (!vchain->fun->getnode_path(vchain, path, &node, path->argc, argv))
+			return 0;
+		res = bpv_getlen(&node, &c, 0, argv);
+		vtree_free(&node);
+		return res;
+	}
+	return bpv_getlen(vchain, &c, path->argc, argv);
+}
+
+struct vtree_chain *
+vtree_path_getnode(struct vtree_chain *vchain, struct vtree_path *path, struct vtree_chain *dst, ...) {
+	enum vtree_cacheable c = VTCACHE_CAN;
+	struct vtree_chain *res;
+
+	if (!vchain || !vchain->fun)
+		return NULL;
+
+	vtree_free(dst);
+
+	VTREE_PATH_ARGS(path, dst, argv);
+
+	if (vchain->fun->getnode_path)
+		res = vchain->fun->getnode_path(vchain, path, dst, path->argc, argv);
+	else
+		res = bpv_getnode(vchain, &c, dst, path->argc, argv);
+
+	if (res != dst) {
+		/* If they didn't touch dst we should clear it because of the free above. */
+		memset(dst, 0, sizeof(*dst));
+	}
+	return res;
+}
+
+/*
+ * The cache is a seqlock, seq is odd while it's being written. Writers
+ * that find it odd or lose the race to make it odd just skip the update.
+ */
+int
+vtree_path_cache_get(struct vtree_path *path, unsigned long gen, const void *root0, const void *root1, void **node0, void **node1) {
+	struct vtree_path_cache *cache = &path->cache;
+	unsigned long seq = __atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE);
+	int hit;
+
+	if (gen == 0 || (seq & 1))
+		return 0;
+
+	hit = __atomic_load_n(&cache->gen, __ATOMIC_RELAXED) == gen &&
+			__atomic_load_n(&cache->root[0], __ATOMIC_RELAXED) == root0 &&
+			__atomic_load_n(&cache->root[1], __ATOMIC_RELAXED) == root1;
+	*node0 = __atomic_load_n(&cache->node[0], __ATOMIC_RELAXED);
+	*node1 = __atomic_load_n(&cache->node[1], __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return hit && __atomic_load_n(&cache->seq, __ATOMIC_RELAXED) == seq;
+}
+
+void
+vtree_path_cache_set(struct vtree_path *path, unsigned long gen, const void *root0, const void *root1, void *node0, void *node1) {
+	struct vtree_path_cache *cache = &path->cache;
+	unsigned long seq = __atomic_load_n(&cache->seq, __ATOMIC_RELAXED);
+
+	if (gen == 0 || (seq & 1))
+		return;
+	if (!__atomic_compare_exchange_n(&cache->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&cache->gen, gen, __ATOMIC_RELAXED);
+	__atomic_store_n(&cache->root[0], root0, __ATOMIC_RELAXED);
+	__atomic_store_n(&cache->root[1], root1, __ATOMIC_RELAXED);
+	__atomic_store_n(&cache->node[0], node0, __ATOMIC_RELAXED);
+	__atomic_store_n(&cache->node[1], node1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&cache->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 /*
  * Shadow vtree
  */
@@ -825,7 +1069,8 @@ const struct vtree_dispatch shadow_vtree = {
 	shadow_vtree_getnode,
 	shadow_vtree_fetch_nodes,
 	shadow_vtree_fetch_keys_and_values,
-	shadow_vtree_free
+	shadow_vtree_free,
+	NULL, /* getnode_path */
 };
 
 const struct vtree_dispatch shadow_vtree_weakref = {
@@ -838,7 +1083,8 @@ const struct vtree_dispatch shadow_vtree_weakref = {
 	shadow_vtree_getnode,
 	shadow_vtree_fetch_nodes,
 	shadow_vtree_fetch_keys_and_values,
-	shadow_vtree_free_weakref
+	shadow_vtree_free_weakref,
+	NULL, /* getnode_path */
 };
 
 static int
@@ -1089,7 +1335,8 @@ const struct vtree_dispatch prefix_vtree = {
 	prefix_vtree_getnode,
 	prefix_vtree_fetch_nodes,
 	prefix_vtree_fetch_keys_and_values,
-	prefix_vtree_free
+	prefix_vtree_free,
+	NULL, /* getnode_path */
 };
 
 const struct vtree_dispatch prefix_vtree_free_prefix = {
@@ -1102,7 +1349,8 @@ const struct vtree_dispatch prefix_vtree_free_prefix = {
 	prefix_vtree_getnode,
 	prefix_vtree_fetch_nodes,
 	prefix_vtree_fetch_keys_and_values,
-	prefix_vtree_free_prefix_free
+	prefix_vtree_free_prefix_free,
+	NULL, /* getnode_path */
 };
 
 void
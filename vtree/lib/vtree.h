@@ -10,6 +10,7 @@
 #define VTREE_LOOP ((const char *)-1)
 
 struct vtree_keyvals;
+struct vtree_path;
 
 struct vtree_loop_var {
 	int len;
@@ -43,6 +44,13 @@ struct vtree_dispatch {
 	void (*fetch_keys_and_values)(struct vtree_chain *, struct vtree_keyvals *loop, enum vtree_cacheable *cc, int, const char **);
 
 	void (*free)(struct vtree_chain *);
+
+	/*
+	 * Optional, used by the vtree_path functions. Like getnode, but the
+	 * first path->prefixc elements of argv are the constant ones in path,
+	 * and whatever they resolve to can be kept in path->cache.
+	 */
+	struct vtree_chain *(*getnode_path)(struct vtree_chain *, struct vtree_path *path, struct vtree_chain *dst, int, const char **);
 };
 
 struct vtree_chain {
@@ -116,6 +124,54 @@ struct vtree_chain *vtree_getnode_cachev(struct vtree_chain *vchain, enum vtree_
 void vtree_fetch_nodes_cachev(struct vtree_chain *vchain, struct vtree_loop_var *loop, enum vtree_cacheable *cc, int argc, const char **argv);
 void vtree_fetch_keys_and_values_cachev(struct vtree_chain *vchain, struct vtree_keyvals *loop, enum vtree_cacheable *cc, int argc, const char **argv);
 
+/*
+ * A compiled path, for lookups done often with the same key, possibly with
+ * some parts changing. The template is split on '.', and the parts "%d"
+ * and "%s" are holes, filled in from the int and const char * arguments
+ * of each lookup:
+ *
+ *	struct vtree_path *p = vtree_path_compile("common.category.%d.name");
+ *	const char *name = vtree_path_get(&vtree, p, category);
+ *
+ * Unlike the _cache functions the result is not cached, but backends can
+ * cache how far the constant parts of the path lead, which is then
+ * checked on each lookup. A path can be used from several threads, and
+ * with several vtrees.
+ */
+struct vtree_path {
+	int argc;
+	const char **argv;	/* NULL for holes. */
+	char *holes;		/* 'd' or 's' for holes, 0 for constant parts. */
+	int prefixc;		/* Number of constant parts before the first hole. */
+
+	/* Owned by the backend, see vtree_path_cache_get. */
+	struct vtree_path_cache {
+		unsigned long seq;
+		unsigned long gen;
+		const void *root[2];
+		void *node[2];
+	} cache;
+};
+
+struct vtree_path *vtree_path_compile(const char *template) NONNULL_ALL;
+void vtree_path_free(struct vtree_path *path);
+
+const char *vtree_path_get(struct vtree_chain *vchain, struct vtree_path *path, ...) NONNULL(2);
+int vtree_path_getint(struct vtree_chain *vchain, struct vtree_path *path, ...) NONNULL(2);
+int vtree_path_haskey(struct vtree_chain *vchain, struct vtree_path *path, ...) NONNULL(2);
+int vtree_path_getlen(struct vtree_chain *vchain, struct vtree_path *path, ...) NONNULL(2);
+/* As vtree_getnode, dst will be freed. */
+struct vtree_chain *vtree_path_getnode(struct vtree_chain *vchain, struct vtree_path *path, struct vtree_chain *dst, ...) NONNULL(2,3);
+
+/*
+ * For backends implementing getnode_path. The cache holds up to two
+ * nodes found from up to two roots, valid as long as gen is unchanged.
+ * gen 0 means nothing is cached. Lookups in several threads are safe,
+ * if two threads update the cache at the same time one of them skips it.
+ */
+int vtree_path_cache_get(struct vtree_path *path, unsigned long gen, const void *root0, const void *root1, void **node0, void **node1);
+void vtree_path_cache_set(struct vtree_path *path, unsigned long gen, const void *root0, const void *root1, void *node0, void *node1);
+
 /* Note: if you don't want shadow_vtree call vtree_free on the contained vtree, override the target
  * fun pointer with &shadow_vtree_weakref after calling shadow_vtree_init. */
 void shadow_vtree_init(struct vtree_chain *, struct shadow_vtree *, struct vtree_chain *);
@@ -404,6 +404,7 @@ const struct vtree_dispatch vtree_literal_vtree = {
 	vtree_literal_fetch_nodes,
 	vtree_literal_fetch_keys_and_values,
 	NULL, //vtree_literal_free
+	NULL, //getnode_path
 };
 
 const struct vtree_dispatch vtree_literal_free_vtree = {
@@ -417,6 +418,7 @@ const struct vtree_dispatch vtree_literal_free_vtree = {
 	vtree_literal_fetch_nodes,
 	vtree_literal_fetch_keys_and_values,
 	vtree_literal_free,
+	NULL, //getnode_path
 };
 
 struct vtree_chain *
@@ -64,6 +64,7 @@ const struct vtree_dispatch vtree_value_vtree = {
 	vtree_value_fetch, /* vtree_value_fetch_nodes, */
 	vtree_value_fetch_keys_and_values,
 	NULL, /* vtree_value_free */
+	NULL, /* getnode_path */
 };
 
 static void
@@ -81,5 +82,6 @@ const struct vtree_dispatch vtree_value_free_vtree = {
 	vtree_value_getnode,
 	vtree_value_fetch, /* vtree_value_fetch_nodes, */
 	vtree_value_fetch_keys_and_values,
-	vtree_value_free
+	vtree_value_free,
+	NULL, /* getnode_path */
 };
@@ -3,6 +3,7 @@
 package bconf
 
 import (
+	"errors"
 	"fmt"
 	"strings"
 )
@@ -49,6 +50,20 @@ type MutBconf interface {
 	BconfAdder
 }
 
+// A BconfAdder that is faster at adding many values at once, such as CBconf.
+// Bulk returns an adder collecting values and a function adding them to the
+// bconf, which must be called when done.
+// The result is the same as adding the values directly in the same order,
+// except that conflicts are only reported by flush, as ErrBulkConflict.
+type BulkAdder interface {
+	BconfAdder
+	Bulk() (adder BconfAdder, flush func() error)
+}
+
+// Returned by the flush function of a BulkAdder if some keys had a
+// node/list conflict. Those keys are skipped, the others are still added.
+var ErrBulkConflict = errors.New("Failed to add some keys, node/list conflict")
+
 // Compares the two bconf keys with the bconf sort order.
 func KeyCompare(a, b string) int {
 	la := len(a)
@@ -93,5 +108,11 @@ func addRecursively(b BconfAdder, m map[string]interface{}, path *[]string) {
 
 // Initialize the BconfAdder from a Bconf interface.
 func InitFromBconf(dst BconfAdder, src Bconf) {
+	if ba, ok := dst.(BulkAdder); ok {
+		adder, flush := ba.Bulk()
+		addRecursively(adder, src.ToMap(), &[]string{})
+		flush()
+		return
+	}
 	addRecursively(dst, src.ToMap(), &[]string{})
 }
@@ -43,3 +43,51 @@ func (b *CBconf) Addv(kv []string, v string) error {
 	C.free(unsafe.Pointer(cv))
 	return &AddError{kv, v}
 }
+
+type cbulk struct {
+	builder *C.struct_bconf_builder
+}
+
+func (bk *cbulk) Add(k ...string) func(v string) error {
+	return func(v string) error {
+		ck := C.CString(strings.Join(k, "."))
+		defer C.free(unsafe.Pointer(ck))
+		cv := C.CString(v)
+		defer C.free(unsafe.Pointer(cv))
+		C.bconf_builder_add(bk.builder, ck, cv)
+		return nil
+	}
+}
+
+func (bk *cbulk) Addv(kv []string, v string) error {
+	if len(kv) == 0 {
+		return nil
+	}
+	ckv := make([]*C.char, len(kv))
+	for i, k := range kv {
+		ck := C.CString(k)
+		defer C.free(unsafe.Pointer(ck))
+		ckv[i] = ck
+	}
+	cv := C.CString(v)
+	defer C.free(unsafe.Pointer(cv))
+	C.bconf_builder_addv(bk.builder, C.int(len(ckv)), &ckv[0], cv, C.ssize_t(len(v)))
+	return nil
+}
+
+// Bulk implements BulkAdder using a C bconf builder, which collects the
+// values and creates each node's children in one go.
+func (b *CBconf) Bulk() (BconfAdder, func() error) {
+	bk := &cbulk{C.bconf_builder_new()}
+	return bk, func() error {
+		if bk.builder == nil {
+			return nil
+		}
+		r := C.bconf_builder_finish(bk.builder, &b.n)
+		bk.builder = nil
+		if r != 0 {
+			return ErrBulkConflict
+		}
+		return nil
+	}
+}
@@ -62,3 +62,30 @@ func TestConflict(t *testing.T) {
 		t.Errorf("%v != \"2\"", aerr.Value)
 	}
 }
+
+func TestBulk(t *testing.T) {
+	b := NewCBconf()
+	defer b.Free()
+	b.Add("a.b.c")("1")
+	adder, flush := b.Bulk()
+	adder.Add("a.b", "d")("2")
+	adder.Addv([]string{"a.b", "c"}, "3")
+	adder.Add("a.b.c")("4")
+	adder.Add("a.b.c.x")("conflict")
+	if err := flush(); err != ErrBulkConflict {
+		t.Errorf("%v != ErrBulkConflict", err)
+	}
+	if err := flush(); err != nil {
+		t.Error(err)
+	}
+	if i := b.Get("a.b.c").Int(0); i != 4 {
+		t.Errorf("%v != 4", i)
+	}
+	if i := b.Get("a.b.d").Int(0); i != 2 {
+		t.Errorf("%v != 2", i)
+	}
+	s := b.ToMap()["a.b"].(map[string]interface{})["c"].(string)
+	if s != "3" {
+		t.Errorf("%v != 3", s)
+	}
+}
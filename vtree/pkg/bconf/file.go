@@ -39,7 +39,23 @@ func (se SyntaxError) Error() string {
 // The path is relative to the current file being read.
 //
 // Lines starting with # are considered comments.
+//
+// If bconf is a BulkAdder, all values read are added in bulk at the end,
+// and the values read before an error are still added.
 func ReadFile(bconf BconfAdder, path string, allowEnv bool) error {
+	ba, ok := bconf.(BulkAdder)
+	if !ok {
+		return readFile(bconf, path, allowEnv)
+	}
+	adder, flush := ba.Bulk()
+	err := readFile(adder, path, allowEnv)
+	if ferr := flush(); err == nil {
+		err = ferr
+	}
+	return err
+}
+
+func readFile(bconf BconfAdder, path string, allowEnv bool) error {
 	f, err := os.Open(path)
 	if err != nil {
 		return err
@@ -61,7 +77,7 @@ func ReadFile(bconf BconfAdder, path string, allowEnv bool) error {
 			if !filepath.IsAbs(inc) {
 				inc = filepath.Join(filepath.Dir(path), inc)
 			}
-			err = ReadFile(bconf, inc, allowEnv)
+			err = readFile(bconf, inc, allowEnv)
 			// We ignore path errors, such as missing file.
 			// It's a feature.
 			if err != nil {
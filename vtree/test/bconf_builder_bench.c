@@ -0,0 +1,141 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Compares building a bconf tree with bconf_add_data() one key at a time
+ * to using a bconf_builder, for keys in file order and in random order.
+ * Also times config_init() on the same keys written to a file. Each time
+ * is the best of three runs.
+ *
+ * Usage: bconf_builder_bench [keys]
+ */
+
+#include "sbp/bconf.h"
+#include "sbp/bconfig.h"
+#include "sbp/error_functions.h"
+#include "sbp/memalloc_functions.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int nkeys = 500000;
+
+struct kv {
+	char key[64];
+	char value[32];
+};
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct kv *
+make_keys(void) {
+	struct kv *kv = xmalloc(nkeys * sizeof(*kv));
+
+	for (int i = 0; i < nkeys; i++) {
+		static const char *leaf[] = { "name", "parent", "settings.min", "settings.max" };
+		snprintf(kv[i].key, sizeof(kv[i].key), "*.*.category.%d.%s", i / 4, leaf[i % 4]);
+		snprintf(kv[i].value, sizeof(kv[i].value), "%d", i);
+	}
+	return kv;
+}
+
+static void
+shuffle(struct kv *kv) {
+	unsigned int seed = 1;
+
+	for (int i = nkeys - 1; i > 0; i--) {
+		int j = rand_r(&seed) % (i + 1);
+		struct kv tmp = kv[i];
+		kv[i] = kv[j];
+		kv[j] = tmp;
+	}
+}
+
+static double
+bench_add(struct kv *kv) {
+	struct bconf_node *root = NULL;
+
+	double start = now();
+	for (int i = 0; i < nkeys; i++)
+		bconf_add_data(&root, kv[i].key, kv[i].value);
+	double elapsed = now() - start;
+	if (bconf_count(bconf_get(root, "*.*.category")) != nkeys / 4)
+		xerrx(1, "bconf_add_data: wrong count");
+	bconf_free(&root);
+	return elapsed;
+}
+
+static double
+bench_builder(struct kv *kv) {
+	struct bconf_node *root = NULL;
+
+	double start = now();
+	struct bconf_builder *b = bconf_builder_new();
+	for (int i = 0; i < nkeys; i++)
+		bconf_builder_add(b, kv[i].key, kv[i].value);
+	if (bconf_builder_finish(b, &root) != 0)
+		xerrx(1, "bconf_builder_finish: conflict");
+	double elapsed = now() - start;
+	if (bconf_count(bconf_get(root, "*.*.category")) != nkeys / 4)
+		xerrx(1, "bconf_builder: wrong count");
+	bconf_free(&root);
+	return elapsed;
+}
+
+static double
+bench_config(struct kv *kv) {
+	char path[] = "/tmp/bconf_builder_bench.XXXXXX";
+	int fd = mkstemp(path);
+	FILE *f = fdopen(fd, "w");
+
+	if (!f)
+		xerr(1, "fdopen");
+	for (int i = 0; i < nkeys; i++)
+		fprintf(f, "%s=%s\n", kv[i].key, kv[i].value);
+	fclose(f);
+
+	double start = now();
+	struct bconf_node *root = config_init(path);
+	double elapsed = now() - start;
+	if (bconf_count(bconf_get(root, "*.*.category")) != nkeys / 4)
+		xerrx(1, "config_init: wrong count");
+	bconf_free(&root);
+	unlink(path);
+	return elapsed;
+}
+
+static double
+best(double (*fn)(struct kv *), struct kv *kv) {
+	double t = fn(kv);
+
+	for (int i = 0; i < 2; i++) {
+		double t2 = fn(kv);
+		if (t2 < t)
+			t = t2;
+	}
+	return t * 1e3;
+}
+
+int
+main(int argc, char *argv[]) {
+	if (argc > 1)
+		nkeys = atoi(argv[1]) / 4 * 4;
+
+	struct kv *kv = make_keys();
+
+	printf("%d keys, times in ms\n", nkeys);
+	printf("%-10s %12s %12s %12s\n", "order", "add_data", "builder", "config_init");
+	printf("%-10s %12.1f %12.1f %12.1f\n", "file", best(bench_add, kv), best(bench_builder, kv), best(bench_config, kv));
+	shuffle(kv);
+	printf("%-10s %12.1f %12.1f %12.1f\n", "random", best(bench_add, kv), best(bench_builder, kv), best(bench_config, kv));
+
+	free(kv);
+	return 0;
+}
@@ -0,0 +1,134 @@
+// Copyright 2018 Schibsted
+
+#include "sbp/bconf.h"
+#include "sbp/buf_string.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+dump(struct buf_string *bs, struct bconf_node *node, int depth) {
+	bscat(bs, "%*s%s", depth, "", bconf_key(node) ?: "");
+	if (bconf_value(node))
+		bscat(bs, "=%s", bconf_value(node));
+	bscat(bs, "\n");
+	for (int i = 0; i < bconf_count(node); i++)
+		dump(bs, bconf_byindex(node, i), depth + 1);
+}
+
+static void
+compare(struct bconf_node *a, struct bconf_node *b) {
+	struct buf_string ba = {0}, bb = {0};
+
+	assert((a == NULL) == (b == NULL));
+	if (!a)
+		return;
+	dump(&ba, a, 0);
+	dump(&bb, b, 0);
+	if (strcmp(ba.buf, bb.buf) != 0) {
+		fprintf(stderr, "Sequential:\n%s\nBuilder:\n%s\n", ba.buf, bb.buf);
+		abort();
+	}
+	free(ba.buf);
+	free(bb.buf);
+}
+
+static void
+test_basic(void) {
+	struct bconf_builder *b = bconf_builder_new();
+	struct bconf_node *root = NULL;
+
+	bconf_builder_add(b, "a.b.c", "1");
+	bconf_builder_add(b, "a.b.10", "ten");
+	bconf_builder_add(b, "a.b.9", "nine");
+	bconf_builder_add(b, "a.*.c", "star");
+	bconf_builder_add(b, "a.b.c", "2");
+	bconf_builder_addv(b, 2, (const char *[]){ "dot.ted", "x" }, "dotted", -1);
+	bconf_builder_addv(b, 2, (const char *[]){ "bin", "x" }, "abcdef", 3);
+	bconf_builder_addv(b, 1, (const char *[]){ "empty" }, NULL, 0);
+	assert(bconf_builder_finish(b, &root) == 0);
+
+	assert(strcmp(bconf_get_string(root, "a.b.c"), "2") == 0);
+	assert(strcmp(bconf_get_string(root, "a.b.10"), "ten") == 0);
+	assert(strcmp(bconf_key(bconf_byindex(bconf_get(root, "a.b"), 0)), "9") == 0);
+	assert(strcmp(bconf_vget_string(root, "a", "x", "c", NULL), "star") == 0);
+	struct bconf_node *dotted = NULL;
+	for (int i = 0; i < bconf_count(root); i++) {
+		if (strcmp(bconf_key(bconf_byindex(root, i)), "dot.ted") == 0)
+			dotted = bconf_byindex(root, i);
+	}
+	assert(strcmp(bconf_get_string(dotted, "x"), "dotted") == 0);
+	assert(strcmp(bconf_get_string(root, "bin.x"), "abc") == 0);
+	assert(bconf_get(root, "empty") && bconf_count(bconf_get(root, "empty")) == 0);
+
+	/* Merges into an existing tree, and conflicts are skipped. */
+	b = bconf_builder_new();
+	bconf_builder_add(b, "a.b.c.d", "conflict");
+	bconf_builder_add(b, "a.b", "conflict");
+	bconf_builder_add(b, "a.b.8", "eight");
+	bconf_builder_add(b, "a.b.c", "3");
+	bconf_builder_add(b, "z", "last");
+	assert(bconf_builder_finish(b, &root) == -1);
+	assert(strcmp(bconf_get_string(root, "a.b.c"), "3") == 0);
+	assert(strcmp(bconf_get_string(root, "a.b.8"), "eight") == 0);
+	assert(strcmp(bconf_key(bconf_byindex(bconf_get(root, "a.b"), 0)), "8") == 0);
+	assert(strcmp(bconf_get_string(root, "z"), "last") == 0);
+	assert(bconf_count(bconf_get(root, "a.b")) == 4);
+
+	bconf_free(&root);
+
+	b = bconf_builder_new();
+	bconf_builder_finish(b, &root);
+	assert(root == NULL);
+	bconf_builder_free(bconf_builder_new());
+}
+
+/*
+ * Adds the same random keys, from a small set to get duplicates and
+ * conflicts, both one by one and with a builder, on top of the same
+ * initial tree.
+ */
+static void
+test_random(unsigned int seed) {
+	static const char *parts[] = { "a", "b", "1", "2", "10", "*", "" };
+	const int nparts = sizeof(parts) / sizeof(parts[0]);
+	struct bconf_node *seq = NULL, *bulk = NULL;
+	const char *keyv[4];
+	char value[32];
+
+	for (int pass = 0; pass < 2; pass++) {
+		struct bconf_builder *b = bconf_builder_new();
+		int seqfail = 0;
+
+		for (int i = 0; i < 200; i++) {
+			int keyc = 1 + rand_r(&seed) % 4;
+			for (int k = 0; k < keyc; k++)
+				keyv[k] = parts[rand_r(&seed) % nparts];
+			if (rand_r(&seed) % 10 == 0) {
+				if (!bconf_add_listnodev(&seq, keyc, keyv))
+					seqfail = 1;
+				bconf_builder_addv(b, keyc, keyv, NULL, 0);
+			} else {
+				snprintf(value, sizeof(value), "%d.%d", pass, i);
+				if (bconf_add_datav_canfail(&seq, keyc, keyv, value, BCONF_DUP) == -1)
+					seqfail = 1;
+				bconf_builder_addv(b, keyc, keyv, value, -1);
+			}
+		}
+		int bulkfail = bconf_builder_finish(b, &bulk) == -1;
+		compare(seq, bulk);
+		assert(seqfail == bulkfail);
+	}
+	bconf_free(&seq);
+	bconf_free(&bulk);
+}
+
+int
+main(int argc, char *argv[]) {
+	test_basic();
+	for (unsigned int seed = 1; seed <= 1000; seed++)
+		test_random(seed);
+	return 0;
+}
@@ -0,0 +1,123 @@
+// Copyright 2018 Schibsted
+
+#include "sbp/bconf.h"
+#include "sbp/bconf_handle.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NKEYS 100
+#define NREADERS 8
+
+static struct bconf_node *
+make_tree(unsigned long version) {
+	struct bconf_node *root = NULL;
+	char key[32], value[32];
+
+	snprintf(value, sizeof(value), "%lu", version);
+	bconf_add_data(&root, "version", value);
+	for (int i = 0; i < NKEYS; i++) {
+		snprintf(key, sizeof(key), "keys.%d", i);
+		bconf_add_data(&root, key, value);
+	}
+	return root;
+}
+
+static void
+test_pin(void) {
+	struct bconf_handle *h = bconf_handle_new(make_tree(1));
+
+	assert(bconf_handle_version(h) == 1);
+	struct bconf_node *a = bconf_handle_pin(h);
+	assert(bconf_get_int(a, "version") == 1);
+
+	/* The old tree stays while pinned, also across nested pins. */
+	assert(bconf_handle_publish(h, make_tree(2)) == 2);
+	struct bconf_node *b = bconf_handle_pin(h);
+	assert(bconf_get_int(b, "version") == 2);
+	assert(bconf_handle_publish(h, make_tree(3)) == 3);
+	assert(bconf_handle_reclaim() == 2);
+	bconf_handle_unpin(h);
+	assert(bconf_get_int(a, "version") == 1);
+	assert(bconf_get_int(b, "version") == 2);
+	assert(bconf_handle_reclaim() == 2);
+	bconf_handle_unpin(h);
+	assert(bconf_handle_reclaim() == 0);
+
+	/* Pins after a publish don't hold the trees replaced before it. */
+	struct bconf_node *c = bconf_handle_pin(h);
+	assert(bconf_get_int(c, "version") == 3);
+	assert(bconf_handle_publish(h, NULL) == 4);
+	assert(bconf_handle_reclaim() == 1);
+	assert(bconf_handle_pin(h) == NULL);
+	bconf_handle_unpin(h);
+	bconf_handle_unpin(h);
+	assert(bconf_handle_reclaim() == 0);
+
+	bconf_handle_free(h);
+}
+
+struct stress {
+	struct bconf_handle *handle;
+	bool done;
+	unsigned long lookups;
+};
+
+static void *
+reader(void *v) {
+	struct stress *s = v;
+	unsigned int seed = (unsigned int)(uintptr_t)&seed;
+	unsigned long last = 0, lookups = 0;
+	char key[32];
+
+	while (!__atomic_load_n(&s->done, __ATOMIC_RELAXED)) {
+		struct bconf_node *root = bconf_handle_pin(s->handle);
+		unsigned long version = bconf_get_int(root, "version");
+
+		/* A freed tree would fail here, or under ASAN. */
+		assert(version >= last);
+		for (int i = 0; i < 10; i++) {
+			snprintf(key, sizeof(key), "keys.%d", rand_r(&seed) % NKEYS);
+			assert((unsigned long)bconf_get_int(root, key) == version);
+		}
+		bconf_handle_unpin(s->handle);
+		last = version;
+		lookups++;
+	}
+	__atomic_add_fetch(&s->lookups, lookups, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* Readers hammering lookups while a new tree is published continuously. */
+static void
+test_stress(int publishes) {
+	struct stress s = { .handle = bconf_handle_new(make_tree(1)) };
+	pthread_t threads[NREADERS];
+
+	for (int i = 0; i < NREADERS; i++)
+		pthread_create(&threads[i], NULL, reader, &s);
+
+	for (int i = 0; i < publishes; i++) {
+		struct bconf_node *root = make_tree(bconf_handle_version(s.handle) + 1);
+		bconf_handle_publish(s.handle, root);
+	}
+
+	__atomic_store_n(&s.done, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < NREADERS; i++)
+		pthread_join(threads[i], NULL);
+
+	assert(s.lookups > 0);
+	assert(bconf_handle_reclaim() == 0);
+	bconf_handle_free(s.handle);
+}
+
+int
+main(int argc, char *argv[]) {
+	test_pin();
+	test_stress(argc > 1 ? atoi(argv[1]) : 2000);
+	return 0;
+}
@@ -0,0 +1,107 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Lookup benchmark for wide and deep bconf trees. Every tree is built
+ * twice, once normally and once from a mempool. Nodes allocated from a
+ * mempool never get a hash index, so the second tree measures the plain
+ * binary search.
+ *
+ * Usage: bconf_index_bench [lookups]
+ */
+
+#include "sbp/bconf.h"
+#include "sbp/error_functions.h"
+#include "sbp/memalloc_functions.h"
+#include "sbp/mempool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int nlookups = 2000000;
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Keys look like host and service names, with a common prefix, rather
+ * than list indexes.
+ */
+static void
+make_key(char *buf, size_t sz, const char *prefix, int width, int depth, unsigned int n) {
+	int len = snprintf(buf, sz, "%s", prefix);
+
+	for (int d = 0; d < depth; d++) {
+		len += snprintf(buf + len, sz - len, "%sservice%u", d ? "." : "", n % width);
+		n /= width;
+	}
+}
+
+#define NKEYS 65536
+
+static double
+bench(struct bconf_node *root, char (*keys)[128]) {
+	int found = 0;
+
+	double start = now();
+	for (int i = 0; i < nlookups; i++)
+		found += bconf_get(root, keys[i % NKEYS]) != NULL;
+	double elapsed = now() - start;
+	if (found != nlookups)
+		xerrx(1, "found %d of %d keys", found, nlookups);
+	return elapsed;
+}
+
+static void
+run(int width, int depth) {
+	struct mempool *pool = mempool_create(4096);
+	struct bconf_node *indexed = NULL, *plain = NULL;
+	const char *prefix = "*.*.common.";
+	char key[256];
+	int total = 1;
+
+	for (int d = 0; d < depth; d++)
+		total *= width;
+	for (int i = 0; i < total; i++) {
+		make_key(key, sizeof(key), prefix, width, depth, i);
+		bconf_add_data(&indexed, key, "value");
+		bconf_add_data_pool(pool, &plain, key, "value");
+	}
+
+	/* Random keys are generated up front so only the lookups are timed. */
+	char (*keys)[128] = xmalloc(NKEYS * sizeof(*keys));
+	unsigned int seed = 1;
+	for (int i = 0; i < NKEYS; i++)
+		make_key(keys[i], sizeof(keys[i]), prefix, width, depth, rand_r(&seed) % total);
+
+	double ti = bench(indexed, keys);
+	double tp = bench(plain, keys);
+	printf("%6d %6d %9d %12.1f %12.1f %8.2fx\n", width, depth, total,
+			tp * 1e9 / nlookups, ti * 1e9 / nlookups, tp / ti);
+
+	free(keys);
+	bconf_free(&indexed);
+	mempool_free(pool);
+}
+
+int
+main(int argc, char *argv[]) {
+	if (argc > 1)
+		nlookups = atoi(argv[1]);
+
+	printf("%6s %6s %9s %12s %12s %9s\n", "width", "depth", "keys", "search ns", "index ns", "speedup");
+	run(16, 1);
+	run(64, 1);
+	run(1000, 1);
+	run(10000, 1);
+	run(100000, 1);
+	run(8, 6);
+	run(40, 3);
+	run(300, 2);
+	return 0;
+}
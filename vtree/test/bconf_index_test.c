@@ -0,0 +1,103 @@
+// Copyright 2018 Schibsted
+
+#include "sbp/bconf.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIDE 1000
+
+static void
+check(struct bconf_node *root, int n, int deleted) {
+	char key[32];
+
+	assert(bconf_count(bconf_get(root, "wide")) == n - deleted);
+	for (int i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "wide.k%d.v", i);
+		const char *v = bconf_get_string(root, key);
+		if (i < deleted) {
+			assert(v == NULL);
+		} else {
+			assert(v);
+			assert(atoi(v) == i);
+		}
+	}
+	assert(bconf_get(root, "wide.k") == NULL);
+	assert(bconf_get(root, "wide.k1x") == NULL);
+}
+
+static void
+test_lookup(void) {
+	struct bconf_node *root = NULL;
+	char key[32], val[16];
+
+	/* Look up between inserts, so the index is built and then updated or regrown. */
+	for (int i = 0; i < WIDE; i++) {
+		snprintf(key, sizeof(key), "wide.k%d.v", i);
+		snprintf(val, sizeof(val), "%d", i);
+		bconf_add_data(&root, key, val);
+		assert(strcmp(bconf_get_string(root, key), val) == 0);
+	}
+	check(root, WIDE, 0);
+
+	/* Order is still the sorted order. */
+	struct bconf_node *wide = bconf_get(root, "wide");
+	for (int i = 1; i < bconf_count(wide); i++)
+		assert(strcmp(bconf_key(bconf_byindex(wide, i - 1)), bconf_key(bconf_byindex(wide, i))) < 0);
+
+	for (int i = 0; i < 10; i++) {
+		snprintf(key, sizeof(key), "k%d", i);
+		assert(bconf_deletev(&root, 2, (const char *[]){ "wide", key }));
+	}
+	check(root, WIDE, 10);
+
+	struct bconf_node *filter = NULL;
+	bconf_add_data(&filter, "wide.k10", "1");
+	bconf_add_data(&filter, "wide.k999", "1");
+	assert(bconf_filter_to_keys(&root, filter) == 0);
+	wide = bconf_get(root, "wide");
+	assert(bconf_filter_to_keys(&wide, bconf_get(filter, "wide")) == WIDE - 12);
+	assert(bconf_get(root, "wide.k10.v"));
+	assert(bconf_get(root, "wide.k999.v"));
+	assert(bconf_get(root, "wide.k500.v") == NULL);
+
+	bconf_free(&filter);
+	bconf_free(&root);
+}
+
+static void *
+lookup_thread(void *arg) {
+	check(arg, WIDE, 0);
+	return NULL;
+}
+
+static void
+test_threads(void) {
+	struct bconf_node *root = NULL;
+	char key[32], val[16];
+	pthread_t threads[8];
+
+	for (int i = 0; i < WIDE; i++) {
+		snprintf(key, sizeof(key), "wide.k%d.v", i);
+		snprintf(val, sizeof(val), "%d", i);
+		bconf_add_data(&root, key, val);
+	}
+
+	/* The index is built lazily by whichever thread gets there first. */
+	for (int i = 0; i < 8; i++)
+		pthread_create(&threads[i], NULL, lookup_thread, root);
+	for (int i = 0; i < 8; i++)
+		pthread_join(threads[i], NULL);
+
+	bconf_free(&root);
+}
+
+int
+main(int argc, char *argv[]) {
+	test_lookup();
+	test_threads();
+	return 0;
+}
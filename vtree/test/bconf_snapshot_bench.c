@@ -0,0 +1,177 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Compares loading a bconf text file with config_init() to opening a
+ * compiled snapshot of it. Each load is done in a child process, which
+ * reports the load time, the time for a lookup of every key through a
+ * vtree, and the growth in private and shared resident memory.
+ *
+ * Usage: bconf_snapshot_bench [keys]
+ */
+
+#include "sbp/bconf.h"
+#include "sbp/bconf_snapshot.h"
+#include "sbp/bconfig.h"
+#include "sbp/error_functions.h"
+#include "sbp/vtree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static char conf_path[] = "/tmp/bconf_snapshot_bench.conf.XXXXXX";
+static char snap_path[] = "/tmp/bconf_snapshot_bench.snap.XXXXXX";
+static int nkeys = 200000;
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Private and shared resident memory in kB. */
+static void
+rss(long *private, long *shared) {
+	long size, resident, share;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f || fscanf(f, "%ld %ld %ld", &size, &resident, &share) != 3)
+		xerrx(1, "Failed to read /proc/self/statm");
+	fclose(f);
+	long pagekb = sysconf(_SC_PAGESIZE) / 1024;
+	*private = (resident - share) * pagekb;
+	*shared = share * pagekb;
+}
+
+static void
+write_conf(void) {
+	int fd = mkstemp(conf_path);
+	FILE *f = fdopen(fd, "w");
+
+	if (!f)
+		xerr(1, "fdopen");
+	for (int i = 0; i < nkeys / 4; i++) {
+		fprintf(f, "*.*.category.%d.name=Category %d\n", i, i);
+		fprintf(f, "*.*.category.%d.parent=%d\n", i, i / 10);
+		fprintf(f, "*.*.category.%d.settings.price.min=%d\n", i, i * 10);
+		fprintf(f, "*.*.category.%d.settings.price.max=%d\n", i, i * 100);
+	}
+	fclose(f);
+}
+
+static int
+lookup_all(struct vtree_chain *vt) {
+	char cat[16];
+	int found = 0;
+
+	for (int i = 0; i < nkeys / 4; i++) {
+		snprintf(cat, sizeof(cat), "%d", i);
+		found += vtree_get(vt, "*", "*", "category", cat, "name", NULL) != NULL;
+		found += vtree_get(vt, "*", "*", "category", cat, "parent", NULL) != NULL;
+		found += vtree_get(vt, "*", "*", "category", cat, "settings", "price", "min", NULL) != NULL;
+		found += vtree_get(vt, "*", "*", "category", cat, "settings", "price", "max", NULL) != NULL;
+	}
+	return found;
+}
+
+static void
+report(const char *name, double load, double lookup, int found, long private0, long shared0) {
+	long private, shared;
+
+	rss(&private, &shared);
+	if (found != nkeys)
+		xerrx(1, "%s: found %d of %d keys", name, found, nkeys);
+	printf("%-10s %10.2f %10.2f %12ld %12ld\n", name, load * 1e3, lookup * 1e9 / nkeys,
+			private - private0, shared - shared0);
+}
+
+static void
+bench_text(void) {
+	long private0, shared0;
+	rss(&private0, &shared0);
+
+	double start = now();
+	struct bconf_node *root = config_init(conf_path);
+	if (!root)
+		xerr(1, "config_init");
+	double load = now() - start;
+
+	struct vtree_chain vt;
+	bconf_vtree(&vt, root);
+	start = now();
+	int found = lookup_all(&vt);
+	report("text", load, now() - start, found, private0, shared0);
+}
+
+static void
+bench_snapshot(void) {
+	long private0, shared0;
+	rss(&private0, &shared0);
+
+	double start = now();
+	struct bconf_snapshot *snap = bconf_snapshot_open(snap_path);
+	if (!snap)
+		xerr(1, "bconf_snapshot_open");
+	double load = now() - start;
+
+	struct vtree_chain vt;
+	bconf_snapshot_vtree(&vt, snap);
+	start = now();
+	int found = lookup_all(&vt);
+	report("snapshot", load, now() - start, found, private0, shared0);
+}
+
+/* Done in a child so the heap it leaves behind doesn't skew the other runs. */
+static void
+compile(void) {
+	double start = now();
+	struct bconf_node *root = config_init(conf_path);
+	if (!root)
+		xerr(1, "config_init");
+	if (bconf_snapshot_write(root, snap_path) < 0)
+		xerr(1, "bconf_snapshot_write");
+	printf("%d keys, compiled in %.2f ms\n\n", nkeys, (now() - start) * 1e3);
+}
+
+static void
+run_child(void (*fn)(void)) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+		xerr(1, "fork");
+	if (pid == 0) {
+		fn();
+		fflush(stdout);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		xerrx(1, "Child failed");
+}
+
+int
+main(int argc, char *argv[]) {
+	if (argc > 1)
+		nkeys = atoi(argv[1]) / 4 * 4;
+
+	write_conf();
+
+	int fd = mkstemp(snap_path);
+	if (fd < 0)
+		xerr(1, "mkstemp");
+	close(fd);
+	run_child(compile);
+
+	printf("%-10s %10s %10s %12s %12s\n", "", "load ms", "ns/lookup", "private kB", "shared kB");
+	run_child(bench_text);
+	run_child(bench_snapshot);
+
+	unlink(conf_path);
+	unlink(snap_path);
+	return 0;
+}
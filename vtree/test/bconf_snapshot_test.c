@@ -0,0 +1,237 @@
+// Copyright 2018 Schibsted
+
+#include "sbp/bconf.h"
+#include "sbp/bconf_snapshot.h"
+#include "sbp/vtree.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char path[] = "/tmp/bconf_snapshot_test.XXXXXX";
+
+static struct bconf_node *
+build(void) {
+	struct bconf_node *root = NULL;
+
+	bconf_add_data(&root, "a.b.c", "1");
+	bconf_add_data(&root, "a.*.c", "star");
+	bconf_add_data(&root, "a.*.d", "stard");
+	bconf_add_data(&root, "list.1.name", "one");
+	bconf_add_data(&root, "list.2.name", "two");
+	bconf_add_data(&root, "list.10.name", "ten");
+	bconf_add_data(&root, "list.10.value", "two");
+	bconf_add_data(&root, "list.2x.name", "twox");
+	bconf_add_data(&root, "utf8.\xc3\xa5\xc3\xa4\xc3\xb6", "\xc3\xa5");
+	bconf_add_data(&root, "empty", "");
+	return root;
+}
+
+static void
+compare_keys(struct vtree_chain *a, struct vtree_chain *b, const char *key) {
+	struct vtree_loop_var la, lb;
+
+	vtree_fetch_keys(a, &la, key, NULL);
+	vtree_fetch_keys(b, &lb, key, NULL);
+	assert(la.len == lb.len);
+	for (int i = 0; i < la.len; i++)
+		assert(strcmp(la.l.list[i], lb.l.list[i]) == 0);
+	if (la.cleanup)
+		la.cleanup(&la);
+	if (lb.cleanup)
+		lb.cleanup(&lb);
+}
+
+static void
+compare(struct vtree_chain *bc, struct vtree_chain *sn) {
+	const char *paths[][4] = {
+		{ "a", "b", "c", NULL },
+		{ "a.b.c", NULL },
+		{ "a", "x", "c", NULL },
+		{ "a", "b", "d", NULL },
+		{ "a", "b", NULL },
+		{ "list", "10", "name", NULL },
+		{ "list.2x.name", NULL },
+		{ "list", "3", "name", NULL },
+		{ "utf8", "\xc3\xa5\xc3\xa4\xc3\xb6", NULL },
+		{ "empty", NULL },
+		{ "missing", "key", NULL },
+	};
+
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		int argc = 0;
+		while (paths[i][argc])
+			argc++;
+		const char *v1 = vtree_get_cachev(bc, NULL, NULL, argc, paths[i]);
+		const char *v2 = vtree_get_cachev(sn, NULL, NULL, argc, paths[i]);
+		assert((v1 == NULL) == (v2 == NULL));
+		assert(!v1 || strcmp(v1, v2) == 0);
+		assert(vtree_haskey_cachev(bc, NULL, NULL, argc, paths[i]) == vtree_haskey_cachev(sn, NULL, NULL, argc, paths[i]));
+		assert(vtree_getlen_cachev(bc, NULL, NULL, argc, paths[i]) == vtree_getlen_cachev(sn, NULL, NULL, argc, paths[i]));
+	}
+	assert(strcmp(vtree_get(sn, "a", "x", "c", NULL), "star") == 0);
+	assert(vtree_getlen(sn, "list", NULL) == 4);
+
+	compare_keys(bc, sn, NULL);
+	compare_keys(bc, sn, "list");
+	compare_keys(bc, sn, "a");
+
+	struct vtree_loop_var loop;
+	vtree_fetch_values(sn, &loop, "list", VTREE_LOOP, "name", NULL);
+	assert(loop.len == 4);
+	assert(strcmp(loop.l.list[0], "one") == 0);
+	assert(strcmp(loop.l.list[1], "two") == 0);
+	assert(strcmp(loop.l.list[2], "ten") == 0);
+	assert(strcmp(loop.l.list[3], "twox") == 0);
+	loop.cleanup(&loop);
+
+	vtree_fetch_keys_by_value(sn, &loop, "two", "list", VTREE_LOOP, "name", NULL);
+	assert(loop.len == 1 && strcmp(loop.l.list[0], "2") == 0);
+	loop.cleanup(&loop);
+	vtree_fetch_keys_by_value(sn, &loop, "none", "list", VTREE_LOOP, "name", NULL);
+	assert(loop.len == 0 && loop.cleanup == NULL);
+
+	struct vtree_chain node = {0};
+	assert(vtree_getnode(sn, &node, "list", "10", NULL) == &node);
+	assert(strcmp(vtree_get(&node, "value", NULL), "two") == 0);
+	vtree_free(&node);
+
+	vtree_fetch_nodes(sn, &loop, "list", NULL);
+	assert(loop.len == 4);
+	assert(strcmp(vtree_get(&loop.l.vlist[2], "name", NULL), "ten") == 0);
+	loop.cleanup(&loop);
+
+	struct vtree_keyvals kv;
+	vtree_fetch_keys_and_values(sn, &kv, "list", VTREE_LOOP, "value", NULL);
+	assert(kv.len == 4);
+	assert(kv.list[0].type == vkvNone);
+	assert(strcmp(kv.list[2].key, "10") == 0 && kv.list[2].type == vkvValue && strcmp(kv.list[2].v.value, "two") == 0);
+	kv.cleanup(&kv);
+	vtree_fetch_keys_and_values(sn, &kv, "list", VTREE_LOOP, NULL);
+	assert(kv.len == 4 && kv.list[0].type == vkvNode);
+	assert(strcmp(vtree_get(&kv.list[0].v.node, "name", NULL), "one") == 0);
+	kv.cleanup(&kv);
+}
+
+static void
+test_snapshot(void) {
+	struct bconf_node *root = build();
+
+	assert(bconf_snapshot_write(root, path) == 0);
+	struct bconf_snapshot *snap = bconf_snapshot_open(path);
+	assert(snap);
+	assert(bconf_snapshot_nodes(snap) == 20);
+
+	struct vtree_chain bc, sn;
+	bconf_vtree(&bc, root);
+	bconf_snapshot_vtree(&sn, snap);
+	compare(&bc, &sn);
+	vtree_free(&sn);
+	vtree_free(&bc);
+
+	bconf_snapshot_close(snap);
+	bconf_free(&root);
+}
+
+static void
+test_empty(void) {
+	assert(bconf_snapshot_write(NULL, path) == 0);
+	struct bconf_snapshot *snap = bconf_snapshot_open(path);
+	assert(snap);
+
+	struct vtree_chain sn;
+	bconf_snapshot_vtree(&sn, snap);
+	assert(vtree_get(&sn, "a", NULL) == NULL);
+	assert(vtree_getlen(&sn, NULL) == 0);
+	bconf_snapshot_close(snap);
+}
+
+static void
+test_invalid(void) {
+	FILE *f = fopen(path, "w");
+	fprintf(f, "a.b=c\n");
+	for (int i = 0; i < 10; i++)
+		fprintf(f, "padding.%d=this is not a snapshot\n", i);
+	fclose(f);
+	errno = 0;
+	assert(bconf_snapshot_open(path) == NULL);
+	assert(errno == EINVAL);
+}
+
+static void
+walk(struct vtree_chain *vt) {
+	struct vtree_keyvals kv;
+
+	vtree_fetch_keys_and_values(vt, &kv, NULL);
+	for (int i = 0; i < kv.len; i++) {
+		assert(strlen(kv.list[i].key) < 100);
+		if (kv.list[i].type == vkvValue)
+			assert(strlen(kv.list[i].v.value) < 100);
+		else if (kv.list[i].type == vkvNode)
+			walk(&kv.list[i].v.node);
+		vtree_get(vt, kv.list[i].key, "*", "c", NULL);
+	}
+	if (kv.cleanup)
+		kv.cleanup(&kv);
+}
+
+/*
+ * Overwrite each word after the header with bad offsets. Either the open
+ * fails or the lookups stay inside the file.
+ */
+static void
+test_corrupt(void) {
+	struct bconf_node *root = build();
+	assert(bconf_snapshot_write(root, path) == 0);
+	bconf_free(&root);
+
+	FILE *f = fopen(path, "r");
+	char orig[4096];
+	size_t size = fread(orig, 1, sizeof(orig), f);
+	fclose(f);
+	assert(size > 32 && size < sizeof(orig));
+
+	const int32_t bad[] = { INT32_MAX, INT32_MIN, -28, 28, 1 };
+	int rejected = 0;
+	for (size_t off = 32; off + 4 <= size; off += 4) {
+		for (size_t b = 0; b < sizeof(bad) / sizeof(bad[0]); b++) {
+			char buf[sizeof(orig)];
+			memcpy(buf, orig, size);
+			memcpy(buf + off, &bad[b], sizeof(bad[b]));
+			f = fopen(path, "w");
+			assert(fwrite(buf, 1, size, f) == size);
+			fclose(f);
+
+			struct bconf_snapshot *snap = bconf_snapshot_open(path);
+			if (!snap) {
+				assert(errno == EINVAL);
+				rejected++;
+				continue;
+			}
+			struct vtree_chain sn;
+			bconf_snapshot_vtree(&sn, snap);
+			walk(&sn);
+			bconf_snapshot_close(snap);
+		}
+	}
+	assert(rejected > 0);
+}
+
+int
+main(int argc, char *argv[]) {
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	test_snapshot();
+	test_empty();
+	test_invalid();
+	test_corrupt();
+
+	unlink(path);
+	return 0;
+}
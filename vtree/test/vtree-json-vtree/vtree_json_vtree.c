@@ -26,7 +26,10 @@ main(int argc, char **argv) {
 	struct bconf_node *new = NULL;
 	struct buf_string obs = {0};
 	struct buf_string nbs = {0};
+	struct buf_string bbs = {0};
+	struct bconf_node *bools = NULL;
 	struct vtree_chain vt;
+	static const char booljson[] = "{\"t\": true, \"f\": false}";
 
 	bconf_add_data(&org, "kaka.tratt1", "foo");
 	bconf_add_data(&org, "kaka.tratt.1", "foo");
@@ -52,10 +55,18 @@ main(int argc, char **argv) {
 
 	printf("strcmp: %d\n", strcmp(obs.buf, nbs.buf));
 
+	json_bconf(&bools, NULL, booljson, sizeof(booljson) - 1, 0);
+	bconf_vtree(&vt, bools);
+	vtree_json(&vt, 0, 0, p, &bbs);
+	vtree_free(&vt);
+	printf("bools: %s\n", bbs.buf);
+
 	free(obs.buf);
 	free(nbs.buf);
+	free(bbs.buf);
 	bconf_free(&org);
 	bconf_free(&new);
+	bconf_free(&bools);
 
 	return 0;
 }
@@ -0,0 +1,151 @@
+// Copyright 2018 Schibsted
+
+/*
+ * Compares vtree lookups with varargs, with the _cache functions and with
+ * compiled paths, through a plain bconf vtree and an app vtree with
+ * both the app and the default node. The cache functions only work for
+ * constant paths, the category lookups have the category id as a hole.
+ *
+ * Usage: vtree_path_bench [lookups]
+ */
+
+#include "sbp/bconf.h"
+#include "sbp/vtree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NCATEGORIES 10000
+
+static int nlookups = 10000000;
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_get(struct vtree_chain *vt) {
+	int sum = 0;
+
+	double start = now();
+	for (int i = 0; i < nlookups; i++)
+		sum += vtree_getint(vt, "common", "search", "settings", "max_results", NULL);
+	double elapsed = now() - start;
+	if (sum != nlookups * 100)
+		abort();
+	return elapsed;
+}
+
+static double
+bench_cache(struct vtree_chain *vt) {
+	int sum = 0;
+	int cache = 0;
+
+	double start = now();
+	for (int i = 0; i < nlookups; i++)
+		sum += vtree_getint_cache(vt, NULL, &cache, "common", "search", "settings", "max_results", NULL);
+	double elapsed = now() - start;
+	if (sum != nlookups * 100)
+		abort();
+	return elapsed;
+}
+
+static double
+bench_path(struct vtree_chain *vt) {
+	struct vtree_path *path = vtree_path_compile("common.search.settings.max_results");
+	int sum = 0;
+
+	double start = now();
+	for (int i = 0; i < nlookups; i++)
+		sum += vtree_path_getint(vt, path);
+	double elapsed = now() - start;
+	if (sum != nlookups * 100)
+		abort();
+	vtree_path_free(path);
+	return elapsed;
+}
+
+/* Sum of all parent values looked up, each category is looked up equally often. */
+static long
+parent_sum(void) {
+	return (long)nlookups / NCATEGORIES * 10 * (NCATEGORIES / 10) * (NCATEGORIES / 10 - 1) / 2;
+}
+
+/* The way it's done without compiled paths, formatting the id each time. */
+static double
+bench_get_hole(struct vtree_chain *vt) {
+	char id[16];
+	long sum = 0;
+
+	double start = now();
+	for (int i = 0; i < nlookups; i++) {
+		snprintf(id, sizeof(id), "%d", i % NCATEGORIES);
+		sum += vtree_getint(vt, "common", "category", id, "settings", "parent", NULL);
+	}
+	double elapsed = now() - start;
+	if (sum != parent_sum())
+		abort();
+	return elapsed;
+}
+
+static double
+bench_path_hole(struct vtree_chain *vt) {
+	struct vtree_path *path = vtree_path_compile("common.category.%d.settings.parent");
+	long sum = 0;
+
+	double start = now();
+	for (int i = 0; i < nlookups; i++)
+		sum += vtree_path_getint(vt, path, i % NCATEGORIES);
+	double elapsed = now() - start;
+	if (sum != parent_sum())
+		abort();
+	vtree_path_free(path);
+	return elapsed;
+}
+
+static void
+run(const char *name, struct vtree_chain *vt) {
+	double get = bench_get(vt), cache = bench_cache(vt), path = bench_path(vt);
+
+	printf("%-10s %-10s %10.1f %10.1f %10.1f\n", name, "constant",
+			get * 1e9 / nlookups, cache * 1e9 / nlookups, path * 1e9 / nlookups);
+
+	get = bench_get_hole(vt);
+	path = bench_path_hole(vt);
+	printf("%-10s %-10s %10.1f %10s %10.1f\n", name, "category",
+			get * 1e9 / nlookups, "-", path * 1e9 / nlookups);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct bconf_node *root = NULL;
+	struct vtree_chain vt;
+	char key[128], value[16];
+
+	if (argc > 1)
+		nlookups = atoi(argv[1]) / NCATEGORIES * NCATEGORIES;
+
+	for (int i = 0; i < NCATEGORIES; i++) {
+		snprintf(key, sizeof(key), "*.common.category.%d.name", i);
+		bconf_add_data(&root, key, "Category");
+		snprintf(key, sizeof(key), "*.common.category.%d.settings.parent", i);
+		snprintf(value, sizeof(value), "%d", i / 10);
+		bconf_add_data(&root, key, value);
+	}
+	bconf_add_data(&root, "*.common.search.settings.max_results", "100");
+	bconf_add_data(&root, "*.common.search.settings.timeout", "10");
+	bconf_add_data(&root, "app.common.search.settings.timeout", "20");
+
+	printf("%-10s %-10s %10s %10s %10s\n", "vtree", "path", "get ns", "cache ns", "path ns");
+	run("bconf", bconf_vtree(&vt, bconf_get(root, "*")));
+	vtree_free(&vt);
+	run("app", bconf_vtree_app(&vt, root, "app"));
+	vtree_free(&vt);
+
+	bconf_free(&root);
+	return 0;
+}
@@ -0,0 +1,217 @@
+// Copyright 2018 Schibsted
+
+#include "sbp/bconf.h"
+#include "sbp/mempool.h"
+#include "sbp/vtree.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static void
+test_compile(void) {
+	struct vtree_path *p = vtree_path_compile("a.b.%d.%s.c");
+
+	assert(p->argc == 5);
+	assert(p->prefixc == 2);
+	assert(strcmp(p->argv[1], "b") == 0);
+	assert(p->holes[2] == 'd' && p->holes[3] == 's' && p->holes[4] == 0);
+	assert(strcmp(p->argv[4], "c") == 0);
+	vtree_path_free(p);
+
+	p = vtree_path_compile("a.%x.b");
+	assert(p->argc == 3 && p->prefixc == 3);
+	assert(strcmp(p->argv[1], "%x") == 0);
+	vtree_path_free(p);
+
+	p = vtree_path_compile("");
+	assert(p->argc == 0 && p->prefixc == 0);
+	vtree_path_free(p);
+}
+
+static struct vtree_path *
+compile(const char *prefix, const char *template) {
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%s%s", prefix, template);
+	return vtree_path_compile(buf);
+}
+
+/* Same lookups through any vtree with the same content, after prefix. */
+static void
+check(struct vtree_chain *vt, const char *prefix) {
+	struct vtree_path *name = compile(prefix, "cat.%d.name");
+	struct vtree_path *setting = compile(prefix, "cat.%d.settings.%s");
+	struct vtree_path *cats = compile(prefix, "cat");
+	struct vtree_path *neg = compile(prefix, "%d");
+	struct vtree_chain node = {0};
+	int catlen = *prefix ? vtree_getlen(vt, "pre", "cat", NULL) : vtree_getlen(vt, "cat", NULL);
+
+	for (int i = 0; i < 2; i++) {
+		assert(strcmp(vtree_path_get(vt, name, 1), "one") == 0);
+		assert(strcmp(vtree_path_get(vt, name, 1000), "thousand") == 0);
+		assert(vtree_path_get(vt, name, 2) == NULL);
+		assert(vtree_path_getint(vt, setting, 1, "max") == 10);
+		assert(vtree_path_getint(vt, setting, 1, "min") == 0);
+		assert(vtree_path_haskey(vt, setting, 1000, "max"));
+		assert(!vtree_path_haskey(vt, setting, 2, "max"));
+		assert(vtree_path_getlen(vt, cats) == catlen);
+		assert(vtree_path_getlen(vt, setting, 1000, "max") == 1);
+		assert(vtree_path_getlen(vt, name, 1) == 0);
+		assert(strcmp(vtree_path_get(vt, neg, -12), "negative") == 0);
+
+		assert(vtree_path_getnode(vt, setting, &node, 2, "max") == NULL);
+		assert(vtree_path_getnode(vt, setting, &node, 1000, "max") == &node);
+		assert(strcmp(vtree_get(&node, "x", NULL), "list") == 0);
+	}
+	vtree_free(&node);
+
+	vtree_path_free(name);
+	vtree_path_free(setting);
+	vtree_path_free(cats);
+	vtree_path_free(neg);
+}
+
+static void
+add_content(struct mempool *pool, struct bconf_node **root, const char *prefix) {
+	static const char *kv[][2] = {
+		{ "cat.1.name", "one" },
+		{ "cat.1.settings.max", "10" },
+		{ "cat.1000.name", "thousand" },
+		{ "cat.1000.settings.max.x", "list" },
+		{ "-12", "negative" },
+	};
+	char key[64];
+
+	for (size_t i = 0; i < sizeof(kv) / sizeof(kv[0]); i++) {
+		snprintf(key, sizeof(key), "%s%s", prefix, kv[i][0]);
+		if (pool)
+			bconf_add_data_pool(pool, root, key, kv[i][1]);
+		else
+			bconf_add_data(root, key, kv[i][1]);
+	}
+}
+
+static void
+test_backends(void) {
+	struct bconf_node *root = NULL, *app = NULL;
+	struct mempool *pool = mempool_create(1024);
+	struct bconf_node *proot = NULL;
+	struct vtree_chain vt, pvt;
+
+	add_content(NULL, &root, "");
+	check(bconf_vtree(&vt, root), "");
+	vtree_free(&vt);
+
+	/* No getnode_path, so the generic lookup is used. */
+	prefix_vtree_init(&pvt, "pre", bconf_vtree(&vt, root));
+	check(&pvt, "pre.");
+	vtree_free(&pvt);
+	vtree_free(&vt);
+
+	add_content(pool, &proot, "");
+	check(bconf_vtree(&vt, proot), "");
+	vtree_free(&vt);
+	mempool_free(pool);
+
+	/* The app overrides cat.1.name, everything else comes from the default. */
+	add_content(NULL, &app, "*.");
+	bconf_add_data(&app, "*.cat.1.name", "default one");
+	bconf_add_data(&app, "app.cat.1.name", "one");
+	check(bconf_vtree_app(&vt, app, "app"), "");
+	vtree_free(&vt);
+
+	bconf_free(&root);
+	bconf_free(&app);
+}
+
+/*
+ * The cached prefix must not survive changes to the tree, including the
+ * tree being freed and another one allocated in its place.
+ */
+static void
+test_invalidate(void) {
+	struct vtree_path *p = vtree_path_compile("a.b.%s");
+	struct bconf_node *root = NULL;
+	struct vtree_chain vt;
+
+	bconf_add_data(&root, "a.*.x", "star");
+	bconf_vtree(&vt, root);
+	assert(strcmp(vtree_path_get(&vt, p, "x"), "star") == 0);
+	bconf_add_data(&root, "a.b.x", "exact");
+	assert(strcmp(vtree_path_get(&vt, p, "x"), "exact") == 0);
+
+	/* Without holes the node with the value itself is cached. */
+	struct vtree_path *q = vtree_path_compile("a.b.x");
+	assert(strcmp(vtree_path_get(&vt, q), "exact") == 0);
+	assert(bconf_deletev(&root, 2, (const char *[]){ "a", "b" }));
+	assert(strcmp(vtree_path_get(&vt, p, "x"), "star") == 0);
+	assert(strcmp(vtree_path_get(&vt, q), "star") == 0);
+	vtree_path_free(q);
+
+	for (int i = 0; i < 10; i++) {
+		char value[16];
+
+		bconf_free(&root);
+		snprintf(value, sizeof(value), "%d", i);
+		bconf_add_data(&root, "a.b.x", value);
+		bconf_vtree(&vt, root);
+		assert(vtree_path_getint(&vt, p, "x") == i);
+	}
+	bconf_free(&root);
+	vtree_path_free(p);
+}
+
+struct thread_arg {
+	struct vtree_chain *vt[2];
+	struct vtree_path *path;
+};
+
+static void *
+lookup_thread(void *v) {
+	struct thread_arg *arg = v;
+
+	for (int i = 0; i < 100000; i++) {
+		int t = i & 1;
+		assert(vtree_path_getint(arg->vt[t], arg->path, i % 100) == t * 1000 + i % 100);
+	}
+	return NULL;
+}
+
+/* Threads sharing a path between two trees keep replacing each other's cache. */
+static void
+test_threads(void) {
+	struct bconf_node *root[2] = { NULL, NULL };
+	struct vtree_chain vt[2];
+	struct thread_arg arg = { { &vt[0], &vt[1] }, vtree_path_compile("x.y.%d") };
+	pthread_t threads[8];
+	char key[32], value[16];
+
+	for (int t = 0; t < 2; t++) {
+		for (int i = 0; i < 100; i++) {
+			snprintf(key, sizeof(key), "x.y.%d", i);
+			snprintf(value, sizeof(value), "%d", t * 1000 + i);
+			bconf_add_data(&root[t], key, value);
+		}
+		bconf_vtree(&vt[t], root[t]);
+	}
+
+	for (int i = 0; i < 8; i++)
+		pthread_create(&threads[i], NULL, lookup_thread, &arg);
+	for (int i = 0; i < 8; i++)
+		pthread_join(threads[i], NULL);
+
+	vtree_path_free(arg.path);
+	bconf_free(&root[0]);
+	bconf_free(&root[1]);
+}
+
+int
+main(int argc, char *argv[]) {
+	test_compile();
+	test_backends();
+	test_invalidate();
+	test_threads();
+	return 0;
+}